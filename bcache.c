@@ -0,0 +1,320 @@
+/* The buffer cache. See bcache.h.
+ *
+ * Like the dcache, a chained hash table, doubling as it fills, and a
+ * doubly-linked LRU list whose head is the most recently used buffer, under
+ * one mutex. Pinned buffers stay on the list; eviction passes over them.
+ * A miss inserts its buffer, marked loading, before dropping the lock to
+ * read it, so that others wanting the same block wait on 'loaded' rather
+ * than read it twice. Writing back a dirty victim is done under the lock,
+ * which is simple but stalls other threads; vsfs writes back in bulk at
+ * vsfs_sync and vsfs_fsync, so there should be few dirty victims.
+ */
+
+#define _GNU_SOURCE /* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "vsfs.h"
+#include "bcache.h"
+
+unsigned long vsfs_bcache_budget = 64ul << 20;
+_Bool vsfs_bcache_direct;
+
+struct buf
+{
+	struct buf *hash_next;
+	struct buf *lru_prev;
+	struct buf *lru_next;
+	unsigned long blkno;
+	unsigned pins;
+	_Bool dirty;
+	_Bool loading;
+	char *data; /* BLOCK_SIZE, aligned for O_DIRECT */
+};
+
+static int fd = -1;
+static _Bool direct; /* fd bypasses the page cache */
+static uint64_t data_offset;
+static struct buf **buckets;
+static unsigned long nbuckets;
+/* sentinel: lru.lru_next is the most recently used buffer */
+static struct buf lru = { .lru_prev = &lru, .lru_next = &lru };
+static struct bcache_stats stats;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loaded = PTHREAD_COND_INITIALIZER;
+
+static void lru_unlink(struct buf *b)
+{
+	b->lru_prev->lru_next = b->lru_next;
+	b->lru_next->lru_prev = b->lru_prev;
+}
+static void lru_push_front(struct buf *b)
+{
+	b->lru_prev = &lru;
+	b->lru_next = lru.lru_next;
+	lru.lru_next->lru_prev = b;
+	lru.lru_next = b;
+}
+
+static struct buf **find_link(unsigned long blkno)
+{
+	struct buf **link = &buckets[blkno & (nbuckets - 1)];
+	while (*link && (*link)->blkno != blkno) link = &(*link)->hash_next;
+	return link;
+}
+static void grow_buckets(void)
+{
+	unsigned long new_nbuckets = nbuckets ? 2 * nbuckets : 256;
+	struct buf **new_buckets = calloc(new_nbuckets, sizeof *new_buckets);
+	if (!new_buckets)
+	{
+		if (!buckets) err(EXIT_FAILURE, "allocating buffer cache");
+		return; /* we will just have longer chains */
+	}
+	for (unsigned long k = 0; k < nbuckets; ++k)
+	{
+		struct buf *next;
+		for (struct buf *b = buckets[k]; b; b = next)
+		{
+			next = b->hash_next;
+			b->hash_next = new_buckets[b->blkno & (new_nbuckets - 1)];
+			new_buckets[b->blkno & (new_nbuckets - 1)] = b;
+		}
+	}
+	free(buckets);
+	buckets = new_buckets;
+	nbuckets = new_nbuckets;
+}
+
+static void write_back(struct buf *b)
+{
+	if (BLOCK_SIZE != pwrite(fd, b->data, BLOCK_SIZE, data_offset + (uint64_t) b->blkno * BLOCK_SIZE))
+	{
+		err(EXIT_FAILURE, "writing back block %lu", b->blkno);
+	}
+	b->dirty = 0;
+	++stats.writebacks;
+}
+static void remove_buf(struct buf *b)
+{
+	*find_link(b->blkno) = b->hash_next;
+	lru_unlink(b);
+	--stats.nblocks;
+}
+
+/* Evict from the cold end until there is room for 'want' more blocks,
+ * passing over pinned buffers. Return a victim's buffer for reuse, if there
+ * was one. */
+static char *make_room(unsigned long want)
+{
+	char *spare = NULL;
+	struct buf *b = lru.lru_prev;
+	while (b != &lru && (stats.nblocks + want) * BLOCK_SIZE > vsfs_bcache_budget)
+	{
+		struct buf *prev = b->lru_prev;
+		if (!b->pins)
+		{
+			if (b->dirty) write_back(b);
+			remove_buf(b);
+			free(spare);
+			spare = b->data;
+			free(b);
+			++stats.evictions;
+		}
+		b = prev;
+	}
+	return spare;
+}
+
+void bcache_open(const char *backing_file_name, uint64_t offset)
+{
+	if (vsfs_bcache_direct && -1 == (fd = open(backing_file_name, O_RDWR | O_DIRECT)))
+	{
+		/* tmpfs, for one, will have none of it */
+		warn("opening %s for direct I/O; using the page cache", backing_file_name);
+	}
+	direct = (fd != -1);
+	if (fd == -1 && -1 == (fd = open(backing_file_name, O_RDWR))) err(EXIT_FAILURE, "opening %s", backing_file_name);
+	data_offset = offset;
+	grow_buckets();
+}
+
+void *bcache_get(unsigned long blkno, _Bool whole)
+{
+	pthread_mutex_lock(&lock);
+	struct buf *b;
+	while ((b = *find_link(blkno)) && b->loading) pthread_cond_wait(&loaded, &lock);
+	if (b)
+	{
+		++stats.hits;
+		++b->pins;
+		lru_unlink(b);
+		lru_push_front(b);
+		pthread_mutex_unlock(&lock);
+		return b->data;
+	}
+	char *data = make_room(1);
+	if (!data && posix_memalign((void **) &data, BLOCK_SIZE, BLOCK_SIZE)) errx(EXIT_FAILURE, "allocating a buffer");
+	if (!(b = malloc(sizeof *b))) err(EXIT_FAILURE, "allocating a buffer");
+	*b = (struct buf) { .blkno = blkno, .pins = 1, .loading = !whole, .data = data };
+	if (stats.nblocks >= nbuckets) grow_buckets();
+	struct buf **link = find_link(blkno);
+	*link = b;
+	lru_push_front(b);
+	++stats.nblocks;
+	if (whole)
+	{
+		pthread_mutex_unlock(&lock);
+		return data;
+	}
+	++stats.misses;
+	pthread_mutex_unlock(&lock);
+	ssize_t n = pread(fd, data, BLOCK_SIZE, data_offset + (uint64_t) blkno * BLOCK_SIZE);
+	if (n < 0) err(EXIT_FAILURE, "reading block %lu", blkno);
+	/* a short read can only be past the end of a sparse image */
+	if (n < BLOCK_SIZE) bzero(data + n, BLOCK_SIZE - n);
+	pthread_mutex_lock(&lock);
+	b->loading = 0;
+	pthread_cond_broadcast(&loaded);
+	pthread_mutex_unlock(&lock);
+	return data;
+}
+
+void bcache_put(unsigned long blkno, _Bool dirty)
+{
+	pthread_mutex_lock(&lock);
+	struct buf *b = *find_link(blkno);
+	if (!b || !b->pins) errx(EXIT_FAILURE, "putting block %lu, which is not pinned", blkno);
+	--b->pins;
+	b->dirty |= dirty;
+	/* if we outgrew the budget while everything was pinned, shrink back */
+	if (stats.nblocks * BLOCK_SIZE > vsfs_bcache_budget) free(make_room(0));
+	pthread_mutex_unlock(&lock);
+}
+
+void bcache_forget(unsigned long blkno)
+{
+	pthread_mutex_lock(&lock);
+	struct buf *b = *find_link(blkno);
+	if (b)
+	{
+		if (b->pins) errx(EXIT_FAILURE, "forgetting block %lu, which is pinned", blkno);
+		remove_buf(b);
+		free(b->data);
+		free(b);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static int compare_blkno(const void *a, const void *b)
+{
+	unsigned long x = (*(struct buf * const *) a)->blkno, y = (*(struct buf * const *) b)->blkno;
+	return (x > y) - (x < y);
+}
+/* Write back the dirty blocks among blocks [first, first + n), in block
+ * order, one pwritev per run of consecutive blocks. Returns how many we
+ * wrote. Call with the lock held. */
+static unsigned long write_dirty(unsigned long first, unsigned long n)
+{
+	/* look up each block of a small range; scan the cache for a big one */
+	_Bool lookup = n < stats.nblocks;
+	unsigned long ndirty = 0;
+	if (lookup) for (unsigned long k = 0; k < n; ++k) { struct buf *b = *find_link(first + k); ndirty += b && b->dirty; }
+	else for (struct buf *b = lru.lru_next; b != &lru; b = b->lru_next) ndirty += b->dirty && b->blkno - first < n;
+	if (!ndirty) return 0;
+	struct buf **dirty = malloc(ndirty * sizeof *dirty);
+	if (!dirty)
+	{
+		/* no memory to sort them, so write them one by one */
+		for (struct buf *b = lru.lru_next; b != &lru; b = b->lru_next) if (b->dirty && b->blkno - first < n) write_back(b);
+		return ndirty;
+	}
+	ndirty = 0;
+	if (lookup) for (unsigned long k = 0; k < n; ++k) { struct buf *b = *find_link(first + k); if (b && b->dirty) dirty[ndirty++] = b; }
+	else for (struct buf *b = lru.lru_next; b != &lru; b = b->lru_next) if (b->dirty && b->blkno - first < n) dirty[ndirty++] = b;
+	if (!lookup) qsort(dirty, ndirty, sizeof *dirty, compare_blkno);
+	struct iovec iov[IOV_MAX];
+	for (unsigned long k = 0, run; k < ndirty; k += run)
+	{
+		unsigned long start = dirty[k]->blkno;
+		for (run = 0; k + run < ndirty && run < IOV_MAX && dirty[k + run]->blkno == start + run; ++run)
+		{
+			iov[run] = (struct iovec) { dirty[k + run]->data, BLOCK_SIZE };
+		}
+		uint64_t pos = data_offset + (uint64_t) start * BLOCK_SIZE;
+		for (unsigned long done = 0; done < run * BLOCK_SIZE; )
+		{
+			/* resume a short write from wherever it stopped */
+			unsigned long j = done / BLOCK_SIZE;
+			iov[j].iov_base = dirty[k + j]->data + done % BLOCK_SIZE;
+			iov[j].iov_len = BLOCK_SIZE - done % BLOCK_SIZE;
+			ssize_t w = pwritev(fd, &iov[j], run - j, pos + done);
+			if (w <= 0) err(EXIT_FAILURE, "writing back blocks %lu to %lu", start, start + run - 1);
+			done += w;
+		}
+		for (unsigned long j = 0; j < run; ++j) dirty[k + j]->dirty = 0;
+		stats.writebacks += run;
+	}
+	free(dirty);
+	return ndirty;
+}
+void bcache_sync(void)
+{
+	pthread_mutex_lock(&lock);
+	write_dirty(0, ULONG_MAX);
+	pthread_mutex_unlock(&lock);
+	bcache_flush();
+}
+unsigned long bcache_write_range(unsigned long first, unsigned long n)
+{
+	pthread_mutex_lock(&lock);
+	unsigned long written = write_dirty(first, n);
+	pthread_mutex_unlock(&lock);
+	return written;
+}
+void bcache_readahead(unsigned long first, unsigned long n)
+{
+	pthread_mutex_lock(&lock);
+	_Bool in = *find_link(first + n - 1) != NULL;
+	pthread_mutex_unlock(&lock);
+	if (!in && !direct) posix_fadvise(fd, data_offset + (uint64_t) first * BLOCK_SIZE, (off_t) n * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+}
+
+void bcache_flush(void)
+{
+	if (0 != fdatasync(fd)) err(EXIT_FAILURE, "syncing buffer cache");
+}
+
+void bcache_get_stats(struct bcache_stats *out)
+{
+	pthread_mutex_lock(&lock);
+	*out = stats;
+	pthread_mutex_unlock(&lock);
+}
+
+/* Called only at exit, when no other thread can be using the cache. */
+void bcache_close(void)
+{
+	if (fd < 0) return;
+	bcache_sync();
+	while (lru.lru_next != &lru)
+	{
+		struct buf *b = lru.lru_next;
+		lru_unlink(b);
+		free(b->data);
+		free(b);
+	}
+	free(buckets);
+	buckets = NULL;
+	nbuckets = 0;
+	stats.nblocks = 0;
+	close(fd);
+	fd = -1;
+}
@@ -0,0 +1,53 @@
+#ifndef BCACHE_H_
+#define BCACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* The buffer cache: the pread/pwrite storage backend. It holds data blocks
+ * of the image in memory, up to vsfs_bcache_budget bytes of them, reading
+ * them with pread on a miss and writing them back with pwrite when they are
+ * evicted (least recently used first) or flushed. vsfs uses it for the
+ * contents of regular files when vsfs_backend is VSFS_BACKEND_PREAD; see
+ * vsfs.h. With vsfs_bcache_direct set, it bypasses the kernel's page cache
+ * with O_DIRECT, where the backing file's filesystem allows.
+ *
+ * A block is pinned from bcache_get until the matching bcache_put, and is
+ * not evicted meanwhile; if every block is pinned, the cache outgrows its
+ * budget rather than wait. All of these functions are thread-safe, except
+ * bcache_open and bcache_close. */
+extern unsigned long vsfs_bcache_budget;
+extern _Bool vsfs_bcache_direct;
+
+/* Open the image, whose data block 0 is at byte 'data_offset', for us. */
+void bcache_open(const char *backing_file_name, uint64_t data_offset);
+/* Pin block 'blkno' and return its contents. If 'whole', the caller will
+ * overwrite all of it, so we needn't read it, and it may hold anything. */
+void *bcache_get(unsigned long blkno, _Bool whole);
+/* Unpin it, noting whether the caller changed it. */
+void bcache_put(unsigned long blkno, _Bool dirty);
+/* The block has been freed: drop it without writing it back. */
+void bcache_forget(unsigned long blkno);
+/* Write back every dirty block, in block order, and make them durable. */
+void bcache_sync(void);
+/* Write back the dirty blocks among 'n' from 'first', without waiting for
+ * them to be durable; returns how many there were. bcache_flush waits. */
+unsigned long bcache_write_range(unsigned long first, unsigned long n);
+void bcache_flush(void);
+/* Start reading 'n' blocks from 'first' into the page cache, so that their
+ * misses find them there; a no-op if the last of them is in the buffer cache
+ * already, or with direct I/O, which bypasses the page cache. */
+void bcache_readahead(unsigned long first, unsigned long n);
+void bcache_close(void);
+
+struct bcache_stats
+{
+	unsigned long hits;
+	unsigned long misses; /* each one a read */
+	unsigned long evictions;
+	unsigned long writebacks; /* blocks written */
+	unsigned long nblocks; /* held now */
+};
+void bcache_get_stats(struct bcache_stats *out);
+
+#endif
@@ -0,0 +1,120 @@
+/* Append benchmark: delayed allocation against allocating on every write.
+ *
+ * Each run forks a child that opens a fresh image and appends to several
+ * files in turn, a few bytes to each, round and round, until each is as big
+ * as asked; then syncs. We run it with the write buffers on and with them
+ * off (vsfs_write_buffer_max = 0, so that each write allocates what it
+ * needs at once), for several sizes of write, and report MB/s, including
+ * the sync, and how fragmented the files came out: their extents on
+ * average, and the average extent's length in blocks. Files appended to
+ * side by side interleave their blocks unless allocation waits.
+ *
+ * Usage: bench-append [files] [MB per file]
+ *        (defaults: 8; 16)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <err.h>
+
+#include "vsfs.h"
+
+static unsigned nfiles;
+static unsigned long file_size;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const char *mode, unsigned long chunk)
+{
+	size_t nbytes = ROUND_UP_TO(BLOCK_SIZE, nfiles * file_size + nfiles * file_size / 16 + (4ul << 20));
+	char path[] = "/tmp/bench-append.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) err(EXIT_FAILURE, "creating temporary image");
+	if (ftruncate(fd, nbytes) != 0) err(EXIT_FAILURE, "sizing temporary image");
+	vsfs_init(path, nbytes);
+	unlink(path);
+	close(fd);
+
+	struct inode *root = vsfs_inode(0), *files[nfiles];
+	char name[32];
+	for (unsigned n = 0; n < nfiles; ++n)
+	{
+		snprintf(name, sizeof name, "file-%u", n);
+		if (!(files[n] = vsfs_creat(root, name))) errx(EXIT_FAILURE, "creat %s", name);
+	}
+	char *buf = malloc(chunk);
+	if (!buf) err(EXIT_FAILURE, "allocating buffer");
+	memset(buf, 'x', chunk);
+
+	double t0 = now_ns();
+	for (unsigned long off = 0; off < file_size; off += chunk)
+	{
+		unsigned long len = (chunk < file_size - off) ? chunk : file_size - off;
+		for (unsigned n = 0; n < nfiles; ++n)
+		{
+			if (vsfs_write(files[n], off, buf, len) != len) errx(EXIT_FAILURE, "write at %lu", off);
+		}
+	}
+	vsfs_sync();
+	double secs = (now_ns() - t0) / 1e9;
+
+	unsigned long nextents = 0, nblocks = 0;
+	for (unsigned n = 0; n < nfiles; ++n)
+	{
+		if (files[n]->size != file_size) errx(EXIT_FAILURE, "file %u is %u bytes", n, files[n]->size);
+		nextents += files[n]->nextents;
+		nblocks += files[n]->nblocks;
+	}
+	printf("%10lu %-10s %10.0f %12.1f %14.1f\n", chunk, mode, (double) nfiles * file_size / secs / (1 << 20),
+		(double) nextents / nfiles, (double) nblocks / nextents);
+}
+
+static void run_in_child(const char *mode, unsigned long chunk)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) err(EXIT_FAILURE, "fork");
+	if (pid == 0)
+	{
+		run(mode, chunk);
+		exit(EXIT_SUCCESS);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		errx(EXIT_FAILURE, "%s run with %lu-byte writes failed", mode, chunk);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	nfiles = (argc > 1) ? strtoul(argv[1], NULL, 0) : 8;
+	file_size = ((argc > 2) ? strtoul(argv[2], NULL, 0) : 16) << 20;
+	if (nfiles == 0 || file_size == 0 || file_size > (1ul << 30)) errx(EXIT_FAILURE, "bad file count or size");
+	debug_level = 0;
+	debug_out = fopen("/dev/null", "w");
+	/* we measure allocation here, not commits */
+	vsfs_mkfs_features &= ~VSFS_FEATURE_JOURNAL;
+
+	printf("%u files of %lu MB, appended to in turn; buffer %lu kB per file\n", nfiles, file_size >> 20,
+		vsfs_write_buffer_max >> 10);
+	printf("%10s %-10s %10s %12s %14s\n", "write", "mode", "MB/s", "extents/file", "blocks/extent");
+	unsigned long buffer_max = vsfs_write_buffer_max;
+	static const unsigned long chunks[] = { 100, 4096, 65536 };
+	for (unsigned c = 0; c < sizeof chunks / sizeof chunks[0]; ++c)
+	{
+		vsfs_write_buffer_max = 0;
+		run_in_child("immediate", chunks[c]);
+		vsfs_write_buffer_max = buffer_max;
+		run_in_child("buffered", chunks[c]);
+	}
+	return 0;
+}
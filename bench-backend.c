@@ -0,0 +1,139 @@
+/* Storage backend benchmark: random reads through the mapping against
+ * reads through the buffer cache.
+ *
+ * We write one large file, close the image, and then, for each backend, open
+ * it afresh in a child process and read 4 kB blocks of the file at random,
+ * twice over the same sequence of offsets:
+ *
+ *   cold: after asking the kernel to drop the image from its page cache, so
+ *         that (on a disk-backed filesystem) every first touch goes to disk;
+ *   warm: again, now that the first pass has brought the blocks in.
+ *
+ * The backends are mmap (the default), pread (the buffer cache, over the
+ * kernel's page cache) and pread+direct (the buffer cache with O_DIRECT,
+ * which falls back to pread, with a warning, where the filesystem lacks it).
+ * With fewer distinct blocks read than fit in the cache, the warm pass of a
+ * pread backend should hit every time. On tmpfs nothing is ever cold, so the
+ * image goes in /var/tmp unless told otherwise. Every block read is checked.
+ *
+ * Usage: bench-backend [file size in MB] [reads] [cache budget in MB] [image directory]
+ *        (defaults: 256; 10000; 64; /var/tmp)
+ */
+#define _GNU_SOURCE
+#include <string.h>
+
+#include "vsfs.h"
+#include "bcache.h"
+#include "bench.h"
+
+static unsigned long file_size, nreads;
+static char path[4096];
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Each block of the file starts with its block number, and is otherwise
+ * filled with a pattern, so that we can tell a block read wrong. */
+static void fill_block(uint64_t *w, unsigned long blk)
+{
+	w[0] = blk;
+	for (unsigned n = 1; n < BLOCK_SIZE / 8; ++n) w[n] = blk * 0x9e3779b97f4a7c15ull + n;
+}
+static void make_file(unsigned long unused)
+{
+	vsfs_init(path, 0);
+	struct inode *f = vsfs_creat(vsfs_inode(0), "big");
+	if (!f) errx(EXIT_FAILURE, "creat");
+	static uint64_t chunk[(1 << 20) / 8];
+	for (unsigned long off = 0; off < file_size; off += sizeof chunk)
+	{
+		for (unsigned k = 0; k < sizeof chunk / BLOCK_SIZE; ++k)
+		{
+			fill_block(chunk + k * BLOCK_SIZE / 8, off / BLOCK_SIZE + k);
+		}
+		if (vsfs_write(f, off, (char *) chunk, sizeof chunk) != sizeof chunk) errx(EXIT_FAILURE, "write at %lu", off);
+	}
+	vsfs_sync();
+}
+
+/* One pass of reads, at the blocks in 'blks'; prints a line of results. */
+static void read_pass(struct inode *f, const char *backend, const char *pass, const unsigned long *blks, uint64_t *times)
+{
+	static uint64_t buf[BLOCK_SIZE / 8], expected[BLOCK_SIZE / 8];
+	struct bcache_stats before, after;
+	bcache_get_stats(&before);
+	double t0 = now_ns();
+	for (unsigned long k = 0; k < nreads; ++k)
+	{
+		double t = now_ns();
+		if (vsfs_read(f, blks[k] * BLOCK_SIZE, (char *) buf, BLOCK_SIZE) != BLOCK_SIZE)
+		{
+			errx(EXIT_FAILURE, "read of block %lu", blks[k]);
+		}
+		times[k] = now_ns() - t;
+		fill_block(expected, blks[k]);
+		if (memcmp(buf, expected, BLOCK_SIZE)) errx(EXIT_FAILURE, "block %lu reads back wrong", blks[k]);
+	}
+	double secs = (now_ns() - t0) / 1e9;
+	bcache_get_stats(&after);
+	qsort(times, nreads, sizeof *times, compare_u64);
+	printf("%-14s %-5s %12.0f %10.1f %10.1f", backend, pass, nreads / secs,
+		times[nreads / 2] / 1e3, times[nreads * 99 / 100] / 1e3);
+	if (vsfs_backend == VSFS_BACKEND_PREAD) printf(" %9.1f%%", 100.0 * (after.hits - before.hits) / nreads);
+	else printf(" %10s", "-");
+	printf("\n");
+}
+static const struct { const char *name; enum vsfs_backend backend; _Bool direct; } backends[] = {
+	{ "mmap", VSFS_BACKEND_MMAP, 0 },
+	{ "pread", VSFS_BACKEND_PREAD, 0 },
+	{ "pread+direct", VSFS_BACKEND_PREAD, 1 },
+};
+static void run_backend(unsigned long b)
+{
+	vsfs_backend = backends[b].backend;
+	vsfs_bcache_direct = backends[b].direct;
+	vsfs_init(path, 0);
+	struct inode *f = vsfs_lookup(vsfs_inode(0), "big");
+	if (!f) errx(EXIT_FAILURE, "lookup");
+	unsigned long *blks = malloc(nreads * sizeof *blks);
+	uint64_t *times = malloc(nreads * sizeof *times);
+	if (!blks || !times) err(EXIT_FAILURE, "allocating reads");
+	/* the same offsets for every backend, each in a child of its own */
+	for (unsigned long k = 0; k < nreads; ++k) blks[k] = next_random() % (file_size / BLOCK_SIZE);
+	read_pass(f, backends[b].name, "cold", blks, times);
+	read_pass(f, backends[b].name, "warm", blks, times);
+}
+int main(int argc, char **argv)
+{
+	file_size = ((argc > 1) ? strtoul(argv[1], NULL, 0) : 256) << 20;
+	nreads = (argc > 2) ? strtoul(argv[2], NULL, 0) : 10000;
+	vsfs_bcache_budget = ((argc > 3) ? strtoul(argv[3], NULL, 0) : 64) << 20;
+	const char *dir = (argc > 4) ? argv[4] : "/var/tmp";
+	if (file_size == 0 || file_size > (3ul << 30) || nreads == 0) errx(EXIT_FAILURE, "bad file size or read count");
+	debug_level = 0;
+	debug_out = fopen("/dev/null", "w");
+	/* we measure reads here, not commits */
+	vsfs_mkfs_features &= ~VSFS_FEATURE_JOURNAL;
+
+	size_t nbytes = ROUND_UP_TO(BLOCK_SIZE, file_size + file_size / 16 + (4ul << 20));
+	snprintf(path, sizeof path, "%s/bench-backend.XXXXXX", dir);
+	int fd = mkstemp(path);
+	if (fd == -1) err(EXIT_FAILURE, "creating image in %s", dir);
+	if (ftruncate(fd, nbytes) != 0) err(EXIT_FAILURE, "sizing image");
+	close(fd);
+	run_in_child(make_file, 0);
+
+	printf("%lu MB file, %lu random 4 kB reads per pass, %lu MB cache, image in %s\n",
+		file_size >> 20, nreads, vsfs_bcache_budget >> 20, dir);
+	printf("%-14s %-5s %12s %10s %10s %10s\n", "backend", "pass", "reads/s", "p50 us", "p99 us", "cache hits");
+	for (unsigned b = 0; b < sizeof backends / sizeof backends[0]; ++b)
+	{
+		drop_cache(path);
+		run_in_child(run_backend, b);
+	}
+	unlink(path);
+	return 0;
+}
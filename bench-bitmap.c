@@ -0,0 +1,151 @@
+/* Microbenchmark for the bitmap scan kernels in bitmap.h.
+ *
+ * We compare the current kernels against the bit-at-a-time versions that
+ * they replaced (kept below, lightly fixed so that they can run at all), at
+ * several fill levels. Bitmaps are filled from the bottom up, as first-fit
+ * allocation leaves them, so the first clear bit sits at the fill boundary.
+ *
+ * Usage: bench-bitmap [nbits]   (default: 32768 bits, one 4 kB bitmap block)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "bitmap.h"
+
+/* The old kernels. */
+static int old_popcount64(uint64_t x)
+{
+	int c = 0;
+	for (int i = 0; i < 64; i++) { c += x & 1; x >>= 1; }
+	return c;
+}
+static unsigned long old_find_first_clear(bitmap_word_t *p_bitmap, bitmap_word_t *p_limit)
+{
+	bitmap_word_t *p_initial_bitmap = p_bitmap;
+	while (p_bitmap < p_limit && *p_bitmap == (bitmap_word_t) -1) ++p_bitmap;
+	if (p_bitmap == p_limit) return (unsigned long) -1;
+	unsigned long test_bit = 1;
+	unsigned test_bit_index = 0;
+	while (*p_bitmap & test_bit) { test_bit <<= 1; ++test_bit_index; }
+	return (p_bitmap - p_initial_bitmap) * BITMAP_WORD_NBITS + test_bit_index;
+}
+static unsigned long old_find_first_set(bitmap_word_t *p_bitmap, bitmap_word_t *p_limit)
+{
+	bitmap_word_t *p_initial_bitmap = p_bitmap;
+	while (p_bitmap < p_limit && *p_bitmap == (bitmap_word_t) 0) ++p_bitmap;
+	if (p_bitmap == p_limit) return (unsigned long) -1;
+	unsigned long test_bit = 1;
+	unsigned test_bit_index = 0;
+	while (!(*p_bitmap & test_bit)) { test_bit <<= 1; ++test_bit_index; }
+	return (p_bitmap - p_initial_bitmap) * BITMAP_WORD_NBITS + test_bit_index;
+}
+static unsigned long old_rfind_first_set_leq(bitmap_word_t *p_bitmap, long start_idx)
+{
+	bitmap_word_t *p_base = p_bitmap;
+	p_bitmap += start_idx / BITMAP_WORD_NBITS;
+	start_idx %= BITMAP_WORD_NBITS;
+	while (1)
+	{
+		while (start_idx >= 0)
+		{
+			bitmap_word_t test_bit = 1ul << start_idx;
+			if (*p_bitmap & test_bit) return start_idx + (p_bitmap - p_base) * BITMAP_WORD_NBITS;
+			--start_idx;
+		}
+		if (p_bitmap == p_base) break;
+		start_idx = BITMAP_WORD_NBITS - 1;
+		--p_bitmap;
+	}
+	return (unsigned long) -1;
+}
+static unsigned long old_count_set(bitmap_word_t *p_bitmap, bitmap_word_t *p_limit)
+{
+	unsigned long count = 0;
+	for (bitmap_word_t *p = p_bitmap; p != p_limit; ++p) count += old_popcount64(*p);
+	return count;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/* Stop the compiler from hoisting or discarding the call under test. */
+static volatile unsigned long sink;
+#define TIME_IT(label, niters, expr) do { \
+	double t0 = now_ns(); \
+	for (unsigned long it_ = 0; it_ < (niters); ++it_) { \
+		__asm__ volatile ("" ::: "memory"); \
+		sink = (expr); \
+	} \
+	printf("  %-28s %10.1f ns/op\n", label, (now_ns() - t0) / (niters)); \
+} while (0)
+
+static void fill_bottom(bitmap_word_t *b, unsigned long nbits, unsigned long nset)
+{
+	memset(b, 0, nbits / 8);
+	for (unsigned long i = 0; i < nset; ++i) bitmap_set(b, i);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long nbits = (argc > 1) ? strtoul(argv[1], NULL, 0) : 8 * 4096;
+	nbits = BITMAP_WORD_NBITS * ((nbits + BITMAP_WORD_NBITS - 1) / BITMAP_WORD_NBITS);
+	unsigned long nwords = nbits / BITMAP_WORD_NBITS;
+	bitmap_word_t *b = malloc(nbits / 8);
+	bitmap_word_t *inv = malloc(nbits / 8);
+	if (!b || !inv) err(EXIT_FAILURE, "allocating bitmaps");
+	/* Aim for roughly the same total work per fill level. */
+	unsigned long niters = 1 + (1ul << 28) / nbits;
+	static const unsigned fills_pct[] = { 1, 50, 99 };
+	static struct { const char *name; bitmap_skip_words_fn *fn; } kernels[] = {
+		{ "scalar", bitmap_skip_words_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+		{ "sse2", bitmap_skip_words_sse2 },
+		{ "avx2", bitmap_skip_words_avx2 },
+#endif
+	};
+	bitmap_skip_words_fn *selected = bitmap_select_skip_words();
+	printf("bitmap of %lu bits, %lu iterations per measurement\n", nbits, niters);
+	for (unsigned f = 0; f < sizeof fills_pct / sizeof fills_pct[0]; ++f)
+	{
+		unsigned long nset = nbits * fills_pct[f] / 100;
+		fill_bottom(b, nbits, nset);
+		for (unsigned long i = 0; i < nwords; ++i) inv[i] = ~b[i];
+		printf("fill %u%% (%lu bits set)\n", fills_pct[f], nset);
+		/* Check that old and new agree before timing anything. */
+		if (old_find_first_clear(b, b + nwords) != bitmap_find_first_clear(b, b + nwords, NULL)
+				|| old_find_first_set(inv, inv + nwords) != bitmap_find_first_set(inv, inv + nwords, NULL)
+				|| old_rfind_first_set_leq(b, nbits - 1) != bitmap_rfind_first_set_leq(b, b + nwords, nbits - 1, NULL)
+				|| old_count_set(b, b + nwords) != bitmap_count_set(b, b + nwords, 0, nbits))
+		{
+			errx(EXIT_FAILURE, "old and new kernels disagree at fill %u%%", fills_pct[f]);
+		}
+		TIME_IT("find_first_clear (old)", niters, old_find_first_clear(b, b + nwords));
+		for (unsigned k = 0; k < sizeof kernels / sizeof kernels[0]; ++k)
+		{
+			char label[64];
+			bitmap_skip_words_impl = kernels[k].fn;
+			snprintf(label, sizeof label, "find_first_clear (%s%s)", kernels[k].name,
+				kernels[k].fn == selected ? "*" : "");
+			TIME_IT(label, niters, bitmap_find_first_clear(b, b + nwords, NULL));
+		}
+		bitmap_skip_words_impl = selected;
+		TIME_IT("find_first_clear_from(hint)", niters,
+			bitmap_find_first_clear_from(b, b + nwords, nset, NULL));
+		TIME_IT("find_first_set (old)", niters, old_find_first_set(inv, inv + nwords));
+		TIME_IT("find_first_set (new)", niters, bitmap_find_first_set(inv, inv + nwords, NULL));
+		TIME_IT("rfind_first_set_leq (old)", niters, old_rfind_first_set_leq(b, nbits - 1));
+		TIME_IT("rfind_first_set_leq (new)", niters, bitmap_rfind_first_set_leq(b, b + nwords, nbits - 1, NULL));
+		TIME_IT("count_set (old)", niters / 8 + 1, old_count_set(b, b + nwords));
+		TIME_IT("count_set (new)", niters / 8 + 1, bitmap_count_set(b, b + nwords, 0, nbits));
+	}
+	printf("(* marks the kernel selected at runtime on this machine)\n");
+	free(b);
+	free(inv);
+	return 0;
+}
@@ -0,0 +1,122 @@
+/* Compression benchmark: compressed files against plain ones.
+ *
+ * Each run forks a child that opens a fresh image, writes one file of the
+ * given size in 64 kB writes and syncs; then reads it all back in 64 kB
+ * reads, and then reads 4 kB from random offsets, as many bytes again. We
+ * run it for a plain and a compressed file, with contents that compress well
+ * (lines of a made-up log), not at all (random bytes) and in between (the
+ * log with every other 4 kB random), and report the MB/s of each phase and
+ * the ratio of the file's size to the blocks it took. The image stays in the
+ * page cache throughout, so reads cost what finding and decompressing the
+ * bytes costs, not I/O.
+ *
+ * Usage: bench-compress [MB]
+ *        (default: 64)
+ */
+#define _GNU_SOURCE /* for bench.h */
+#include <string.h>
+
+#include "vsfs.h"
+#include "bench.h"
+
+#define IO_SIZE (64 * 1024)
+static unsigned long file_size;
+
+enum contents { LOG, RANDOM, MIXED };
+static const char *const contents_names[] = { "log", "random", "mixed" };
+static void fill(char *buf, unsigned long len, enum contents what)
+{
+	static const char *const levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+	unsigned long n = 0;
+	while (n < len)
+	{
+		char line[160];
+		uint64_t r = next_random();
+		int k = snprintf(line, sizeof line, "2026-10-17 05:%02u:%02u.%06u %-5s worker-%u: request %u from 10.0.%u.%u took %u ms\n",
+			(unsigned) (r % 60), (unsigned) (r >> 6) % 60, (unsigned) (r >> 12) % 1000000, levels[(r >> 32) % 6],
+			(unsigned) (r >> 35) % 16, (unsigned) (r >> 20) % 100000, (unsigned) (r >> 40) % 4, (unsigned) (r >> 44) % 256,
+			(unsigned) (r >> 52) % 500);
+		if (k > len - n) k = len - n;
+		memcpy(buf + n, line, k);
+		n += k;
+	}
+	if (what == LOG) return;
+	for (unsigned long off = 0; off < len; off += 8)
+	{
+		uint64_t r = next_random();
+		if (what == RANDOM || (off / 4096) % 2) memcpy(buf + off, &r, (len - off < 8) ? len - off : 8);
+	}
+}
+
+/* the kind of file that run makes, set before each */
+static _Bool compressed;
+static void run(unsigned long arg)
+{
+	enum contents what = arg;
+	size_t nbytes = ROUND_UP_TO(BLOCK_SIZE, file_size + file_size / 8 + (4ul << 20));
+	char path[] = "/tmp/bench-compress.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) err(EXIT_FAILURE, "creating temporary image");
+	if (ftruncate(fd, nbytes) != 0) err(EXIT_FAILURE, "sizing temporary image");
+	vsfs_init(path, nbytes);
+	unlink(path);
+	close(fd);
+
+	struct inode *f = vsfs_creat(vsfs_inode(0), "file");
+	if (!f) errx(EXIT_FAILURE, "creat");
+	if (compressed && vsfs_set_compression(f, 1) != 0) errx(EXIT_FAILURE, "the image has no compression");
+	char *data = malloc(file_size), *buf = malloc(IO_SIZE);
+	if (!data || !buf) err(EXIT_FAILURE, "allocating buffers");
+	fill(data, file_size, what);
+	struct vsfs_statfs before, after;
+	vsfs_statfs(&before);
+
+	double t0 = now_ns();
+	for (unsigned long off = 0; off < file_size; off += IO_SIZE)
+	{
+		unsigned long len = (IO_SIZE < file_size - off) ? IO_SIZE : file_size - off;
+		if (vsfs_write(f, off, data + off, len) != len) errx(EXIT_FAILURE, "write at %lu", off);
+	}
+	vsfs_sync();
+	double t1 = now_ns();
+	for (unsigned long off = 0; off < file_size; off += IO_SIZE)
+	{
+		unsigned long len = (IO_SIZE < file_size - off) ? IO_SIZE : file_size - off;
+		if (vsfs_read(f, off, buf, len) != len || memcmp(buf, data + off, len)) errx(EXIT_FAILURE, "read at %lu", off);
+	}
+	double t2 = now_ns();
+	for (unsigned long n = 0; n < file_size / 4096; ++n)
+	{
+		unsigned long off = next_random() % (file_size / 4096) * 4096;
+		if (vsfs_read(f, off, buf, 4096) != 4096) errx(EXIT_FAILURE, "read at %lu", off);
+	}
+	double t3 = now_ns();
+	vsfs_statfs(&after);
+
+	unsigned long used = (before.nfree_data_blocks - after.nfree_data_blocks) * BLOCK_SIZE;
+	double mb = (double) file_size / (1 << 20);
+	printf("%-8s %-10s %10.0f %10.0f %10.0f %8.2f\n", contents_names[what], compressed ? "compressed" : "plain",
+		mb / ((t1 - t0) / 1e9), mb / ((t2 - t1) / 1e9), mb / ((t3 - t2) / 1e9), (double) file_size / used);
+}
+
+int main(int argc, char **argv)
+{
+	file_size = ((argc > 1) ? strtoul(argv[1], NULL, 0) : 64) << 20;
+	if (file_size == 0 || file_size > (1ul << 31)) errx(EXIT_FAILURE, "bad file size");
+	debug_level = 0;
+	debug_out = fopen("/dev/null", "w");
+	/* we measure compression here, not commits */
+	vsfs_mkfs_features &= ~VSFS_FEATURE_JOURNAL;
+
+	printf("one file of %lu MB, in clusters of %u blocks when compressed\n", file_size >> 20,
+		(unsigned) VSFS_CLUSTER_BLOCKS);
+	printf("%-8s %-10s %10s %10s %10s %8s\n", "contents", "file", "write MB/s", "read MB/s", "4k rand", "ratio");
+	for (enum contents what = LOG; what <= MIXED; ++what)
+	{
+		compressed = 0;
+		run_in_child(run, what);
+		compressed = 1;
+		run_in_child(run, what);
+	}
+	return 0;
+}
@@ -0,0 +1,376 @@
+/* Microbenchmarks for the core operations, to catch regressions between
+ * releases.
+ *
+ * Each case runs in a child of its own, on a fresh image, and times single
+ * operations one by one:
+ *
+ *   mkfs, open:        vsfs_init creating, or opening, images of several sizes;
+ *   inode_alloc/free:  with the inode table at several fill levels;
+ *   data_alloc/free:   with the data blocks at several fill levels;
+ *   dir_append:        vsfs_link, into directories of several sizes;
+ *   dir_lookup(_miss): vsfs_lookup_one, for names present (absent) there;
+ *   walk:              for_each_data_block over a whole file, contiguous or
+ *                      in one-block extents;
+ *   statfs:            vsfs_statfs, on images of several sizes.
+ *
+ * Free slots are scattered before the allocations are timed, as a real
+ * image's would be. The *_alloc and *_free cases call internals that only
+ * the benchmarks' objects export (see VSFS_BENCH in vsfs.h). There is no
+ * journal, except for mkfs and open, so that we time the operations and not
+ * the commits.
+ *
+ * Output is one line per case, with whitespace-separated columns: the case,
+ * its parameters, the number of operations timed, then the mean, the 50th,
+ * 90th and 99th percentiles and the maximum, in nanoseconds per operation.
+ * Lines starting with '#' are comments. Each time includes one clock read,
+ * some tens of nanoseconds.
+ *
+ * Usage: bench-core [operations per case]
+ *        (default: 10000; mkfs and open do 20, walks at most 1000)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <err.h>
+
+#include "vsfs.h"
+
+#define OPEN_SAMPLES 20
+#define WALK_SAMPLES 1000
+#define NAMES_PER_TARGET 30000 /* links per file, within its 16-bit refcount */
+
+static unsigned long nsamples;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+static int compare_times(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+static void report(const char *name, const char *params, uint64_t *times, unsigned long n)
+{
+	if (n == 0) errx(EXIT_FAILURE, "%s %s: nothing timed", name, params);
+	qsort(times, n, sizeof *times, compare_times);
+	double sum = 0;
+	for (unsigned long k = 0; k < n; ++k) sum += times[k];
+	printf("%-16s %-24s %8lu %10.0f %10lu %10lu %10lu %10lu\n", name, params, n, sum / n,
+		(unsigned long) times[(n - 1) * 50 / 100], (unsigned long) times[(n - 1) * 90 / 100],
+		(unsigned long) times[(n - 1) * 99 / 100], (unsigned long) times[n - 1]);
+	fflush(stdout);
+}
+static uint64_t *alloc_times(unsigned long n)
+{
+	uint64_t *times = malloc(n * sizeof *times);
+	if (!times) err(EXIT_FAILURE, "allocating timings");
+	return times;
+}
+
+/* Create an image of 'nbytes' in /tmp, leaving it open as the filesystem. */
+static void make_image(size_t nbytes)
+{
+	char path[] = "/tmp/bench-core.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) err(EXIT_FAILURE, "creating temporary image");
+	if (ftruncate(fd, nbytes) != 0) err(EXIT_FAILURE, "sizing temporary image");
+	vsfs_init(path, nbytes);
+	unlink(path);
+	close(fd);
+}
+static void run_in_child(void (*fn)(unsigned long), unsigned long arg)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) err(EXIT_FAILURE, "fork");
+	if (pid == 0)
+	{
+		fn(arg);
+		exit(EXIT_SUCCESS);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		errx(EXIT_FAILURE, "benchmark failed");
+	}
+}
+
+/* mkfs and open: each sample is a child that calls vsfs_init once and
+ * hands back how long it took. */
+static void time_init(const char *path, int out)
+{
+	uint64_t t0 = now_ns();
+	vsfs_init(path, 0);
+	uint64_t t = now_ns() - t0;
+	if (write(out, &t, sizeof t) != sizeof t) err(EXIT_FAILURE, "writing timing");
+}
+static uint64_t time_init_in_child(const char *path)
+{
+	int fds[2];
+	if (pipe(fds) != 0) err(EXIT_FAILURE, "pipe");
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) err(EXIT_FAILURE, "fork");
+	if (pid == 0)
+	{
+		close(fds[0]);
+		time_init(path, fds[1]);
+		exit(EXIT_SUCCESS);
+	}
+	close(fds[1]);
+	uint64_t t;
+	int status;
+	if (read(fds[0], &t, sizeof t) != sizeof t) errx(EXIT_FAILURE, "no timing from vsfs_init of `%s'", path);
+	close(fds[0]);
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		errx(EXIT_FAILURE, "vsfs_init of `%s' failed", path);
+	}
+	return t;
+}
+static void bench_init(unsigned long long nbytes)
+{
+	char path[] = "/tmp/bench-core.XXXXXX", params[32];
+	int fd = mkstemp(path);
+	if (fd == -1) err(EXIT_FAILURE, "creating temporary image");
+	uint64_t mkfs_times[OPEN_SAMPLES], open_times[OPEN_SAMPLES];
+	for (unsigned n = 0; n < OPEN_SAMPLES; ++n)
+	{
+		/* a fresh, zeroed image each time */
+		if (ftruncate(fd, 0) != 0 || ftruncate(fd, nbytes) != 0) err(EXIT_FAILURE, "sizing temporary image");
+		mkfs_times[n] = time_init_in_child(path);
+	}
+	for (unsigned n = 0; n < OPEN_SAMPLES; ++n) open_times[n] = time_init_in_child(path);
+	unlink(path);
+	close(fd);
+	snprintf(params, sizeof params, "image=%lluM", nbytes >> 20);
+	report("mkfs", params, mkfs_times, OPEN_SAMPLES);
+	report("open", params, open_times, OPEN_SAMPLES);
+}
+
+/* Allocation: fill the table, free all but 'fill' percent of it at random,
+ * then time allocating half of what is free, and freeing it again, until
+ * we have enough samples. */
+static unsigned long inode_alloc_idx(void)
+{
+	struct inode *i = vsfs_bench_inode_alloc();
+	return i ? (unsigned long) (i - vsfs_inode(0)) : -1;
+}
+static void inode_free_idx(unsigned long idx)
+{
+	vsfs_bench_inode_free(vsfs_inode(idx));
+}
+static void bench_alloc(const char *what, unsigned long (*alloc)(void), void (*release)(unsigned long),
+	unsigned long capacity, unsigned fill)
+{
+	unsigned long *held = malloc(capacity * sizeof *held), nheld = 0;
+	if (!held) err(EXIT_FAILURE, "allocating");
+	for (unsigned long idx; nheld < capacity && (idx = alloc()) != -1; ) held[nheld++] = idx;
+	srand(1);
+	for (unsigned long k = nheld; k > 1; --k)
+	{
+		unsigned long j = rand() % k, t = held[k - 1];
+		held[k - 1] = held[j];
+		held[j] = t;
+	}
+	unsigned long keep = nheld * fill / 100;
+	for (unsigned long k = keep; k < nheld; ++k) release(held[k]);
+	unsigned long batch = (nheld - keep) / 2;
+	if (batch == 0) errx(EXIT_FAILURE, "%s: nothing free at %u%%", what, fill);
+
+	uint64_t *alloc_t = alloc_times(nsamples), *free_t = alloc_times(nsamples);
+	unsigned long n = 0;
+	while (n < nsamples)
+	{
+		unsigned long m = (batch < nsamples - n) ? batch : nsamples - n;
+		for (unsigned long k = 0; k < m; ++k)
+		{
+			uint64_t t0 = now_ns();
+			held[keep + k] = alloc();
+			alloc_t[n + k] = now_ns() - t0;
+			if (held[keep + k] == -1) errx(EXIT_FAILURE, "%s: allocation failed", what);
+		}
+		for (unsigned long k = 0; k < m; ++k)
+		{
+			uint64_t t0 = now_ns();
+			release(held[keep + k]);
+			free_t[n + k] = now_ns() - t0;
+		}
+		n += m;
+	}
+	char name[32], params[32];
+	snprintf(params, sizeof params, "fill=%u%%", fill);
+	snprintf(name, sizeof name, "%s_alloc", what);
+	report(name, params, alloc_t, n);
+	snprintf(name, sizeof name, "%s_free", what);
+	report(name, params, free_t, n);
+}
+static void bench_inode_alloc(unsigned long fill)
+{
+	vsfs_mkfs_inodes = 32768;
+	make_image(64 << 20);
+	bench_alloc("inode", inode_alloc_idx, inode_free_idx, vsfs_mkfs_inodes, fill);
+}
+static void bench_data_alloc(unsigned long fill)
+{
+	make_image(256 << 20);
+	bench_alloc("data", vsfs_bench_data_alloc, vsfs_bench_data_free, (256 << 20) / BLOCK_SIZE, fill);
+}
+
+/* Directories: link 'nentries' names into the root, then time more links,
+ * and lookups of names that are there and of names that are not. */
+static void bench_dir(unsigned long nentries)
+{
+	make_image(ROUND_UP_TO(BLOCK_SIZE, (nentries + nsamples) * 64 + (16ul << 20)));
+	struct inode *root = vsfs_inode(0);
+	unsigned long ntargets = (nentries + nsamples) / NAMES_PER_TARGET + 1;
+	struct inode **targets = malloc(ntargets * sizeof *targets);
+	if (!targets) err(EXIT_FAILURE, "allocating");
+	char name[32], params[32];
+	for (unsigned long k = 0; k < ntargets; ++k)
+	{
+		snprintf(name, sizeof name, "target-%lu", k);
+		if (!(targets[k] = vsfs_creat(root, name))) errx(EXIT_FAILURE, "creat %s", name);
+	}
+	for (unsigned long n = 0; n < nentries; ++n)
+	{
+		snprintf(name, sizeof name, "name-%lu", n);
+		if (!vsfs_link(root, targets[n / NAMES_PER_TARGET], name)) errx(EXIT_FAILURE, "link %s", name);
+	}
+
+	uint64_t *t = alloc_times(nsamples);
+	snprintf(params, sizeof params, "entries=%lu", nentries);
+	for (unsigned long n = 0; n < nsamples; ++n)
+	{
+		snprintf(name, sizeof name, "extra-%lu", n);
+		struct inode *target = targets[(nentries + n) / NAMES_PER_TARGET];
+		uint64_t t0 = now_ns();
+		struct dirent *d = vsfs_link(root, target, name);
+		t[n] = now_ns() - t0;
+		if (!d) errx(EXIT_FAILURE, "link %s", name);
+	}
+	report("dir_append", params, t, nsamples);
+	/* the appends are part of the directory from here on */
+	nentries += nsamples;
+	srand(1);
+	for (unsigned long n = 0; n < nsamples; ++n)
+	{
+		unsigned long k = rand() % nentries;
+		if (k < nentries - nsamples) snprintf(name, sizeof name, "name-%lu", k);
+		else snprintf(name, sizeof name, "extra-%lu", k - (nentries - nsamples));
+		uint64_t t0 = now_ns();
+		struct dirent *d = vsfs_lookup_one(root, name);
+		t[n] = now_ns() - t0;
+		if (!d) errx(EXIT_FAILURE, "lookup %s", name);
+	}
+	report("dir_lookup", params, t, nsamples);
+	for (unsigned long n = 0; n < nsamples; ++n)
+	{
+		snprintf(name, sizeof name, "missing-%lu", n);
+		uint64_t t0 = now_ns();
+		struct dirent *d = vsfs_lookup_one(root, name);
+		t[n] = now_ns() - t0;
+		if (d) errx(EXIT_FAILURE, "found %s", name);
+	}
+	report("dir_lookup_miss", params, t, nsamples);
+}
+
+/* Walks: write a file of 'nblocks' blocks, in one run, or alternating
+ * block by block with another file so that each block is an extent of its
+ * own; then time walking all its blocks. */
+static enum cb_res_t touch_block(data_block_t *block, unsigned block_idx_in_file, uintptr_t arg)
+{
+	*(uint64_t *) arg += *(const uint64_t *) block;
+	return VSF_CONTINUE;
+}
+static void bench_walk(unsigned long nblocks, _Bool fragmented)
+{
+	make_image(ROUND_UP_TO(BLOCK_SIZE, 2 * nblocks * BLOCK_SIZE * 17 / 16 + (4ul << 20)));
+	struct inode *root = vsfs_inode(0);
+	struct inode *f = vsfs_creat(root, "walked"), *other = vsfs_creat(root, "other");
+	if (!f || !other) errx(EXIT_FAILURE, "creat");
+	static char block[BLOCK_SIZE];
+	memset(block, 'x', sizeof block);
+	if (fragmented) vsfs_write_buffer_max = 0;
+	for (unsigned long b = 0; b < nblocks; ++b)
+	{
+		if (vsfs_write(f, b * BLOCK_SIZE, block, BLOCK_SIZE) != BLOCK_SIZE) errx(EXIT_FAILURE, "write");
+		if (fragmented && vsfs_write(other, b * BLOCK_SIZE, block, BLOCK_SIZE) != BLOCK_SIZE) errx(EXIT_FAILURE, "write");
+	}
+	vsfs_sync();
+
+	unsigned long n = (nsamples < WALK_SAMPLES) ? nsamples : WALK_SAMPLES;
+	uint64_t *t = alloc_times(n), sum = 0;
+	for (unsigned long k = 0; k < n; ++k)
+	{
+		uint64_t t0 = now_ns();
+		for_each_data_block(f, touch_block, (uintptr_t) &sum);
+		t[k] = now_ns() - t0;
+	}
+	if (sum != n * nblocks * 0x7878787878787878ull) errx(EXIT_FAILURE, "walk missed blocks");
+	char params[48];
+	snprintf(params, sizeof params, "blocks=%lu,extents=%u,fragmented=%d", nblocks, (unsigned) f->nextents,
+		fragmented);
+	report("walk", params, t, n);
+}
+static void bench_walk_contiguous(unsigned long nblocks)
+{
+	bench_walk(nblocks, 0);
+}
+static void bench_walk_fragmented(unsigned long nblocks)
+{
+	bench_walk(nblocks, 1);
+}
+
+/* statfs: should not depend on the size of the image */
+static void bench_statfs(unsigned long nbytes)
+{
+	make_image(nbytes);
+	uint64_t *t = alloc_times(nsamples);
+	struct vsfs_statfs s;
+	for (unsigned long k = 0; k < nsamples; ++k)
+	{
+		uint64_t t0 = now_ns();
+		vsfs_statfs(&s);
+		t[k] = now_ns() - t0;
+	}
+	if (s.nfree_data_blocks + 1 != s.ndata_blocks) errx(EXIT_FAILURE, "statfs miscounted");
+	char params[32];
+	snprintf(params, sizeof params, "image=%luM", nbytes >> 20);
+	report("statfs", params, t, nsamples);
+}
+
+int main(int argc, char **argv)
+{
+	nsamples = (argc > 1) ? strtoul(argv[1], NULL, 0) : 10000;
+	if (nsamples == 0) errx(EXIT_FAILURE, "bad operation count");
+	debug_level = 0;
+	debug_out = fopen("/dev/null", "w");
+
+	printf("# vsfs core microbenchmarks: ns per operation\n");
+	printf("# %-14s %-24s %8s %10s %10s %10s %10s %10s\n", "case", "params", "ops", "mean", "p50", "p90", "p99", "max");
+	static const unsigned long long image_sizes[] = { 64ull << 20, 1ull << 30, 16ull << 30 };
+	for (unsigned k = 0; k < sizeof image_sizes / sizeof image_sizes[0]; ++k) bench_init(image_sizes[k]);
+
+	/* the rest measure the operations, not commits */
+	vsfs_mkfs_features &= ~VSFS_FEATURE_JOURNAL;
+	static const unsigned long fills[] = { 0, 50, 90, 99 };
+	for (unsigned k = 0; k < sizeof fills / sizeof fills[0]; ++k) run_in_child(bench_inode_alloc, fills[k]);
+	for (unsigned k = 0; k < sizeof fills / sizeof fills[0]; ++k) run_in_child(bench_data_alloc, fills[k]);
+	static const unsigned long dir_sizes[] = { 100, 10000, 100000 };
+	for (unsigned k = 0; k < sizeof dir_sizes / sizeof dir_sizes[0]; ++k) run_in_child(bench_dir, dir_sizes[k]);
+	static const unsigned long walk_sizes[] = { 1, 256, 16384 };
+	for (unsigned k = 0; k < sizeof walk_sizes / sizeof walk_sizes[0]; ++k)
+	{
+		run_in_child(bench_walk_contiguous, walk_sizes[k]);
+		run_in_child(bench_walk_fragmented, walk_sizes[k]);
+	}
+	for (unsigned k = 0; k < sizeof image_sizes / sizeof image_sizes[0]; ++k) run_in_child(bench_statfs, image_sizes[k]);
+	return 0;
+}
@@ -0,0 +1,144 @@
+/* Defragmentation benchmark: cold sequential reads of fragmented files,
+ * before and after vsfs_defrag.
+ *
+ * We build an image, in a directory on a real disk (not tmpfs, where nothing
+ * is ever cold), holding 16 files that together make up the given size,
+ * written a block at a time in turn, with no write buffering, so that their
+ * blocks interleave. Then each phase runs in a child that opens the image:
+ * one drops it from the page cache and reads every file from the start in
+ * 64 kB reads; one defragments it, in passes of the given budget, until a
+ * sweep is done; and one reads it cold again. We report the runs per file
+ * and the free space's runs before and after, the read MB/s, and what the
+ * defragmentation took, pass by pass. Dropping the cache needs no
+ * privileges, but only works on pages nothing has mapped, so we also report
+ * what share of the image stayed cached.
+ *
+ * Usage: bench-defrag [MB] [directory] [budget ms]
+ *        (defaults: 128; /var/tmp; 10)
+ */
+#define _GNU_SOURCE /* mincore */
+#include <string.h>
+
+#include "vsfs.h"
+#include "bench.h"
+
+#define NFILES 16
+#define IO_SIZE (64 * 1024)
+static unsigned long file_size, budget_ms;
+static char image[4096];
+
+static struct inode *file(unsigned k)
+{
+	char name[16];
+	snprintf(name, sizeof name, "f%u", k);
+	struct inode *f = vsfs_lookup(vsfs_inode(0), name);
+	if (!f) errx(EXIT_FAILURE, "finding %s", name);
+	return f;
+}
+static void report_layout(const char *when)
+{
+	unsigned long runs = 0;
+	for (unsigned k = 0; k < NFILES; ++k) runs += vsfs_fragments(file(k));
+	struct vsfs_free_histogram h;
+	vsfs_free_histogram(&h);
+	printf("%-7s %9.1f runs per file; free space in %lu runs, the longest %lu blocks\n", when,
+		(double) runs / NFILES, h.nruns, h.largest);
+}
+
+static void build(unsigned long unused)
+{
+	vsfs_init(image, 0);
+	struct inode *f[NFILES];
+	char buf[BLOCK_SIZE], name[16];
+	for (unsigned k = 0; k < NFILES; ++k)
+	{
+		snprintf(name, sizeof name, "f%u", k);
+		if (!(f[k] = vsfs_creat(vsfs_inode(0), name))) errx(EXIT_FAILURE, "creating %s", name);
+	}
+	for (unsigned long off = 0; off < file_size; off += BLOCK_SIZE)
+	{
+		for (unsigned k = 0; k < NFILES; ++k)
+		{
+			for (unsigned j = 0; j < BLOCK_SIZE; j += 8)
+			{
+				uint64_t r = next_random();
+				memcpy(buf + j, &r, 8);
+			}
+			if (vsfs_write(f[k], off, buf, BLOCK_SIZE) != BLOCK_SIZE) errx(EXIT_FAILURE, "write at %lu", off);
+		}
+	}
+	vsfs_sync();
+	report_layout("before");
+}
+
+static void read_all(unsigned long unused)
+{
+	vsfs_init(image, 0);
+	struct inode *f[NFILES];
+	for (unsigned k = 0; k < NFILES; ++k) f[k] = file(k);
+	char *buf = malloc(IO_SIZE);
+	if (!buf) err(EXIT_FAILURE, "allocating a buffer");
+	double cached = drop_cache(image);
+	double t0 = now_ns();
+	for (unsigned k = 0; k < NFILES; ++k)
+	{
+		for (unsigned long off = 0; off < file_size; off += IO_SIZE)
+		{
+			if (vsfs_read(f[k], off, buf, IO_SIZE) != IO_SIZE) errx(EXIT_FAILURE, "read at %lu", off);
+		}
+	}
+	double secs = (now_ns() - t0) / 1e9;
+	printf("read    %9.0f MB/s cold (%.1f%% stayed cached)\n", (double) NFILES * file_size / secs / (1 << 20), 100 * cached);
+}
+
+static void defrag(unsigned long unused)
+{
+	vsfs_init(image, 0);
+	struct vsfs_defrag_report r;
+	unsigned long npasses = 0, nmoved = 0, ndefragged = 0;
+	double longest = 0, t0 = now_ns();
+	do
+	{
+		double t = now_ns();
+		vsfs_defrag(budget_ms, &r);
+		t = now_ns() - t;
+		if (t > longest) longest = t;
+		++npasses;
+		nmoved += r.nblocks_moved;
+		ndefragged += r.ndefragged;
+	} while (!r.done);
+	vsfs_sync();
+	double secs = (now_ns() - t0) / 1e9;
+	printf("defrag  %9.2f s, %lu passes of %lu ms (the longest %.1f ms); %lu blocks moved, %lu files into one run\n",
+		secs, npasses, budget_ms, longest / 1e6, nmoved, ndefragged);
+	report_layout("after");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long total = ((argc > 1) ? strtoul(argv[1], NULL, 0) : 128) << 20;
+	const char *dir = (argc > 2) ? argv[2] : "/var/tmp";
+	budget_ms = (argc > 3) ? strtoul(argv[3], NULL, 0) : 10;
+	file_size = ROUND_DOWN_TO(BLOCK_SIZE, total / NFILES);
+	if (file_size < IO_SIZE || total > (1ul << 34)) errx(EXIT_FAILURE, "bad size");
+	file_size = ROUND_DOWN_TO(IO_SIZE, file_size);
+	debug_level = 0;
+	debug_out = fopen("/dev/null", "w");
+	/* each block its own allocation, as with many small appends */
+	vsfs_write_buffer_max = 0;
+
+	snprintf(image, sizeof image, "%s/bench-defrag.XXXXXX", dir);
+	int fd = mkstemp(image);
+	if (fd == -1) err(EXIT_FAILURE, "creating an image in `%s'", dir);
+	/* room for every file to move once, and then some */
+	if (ftruncate(fd, ROUND_UP_TO(BLOCK_SIZE, 2 * total + total / 4 + (8ul << 20))) != 0) err(EXIT_FAILURE, "sizing the image");
+	close(fd);
+
+	printf("%u files of %lu MB, each written a block at a time in turn\n", NFILES, file_size >> 20);
+	run_in_child(build, 0);
+	run_in_child(read_all, 0);
+	run_in_child(defrag, 0);
+	run_in_child(read_all, 0);
+	unlink(image);
+	return 0;
+}
@@ -0,0 +1,103 @@
+/* Benchmark for directory insert and lookup: linear scans of fixed-size
+ * and of compact directory entries, and the hashed directory index (over
+ * compact entries).
+ *
+ * For each mode we fork a child that opens a fresh image, fills the root
+ * directory with N names, then looks up a sample of them. A few hundred
+ * names are files made by vsfs_creat; the rest are further links to those
+ * files, since the inode table is much smaller than N.
+ *
+ * Usage: bench-dir [nnames]   (default: 100000)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <err.h>
+
+#include "vsfs.h"
+
+#define MAX_FILES 256
+#define MAX_LOOKUPS 10000
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const char *mode, unsigned long nnames)
+{
+	/* room for every dirent, the index at its largest, and some slack */
+	size_t nbytes = ROUND_UP_TO(BLOCK_SIZE, nnames * (sizeof (struct dirent) + 64) + (1ul << 20));
+	char path[] = "/tmp/bench-dir.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) err(EXIT_FAILURE, "creating temporary image");
+	if (ftruncate(fd, nbytes) != 0) err(EXIT_FAILURE, "sizing temporary image");
+	vsfs_mkfs_features = (0 == strcmp(mode, "fixed")) ? 0 : VSFS_FEATURE_COMPACT_DIRENTS;
+	vsfs_init(path, nbytes);
+	unlink(path);
+	close(fd);
+
+	vsfs_dir_index_enabled = (0 == strcmp(mode, "hashed"));
+	struct inode *root = vsfs_inode(0);
+	struct inode *files[MAX_FILES];
+	unsigned nfiles = 0;
+	char name[32];
+
+	double t0 = now_ns();
+	for (unsigned long n = 0; n < nnames; ++n)
+	{
+		snprintf(name, sizeof name, "name-%lu", n);
+		if (nfiles < MAX_FILES)
+		{
+			if (!(files[nfiles++] = vsfs_creat(root, name))) errx(EXIT_FAILURE, "creat %s", name);
+		}
+		else if (!vsfs_link(root, files[n % MAX_FILES], name)) errx(EXIT_FAILURE, "link %s", name);
+	}
+	double t_insert = now_ns() - t0;
+
+	/* Look up an evenly spaced sample, plus as many names that aren't there. */
+	unsigned long nlookups = (nnames < MAX_LOOKUPS) ? nnames : MAX_LOOKUPS;
+	unsigned long stride = nnames / nlookups;
+	t0 = now_ns();
+	for (unsigned long n = 0; n < nlookups; ++n)
+	{
+		snprintf(name, sizeof name, "name-%lu", n * stride);
+		if (!vsfs_lookup_one(root, name)) errx(EXIT_FAILURE, "lookup %s", name);
+		snprintf(name, sizeof name, "absent-%lu", n);
+		if (vsfs_lookup_one(root, name)) errx(EXIT_FAILURE, "lookup %s", name);
+	}
+	double t_lookup = now_ns() - t0;
+	printf("%-8s %10lu %16.1f %16.1f %10u\n", mode, nnames, t_insert / nnames, t_lookup / (2 * nlookups),
+		(unsigned) root->nblocks);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long nnames = (argc > 1) ? strtoul(argv[1], NULL, 0) : 100000;
+	debug_level = 0;
+	debug_out = fopen("/dev/null", "w");
+	printf("%-8s %10s %16s %16s %10s\n", "mode", "names", "insert ns/op", "lookup ns/op", "dir blocks");
+	const char *modes[] = { "fixed", "compact", "hashed" };
+	for (unsigned m = 0; m < sizeof modes / sizeof modes[0]; ++m)
+	{
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == -1) err(EXIT_FAILURE, "fork");
+		if (pid == 0)
+		{
+			run(modes[m], nnames);
+			exit(EXIT_SUCCESS);
+		}
+		int status;
+		if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			errx(EXIT_FAILURE, "%s run failed", modes[m]);
+		}
+	}
+	return 0;
+}
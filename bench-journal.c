@@ -0,0 +1,201 @@
+/* Throughput benchmark for the metadata journal.
+ *
+ * Each run forks a child that opens a fresh, journalled image and has some
+ * threads add names to the root directory, as in bench-threads: a few by
+ * vsfs_creat and the rest as vsfs_links to those files. We run:
+ *
+ *   per-op: no group commit; each operation commits and flushes alone;
+ *   group:  group commit, at 1 thread and then doubling up to N threads;
+ *   async:  group commit, but operations don't wait for their batch to be
+ *           durable, at N threads, with a vsfs_sync at the end.
+ *
+ * and report operations per second, including the final sync, together with
+ * the number of commits (each of which costs one flush), how many operations
+ * each commit carried on average, and how many bytes each operation logged.
+ *
+ * Then, on a 4 GB image with asynchronous operations, we time small durable
+ * updates: a 64-byte write to one of a few small files, made durable with
+ * vsfs_fsync on that file, or with vsfs_sync, reporting microseconds per
+ * update and the pwrites per commit of blocks written in place.
+ *
+ * The image lives in the given directory, which should be on the kind of
+ * storage you care about; a tmpfs makes flushes free and the figures
+ * meaningless.
+ *
+ * Usage: bench-journal [directory] [max threads] [names per thread]
+ *        (defaults: the current directory; 8; 2000)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <err.h>
+
+#include "vsfs.h"
+#include "journal.h"
+
+#define NFILES_PER_THREAD 4
+
+static const char *dir;
+static unsigned nthreads;
+static unsigned long nnames;
+static struct inode *root;
+static pthread_barrier_t barrier;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *create_names(void *arg)
+{
+	unsigned t = (uintptr_t) arg;
+	struct inode *files[NFILES_PER_THREAD];
+	char name[32];
+	pthread_barrier_wait(&barrier);
+	for (unsigned long n = 0; n < nnames; ++n)
+	{
+		snprintf(name, sizeof name, "t%u-name-%lu", t, n);
+		if (n < NFILES_PER_THREAD)
+		{
+			if (!(files[n] = vsfs_creat(root, name))) errx(EXIT_FAILURE, "creat %s", name);
+		}
+		else if (!vsfs_link(root, files[n % NFILES_PER_THREAD], name)) errx(EXIT_FAILURE, "link %s", name);
+	}
+	return NULL;
+}
+
+static void run(const char *mode)
+{
+	/* room for every dirent and the index at its largest, plus some slack */
+	size_t nbytes = ROUND_UP_TO(BLOCK_SIZE, nthreads * nnames * 96 + (4ul << 20));
+	char path[4096];
+	snprintf(path, sizeof path, "%s/bench-journal.XXXXXX", dir);
+	int fd = mkstemp(path);
+	if (fd == -1) err(EXIT_FAILURE, "creating temporary image in `%s'", dir);
+	if (ftruncate(fd, nbytes) != 0) err(EXIT_FAILURE, "sizing temporary image");
+	vsfs_init(path, nbytes);
+	unlink(path);
+	close(fd);
+	root = vsfs_inode(0);
+	if (nnames <= NFILES_PER_THREAD) errx(EXIT_FAILURE, "need more than %d names per thread", NFILES_PER_THREAD);
+
+	struct journal_stats before, after;
+	journal_get_stats(&before);
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	pthread_t threads[nthreads];
+	for (unsigned t = 0; t < nthreads; ++t)
+	{
+		if (0 != pthread_create(&threads[t], NULL, create_names, (void *)(uintptr_t) t)) errx(EXIT_FAILURE, "pthread_create");
+	}
+	pthread_barrier_wait(&barrier);
+	double t0 = now_ns();
+	for (unsigned t = 0; t < nthreads; ++t) pthread_join(threads[t], NULL);
+	vsfs_sync();
+	double elapsed = now_ns() - t0;
+	journal_get_stats(&after);
+
+	unsigned long nops = after.nops - before.nops;
+	unsigned long ncommits = after.ncommits - before.ncommits;
+	printf("%-8s %8u %12.0f %10lu %12.1f %12.1f\n", mode, nthreads, nops / (elapsed / 1e9), ncommits,
+		ncommits ? (double) nops / ncommits : 0.0,
+		nops ? (double) (after.nbytes_logged - before.nbytes_logged) / nops : 0.0);
+}
+
+#define NUPDATE_FILES 16
+static void run_updates(const char *mode)
+{
+	size_t nbytes = 4ul << 30;
+	char path[4096];
+	snprintf(path, sizeof path, "%s/bench-journal.XXXXXX", dir);
+	int fd = mkstemp(path);
+	if (fd == -1) err(EXIT_FAILURE, "creating temporary image in `%s'", dir);
+	if (ftruncate(fd, nbytes) != 0) err(EXIT_FAILURE, "sizing temporary image");
+	vsfs_init(path, nbytes);
+	unlink(path);
+	close(fd);
+	root = vsfs_inode(0);
+	struct inode *files[NUPDATE_FILES];
+	static char block[2 * BLOCK_SIZE];
+	char name[32];
+	for (unsigned k = 0; k < NUPDATE_FILES; ++k)
+	{
+		snprintf(name, sizeof name, "small-%u", k);
+		if (!(files[k] = vsfs_creat(root, name))) errx(EXIT_FAILURE, "creat %s", name);
+		if (vsfs_write(files[k], 0, block, sizeof block) != sizeof block) errx(EXIT_FAILURE, "write %s", name);
+	}
+	vsfs_sync();
+
+	struct journal_stats before, after;
+	journal_get_stats(&before);
+	double t0 = now_ns();
+	for (unsigned long n = 0; n < nnames; ++n)
+	{
+		struct inode *f = files[n % NUPDATE_FILES];
+		if (vsfs_write(f, (n * 64) % sizeof block, block, 64) != 64) errx(EXIT_FAILURE, "update");
+		if (mode[0] == 'f') vsfs_fsync(f);
+		else vsfs_sync();
+	}
+	double elapsed = now_ns() - t0;
+	journal_get_stats(&after);
+	unsigned long ncommits = after.ncommits - before.ncommits;
+	printf("%-8s %12.1f %10lu %14.1f\n", mode, elapsed / 1e3 / nnames, ncommits,
+		ncommits ? (double) (after.nhome_writes - before.nhome_writes) / ncommits : 0.0);
+}
+
+static void run_in_child(const char *mode)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) err(EXIT_FAILURE, "fork");
+	if (pid == 0)
+	{
+		if (0 == strcmp(mode, "fsync") || 0 == strcmp(mode, "sync")) run_updates(mode);
+		else run(mode);
+		exit(EXIT_SUCCESS);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		errx(EXIT_FAILURE, "%s run failed", mode);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	dir = (argc > 1) ? argv[1] : ".";
+	unsigned max_threads = (argc > 2) ? strtoul(argv[2], NULL, 0) : 8;
+	nnames = (argc > 3) ? strtoul(argv[3], NULL, 0) : 2000;
+	if (max_threads == 0) errx(EXIT_FAILURE, "need at least one thread");
+	debug_level = 0;
+	debug_out = fopen("/dev/null", "w");
+	vsfs_mkfs_features |= VSFS_FEATURE_JOURNAL;
+	printf("%lu names per thread; commit interval %lu us\n", nnames, vsfs_commit_interval_us);
+	printf("%-8s %8s %12s %10s %12s %12s\n", "mode", "threads", "ops/sec", "commits", "ops/commit", "bytes/op");
+
+	vsfs_group_commit = 0;
+	nthreads = 1;
+	run_in_child("per-op");
+
+	vsfs_group_commit = 1;
+	for (nthreads = 1; ; nthreads *= 2)
+	{
+		if (nthreads > max_threads) nthreads = max_threads;
+		run_in_child("group");
+		if (nthreads == max_threads) break;
+	}
+
+	vsfs_durable_ops = 0;
+	run_in_child("async");
+
+	printf("\n%lu small durable updates on a 4 GB image\n", nnames);
+	printf("%-8s %12s %10s %14s\n", "mode", "us/update", "commits", "writes/commit");
+	run_in_child("fsync");
+	run_in_child("sync");
+	return 0;
+}
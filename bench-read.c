@@ -0,0 +1,142 @@
+/* Read throughput benchmark: copying reads against zero-copy spans.
+ *
+ * We write one large file, then read all of it repeatedly, in requests of
+ * several sizes, each of four ways:
+ *
+ *   copy+sum:    vsfs_read into a buffer, then sum the buffer;
+ *   spans+sum:   vsfs_read_spans, then sum the bytes in place;
+ *   copy+writev: vsfs_read into a buffer, then write it to /dev/null;
+ *   spans+writev: vsfs_read_spans, then writev the spans to /dev/null.
+ *
+ * The sums show the cost of the copy when the caller reads every byte
+ * anyway; the writes to /dev/null, which reads nothing, show the cost of the
+ * copy alone, as when handing file contents to the kernel. Every sum is
+ * checked against the file's contents. Figures are in MB/s of file data.
+ *
+ * Usage: bench-read [file size in MB] [passes]
+ *        (defaults: 256; 4)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "vsfs.h"
+
+#define MAX_SPANS 64
+
+static struct inode *file;
+static unsigned long file_size;
+static unsigned passes;
+static char *buf;
+static int devnull;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+static uint64_t sum_bytes(const void *p, size_t len)
+{
+	uint64_t sum = 0;
+	const uint64_t *w = p;
+	for (size_t n = 0; n < len / 8; ++n) sum += w[n];
+	for (size_t n = len - len % 8; n < len; ++n) sum += ((const unsigned char *) p)[n];
+	return sum;
+}
+
+enum how { COPY_SUM, SPANS_SUM, COPY_WRITEV, SPANS_WRITEV };
+/* Read the whole file once, in requests of 'chunk' bytes. */
+static uint64_t read_file(enum how how, unsigned long chunk)
+{
+	uint64_t sum = 0;
+	struct iovec spans[MAX_SPANS];
+	for (unsigned long off = 0; off < file_size; )
+	{
+		long n;
+		if (how == COPY_SUM || how == COPY_WRITEV)
+		{
+			n = vsfs_read(file, off, buf, chunk);
+			if (n <= 0) errx(EXIT_FAILURE, "read at %lu", off);
+			if (how == COPY_SUM) sum += sum_bytes(buf, n);
+			else if (write(devnull, buf, n) != n) err(EXIT_FAILURE, "writing /dev/null");
+		}
+		else
+		{
+			unsigned nspans = MAX_SPANS;
+			n = vsfs_read_spans(file, off, chunk, spans, &nspans);
+			if (n <= 0) errx(EXIT_FAILURE, "read spans at %lu", off);
+			if (how == SPANS_SUM) for (unsigned k = 0; k < nspans; ++k) sum += sum_bytes(spans[k].iov_base, spans[k].iov_len);
+			else if (writev(devnull, spans, nspans) != n) err(EXIT_FAILURE, "writing /dev/null");
+			vsfs_release_spans(file);
+		}
+		off += n;
+	}
+	return sum;
+}
+
+int main(int argc, char **argv)
+{
+	file_size = ((argc > 1) ? strtoul(argv[1], NULL, 0) : 256) << 20;
+	passes = (argc > 2) ? strtoul(argv[2], NULL, 0) : 4;
+	if (file_size == 0 || file_size > (3ul << 30) || passes == 0) errx(EXIT_FAILURE, "bad file size or pass count");
+	debug_level = 0;
+	debug_out = fopen("/dev/null", "w");
+	FILE *null_file = fopen("/dev/null", "w");
+	if (!null_file) err(EXIT_FAILURE, "opening /dev/null");
+	devnull = fileno(null_file);
+	/* we measure reads here, not commits */
+	vsfs_mkfs_features &= ~VSFS_FEATURE_JOURNAL;
+
+	size_t nbytes = ROUND_UP_TO(BLOCK_SIZE, file_size + file_size / 16 + (4ul << 20));
+	char path[] = "/tmp/bench-read.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) err(EXIT_FAILURE, "creating temporary image");
+	if (ftruncate(fd, nbytes) != 0) err(EXIT_FAILURE, "sizing temporary image");
+	vsfs_init(path, nbytes);
+	unlink(path);
+	close(fd);
+
+	/* Fill the file with a pattern, remembering what it sums to. */
+	file = vsfs_creat(vsfs_inode(0), "big");
+	if (!file) errx(EXIT_FAILURE, "creat");
+	buf = malloc(1 << 20);
+	if (!buf) err(EXIT_FAILURE, "allocating buffer");
+	uint64_t expected = 0, x = 88172645463325252ull;
+	for (unsigned long off = 0; off < file_size; off += 1 << 20)
+	{
+		for (size_t n = 0; n < (1 << 20) / 8; ++n)
+		{
+			x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+			((uint64_t *) buf)[n] = x;
+		}
+		expected += sum_bytes(buf, 1 << 20);
+		if (vsfs_write(file, off, buf, 1 << 20) != 1 << 20) errx(EXIT_FAILURE, "write at %lu", off);
+	}
+	/* and fault it all in, so that we time reads, not page faults */
+	if (read_file(SPANS_SUM, 1 << 20) != expected) errx(EXIT_FAILURE, "file reads back wrong");
+
+	printf("%lu MB file, %u passes; MB/s\n", file_size >> 20, passes);
+	printf("%10s %14s %14s %14s %14s\n", "request", "copy+sum", "spans+sum", "copy+writev", "spans+writev");
+	static const unsigned long chunks[] = { 4096, 65536, 1 << 20 };
+	for (unsigned c = 0; c < sizeof chunks / sizeof chunks[0]; ++c)
+	{
+		printf("%10lu", chunks[c]);
+		for (enum how how = COPY_SUM; how <= SPANS_WRITEV; ++how)
+		{
+			double t0 = now_ns();
+			for (unsigned p = 0; p < passes; ++p)
+			{
+				uint64_t sum = read_file(how, chunks[c]);
+				if ((how == COPY_SUM || how == SPANS_SUM) && sum != expected) errx(EXIT_FAILURE, "wrong sum");
+			}
+			double secs = (now_ns() - t0) / 1e9;
+			printf(" %14.0f", (double) passes * file_size / secs / (1 << 20));
+		}
+		printf("\n");
+	}
+	return 0;
+}
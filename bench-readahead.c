@@ -0,0 +1,104 @@
+/* Readahead benchmark: cold-cache reads, with our readahead and without.
+ *
+ * We build an image holding one file of the given size, in a directory on a
+ * real disk (not tmpfs, where nothing is ever cold). Then each run forks a
+ * child that opens the image, drops it from the page cache, and reads the
+ * file: all of it in 64 kB reads, from the start; or 4 kB or 64 kB reads at
+ * random offsets, for 1/64 of it. We run each with vsfs_readahead_max
+ * at 0, which leaves readahead to the kernel's read-around on the mapping,
+ * and at its default, through the mapping and through the pread backend,
+ * and report MB/s. Dropping the cache needs no privileges, but only works
+ * on pages nothing has mapped, so we also report what share of the file
+ * stayed cached.
+ *
+ * Usage: bench-readahead [MB] [directory] [readahead kB]
+ *        (defaults: 256; /var/tmp; vsfs_readahead_max)
+ */
+#define _GNU_SOURCE /* mincore */
+#include <string.h>
+
+#include "vsfs.h"
+#include "bench.h"
+
+#define IO_SIZE (64 * 1024)
+static unsigned long file_size;
+static char image[4096];
+
+static void build(unsigned long unused)
+{
+	vsfs_init(image, 0);
+	struct inode *f = vsfs_creat(vsfs_inode(0), "file");
+	char *buf = malloc(IO_SIZE);
+	if (!f || !buf) errx(EXIT_FAILURE, "creating the file");
+	for (unsigned long off = 0; off < file_size; off += IO_SIZE)
+	{
+		for (unsigned k = 0; k < IO_SIZE; k += 8)
+		{
+			uint64_t r = next_random();
+			memcpy(buf + k, &r, 8);
+		}
+		if (vsfs_write(f, off, buf, IO_SIZE) != IO_SIZE) errx(EXIT_FAILURE, "write at %lu", off);
+	}
+	vsfs_sync();
+}
+
+enum pattern { SEQUENTIAL, RANDOM_4K, RANDOM_64K };
+static const char *const pattern_names[] = { "seq 64k", "rand 4k", "rand 64k" };
+static void run(unsigned long arg)
+{
+	enum pattern what = arg;
+	vsfs_init(image, 0);
+	struct inode *f = vsfs_lookup(vsfs_inode(0), "file");
+	char *buf = malloc(IO_SIZE);
+	if (!f || !buf) errx(EXIT_FAILURE, "finding the file");
+	double cached = drop_cache(image);
+	unsigned long io = (what == RANDOM_4K) ? 4096 : IO_SIZE;
+	unsigned long nreads = (what == SEQUENTIAL) ? file_size / io : file_size / 64 / io;
+	double t0 = now_ns();
+	for (unsigned long n = 0; n < nreads; ++n)
+	{
+		unsigned long off = (what == SEQUENTIAL) ? n * io : next_random() % (file_size / io) * io;
+		if (vsfs_read(f, off, buf, io) != io) errx(EXIT_FAILURE, "read at %lu", off);
+	}
+	double secs = (now_ns() - t0) / 1e9;
+	printf("%-9s %-6s %-6s %10.0f %9.1f%%\n", pattern_names[what], vsfs_backend == VSFS_BACKEND_PREAD ? "pread" : "mmap",
+		vsfs_readahead_max ? "vsfs" : "kernel", (double) nreads * io / secs / (1 << 20), 100 * cached);
+}
+
+int main(int argc, char **argv)
+{
+	file_size = ((argc > 1) ? strtoul(argv[1], NULL, 0) : 256) << 20;
+	const char *dir = (argc > 2) ? argv[2] : "/var/tmp";
+	if (argc > 3) vsfs_readahead_max = strtoul(argv[3], NULL, 0) << 10;
+	if (file_size == 0 || file_size > (1ul << 34)) errx(EXIT_FAILURE, "bad file size");
+	debug_level = 0;
+	debug_out = fopen("/dev/null", "w");
+	/* we measure reads here, not commits */
+	vsfs_mkfs_features &= ~VSFS_FEATURE_JOURNAL;
+
+	snprintf(image, sizeof image, "%s/bench-readahead.XXXXXX", dir);
+	int fd = mkstemp(image);
+	if (fd == -1) err(EXIT_FAILURE, "creating an image in `%s'", dir);
+	if (ftruncate(fd, ROUND_UP_TO(BLOCK_SIZE, file_size + file_size / 16 + (4ul << 20))) != 0) err(EXIT_FAILURE, "sizing the image");
+	close(fd);
+	run_in_child(build, 0);
+
+	printf("one file of %lu MB, read cold; readahead up to %lu kB\n", file_size >> 20, vsfs_readahead_max >> 10);
+	printf("%-9s %-6s %-6s %10s %10s\n", "reads", "via", "ahead", "MB/s", "cached");
+	unsigned long readahead_max = vsfs_readahead_max;
+	for (enum pattern what = SEQUENTIAL; what <= RANDOM_64K; ++what)
+	{
+		vsfs_backend = VSFS_BACKEND_MMAP;
+		vsfs_readahead_max = 0;
+		run_in_child(run, what);
+		vsfs_readahead_max = readahead_max;
+		run_in_child(run, what);
+		vsfs_backend = VSFS_BACKEND_PREAD;
+		vsfs_readahead_max = 0;
+		run_in_child(run, what);
+		vsfs_readahead_max = readahead_max;
+		run_in_child(run, what);
+	}
+	unlink(image);
+	return 0;
+}
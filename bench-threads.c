@@ -0,0 +1,208 @@
+/* Multithreaded stress and throughput benchmark for the public operations.
+ *
+ * For each thread count from 1 up to N (doubling), we fork a child that opens
+ * a fresh image and runs three phases, each started on a barrier and timed
+ * by wall clock:
+ *
+ *   create: each thread adds its own names to the root directory, a few by
+ *           vsfs_creat and the rest as vsfs_links to those files;
+ *   lookup: each thread resolves random names, from every thread's set, with
+ *           vsfs_lookup;
+ *   mixed:  each thread unlinks half of its names, while looking up names
+ *           that must survive.
+ *
+ * Every lookup checks the inode it gets back, and after the last phase we
+ * check every name and every link count, so a locking bug shows up as a
+ * failure rather than as a good number.
+ *
+ * Usage: bench-threads [max threads] [names per thread]
+ *        (defaults: the number of CPUs, but at least 4; 20000)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <err.h>
+
+#include "vsfs.h"
+
+#define MAX_FILES_PER_THREAD 16
+
+static unsigned nthreads;
+static unsigned long nnames;
+static unsigned nfiles;
+static struct inode **files; /* nthreads * nfiles */
+static struct inode *root;
+static pthread_barrier_t barrier;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+static void name_of(char *buf, size_t sz, unsigned t, unsigned long n)
+{
+	snprintf(buf, sz, "t%u-name-%lu", t, n);
+}
+static struct inode *file_of(unsigned t, unsigned long n)
+{
+	return files[t * nfiles + n % nfiles];
+}
+static unsigned long xorshift(unsigned long *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+static void check_lookup(unsigned t, unsigned long n, _Bool expect_present)
+{
+	char name[32];
+	name_of(name, sizeof name, t, n);
+	struct inode *i = vsfs_lookup(root, name);
+	if (expect_present ? (i != file_of(t, n)) : (i != NULL))
+	{
+		errx(EXIT_FAILURE, "lookup %s: expected %s", name, expect_present ? "its file" : "nothing");
+	}
+}
+
+static void *create_phase(void *arg)
+{
+	unsigned t = (uintptr_t) arg;
+	char name[32];
+	pthread_barrier_wait(&barrier);
+	for (unsigned long n = 0; n < nnames; ++n)
+	{
+		name_of(name, sizeof name, t, n);
+		if (n < nfiles)
+		{
+			if (!(files[t * nfiles + n] = vsfs_creat(root, name))) errx(EXIT_FAILURE, "creat %s", name);
+		}
+		else if (!vsfs_link(root, file_of(t, n), name)) errx(EXIT_FAILURE, "link %s", name);
+	}
+	return NULL;
+}
+static void *lookup_phase(void *arg)
+{
+	unsigned t = (uintptr_t) arg;
+	unsigned long state = 88172645463325252ul + t;
+	pthread_barrier_wait(&barrier);
+	for (unsigned long n = 0; n < nnames; ++n)
+	{
+		unsigned long r = xorshift(&state);
+		check_lookup(r % nthreads, (r / nthreads) % nnames, 1);
+	}
+	return NULL;
+}
+static void *mixed_phase(void *arg)
+{
+	unsigned t = (uintptr_t) arg;
+	unsigned long state = 2463534242ul + t;
+	char name[32];
+	pthread_barrier_wait(&barrier);
+	/* Odd names go, except those that are the files' first names. */
+	for (unsigned long n = nfiles | 1; n < nnames; n += 2)
+	{
+		name_of(name, sizeof name, t, n);
+		if (!vsfs_unlink(root, name)) errx(EXIT_FAILURE, "unlink %s", name);
+		unsigned long r = xorshift(&state);
+		check_lookup(r % nthreads, 2 * ((r / nthreads) % (nnames / 2)), 1);
+	}
+	return NULL;
+}
+
+static double run_phase(void *(*fn)(void *))
+{
+	pthread_t threads[nthreads];
+	for (unsigned t = 0; t < nthreads; ++t)
+	{
+		if (0 != pthread_create(&threads[t], NULL, fn, (void *)(uintptr_t) t)) errx(EXIT_FAILURE, "pthread_create");
+	}
+	/* No thread can start until we reach the barrier, but on a busy machine
+	 * they may all finish before we return from it. */
+	double t0 = now_ns();
+	pthread_barrier_wait(&barrier);
+	for (unsigned t = 0; t < nthreads; ++t) pthread_join(threads[t], NULL);
+	return now_ns() - t0;
+}
+
+static void run(void)
+{
+	/* room for every dirent and the index at its largest, plus some slack */
+	size_t nbytes = ROUND_UP_TO(BLOCK_SIZE, nthreads * nnames * 96 + (1ul << 20));
+	char path[] = "/tmp/bench-threads.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) err(EXIT_FAILURE, "creating temporary image");
+	if (ftruncate(fd, nbytes) != 0) err(EXIT_FAILURE, "sizing temporary image");
+	vsfs_init(path, nbytes);
+	unlink(path);
+	close(fd);
+
+	root = vsfs_inode(0);
+	nfiles = 256 / nthreads;
+	if (nfiles > MAX_FILES_PER_THREAD) nfiles = MAX_FILES_PER_THREAD;
+	if (nfiles == 0 || nnames < 2 * nfiles || nnames / nfiles >= 65535) errx(EXIT_FAILURE, "bad thread or name count");
+	files = calloc(nthreads * nfiles, sizeof *files);
+	if (!files) err(EXIT_FAILURE, "allocating file table");
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+
+	unsigned long total = nthreads * nnames;
+	double t_create = run_phase(create_phase);
+	double t_lookup = run_phase(lookup_phase);
+	double t_mixed = run_phase(mixed_phase);
+	unsigned long nunlinked = (nnames - (nfiles | 1) + 1) / 2;
+
+	/* Now check everything. */
+	for (unsigned t = 0; t < nthreads; ++t)
+	{
+		for (unsigned long n = 0; n < nnames; ++n) check_lookup(t, n, n < nfiles || n % 2 == 0);
+		for (unsigned f = 0; f < nfiles; ++f)
+		{
+			unsigned long expected = 0;
+			for (unsigned long n = f; n < nnames; n += nfiles) expected += (n < nfiles || n % 2 == 0);
+			if (files[t * nfiles + f]->refcount != expected)
+			{
+				errx(EXIT_FAILURE, "thread %u file %u has %u links, expected %lu", t, f,
+					(unsigned) files[t * nfiles + f]->refcount, expected);
+			}
+		}
+	}
+	printf("%8u %16.0f %16.0f %16.0f\n", nthreads, total / (t_create / 1e9), total / (t_lookup / 1e9),
+		2 * nthreads * nunlinked / (t_mixed / 1e9));
+}
+
+int main(int argc, char **argv)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned max_threads = (argc > 1) ? strtoul(argv[1], NULL, 0) : (ncpus > 4 ? ncpus : 4);
+	nnames = (argc > 2) ? strtoul(argv[2], NULL, 0) : 20000;
+	debug_level = 0;
+	debug_out = fopen("/dev/null", "w");
+	/* we measure locking here; for the cost of commits, see bench-journal */
+	vsfs_mkfs_features &= ~VSFS_FEATURE_JOURNAL;
+	printf("%ld CPUs online, %lu names per thread; all figures are operations per second\n", ncpus, nnames);
+	printf("%8s %16s %16s %16s\n", "threads", "create", "lookup", "mixed");
+	for (nthreads = 1; ; nthreads *= 2)
+	{
+		if (nthreads > max_threads) nthreads = max_threads;
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == -1) err(EXIT_FAILURE, "fork");
+		if (pid == 0)
+		{
+			run();
+			exit(EXIT_SUCCESS);
+		}
+		int status;
+		if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			errx(EXIT_FAILURE, "run with %u threads failed", nthreads);
+		}
+		if (nthreads == max_threads) break;
+	}
+	return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+/* Helpers for the benchmarks and the tests, each of which is a single file
+ * that includes this one, after defining _GNU_SOURCE (for mincore). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <err.h>
+
+static inline double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* xorshift64, from the same seed in every process, so that a child forked
+ * before its first call sees the same sequence as any other */
+static uint64_t rng = 88172645463325252ull;
+static inline uint64_t next_random(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+/* Drop the image at 'path' from the page cache; returns the share of it
+ * still cached. That needs no privileges, but only works on pages nothing
+ * has mapped, and on tmpfs nothing is ever dropped. */
+static inline double drop_cache(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) err(EXIT_FAILURE, "opening `%s'", path);
+	struct stat st;
+	if (fstat(fd, &st) != 0) err(EXIT_FAILURE, "sizing `%s'", path);
+	if (fdatasync(fd) != 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) err(EXIT_FAILURE, "dropping `%s'", path);
+	long page = sysconf(_SC_PAGE_SIZE);
+	size_t npages = (st.st_size + page - 1) / page, ncached = 0;
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	unsigned char *vec = malloc(npages);
+	if (p == MAP_FAILED || !vec || mincore(p, st.st_size, vec) != 0) err(EXIT_FAILURE, "checking `%s'", path);
+	for (size_t k = 0; k < npages; ++k) ncached += vec[k] & 1;
+	munmap(p, st.st_size);
+	free(vec);
+	close(fd);
+	return (double) ncached / npages;
+}
+
+/* Run fn(arg) in a child process, which can open an image afresh (vsfs_init
+ * is once per process); exits if it fails. */
+static inline void run_in_child(void (*fn)(unsigned long), unsigned long arg)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) err(EXIT_FAILURE, "fork");
+	if (pid == 0)
+	{
+		fn(arg);
+		exit(EXIT_SUCCESS);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		errx(EXIT_FAILURE, "run failed");
+	}
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <assert.h>
 // want a truly word-sized integer... let's use uintptr_t for now
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef WORD_BITSIZE
 #define WORD_BITSIZE __INTPTR_WIDTH__
@@ -15,32 +16,19 @@ _Static_assert(BITMAP_WORD_NBITS == WORD_BITSIZE, "bitmap word size is platform
 #define popcount_y_(n) popcount ## n
 #define popcount_x_(n) popcount_y_(n)
 #define popcount_word popcount_x_(WORD_BITSIZE)
-// FIXME: replace these with the fast versions!
-static inline int popcount64(uint64_t x) {
-	int c = 0;
-	int i;
-	for (i = 0; i < 64; i++) {
-		c += x & 1;
-		x >>= 1;
-	}
-	return c;
-}
+static inline int popcount64(uint64_t x) { return __builtin_popcountll(x); }
+static inline int popcount32(uint32_t x) { return __builtin_popcount(x); }
+/* Index of the lowest (ctz) or highest (msb) set bit in a nonzero word. */
+static inline unsigned word_ctz(bitmap_word_t x) { return __builtin_ctzl(x); }
+static inline unsigned word_msb(bitmap_word_t x) { return BITMAP_WORD_NBITS - 1 - __builtin_clzl(x); }
 
-static inline int popcount32(uint32_t x) {
-	int c = 0;
-	int i;
-	for (i = 0; i < 32; i++) {
-		c += x & 1;
-		x >>= 1;
-	}
-	return c;
-}
+/* Visit the index of every set bit in [b, b_end). We clear the lowest set bit
+ * of a copy of each word as we go, so the cost is per set bit, not per bit. */
 #define BITMAP_FOR_EACH_BIT_SET(b, b_end, action) \
     for (bitmap_word_t *p = (b); p != (b_end); ++p) { \
-        bitmap_word_t word = *p; \
         /* little-endian means we start with the LSB */ \
-        for (unsigned i = 0; i < BITMAP_WORD_NBITS; ++i) { \
-            if (word & (0x1ul << i)) { action( (p-(b)) + i ); } \
+        for (bitmap_word_t word = *p; word != 0; word &= word - 1) { \
+            action( ((p-(b)) * BITMAP_WORD_NBITS + word_ctz(word)) ); \
         } \
     }
 
@@ -68,14 +56,147 @@ static inline _Bool bitmap_get(bitmap_word_t *p_bitmap, unsigned long index)
 {
 	return p_bitmap[index / BITMAP_WORD_NBITS] & (1ul << (index % BITMAP_WORD_NBITS));
 }
+/* Setting and clearing bits is atomic, so threads may update different bits
+ * of the same word concurrently. The scans below use plain loads, so what
+ * they find is only a hint: an allocator must claim a clear bit it found
+ * with bitmap_test_and_set, and search again if it lost the race. */
 static inline void bitmap_set(bitmap_word_t *p_bitmap, unsigned long index)
 {
-	p_bitmap[index / BITMAP_WORD_NBITS] |= (1ul << (index % BITMAP_WORD_NBITS));
+	__atomic_fetch_or(&p_bitmap[index / BITMAP_WORD_NBITS], 1ul << (index % BITMAP_WORD_NBITS),
+		__ATOMIC_ACQ_REL);
 }
 static inline void bitmap_clear(bitmap_word_t *p_bitmap, unsigned long index)
 {
-	p_bitmap[index / BITMAP_WORD_NBITS] &= ~(1ul << (index % BITMAP_WORD_NBITS));
+	__atomic_fetch_and(&p_bitmap[index / BITMAP_WORD_NBITS], ~(1ul << (index % BITMAP_WORD_NBITS)),
+		__ATOMIC_ACQ_REL);
+}
+/* Set the bit, returning whether it was already set. */
+static inline _Bool bitmap_test_and_set(bitmap_word_t *p_bitmap, unsigned long index)
+{
+	bitmap_word_t bit = 1ul << (index % BITMAP_WORD_NBITS);
+	return __atomic_fetch_or(&p_bitmap[index / BITMAP_WORD_NBITS], bit, __ATOMIC_ACQ_REL) & bit;
+}
+/* Atomically set the lowest bit that is clear in *p and also set in 'usable',
+ * returning its index within the word, or -1 if there is none. */
+static inline int bitmap_word_claim_first_clear(bitmap_word_t *p, bitmap_word_t usable)
+{
+	bitmap_word_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+	while (1)
+	{
+		bitmap_word_t avail = ~old & usable;
+		if (!avail) return -1;
+		bitmap_word_t bit = avail & -avail;
+		if (__atomic_compare_exchange_n(p, &old, old | bit, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			return word_ctz(bit);
+		}
+	}
+}
+
+/* Word-skipping kernels. Each returns the first word in [p, p_limit) that is
+ * not equal to 'fill', which must be all-zeroes or all-ones. This is the inner
+ * loop of every search below: allocation bitmaps are mostly long runs of full
+ * or empty words, so it pays to test several words per instruction.
+ * The vector versions are chosen at runtime, on the first call. */
+static inline bitmap_word_t *bitmap_skip_words_scalar(bitmap_word_t *p, bitmap_word_t *p_limit,
+	bitmap_word_t fill)
+{
+	/* Unroll by four; OR-ing the XORs lets us test four words with one branch. */
+	while (p_limit - p >= 4)
+	{
+		if (((p[0] ^ fill) | (p[1] ^ fill) | (p[2] ^ fill) | (p[3] ^ fill)) != 0) break;
+		p += 4;
+	}
+	while (p != p_limit && *p == fill) ++p;
+	return p;
+}
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+__attribute__((target("sse2")))
+static inline bitmap_word_t *bitmap_skip_words_sse2(bitmap_word_t *p, bitmap_word_t *p_limit,
+	bitmap_word_t fill)
+{
+	__m128i v_fill = _mm_set1_epi8((char) fill);
+	while ((char*) p_limit - (char*) p >= 2 * sizeof (__m128i))
+	{
+		__m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) p), v_fill);
+		__m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) p + 1), v_fill);
+		if (_mm_movemask_epi8(_mm_and_si128(eq0, eq1)) != 0xffff) break;
+		p += 2 * sizeof (__m128i) / sizeof *p;
+	}
+	return bitmap_skip_words_scalar(p, p_limit, fill);
+}
+__attribute__((target("avx2")))
+static inline bitmap_word_t *bitmap_skip_words_avx2(bitmap_word_t *p, bitmap_word_t *p_limit,
+	bitmap_word_t fill)
+{
+	__m256i v_fill = _mm256_set1_epi8((char) fill);
+	while ((char*) p_limit - (char*) p >= 2 * sizeof (__m256i))
+	{
+		__m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) p), v_fill);
+		__m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) p + 1), v_fill);
+		if (_mm256_movemask_epi8(_mm256_and_si256(eq0, eq1)) != -1) break;
+		p += 2 * sizeof (__m256i) / sizeof *p;
+	}
+	return bitmap_skip_words_scalar(p, p_limit, fill);
+}
+#endif
+typedef bitmap_word_t *bitmap_skip_words_fn(bitmap_word_t *p, bitmap_word_t *p_limit,
+	bitmap_word_t fill);
+/* Selected kernel; null until first use. Writing it from several threads is a
+ * benign race, since they all compute the same value. */
+static bitmap_skip_words_fn *bitmap_skip_words_impl __attribute__((unused));
+static inline bitmap_skip_words_fn *bitmap_select_skip_words(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return bitmap_skip_words_avx2;
+	if (__builtin_cpu_supports("sse2")) return bitmap_skip_words_sse2;
+#endif
+	return bitmap_skip_words_scalar;
+}
+static inline bitmap_word_t *bitmap_skip_words(bitmap_word_t *p, bitmap_word_t *p_limit,
+	bitmap_word_t fill)
+{
+	/* Don't bother dispatching for a handful of words. */
+	if (p_limit - p < 8) return bitmap_skip_words_scalar(p, p_limit, fill);
+	if (__builtin_expect(!bitmap_skip_words_impl, 0)) bitmap_skip_words_impl = bitmap_select_skip_words();
+	return bitmap_skip_words_impl(p, p_limit, fill);
+}
+
+/* Population count over whole words, likewise dispatched at runtime: without
+ * a popcnt instruction the builtin expands to a dozen shifts and masks. */
+static inline unsigned long bitmap_count_words_generic(bitmap_word_t *p, bitmap_word_t *p_limit)
+{
+	unsigned long count = 0;
+	for (; p != p_limit; ++p) count += popcount_word(*p);
+	return count;
 }
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("popcnt")))
+static inline unsigned long bitmap_count_words_popcnt(bitmap_word_t *p, bitmap_word_t *p_limit)
+{
+	unsigned long count = 0;
+	for (; p != p_limit; ++p) count += __builtin_popcountl(*p);
+	return count;
+}
+#endif
+typedef unsigned long bitmap_count_words_fn(bitmap_word_t *p, bitmap_word_t *p_limit);
+static bitmap_count_words_fn *bitmap_count_words_impl __attribute__((unused));
+static inline bitmap_count_words_fn *bitmap_select_count_words(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("popcnt")) return bitmap_count_words_popcnt;
+#endif
+	return bitmap_count_words_generic;
+}
+static inline unsigned long bitmap_count_words(bitmap_word_t *p, bitmap_word_t *p_limit)
+{
+	if (__builtin_expect(!bitmap_count_words_impl, 0)) bitmap_count_words_impl = bitmap_select_count_words();
+	return bitmap_count_words_impl(p, p_limit);
+}
+
 /* Here we do a reverse search for the first bit set at or below
  * bit position start_idx.
  * We return the position (index) of that bit, or (bitmap_word_t) -1 if no set bit was found.
@@ -87,24 +208,16 @@ static inline unsigned long bitmap_rfind_first_set_leq(bitmap_word_t *p_bitmap,
 	p_bitmap += start_idx / BITMAP_WORD_NBITS;
 	start_idx %= BITMAP_WORD_NBITS;
 	if (p_bitmap > p_limit) return (unsigned long) -1;
-	while (1)
+	/* Mask off the bits above start_idx in the first word only. */
+	bitmap_word_t word = *p_bitmap & BOTTOM_N_BITS_SET_T(bitmap_word_t, start_idx + 1);
+	while (word == 0)
 	{
-		while (start_idx >= 0)
-		{
-			bitmap_word_t test_bit = 1ul << start_idx;
-			if (*p_bitmap & test_bit)
-			{
-				if (out_test_bit) *out_test_bit = test_bit;
-				return start_idx + (p_bitmap - p_base) * BITMAP_WORD_NBITS;
-			}
-			--start_idx;
-		}
-		// now start_idx < 0
-		if (p_bitmap == p_base) break;
-		start_idx = BITMAP_WORD_NBITS - 1;
-		--p_bitmap;
+		if (p_bitmap == p_base) return (unsigned long) -1;
+		word = *--p_bitmap;
 	}
-	return (unsigned long) -1;
+	unsigned bit_idx = word_msb(word);
+	if (out_test_bit) *out_test_bit = 1ul << bit_idx;
+	return bit_idx + (p_bitmap - p_base) * BITMAP_WORD_NBITS;
 }
 /* Here we do a forward search for the first bit set starting at position start_idx.
  * We return its position, or (bitmap_word_t)-1 if not found.
@@ -116,121 +229,85 @@ static inline unsigned long bitmap_find_first_set1_geq(bitmap_word_t *p_bitmap,
 	p_bitmap += start_idx / BITMAP_WORD_NBITS;
 	start_idx %= BITMAP_WORD_NBITS;
 	if (p_bitmap >= p_limit) return (unsigned long) -1;
-	while (1)
+	/* Mask off the bits below start_idx in the first word only. */
+	bitmap_word_t word = *p_bitmap & BOTTOM_N_BITS_CLEAR_T(bitmap_word_t, start_idx);
+	if (word == 0)
 	{
-		while (start_idx < BITMAP_WORD_NBITS)
-		{
-			unsigned long test_bit = 1ul << start_idx;
-			if (*p_bitmap & test_bit)
-			{
-				if (out_test_bit) *out_test_bit = test_bit;
-				return start_idx + (p_bitmap - p_base) * BITMAP_WORD_NBITS;
-			}
-			++start_idx;
-		}
-		// now start_idx < 0
-		++p_bitmap;
-		if (p_bitmap == p_limit) break;
-		start_idx = 0;
+		p_bitmap = bitmap_skip_words(p_bitmap + 1, p_limit, (bitmap_word_t) 0);
+		if (p_bitmap == p_limit) return (unsigned long) -1;
+		word = *p_bitmap;
 	}
-	return (unsigned long) -1;
+	unsigned bit_idx = word_ctz(word);
+	if (out_test_bit) *out_test_bit = 1ul << bit_idx;
+	return bit_idx + (p_bitmap - p_base) * BITMAP_WORD_NBITS;
 }
-static inline unsigned long bitmap_find_first_set(bitmap_word_t *p_bitmap, bitmap_word_t *p_limit, unsigned long *out_test_bit)
+/* As above, but for the first clear bit at or above start_idx. */
+static inline unsigned long bitmap_find_first_clear_geq(bitmap_word_t *p_bitmap, bitmap_word_t *p_limit, unsigned long start_idx, unsigned long *out_test_bit)
 {
-	bitmap_word_t *p_initial_bitmap;
-			
-	while (*p_bitmap == (bitmap_word_t) 0
-				&& p_bitmap < p_limit) ++p_bitmap;
-	if (p_bitmap == p_limit) return (unsigned long) -1;
-	
-	/* Find the lowest free bit in this bitmap. */
-	unsigned long test_bit = 1;
-	unsigned test_bit_index = 0;
-	// while the test bit is unset...
-	while (!(*p_bitmap & test_bit))
+	bitmap_word_t *p_base = p_bitmap;
+	p_bitmap += start_idx / BITMAP_WORD_NBITS;
+	start_idx %= BITMAP_WORD_NBITS;
+	if (p_bitmap >= p_limit) return (unsigned long) -1;
+	/* Invert, so that we are searching for a set bit. */
+	bitmap_word_t word = ~*p_bitmap & BOTTOM_N_BITS_CLEAR_T(bitmap_word_t, start_idx);
+	if (word == 0)
 	{
-		if (__builtin_expect(test_bit != 1ul<<(BITMAP_WORD_NBITS - 1), 1))
-		{
-			test_bit <<= 1;
-			++test_bit_index;
-		}
-		else assert(0); // all 1s --> we shouldn't have got here
+		p_bitmap = bitmap_skip_words(p_bitmap + 1, p_limit, (bitmap_word_t) -1);
+		if (p_bitmap == p_limit) return (unsigned long) -1;
+		word = ~*p_bitmap;
 	}
-	/* FIXME: thread-safety */
-	unsigned free_index = (p_bitmap - p_initial_bitmap) * BITMAP_WORD_NBITS
-			+ test_bit_index;
-	
-	if (out_test_bit) *out_test_bit = test_bit;
-	return free_index;	
+	unsigned bit_idx = word_ctz(word);
+	if (out_test_bit) *out_test_bit = 1ul << bit_idx;
+	return bit_idx + (p_bitmap - p_base) * BITMAP_WORD_NBITS;
+}
+static inline unsigned long bitmap_find_first_set(bitmap_word_t *p_bitmap, bitmap_word_t *p_limit, unsigned long *out_test_bit)
+{
+	return bitmap_find_first_set1_geq(p_bitmap, p_limit, 0, out_test_bit);
 }
+/* Takes no lock, so if other threads may set bits meanwhile, the bit it
+ * finds may already be taken: claim it with bitmap_test_and_set, and search
+ * again if that says it was set. */
 static inline unsigned long bitmap_find_first_clear(bitmap_word_t *p_bitmap, bitmap_word_t *p_limit, unsigned long *out_test_bit)
 {
-	bitmap_word_t *p_initial_bitmap = p_bitmap;
-	while (*p_bitmap == (bitmap_word_t) -1
-				&& p_bitmap < p_limit) ++p_bitmap;
-	if (p_bitmap == p_limit) return (unsigned long) -1;
-	
-	/* Find the lowest free bit in this bitmap. */
-	unsigned long test_bit = 1;
-	unsigned test_bit_index = 0;
-	while (*p_bitmap & test_bit)
-	{
-		if (__builtin_expect(test_bit != 1ul<<(BITMAP_WORD_NBITS - 1), 1))
-		{
-			test_bit <<= 1;
-			++test_bit_index;
-		}
-		else assert(0); // all 1s --> we shouldn't have got here
-	}
-	/* FIXME: thread-safety */
-	unsigned free_index = (p_bitmap - p_initial_bitmap) * BITMAP_WORD_NBITS
-			+ test_bit_index;
-	
-	if (out_test_bit) *out_test_bit = test_bit;
-	return free_index;
+	return bitmap_find_first_clear_geq(p_bitmap, p_limit, 0, out_test_bit);
 }
+/* Find the first clear bit at or after 'hint', wrapping around to the start of
+ * the bitmap if there is none. Allocators can pass the last index they handed
+ * out, so that a mostly-full prefix is not rescanned on every call. */
+static inline unsigned long bitmap_find_first_clear_from(bitmap_word_t *p_bitmap, bitmap_word_t *p_limit, unsigned long hint, unsigned long *out_test_bit)
+{
+	if (hint >= (p_limit - p_bitmap) * BITMAP_WORD_NBITS) hint = 0;
+	unsigned long found = bitmap_find_first_clear_geq(p_bitmap, p_limit, hint, out_test_bit);
+	if (found != (unsigned long) -1 || hint == 0) return found;
+	/* Wrap around. We may rescan the hint's own word, which is harmless. */
+	found = bitmap_find_first_clear_geq(p_bitmap, p_bitmap + (hint / BITMAP_WORD_NBITS) + 1,
+		0, out_test_bit);
+	return (found < hint) ? found : (unsigned long) -1;
+}
+/* Count the set bits in [start_idx_ge, end_idx_lt). */
 static inline unsigned long bitmap_count_set(bitmap_word_t *p_bitmap, bitmap_word_t *p_limit,
 	unsigned long start_idx_ge, unsigned long end_idx_lt)
 {
 	if (end_idx_lt <= start_idx_ge) return 0;
 	bitmap_word_t *p_startword = p_bitmap + (start_idx_ge / BITMAP_WORD_NBITS);
-	bitmap_word_t *p_endword = p_bitmap + ((end_idx_lt + (BITMAP_WORD_NBITS-1) / BITMAP_WORD_NBITS));
+	/* the word containing the last bit we count */
+	bitmap_word_t *p_endword = p_bitmap + ((end_idx_lt - 1) / BITMAP_WORD_NBITS);
 	start_idx_ge %= BITMAP_WORD_NBITS;
-	end_idx_lt %= BITMAP_WORD_NBITS;
+	unsigned end_nbits = 1 + (end_idx_lt - 1) % BITMAP_WORD_NBITS;
 	if (p_startword >= p_limit) return (unsigned long) -1;
 	if (p_endword >= p_limit) return (unsigned long) -1;
-	unsigned long count = 0;
-	while (p_startword != p_endword)
+	if (p_startword == p_endword)
 	{
-		bitmap_word_t word;
-		if (start_idx_ge)
-		{
-			// only count the higher-addressed (most-significant) 
-			// BITMAP_WORD_NBITS - start_idx_ge
-			// bits.
-			word = (*p_startword) >> (BITMAP_WORD_NBITS - start_idx_ge);
-		} else word = *p_startword;
-		count += popcount_word(word);
-		++p_startword;
-		start_idx_ge = 0; // start from the beginning of the next word
+		/* create a bitmask in which only bits [start_idx_ge, end_idx_lt) are set. */
+		return popcount_word(*p_startword
+			& BOTTOM_N_BITS_SET_T(bitmap_word_t, end_nbits)
+			& BOTTOM_N_BITS_CLEAR_T(bitmap_word_t, start_idx_ge));
 	}
-	// now just handle the last word. BEWARE: start_idx_ge may still be nonzero,
-	// if our first word and last words are the same.
-	// create a bitmask in which only bits [start_idx_ge, end_idx_lt) are set.
-	bitmap_word_t word;
-	unsigned nbits = end_idx_lt - start_idx_ge;
-	if (nbits < BITMAP_WORD_NBITS)
-	{
-		bitmap_word_t bitmask = 
-			/* set bottom bits up to our end idx */
-			BOTTOM_N_BITS_SET_T(bitmap_word_t, end_idx_lt) & 
-			/* set top bits down to our start idx */
-			TOP_N_BITS_SET_T(bitmap_word_t, BITMAP_WORD_NBITS - start_idx_ge)
-			/* ANDed together... */
-			;
-		word = *p_startword & bitmask;
-	} else word = *p_startword;
-	count += popcount_word(word);
+	// only count the most-significant BITMAP_WORD_NBITS - start_idx_ge bits of the first word
+	unsigned long count = popcount_word(*p_startword & BOTTOM_N_BITS_CLEAR_T(bitmap_word_t, start_idx_ge));
+	count += bitmap_count_words(p_startword + 1, p_endword);
+	// and only the least-significant end_nbits of the last word
+	count += popcount_word(*p_endword & BOTTOM_N_BITS_SET_T(bitmap_word_t, end_nbits));
 	return count;
 }
 
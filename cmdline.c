@@ -1,63 +1,269 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <err.h>
 
 /* In this file we actually define the table of commands and their argment
- * format strings. You are not expected to understand this. */
+ * format strings. You are not expected to understand this. Each
+ * CMDLINE_FMT(ident, argstr) in the headers adds to the _cmdline_cmds
+ * section a struct command_decl naming the command, its format and its
+ * handler, cmd_ident, which must be defined below; at startup we hash the
+ * lot into command_table. */
 #define CMDLINE_FMT(ident, argstr) \
-	extern const char ident ## _cmdline; \
-	extern const char ident ## _cmdstr; \
-	__asm__(".pushsection _cmdline_strings\n"\
+	__asm__(".pushsection _cmdline_strings,\"a\"\n"\
             #ident "_cmdstring:\n"\
             ".asciz \"" #ident "\"\n"\
             #ident "_argstr:\n"\
             ".asciz \"" argstr "\"\n"\
             ".popsection\n"\
-            ".pushsection _cmdline_cmds\n"\
+            ".pushsection _cmdline_cmds,\"aw\"\n"\
+            ".balign 8\n"\
             ".quad " #ident "_cmdstring\n"\
             ".quad " #ident "_argstr\n"\
+            ".quad cmd_" #ident "\n"\
             ".popsection\n")
 
-typedef const char cmdpair[2];
-extern cmdpair *__start__cmdline_cmds;
-extern cmdpair *__stop__cmdline_cmds;
+/* A parsed argument: "%u" is an inode number, which must exist; "%lu" and
+ * "%d" are numbers; "%s" is one word, pointing into the line. */
+struct cmd_arg
+{
+	unsigned long n;
+	struct inode *inode;
+	const char *s;
+};
+struct command_decl
+{
+	const char *name;
+	const char *argstr;
+	void (*run)(struct cmd_arg *args);
+};
+extern const struct command_decl __start__cmdline_cmds[];
+extern const struct command_decl __stop__cmdline_cmds[];
+#define CMDLINE_HANDLER(ident) __attribute__((used)) static void cmd_ ## ident(struct cmd_arg *a)
 
 #include "vsfs.h"
+#include "dcache.h"
+#include "journal.h"
+
+CMDLINE_FMT(dcstats, "");
+
+/* In batch mode (-b), results go to stdout, fully buffered, and with -q
+ * they are not even formatted; either way, complaints go to stderr. A
+ * crash in batch mode may lose the commands of the last commit interval
+ * (but never leaves one half done). */
+static _Bool batch, quiet;
+static FILE *results;
+#define RESULT(...) do { if (!quiet) fprintf(results, __VA_ARGS__); } while (0)
+
+static void print_read(struct inode *f, unsigned long offset, unsigned long sz)
+{
+	static char *buf;
+	static unsigned long bufsize;
+	if (sz > bufsize)
+	{
+		free(buf);
+		if (!(buf = malloc(sz))) err(EXIT_FAILURE, "allocating read buffer");
+		bufsize = sz;
+	}
+	long n = vsfs_read(f, offset, buf, sz);
+	if (quiet) return;
+	if (n < 0) RESULT("not read\n");
+	else
+	{
+		/* show non-printing bytes as '.'; dumpf shows them all in hex */
+		for (long k = 0; k < n; ++k) if (buf[k] < ' ' || buf[k] > '~') buf[k] = '.';
+		RESULT("read %ld bytes: %.*s\n", n, (int) n, buf);
+	}
+}
+
+CMDLINE_HANDLER(link)     { struct dirent *d = vsfs_link(a[0].inode, a[1].inode, a[2].s); RESULT("%s\n", print_dirent(d)); }
+CMDLINE_HANDLER(unlink)   { struct inode *d = vsfs_unlink(a[0].inode, a[1].s);             RESULT("%s\n", d ? "unlinked" : "not unlinked"); }
+CMDLINE_HANDLER(lookup)   { struct inode *i = vsfs_lookup(a[0].inode, a[1].s);             RESULT("%s\n", print_inode(i)); }
+CMDLINE_HANDLER(lookupd)  { struct dirent *d = vsfs_lookup_one(a[0].inode, a[1].s);        RESULT("%s\n", print_dirent(d)); }
+CMDLINE_HANDLER(creat)    { struct inode *i = vsfs_creat(a[0].inode, a[1].s);              RESULT("%s\n", print_inode(i)); }
+CMDLINE_HANDLER(read)     { print_read(a[0].inode, a[1].n, a[2].n); }
+CMDLINE_HANDLER(write)    { long n = vsfs_write(a[0].inode, a[1].n, a[2].s, strlen(a[2].s)); RESULT("wrote %ld bytes\n", n); }
+CMDLINE_HANDLER(truncate) { long n = vsfs_truncate(a[0].inode, a[1].n);                    RESULT("size %ld\n", n); }
+CMDLINE_HANDLER(seekdata) { long n = vsfs_seek_data(a[0].inode, a[1].n);                   RESULT("data at %ld\n", n); }
+CMDLINE_HANDLER(seekhole) { long n = vsfs_seek_hole(a[0].inode, a[1].n);                   RESULT("hole at %ld\n", n); }
+CMDLINE_HANDLER(sync)     { vsfs_sync(); }
+CMDLINE_HANDLER(fsync)    { long n = vsfs_fsync(a[0].inode);                               RESULT("%s\n", n == 0 ? "synced" : "not synced"); }
+CMDLINE_HANDLER(compress) { long n = vsfs_set_compression(a[0].inode, a[1].n);             RESULT("%s\n", n == 0 ? "set" : "not set"); }
+CMDLINE_HANDLER(clone)    { struct inode *i = vsfs_clone(a[0].inode, a[1].inode, a[2].s);  RESULT("%s\n", print_inode(i)); }
+CMDLINE_HANDLER(snapshot) { long n = vsfs_snapshot();                                      if (n < 0) RESULT("no snapshot\n"); else RESULT("snapshot %ld\n", n); }
+CMDLINE_HANDLER(restore)  { long n = vsfs_snapshot_restore(a[0].n);                        RESULT("%s\n", n == 0 ? "restored" : "not restored"); }
+CMDLINE_HANDLER(snapdel)  { long n = vsfs_snapshot_delete(a[0].n);                         RESULT("%s\n", n == 0 ? "deleted" : "not deleted"); }
+CMDLINE_HANDLER(statfs)
+{
+	struct vsfs_statfs s;
+	vsfs_statfs(&s);
+	RESULT("%lu of %lu inodes free, %lu of %lu data blocks free (%lu available), block size %lu\n",
+		s.nfree_inodes, s.ninodes, s.nfree_data_blocks, s.ndata_blocks, s.navail_data_blocks, s.block_size);
+}
+CMDLINE_HANDLER(frags)    { long n = vsfs_fragments(a[0].inode);                           if (n < 0) RESULT("no such file\n"); else RESULT("%ld runs\n", n); }
+CMDLINE_HANDLER(defrag)
+{
+	struct vsfs_defrag_report r;
+	vsfs_defrag(a[0].n, &r);
+	RESULT("%lu files, %lu fragmented, %lu moved into one run; %lu blocks moved%s\n",
+		r.nfiles, r.nfragmented, r.ndefragged, r.nblocks_moved, r.done ? "; sweep done" : "");
+}
+CMDLINE_HANDLER(freefrag)
+{
+	struct vsfs_free_histogram h;
+	vsfs_free_histogram(&h);
+	RESULT("%lu free data blocks in %lu runs, the longest %lu blocks\n", h.nfree, h.nruns, h.largest);
+	for (unsigned k = 0; k < VSFS_FREE_HISTOGRAM_BUCKETS; ++k) if (h.bucket_nruns[k])
+	{
+		RESULT("%10lu-%-10lu %10lu runs %10lu blocks %5.1f%%\n", 1ul << k, (2ul << k) - 1,
+			h.bucket_nruns[k], h.bucket_nblocks[k], 100.0 * h.bucket_nblocks[k] / h.nfree);
+	}
+}
+CMDLINE_HANDLER(dumpfs)   { dumpfs(); }
+CMDLINE_HANDLER(dumpi)    { dumpi(a[0].n); }
+CMDLINE_HANDLER(dumpd)    { dumpd(a[0].n); }
+CMDLINE_HANDLER(dumpf)    { dumpf(a[0].n); }
+CMDLINE_HANDLER(dcstats)
+{
+	struct dcache_stats s;
+	dcache_get_stats(&s);
+	RESULT("dcache: %lu hits (%lu negative), %lu misses, %lu evictions, %lu entries in %lu bytes\n",
+		s.hits, s.negative_hits, s.misses, s.evictions, s.nentries, s.nbytes);
+}
+
+/* The commands, hashed by name, with their formats parsed once. */
+#define MAX_ARGS 4
+enum arg_kind { ARG_INODE, ARG_NUMBER, ARG_WORD };
+struct command
+{
+	const struct command_decl *decl;
+	unsigned nargs;
+	enum arg_kind kinds[MAX_ARGS];
+};
+#define COMMAND_TABLE_SIZE 64
+static struct command command_table[COMMAND_TABLE_SIZE];
+
+static unsigned command_hash(const char *name)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	for (; *name; ++name) h = (h ^ (unsigned char) *name) * 16777619u;
+	return h % COMMAND_TABLE_SIZE;
+}
+static void build_command_table(void)
+{
+	for (const struct command_decl *d = __start__cmdline_cmds; d < __stop__cmdline_cmds; ++d)
+	{
+		unsigned h = command_hash(d->name);
+		while (command_table[h].decl)
+		{
+			if (0 == strcmp(command_table[h].decl->name, d->name)) errx(EXIT_FAILURE, "command %s declared twice", d->name);
+			h = (h + 1) % COMMAND_TABLE_SIZE;
+		}
+		struct command *c = &command_table[h];
+		c->decl = d;
+		for (const char *f = d->argstr; *f; )
+		{
+			if (*f == ' ') { ++f; continue; }
+			if (c->nargs == MAX_ARGS) errx(EXIT_FAILURE, "command %s has too many arguments", d->name);
+			if (0 == strncmp(f, "%u", 2)) { c->kinds[c->nargs++] = ARG_INODE; f += 2; }
+			else if (0 == strncmp(f, "%lu", 3)) { c->kinds[c->nargs++] = ARG_NUMBER; f += 3; }
+			else if (0 == strncmp(f, "%d", 2)) { c->kinds[c->nargs++] = ARG_NUMBER; f += 2; }
+			else if (0 == strncmp(f, "%s", 2)) { c->kinds[c->nargs++] = ARG_WORD; f += 2; }
+			else errx(EXIT_FAILURE, "command %s has a bad format \"%s\"", d->name, d->argstr);
+		}
+	}
+}
+static const struct command *find_command(const char *name)
+{
+	for (unsigned h = command_hash(name); command_table[h].decl; h = (h + 1) % COMMAND_TABLE_SIZE)
+	{
+		if (0 == strcmp(command_table[h].decl->name, name)) return &command_table[h];
+	}
+	return NULL;
+}
+
+/* Split off the next whitespace-separated word of *p, in place. */
+static char *next_word(char **p)
+{
+	char *s = *p + strspn(*p, " \t\r\n");
+	if (!*s) return NULL;
+	char *end = s + strcspn(s, " \t\r\n");
+	*p = *end ? end + 1 : end;
+	*end = '\0';
+	return s;
+}
+static _Bool parse_args(const struct command *c, char *p, struct cmd_arg *args)
+{
+	for (unsigned k = 0; k < c->nargs; ++k)
+	{
+		char *word = next_word(&p), *end;
+		if (!word) return 0;
+		if (c->kinds[k] == ARG_WORD)
+		{
+			args[k].s = word;
+			continue;
+		}
+		args[k].n = strtoul(word, &end, 10);
+		if (*end) return 0;
+		if (c->kinds[k] == ARG_INODE && !(args[k].inode = vsfs_inode(args[k].n))) return 0;
+	}
+	return 1;
+}
 
 int main(int argc, char **argv)
 {
 	debug_level = 11; // HACK
 	debug_out = stderr; /* FIXME: allow config */
-	if (argc < 2) errx(EXIT_FAILURE, "must name a backing file");
-	vsfs_init(argv[1], TOTAL_BLOCKS * BLOCK_SIZE);
-	/* To allow command-line interaction and test scripts,
-	 * we read lines from stdin, to be parsed with fscanf/sscanf:
-	 * first we do  "%s" to get 'command', then scan the rest
-	 * according to a per-command format string. */
-	ssize_t nread;
+	int opt;
+	while ((opt = getopt(argc, argv, "bq")) != -1)
+	{
+		if (opt == 'b') batch = 1;
+		else if (opt == 'q') batch = quiet = 1;
+		else errx(EXIT_FAILURE, "usage: %s [-b | -q] backing-file", argv[0]);
+	}
+	if (optind >= argc) errx(EXIT_FAILURE, "must name a backing file");
+	if (batch)
+	{
+		/* Commit in batches, not per command; everything is durable by
+		 * exit, or at a 'sync'. */
+		vsfs_durable_ops = 0;
+		debug_level = 0;
+		debug_out = stdout;
+		setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+	}
+	results = debug_out;
+	vsfs_init(argv[optind], 0);
+	build_command_table();
+	/* To allow command-line interaction and test scripts, we read lines
+	 * from stdin: first a command, then its arguments, which we parse
+	 * according to its format string. Words are separated by whitespace;
+	 * blank lines and lines starting with '#' are skipped. In batch mode,
+	 * the exit status says whether any line failed to parse. */
 	size_t bufsize = 0;
 	char *lineptr = NULL;
-	while (0 != (nread = getline(&lineptr, &bufsize, stdin)))
+	unsigned long lineno = 0, nerrors = 0;
+	while (-1 != getline(&lineptr, &bufsize, stdin))
 	{
-		int nbytes;
-		char cmd[11];
-		int nfields = sscanf(lineptr, "%10s%n", (char*) &cmd, &nbytes);
-		if (nfields >= 1)
+		++lineno;
+		char *p = lineptr, *cmd = next_word(&p);
+		if (!cmd || cmd[0] == '#') continue;
+		const struct command *c = find_command(cmd);
+		struct cmd_arg args[MAX_ARGS];
+		if (!c)
 		{
-			/* We have a command in cmd */
-			if (0 == strcmp(cmd, "link")) { warnx("FIXME: Do link"); }
-			else if (0 == strcmp(cmd, "dumpfs"))  {                                                                                                                                              dumpfs(); }
-			else if (0 == strcmp(cmd, "dumpi"))   { unsigned i;                 int nfields = sscanf(lineptr + nbytes, "%u", &i);         if (nfields == 1)                                      dumpi(i);        else debug_printf(0, "parse error\n"); }
-			else if (0 == strcmp(cmd, "dumpd"))   { unsigned i;                 int nfields = sscanf(lineptr + nbytes, "%u", &i);         if (nfields == 1)                                      dumpd(i);        else debug_printf(0, "parse error\n"); }
-			else if (0 == strcmp(cmd, "dumpf"))   { unsigned i;                 int nfields = sscanf(lineptr + nbytes, "%u", &i);         if (nfields == 1)                                      dumpf(i);        else debug_printf(0, "parse error\n"); }
-			else if (0 == strcmp(cmd, "lookupd")) { unsigned i; char *s = NULL; int nfields = sscanf(lineptr + nbytes, "%u %ms", &i, &s); if (nfields == 2) debug_printf(0, "%s\n", print_dirent(lookupd(i, s))); else debug_printf(0, "parse error\n"); if (s) free(s); }
-			else if (0 == strcmp(cmd, "creat")  ) { unsigned i; char *s = NULL; int nfields = sscanf(lineptr + nbytes, "%u %ms", &i, &s); if (nfields == 2) debug_printf(0, "%s\n",  print_inode(creat(i, s)));   else debug_printf(0, "parse error\n"); if (s) free(s); }
-			else warnx("unknown command");
+			warnx("line %lu: unknown command", lineno);
+			++nerrors;
 		}
-
-		/* Ensure we always allocate a fresh buffer. See getline(3). */
-		bufsize = 0; free(lineptr);
+		else if (!parse_args(c, p, args))
+		{
+			if (batch) warnx("line %lu: parse error", lineno);
+			else debug_printf(0, "parse error\n");
+			++nerrors;
+		}
+		else c->decl->run(args);
 	}
-	if (lineptr) free(lineptr);
-	return 0;
+	free(lineptr);
+	return (batch && nerrors) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,207 @@
+/* The dentry cache. See dcache.h.
+ *
+ * Entries live in a chained hash table, whose bucket array doubles when the
+ * table gets as full as it has buckets, and on a doubly-linked LRU list whose
+ * head is the most recently used entry. We count each entry's malloc'd size,
+ * including its name, against the budget. A single mutex protects it all;
+ * even a lookup moves its entry on the LRU list.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "vsfs.h"
+#include "dcache.h"
+
+unsigned long vsfs_dcache_budget = 1ul << 20;
+
+struct dcache_entry
+{
+	struct dcache_entry *hash_next;
+	struct dcache_entry *lru_prev;
+	struct dcache_entry *lru_next;
+	uint32_t hash;
+	uint32_t dir_ino;
+	uint32_t ino;
+	char name[];
+};
+
+static struct dcache_entry **buckets;
+static unsigned long nbuckets;
+/* sentinel: lru.lru_next is the most recently used entry */
+static struct dcache_entry lru = { .lru_prev = &lru, .lru_next = &lru };
+static struct dcache_stats stats;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t dcache_hash(uint32_t dir_ino, const char *name)
+{
+	/* 32-bit FNV-1a over the directory's inode number, then the name */
+	uint32_t h = 2166136261u;
+	for (unsigned n = 0; n < sizeof dir_ino; ++n)
+	{
+		h ^= (dir_ino >> (8 * n)) & 0xff;
+		h *= 16777619u;
+	}
+	for (; *name; ++name)
+	{
+		h ^= (unsigned char) *name;
+		h *= 16777619u;
+	}
+	return h;
+}
+static size_t entry_size(const char *name)
+{
+	return sizeof (struct dcache_entry) + strlen(name) + 1;
+}
+
+static void lru_unlink(struct dcache_entry *e)
+{
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+}
+static void lru_push_front(struct dcache_entry *e)
+{
+	e->lru_prev = &lru;
+	e->lru_next = lru.lru_next;
+	lru.lru_next->lru_prev = e;
+	lru.lru_next = e;
+}
+
+/* Return a pointer to the link that points at the matching entry, if any,
+ * else to the null link at the end of its chain. */
+static struct dcache_entry **find_link(uint32_t hash, uint32_t dir_ino, const char *name)
+{
+	struct dcache_entry **link = &buckets[hash & (nbuckets - 1)];
+	while (*link && !((*link)->hash == hash && (*link)->dir_ino == dir_ino
+			&& 0 == strcmp((*link)->name, name)))
+	{
+		link = &(*link)->hash_next;
+	}
+	return link;
+}
+static void remove_entry(struct dcache_entry **link)
+{
+	struct dcache_entry *e = *link;
+	*link = e->hash_next;
+	lru_unlink(e);
+	--stats.nentries;
+	stats.nbytes -= entry_size(e->name);
+	free(e);
+}
+
+static void grow_buckets(void)
+{
+	unsigned long new_nbuckets = nbuckets ? 2 * nbuckets : 256;
+	struct dcache_entry **new_buckets = calloc(new_nbuckets, sizeof *new_buckets);
+	if (!new_buckets) return; /* we will just have longer chains */
+	for (unsigned long b = 0; b < nbuckets; ++b)
+	{
+		struct dcache_entry *next;
+		for (struct dcache_entry *e = buckets[b]; e; e = next)
+		{
+			next = e->hash_next;
+			e->hash_next = new_buckets[e->hash & (new_nbuckets - 1)];
+			new_buckets[e->hash & (new_nbuckets - 1)] = e;
+		}
+	}
+	free(buckets);
+	buckets = new_buckets;
+	nbuckets = new_nbuckets;
+}
+
+_Bool dcache_lookup(uint32_t dir_ino, const char *name, uint32_t *out_ino)
+{
+	pthread_mutex_lock(&lock);
+	struct dcache_entry *e = buckets ? *find_link(dcache_hash(dir_ino, name), dir_ino, name) : NULL;
+	if (!e)
+	{
+		++stats.misses;
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	++stats.hits;
+	if (e->ino == DCACHE_NEGATIVE) ++stats.negative_hits;
+	lru_unlink(e);
+	lru_push_front(e);
+	*out_ino = e->ino;
+	pthread_mutex_unlock(&lock);
+	return 1;
+}
+
+static void insert_locked(uint32_t dir_ino, const char *name, uint32_t ino)
+{
+	if (!buckets || stats.nentries >= nbuckets) grow_buckets();
+	if (!buckets) return;
+	uint32_t hash = dcache_hash(dir_ino, name);
+	struct dcache_entry **link = find_link(hash, dir_ino, name);
+	if (*link)
+	{
+		(*link)->ino = ino;
+		lru_unlink(*link);
+		lru_push_front(*link);
+		return;
+	}
+	size_t sz = entry_size(name);
+	if (sz > vsfs_dcache_budget) return;
+	/* Make room, from the cold end. */
+	while (stats.nbytes + sz > vsfs_dcache_budget)
+	{
+		struct dcache_entry *victim = lru.lru_prev;
+		remove_entry(find_link(victim->hash, victim->dir_ino, victim->name));
+		++stats.evictions;
+	}
+	/* Eviction may have freed the entry holding our link, so find it again. */
+	link = find_link(hash, dir_ino, name);
+	struct dcache_entry *e = malloc(sz);
+	if (!e) return;
+	e->hash = hash;
+	e->dir_ino = dir_ino;
+	e->ino = ino;
+	strcpy(e->name, name);
+	e->hash_next = NULL;
+	*link = e;
+	lru_push_front(e);
+	++stats.nentries;
+	stats.nbytes += sz;
+}
+void dcache_insert(uint32_t dir_ino, const char *name, uint32_t ino)
+{
+	pthread_mutex_lock(&lock);
+	insert_locked(dir_ino, name, ino);
+	pthread_mutex_unlock(&lock);
+}
+
+void dcache_invalidate(uint32_t dir_ino, const char *name)
+{
+	pthread_mutex_lock(&lock);
+	if (buckets)
+	{
+		struct dcache_entry **link = find_link(dcache_hash(dir_ino, name), dir_ino, name);
+		if (*link) remove_entry(link);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void dcache_get_stats(struct dcache_stats *out)
+{
+	pthread_mutex_lock(&lock);
+	*out = stats;
+	pthread_mutex_unlock(&lock);
+}
+
+/* Called only at exit, when no other thread can be using the cache. */
+void dcache_deinit(void)
+{
+	while (lru.lru_next != &lru)
+	{
+		struct dcache_entry *e = lru.lru_next;
+		lru_unlink(e);
+		free(e);
+	}
+	free(buckets);
+	buckets = NULL;
+	nbuckets = 0;
+	stats.nentries = stats.nbytes = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef DCACHE_H_
+#define DCACHE_H_
+
+#include <stdint.h>
+
+/* The dentry cache: an in-memory map from (directory inode number, name) to
+ * the inode number that the name resolves to, or to DCACHE_NEGATIVE if we
+ * know that the name is absent. The core fills it during path lookup, and
+ * keeps it coherent by calling dcache_insert whenever it adds or removes a
+ * directory entry. Its memory use is bounded by vsfs_dcache_budget bytes;
+ * beyond that, the least recently used entries are evicted. All of these
+ * functions are thread-safe, except dcache_deinit. */
+#define DCACHE_NEGATIVE ((uint32_t) -1)
+
+extern unsigned long vsfs_dcache_budget;
+
+/* Returns 1 on a hit, storing the cached inode number (or DCACHE_NEGATIVE). */
+_Bool dcache_lookup(uint32_t dir_ino, const char *name, uint32_t *out_ino);
+/* Record that 'name' in 'dir_ino' resolves to 'ino' (or DCACHE_NEGATIVE),
+ * replacing any existing entry. */
+void dcache_insert(uint32_t dir_ino, const char *name, uint32_t ino);
+void dcache_invalidate(uint32_t dir_ino, const char *name);
+
+struct dcache_stats
+{
+	unsigned long hits;
+	unsigned long negative_hits; /* included in hits */
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long nentries;
+	unsigned long nbytes;
+};
+void dcache_get_stats(struct dcache_stats *out);
+void dcache_deinit(void);
+
+#endif
@@ -27,7 +27,8 @@ const char *print_inode(struct inode *i)
 	{
 		snprintf(buf, sizeof buf, "%s refcount %u nblocks %u size %lu",
 			(i->ftype == VSF_DIR) ? "directory" :
-			(i->ftype == VSF_FILE) ? "file" : "(invalid)",
+			(i->ftype == VSF_FILE) ? "file" :
+			(i->ftype == VSF_DIR_INDEX) ? "directory index" : "(invalid)",
 			(unsigned) i->refcount,
 			(unsigned) i->nblocks,
 			(unsigned long) i->size);
@@ -35,11 +36,37 @@ const char *print_inode(struct inode *i)
 	return buf;
 }
 
+static void dump_one_block_as_vdirents(data_block_t *block, unsigned block_idx_in_file,
+	unsigned bytes_to_dump_in_this_block)
+{
+	char *base = (char *) block;
+	unsigned off = 0;
+	while (off < bytes_to_dump_in_this_block)
+	{
+		struct vdirent *v = (struct vdirent *)(base + off);
+		if (v->rec_len == 0) break; /* rest of block unused */
+		debug_printf(0, "entry at offset %u: ", (unsigned) (block_idx_in_file * BLOCK_SIZE + off));
+		if (v->name_len == 0) debug_printf(0, "(deleted, %u bytes)\n", (unsigned) v->rec_len);
+		else
+		{
+			debug_printf(0, "inode %u, name %.*s\n", (unsigned) v->inode_num,
+				(int) v->name_len, v->name);
+		}
+		off += v->rec_len;
+	}
+}
+
 enum cb_res_t dump_one_block_as_dirents(data_block_t *block, unsigned block_idx_in_file,
 	uintptr_t total_file_size)
 {
+	if (total_file_size <= BLOCK_SIZE * block_idx_in_file) return VSF_STOP;
 	unsigned bytes_remaining_in_file = total_file_size - BLOCK_SIZE * block_idx_in_file;
 	unsigned bytes_to_dump_in_this_block = (bytes_remaining_in_file < BLOCK_SIZE) ? bytes_remaining_in_file : BLOCK_SIZE;
+	if (vsfs_features() & VSFS_FEATURE_COMPACT_DIRENTS)
+	{
+		dump_one_block_as_vdirents(block, block_idx_in_file, bytes_to_dump_in_this_block);
+		return VSF_CONTINUE;
+	}
 	unsigned dirents_to_dump = bytes_to_dump_in_this_block / sizeof (struct dirent);
 	struct dirent *block_dirents = (struct dirent *) block;
 	unsigned starting_dirent_idx = block_idx_in_file * BLOCK_SIZE / sizeof (struct dirent);
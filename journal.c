@@ -0,0 +1,663 @@
+/* The metadata journal. See journal.h.
+ *
+ * The journal region is split into two halves, and batch number 'seq' is
+ * logged in half (seq & 1). A batch is a header followed by records:
+ *
+ *  - a delta record gives a block number, a byte range within the block and
+ *    the new bytes of that range;
+ *  - a fresh record names a block that was free when the batch began. We
+ *    write such blocks in place before logging the batch, since nothing that
+ *    is committed can point at them, and the record holds only a checksum of
+ *    the block's new contents. If the checksum doesn't match at replay, the
+ *    in-place write was lost, so the batch is treated as never committed.
+ *
+ * The header's checksum covers the whole batch, so a torn log write also
+ * invalidates it. Committing a batch costs one flush: we write its fresh
+ * blocks and its log, then flush, then write its deltas in place. Those
+ * in-place writes become durable at the next batch's flush, which is why
+ * replay need only re-apply the newest valid batch, and why the next batch
+ * but one may overwrite its half.
+ *
+ * Deltas are tracked at the granularity of 64-byte chunks, with one 64-bit
+ * mask of dirty chunks per block, in an open-addressed table keyed by block
+ * number. As they are dirtied, we keep a bound on how big the batch's log
+ * will be, counting each chunk as a record of its own. Each operation may
+ * add up to op_max to that (see journal_room); journal_begin sets that much
+ * aside in the running batch, committing it first if what it holds and what
+ * the operations in flight have set aside leave no room, so that a batch
+ * always fits in its half. An operation that would log more goes in steps
+ * (see journal_end_step).
+ *
+ * A commit holds txn_lock exclusively, so it sees only whole operations,
+ * which hold it shared. The blocks it writes in place are sorted first, so
+ * that each run of adjacent blocks, being adjacent in the mapping too, goes
+ * in one pwrite.
+ */
+#define _GNU_SOURCE /* for pthread_rwlockattr_setkind_np */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <err.h>
+
+#include "vsfs.h"
+#include "journal.h"
+
+unsigned long vsfs_commit_interval_us = 1000;
+_Bool vsfs_group_commit = 1;
+_Bool vsfs_durable_ops = 1;
+
+#define JOURNAL_MAGIC "VSJ1"
+#define CHUNK_SIZE 64
+#define CHUNKS_PER_BLOCK (BLOCK_SIZE / CHUNK_SIZE)
+_Static_assert(CHUNKS_PER_BLOCK == 64, "one 64-bit mask of dirty chunks per block");
+
+struct journal_header
+{
+	char magic[4];
+	uint32_t nbytes; /* including this header */
+	uint64_t seq;
+	uint64_t checksum; /* of the whole batch, with this field zero */
+};
+struct journal_record
+{
+	uint32_t blkno;
+	uint16_t offset;
+	uint16_t len; /* 0 for a fresh record, followed by an 8-byte checksum */
+};
+#define RECORD_PAYLOAD_SIZE(len) ROUND_UP_TO(8, (len) ? (len) : 8)
+/* what the log may need for a dirty chunk, and for a fresh block */
+#define CHUNK_COST (CHUNK_SIZE + sizeof (struct journal_record))
+#define FRESH_COST (sizeof (struct journal_record) + 8)
+/* Room for what before_commit dirties: a few chunks, such as the
+ * superblock's free counts. */
+#define COMMIT_SLACK (4 * CHUNK_COST)
+
+struct dirty_block
+{
+	uint32_t blkno_plus_one; /* 0 means the slot is empty */
+	uint8_t fresh;
+	uint8_t freed;
+	uint64_t chunks;
+};
+
+static _Bool enabled;
+static int fd;
+static char *base;
+static long page_size;
+static uint32_t start;
+static size_t half_bytes;
+static size_t capacity; /* for what the operations in a batch log */
+static size_t op_max;
+static void (*free_later_cb)(unsigned long);
+static void (*before_commit_cb)(void);
+static pthread_rwlock_t txn_lock;
+static char *logbuf;
+/* the blocks a commit writes in place, sorted */
+static uint32_t *home; /* as big as the dirty table */
+/* blocks committed since we last dropped their pages; see drop_private */
+static uint32_t *committed;
+static unsigned long ncommitted, committed_capacity;
+static _Thread_local _Bool op_is_exclusive;
+static _Thread_local _Bool in_op;
+static _Thread_local size_t op_spent; /* what this step has added to log_estimate */
+
+/* The mutex protects everything below. */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t op_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static struct dirty_block *dirty;
+static unsigned long dirty_nslots;
+static unsigned long ndirty;
+static unsigned long *pending_frees;
+static unsigned long npending_frees;
+static unsigned long pending_frees_capacity;
+static size_t log_estimate; /* no less than the batch's log will take */
+static size_t reserved; /* what the operations in flight may yet add to it */
+static uint64_t running_seq; /* the batch that operations are joining */
+static uint64_t committed_seq;
+static double batch_start_ns; /* when the running batch first dirtied something */
+static _Bool committing;
+static unsigned nactive;
+static struct journal_stats stats;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+static uint64_t checksum(const void *p, size_t len)
+{
+	/* 64-bit FNV-1a */
+	uint64_t h = 14695981039346656037ull;
+	for (const unsigned char *c = p; c != (const unsigned char *) p + len; ++c)
+	{
+		h ^= *c;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+static void pwrite_fully(const void *buf, size_t len, off_t off)
+{
+	for (ssize_t n; len > 0; buf = (const char *) buf + n, len -= n, off += n)
+	{
+		n = pwrite(fd, buf, len, off);
+		if (n <= 0) err(EXIT_FAILURE, "writing backing file");
+	}
+}
+static _Bool pread_fully(int fd, void *buf, size_t len, off_t off)
+{
+	for (ssize_t n; len > 0; buf = (char *) buf + n, len -= n, off += n)
+	{
+		n = pread(fd, buf, len, off);
+		if (n <= 0) return 0;
+	}
+	return 1;
+}
+
+/* Replay */
+
+/* Is 'buf', read from half 'h', a whole batch whose fresh blocks all made it
+ * to disk? */
+static _Bool batch_is_valid(int fd, char *buf, unsigned h)
+{
+	struct journal_header *hdr = (struct journal_header *) buf;
+	if (0 != memcmp(hdr->magic, JOURNAL_MAGIC, 4)) return 0;
+	if (hdr->nbytes < sizeof *hdr || hdr->nbytes > half_bytes || (hdr->seq & 1) != h) return 0;
+	uint64_t sum = hdr->checksum;
+	hdr->checksum = 0;
+	_Bool ok = (checksum(buf, hdr->nbytes) == sum);
+	hdr->checksum = sum;
+	if (!ok) return 0;
+	static data_block_t block;
+	for (size_t off = sizeof *hdr; off < hdr->nbytes; )
+	{
+		struct journal_record *r = (struct journal_record *)(buf + off);
+		off += sizeof *r;
+		if (r->len == 0)
+		{
+			if (!pread_fully(fd, block, BLOCK_SIZE, (off_t) r->blkno * BLOCK_SIZE)) return 0;
+			if (checksum(block, BLOCK_SIZE) != *(uint64_t *)(buf + off)) return 0;
+		}
+		off += RECORD_PAYLOAD_SIZE(r->len);
+	}
+	return 1;
+}
+uint64_t journal_replay(int fd, uint32_t journal_start, uint32_t journal_nblocks)
+{
+	half_bytes = (journal_nblocks / 2) * BLOCK_SIZE;
+	char *bufs[2] = { malloc(half_bytes), malloc(half_bytes) };
+	if (!bufs[0] || !bufs[1]) err(EXIT_FAILURE, "allocating journal replay buffers");
+	int newest = -1;
+	for (unsigned h = 0; h < 2; ++h)
+	{
+		if (!pread_fully(fd, bufs[h], half_bytes, ((off_t) journal_start * BLOCK_SIZE) + h * half_bytes)
+				|| !batch_is_valid(fd, bufs[h], h))
+		{
+			continue;
+		}
+		if (newest == -1 || ((struct journal_header *) bufs[h])->seq > ((struct journal_header *) bufs[newest])->seq)
+		{
+			newest = h;
+		}
+	}
+	uint64_t seq = 0;
+	if (newest != -1)
+	{
+		char *buf = bufs[newest];
+		struct journal_header *hdr = (struct journal_header *) buf;
+		seq = hdr->seq;
+		debug_printf(1, "replaying journal batch %llu\n", (unsigned long long) seq);
+		for (size_t off = sizeof *hdr; off < hdr->nbytes; )
+		{
+			struct journal_record *r = (struct journal_record *)(buf + off);
+			off += sizeof *r;
+			if (r->len != 0 && pwrite(fd, buf + off, r->len, (off_t) r->blkno * BLOCK_SIZE + r->offset) != r->len)
+			{
+				err(EXIT_FAILURE, "replaying journal");
+			}
+			off += RECORD_PAYLOAD_SIZE(r->len);
+		}
+		if (fdatasync(fd) != 0) err(EXIT_FAILURE, "syncing backing file");
+	}
+	free(bufs[0]);
+	free(bufs[1]);
+	return seq;
+}
+
+void journal_open(int backing_fd, void *mapping, uint32_t journal_start, uint32_t journal_nblocks,
+	uint64_t last_seq, void (*free_later)(unsigned long), void (*before_commit)(void))
+{
+	fd = backing_fd;
+	base = mapping;
+	page_size = sysconf(_SC_PAGE_SIZE);
+	if (page_size == -1) err(EXIT_FAILURE, "getting page size");
+	start = journal_start;
+	half_bytes = (journal_nblocks / 2) * BLOCK_SIZE;
+	capacity = half_bytes - sizeof (struct journal_header) - COMMIT_SLACK;
+	/* enough for an operation to rewrite a few blocks whole, however small
+	 * the journal */
+	op_max = capacity / 8;
+	if (op_max < 3 * CHUNKS_PER_BLOCK * CHUNK_COST) op_max = 3 * CHUNKS_PER_BLOCK * CHUNK_COST;
+	if (op_max > capacity) op_max = capacity;
+	free_later_cb = free_later;
+	before_commit_cb = before_commit;
+	committed_seq = last_seq;
+	running_seq = last_seq + 1;
+	logbuf = malloc(half_bytes);
+	if (!logbuf) err(EXIT_FAILURE, "allocating journal buffer");
+	/* Prefer the committer, or a stream of operations could starve it. */
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&txn_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	enabled = 1;
+}
+
+/* The dirty-block table. Call with the mutex held. */
+
+static struct dirty_block *dirty_slot(uint32_t blkno)
+{
+	unsigned long mask = dirty_nslots - 1;
+	for (unsigned long n = (blkno * 2654435761u) & mask; ; n = (n + 1) & mask)
+	{
+		if (dirty[n].blkno_plus_one == blkno + 1 || dirty[n].blkno_plus_one == 0) return &dirty[n];
+	}
+}
+static struct dirty_block *dirty_get(uint32_t blkno)
+{
+	if (2 * (ndirty + 1) > dirty_nslots)
+	{
+		struct dirty_block *old = dirty;
+		unsigned long old_nslots = dirty_nslots;
+		dirty_nslots = old_nslots ? 2 * old_nslots : 256;
+		dirty = calloc(dirty_nslots, sizeof *dirty);
+		if (!dirty) err(EXIT_FAILURE, "allocating journal dirty table");
+		/* a commit may write home every block in the table */
+		free(home);
+		if (!(home = malloc(dirty_nslots * sizeof *home))) err(EXIT_FAILURE, "allocating journal dirty table");
+		for (unsigned long n = 0; n < old_nslots; ++n)
+		{
+			if (old[n].blkno_plus_one) *dirty_slot(old[n].blkno_plus_one - 1) = old[n];
+		}
+		free(old);
+	}
+	struct dirty_block *d = dirty_slot(blkno);
+	if (!d->blkno_plus_one)
+	{
+		*d = (struct dirty_block) { .blkno_plus_one = blkno + 1 };
+		++ndirty;
+		if (!batch_start_ns) batch_start_ns = now_ns();
+	}
+	return d;
+}
+
+/* Count 'n' more bytes that the batch may log, against the operation that
+ * dirtied them, if any, rather than against what it set aside. */
+static void charge(size_t n)
+{
+	log_estimate += n;
+	if (!in_op) return;
+	size_t left = (op_spent < op_max) ? op_max - op_spent : 0;
+	if (!op_is_exclusive) reserved -= (n < left) ? n : left;
+	op_spent += n;
+}
+void journal_dirty(const void *p, size_t len)
+{
+	if (!enabled || len == 0) return;
+	size_t off = (const char *) p - base;
+	size_t end = off + len;
+	pthread_mutex_lock(&mutex);
+	for (size_t blk = off / BLOCK_SIZE; blk * BLOCK_SIZE < end; ++blk)
+	{
+		size_t lo = (off > blk * BLOCK_SIZE) ? off - blk * BLOCK_SIZE : 0;
+		size_t hi = (end < (blk + 1) * BLOCK_SIZE) ? end - blk * BLOCK_SIZE : BLOCK_SIZE;
+		unsigned first = lo / CHUNK_SIZE, last = (hi - 1) / CHUNK_SIZE;
+		uint64_t mask = ((last == 63) ? ~0ull : ((1ull << (last + 1)) - 1)) & ~((1ull << first) - 1);
+		struct dirty_block *d = dirty_get(blk);
+		if (!d->fresh) charge(__builtin_popcountll(mask & ~d->chunks) * CHUNK_COST);
+		d->chunks |= mask;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+void journal_fresh(const void *block)
+{
+	if (!enabled) return;
+	pthread_mutex_lock(&mutex);
+	struct dirty_block *d = dirty_get(((const char *) block - base) / BLOCK_SIZE);
+	if (!d->fresh) charge(FRESH_COST);
+	d->fresh = 1;
+	pthread_mutex_unlock(&mutex);
+}
+_Bool journal_free_later(const void *block, unsigned long cookie)
+{
+	if (!enabled) return 0;
+	pthread_mutex_lock(&mutex);
+	if (npending_frees == pending_frees_capacity)
+	{
+		pending_frees_capacity = pending_frees_capacity ? 2 * pending_frees_capacity : 64;
+		pending_frees = realloc(pending_frees, pending_frees_capacity * sizeof *pending_frees);
+		if (!pending_frees) err(EXIT_FAILURE, "allocating journal free list");
+	}
+	pending_frees[npending_frees++] = cookie;
+	/* Its contents no longer matter. */
+	struct dirty_block *d = dirty_get(((const char *) block - base) / BLOCK_SIZE);
+	d->freed = 1;
+	pthread_mutex_unlock(&mutex);
+	return 1;
+}
+
+/* Committing */
+
+static int compare_blkno(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+/* Write in place the batch's fresh blocks, or its other dirty ones, in
+ * block order, one pwrite per run of adjacent blocks. */
+static void write_home(_Bool fresh)
+{
+	unsigned long n = 0;
+	for (unsigned long k = 0; k < dirty_nslots; ++k)
+	{
+		struct dirty_block *d = &dirty[k];
+		if (d->blkno_plus_one && !d->freed && d->fresh == fresh) home[n++] = d->blkno_plus_one - 1;
+	}
+	qsort(home, n, sizeof *home, compare_blkno);
+	for (unsigned long k = 0, run; k < n; k += run)
+	{
+		for (run = 1; k + run < n && home[k + run] == home[k] + run; ++run);
+		pwrite_fully(base + (size_t) home[k] * BLOCK_SIZE, run * BLOCK_SIZE, (off_t) home[k] * BLOCK_SIZE);
+		++stats.nhome_writes;
+	}
+	if (fresh) stats.nblocks_written_direct += n;
+}
+/* Once a batch is all in place, the mapping's private copies of its blocks
+ * (freed ones too) match the file, and can go: otherwise whatever we ever
+ * changed would stay in anonymous memory for as long as the image is open.
+ * Dropping them costs a page fault and a copy at their next change, so we
+ * let them pile up to DROP_NBLOCKS first, and the superblock, bitmaps and
+ * other metadata that every batch changes stay in memory in between. A page
+ * that holds other blocks as well loses nothing: it was copied from the
+ * file, and any of them changed since were in a committed batch too. */
+#define DROP_NBLOCKS 4096
+static void drop_private(void)
+{
+	for (unsigned long k = 0; k < dirty_nslots; ++k)
+	{
+		if (!dirty[k].blkno_plus_one) continue;
+		if (ncommitted == committed_capacity)
+		{
+			committed_capacity = committed_capacity ? 2 * committed_capacity : 256;
+			if (!(committed = realloc(committed, committed_capacity * sizeof *committed))) err(EXIT_FAILURE, "allocating journal drop list");
+		}
+		committed[ncommitted++] = dirty[k].blkno_plus_one - 1;
+	}
+	if (ncommitted < DROP_NBLOCKS) return;
+	qsort(committed, ncommitted, sizeof *committed, compare_blkno);
+	for (unsigned long k = 0, end; k < ncommitted; k = end)
+	{
+		uint32_t last = committed[k];
+		for (end = k + 1; end < ncommitted && committed[end] <= last + 1; ++end) last = committed[end];
+		uintptr_t from = ROUND_DOWN_TO(page_size, (uintptr_t) (base + (size_t) committed[k] * BLOCK_SIZE));
+		uintptr_t to = ROUND_UP_TO(page_size, (uintptr_t) (base + ((size_t) last + 1) * BLOCK_SIZE));
+		if (madvise((void *) from, to - from, MADV_DONTNEED) != 0) err(EXIT_FAILURE, "dropping committed pages");
+	}
+	ncommitted = 0;
+}
+static void write_log(size_t nbytes, uint64_t seq)
+{
+	struct journal_header *hdr = (struct journal_header *) logbuf;
+	memcpy(hdr->magic, JOURNAL_MAGIC, 4);
+	hdr->nbytes = nbytes;
+	hdr->seq = seq;
+	hdr->checksum = 0;
+	hdr->checksum = checksum(logbuf, nbytes);
+	pwrite_fully(logbuf, nbytes, (off_t) start * BLOCK_SIZE + (seq & 1) * half_bytes);
+}
+/* Commit the running batch. Call with txn_lock held exclusively. */
+static void commit(void)
+{
+	/* Release what the batch freed, so that those bitmap changes are in it
+	 * too. Nothing else can be touching the journal now. */
+	for (unsigned long n = 0; n < npending_frees; ++n) free_later_cb(pending_frees[n]);
+	npending_frees = 0;
+	before_commit_cb();
+	uint64_t seq = running_seq;
+	size_t nbytes = sizeof (struct journal_header);
+	_Bool overflow = 0;
+	for (unsigned long n = 0; n < dirty_nslots; ++n)
+	{
+		struct dirty_block *d = &dirty[n];
+		if (!d->blkno_plus_one || d->freed) continue;
+		uint32_t blkno = d->blkno_plus_one - 1;
+		char *block = base + (size_t) blkno * BLOCK_SIZE;
+		if (d->fresh)
+		{
+			if (nbytes + sizeof (struct journal_record) + 8 > half_bytes) { overflow = 1; continue; }
+			*(struct journal_record *)(logbuf + nbytes) = (struct journal_record) { .blkno = blkno };
+			nbytes += sizeof (struct journal_record);
+			*(uint64_t *)(logbuf + nbytes) = checksum(block, BLOCK_SIZE);
+			nbytes += 8;
+			continue;
+		}
+		/* one record per run of dirty chunks */
+		for (uint64_t chunks = d->chunks; chunks && !overflow; )
+		{
+			unsigned first = __builtin_ctzll(chunks);
+			uint64_t rest = chunks >> first;
+			unsigned nchunks = (rest == ~0ull) ? 64 : __builtin_ctzll(~rest);
+			chunks = (first + nchunks == 64) ? 0 : chunks & (~0ull << (first + nchunks));
+			size_t len = nchunks * CHUNK_SIZE;
+			if (nbytes + sizeof (struct journal_record) + len > half_bytes) { overflow = 1; break; }
+			*(struct journal_record *)(logbuf + nbytes) = (struct journal_record) {
+				.blkno = blkno,
+				.offset = first * CHUNK_SIZE,
+				.len = len
+			};
+			nbytes += sizeof (struct journal_record);
+			memcpy(logbuf + nbytes, block + first * CHUNK_SIZE, len);
+			nbytes += len;
+		}
+	}
+	/* Only an operation that logged far more than journal_room allowed can
+	 * get us here. Writing the batch in place unlogged could leave it half
+	 * done, so we stop with nothing of it written: the image stays as of the
+	 * last commit. With the journal off, nothing done at exit reaches the
+	 * image either, since the mapping is private. */
+	if (overflow)
+	{
+		enabled = 0;
+		errx(EXIT_FAILURE, "journal batch %llu is too big to log", (unsigned long long) seq);
+	}
+	write_home(1);
+	write_log(nbytes, seq);
+	if (fdatasync(fd) != 0) err(EXIT_FAILURE, "syncing backing file");
+	write_home(0);
+	stats.nbytes_logged += nbytes;
+	drop_private();
+	pthread_mutex_lock(&mutex);
+	if (ndirty) bzero(dirty, dirty_nslots * sizeof *dirty);
+	ndirty = 0;
+	log_estimate = 0;
+	batch_start_ns = 0;
+	committed_seq = seq;
+	running_seq = seq + 1;
+	++stats.ncommits;
+	pthread_mutex_unlock(&mutex);
+}
+/* Make sure batch 'seq' has committed. One waiter becomes the leader and does
+ * the commit, first letting any operations in flight finish and join the
+ * batch, for up to the commit interval, if 'gather' is set. */
+static void commit_through(uint64_t seq, _Bool gather)
+{
+	pthread_mutex_lock(&mutex);
+	while (committed_seq < seq)
+	{
+		if (committing)
+		{
+			pthread_cond_wait(&commit_done, &mutex);
+			continue;
+		}
+		committing = 1;
+		if (gather && nactive > 0)
+		{
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			long long ns = deadline.tv_nsec + (long long) vsfs_commit_interval_us * 1000;
+			deadline.tv_sec += ns / 1000000000;
+			deadline.tv_nsec = ns % 1000000000;
+			while (nactive > 0 && pthread_cond_timedwait(&op_done, &mutex, &deadline) != ETIMEDOUT);
+		}
+		pthread_mutex_unlock(&mutex);
+		pthread_rwlock_wrlock(&txn_lock);
+		/* A commit by an exclusive operation may have beaten us to it. */
+		if (committed_seq < seq) commit();
+		pthread_rwlock_unlock(&txn_lock);
+		pthread_mutex_lock(&mutex);
+		committing = 0;
+		pthread_cond_broadcast(&commit_done);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void journal_begin(void)
+{
+	if (!enabled) return;
+	op_is_exclusive = !vsfs_group_commit;
+	op_spent = 0;
+	if (op_is_exclusive)
+	{
+		pthread_rwlock_wrlock(&txn_lock);
+		/* the batch may hold earlier steps of this operation */
+		if (log_estimate + op_max > capacity) commit();
+		in_op = 1;
+		return;
+	}
+	for (;;)
+	{
+		pthread_rwlock_rdlock(&txn_lock);
+		pthread_mutex_lock(&mutex);
+		uint64_t seq = running_seq;
+		_Bool room = (log_estimate + reserved + op_max <= capacity);
+		if (room)
+		{
+			reserved += op_max;
+			++nactive;
+		}
+		pthread_mutex_unlock(&mutex);
+		if (room) break;
+		pthread_rwlock_unlock(&txn_lock);
+		commit_through(seq, 0);
+	}
+	in_op = 1;
+}
+/* Leave the running batch, giving back what we set aside in it and didn't
+ * use. Call with the mutex held. */
+static void op_leave(void)
+{
+	reserved -= (op_spent < op_max) ? op_max - op_spent : 0;
+	--nactive;
+	pthread_cond_broadcast(&op_done);
+}
+void journal_end(void)
+{
+	if (!enabled) return;
+	in_op = 0;
+	if (op_is_exclusive)
+	{
+		pthread_mutex_lock(&mutex);
+		++stats.nops;
+		_Bool empty = !ndirty && !npending_frees;
+		pthread_mutex_unlock(&mutex);
+		if (!empty) commit();
+		pthread_rwlock_unlock(&txn_lock);
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	uint64_t seq = running_seq;
+	++stats.nops;
+	op_leave();
+	/* as in journal_sync: if the batch is empty, so far, then whatever this
+	 * operation saw is durable already */
+	_Bool empty = !ndirty && !npending_frees;
+	_Bool stale = batch_start_ns && now_ns() - batch_start_ns > vsfs_commit_interval_us * 1e3;
+	pthread_mutex_unlock(&mutex);
+	pthread_rwlock_unlock(&txn_lock);
+	if (empty) return;
+	if (vsfs_durable_ops) commit_through(seq, 1);
+	else if (stale) commit_through(seq, 0);
+}
+void journal_end_step(void)
+{
+	if (!enabled) return;
+	in_op = 0;
+	if (!op_is_exclusive)
+	{
+		pthread_mutex_lock(&mutex);
+		op_leave();
+		pthread_mutex_unlock(&mutex);
+	}
+	pthread_rwlock_unlock(&txn_lock);
+}
+size_t journal_room(void)
+{
+	if (!enabled) return SIZE_MAX;
+	return (op_spent < op_max) ? op_max - op_spent : 0;
+}
+
+void journal_sync(void)
+{
+	if (!enabled) return;
+	pthread_mutex_lock(&mutex);
+	uint64_t seq = running_seq;
+	/* every batch before an empty one was durable once it committed */
+	_Bool empty = !ndirty;
+	pthread_mutex_unlock(&mutex);
+	if (!empty) commit_through(seq, 0);
+}
+size_t journal_cost(size_t len)
+{
+	/* every chunk it touches, each in a record of its own at worst */
+	return (len + 2 * CHUNK_SIZE - 2) / CHUNK_SIZE * CHUNK_COST;
+}
+size_t journal_fresh_cost(void)
+{
+	return FRESH_COST;
+}
+/* Called only at exit, when no other thread can be using the journal. */
+void journal_close(void)
+{
+	if (!enabled) return;
+	journal_sync();
+	/* make the last batch's in-place writes durable too */
+	if (fdatasync(fd) != 0) warn("syncing backing file");
+	enabled = 0;
+	free(dirty);
+	dirty = NULL;
+	dirty_nslots = ndirty = 0;
+	free(home);
+	home = NULL;
+	free(committed);
+	committed = NULL;
+	ncommitted = committed_capacity = 0;
+	free(pending_frees);
+	pending_frees = NULL;
+	pending_frees_capacity = 0;
+	free(logbuf);
+	logbuf = NULL;
+	pthread_rwlock_destroy(&txn_lock);
+}
+
+void journal_get_stats(struct journal_stats *out)
+{
+	pthread_mutex_lock(&mutex);
+	*out = stats;
+	pthread_mutex_unlock(&mutex);
+}
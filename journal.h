@@ -0,0 +1,81 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* The metadata journal. On a filesystem with VSFS_FEATURE_JOURNAL, the image
+ * is mapped privately, so changes reach the backing file only when the
+ * journal commits them. Every mutating operation runs between journal_begin
+ * and journal_end, and calls journal_dirty on each range of the mapping that
+ * it changes (or journal_fresh on a newly allocated block). Operations are
+ * grouped into batches; committing a batch logs its changes, makes the log
+ * durable with a single flush, then writes the changes in place. At open,
+ * journal_replay re-applies the last committed batch, in case those in-place
+ * writes did not all happen. See journal.c for the details.
+ *
+ * All of these are no-ops on a filesystem without a journal. */
+
+/* Tunables. If vsfs_durable_ops is set, each operation returns only once it
+ * is durable; otherwise batches are committed at most every interval, and on
+ * vsfs_sync. With vsfs_group_commit set, an operation that must wait for a
+ * commit lets other operations in flight join its batch, for up to
+ * vsfs_commit_interval_us; with it clear, operations run one at a time and
+ * each commits alone. */
+extern unsigned long vsfs_commit_interval_us;
+extern _Bool vsfs_group_commit;
+extern _Bool vsfs_durable_ops;
+
+/* Returns the sequence number of the last committed batch in the journal
+ * region (0 if none), after re-applying it to the file with pwrite. Call
+ * before mapping the file. */
+uint64_t journal_replay(int fd, uint32_t journal_start, uint32_t journal_nblocks);
+/* 'free_later' frees a data block once the batch freeing it has committed;
+ * see journal_free_later. 'before_commit' is called as each batch commits,
+ * after those frees and with no operation in flight, to make any last
+ * changes that the batch should carry. */
+void journal_open(int fd, void *mapping, uint32_t journal_start, uint32_t journal_nblocks,
+	uint64_t last_seq, void (*free_later)(unsigned long), void (*before_commit)(void));
+
+/* journal_begin sets aside room in the running batch for what the operation
+ * logs, up to journal_room. An operation that would log more must be split
+ * into steps that each fit, such that the filesystem is consistent after
+ * each: it ends all but the last with journal_end_step, which is journal_end
+ * without waiting for the step to be durable, and begins the next with
+ * journal_begin. A batch that is too big to log anyway is not committed: the
+ * process exits, leaving the image as of the last commit. Don't hold inode
+ * locks across steps, since journal_begin may wait for a commit, which waits
+ * for every operation in flight. */
+void journal_begin(void);
+/* How much more the running step may log, in bytes (SIZE_MAX if there is no
+ * journal); see journal_cost for what dirtying a range adds. */
+size_t journal_room(void);
+void journal_dirty(const void *p, size_t len);
+void journal_fresh(const void *block);
+/* Blocks freed by a batch must not be reused until it has committed, lest
+ * we overwrite them in place while the committed metadata still points at
+ * them. Returns 0 if there is no journal, in which case the caller frees
+ * the block now; otherwise the journal calls free_later(cookie) at commit. */
+_Bool journal_free_later(const void *block, unsigned long cookie);
+void journal_end(void);
+void journal_end_step(void);
+
+/* commit everything done so far, and wait for it to be durable */
+void journal_sync(void);
+/* The most that dirtying a range of 'len' bytes can add to a batch, in
+ * bytes, and what a fresh block adds. */
+size_t journal_cost(size_t len);
+size_t journal_fresh_cost(void);
+void journal_close(void);
+
+struct journal_stats
+{
+	unsigned long nops;
+	unsigned long ncommits;
+	unsigned long nbytes_logged;
+	unsigned long nblocks_written_direct; /* fresh blocks, not logged */
+	unsigned long nhome_writes; /* pwrites of runs of blocks in place */
+};
+void journal_get_stats(struct journal_stats *out);
+
+#endif
@@ -0,0 +1,178 @@
+/* The LZ codec. See lz.h.
+ *
+ * The compressor is greedy, with one hash table of positions keyed by the
+ * next 4 bytes; it takes the first match it finds, extends it both ways and
+ * moves on. Where it keeps finding nothing, it skips ahead faster and
+ * faster, so that incompressible input costs little. The decompressor
+ * checks every length against both buffers before copying.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define MAX_DISTANCE 65535
+#define HASH_BITS 12
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+static inline unsigned hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+/* How many bytes from 'p' on, up to 'end', are the same as those from 'm'. */
+static unsigned long match_length(const uint8_t *p, const uint8_t *m, const uint8_t *end)
+{
+	const uint8_t *start = p;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; end - p >= 8; p += 8, m += 8)
+	{
+		uint64_t a, b;
+		memcpy(&a, p, sizeof a);
+		memcpy(&b, m, sizeof b);
+		if (a != b) return p - start + (__builtin_ctzll(a ^ b) >> 3);
+	}
+#endif
+	while (p < end && *p == *m) ++p, ++m;
+	return p - start;
+}
+static uint8_t *put_length(uint8_t *op, unsigned long len)
+{
+	for (; len >= 255; len -= 255) *op++ = 255;
+	*op++ = len;
+	return op;
+}
+/* Append a record of 'nlit' literals from 'lit' and, unless 'last', a match
+ * of 'mlen' bytes 'dist' back. Returns the new end of the output, or null
+ * if it would pass 'oend'. */
+static uint8_t *put_record(uint8_t *op, uint8_t *oend, const uint8_t *lit, unsigned long nlit,
+	unsigned dist, unsigned long mlen, _Bool last)
+{
+	unsigned long need = 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1;
+	if (need > (unsigned long) (oend - op)) return NULL;
+	uint8_t *token = op++;
+	*token = ((nlit >= 15) ? 15 : nlit) << 4;
+	if (nlit >= 15) op = put_length(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (last) return op;
+	*op++ = dist;
+	*op++ = dist >> 8;
+	mlen -= MIN_MATCH;
+	*token |= (mlen >= 15) ? 15 : mlen;
+	if (mlen >= 15) op = put_length(op, mlen - 15);
+	return op;
+}
+
+unsigned long lz_compress(const void *src, unsigned long n, void *dst, unsigned long cap)
+{
+	const uint8_t *in = src, *end = in + n, *ip = in, *anchor = in;
+	uint8_t *op = dst, *oend = op + cap;
+	uint32_t table[1 << HASH_BITS];
+	memset(table, 0, sizeof table);
+	unsigned misses = 0;
+	while (end - ip >= MIN_MATCH)
+	{
+		uint32_t seq = read32(ip);
+		unsigned h = hash(seq);
+		const uint8_t *m = in + table[h];
+		table[h] = ip - in;
+		if (m >= ip || ip - m > MAX_DISTANCE || read32(m) != seq)
+		{
+			unsigned long step = 1 + (misses++ >> 5);
+			if (step > (unsigned long) (end - ip)) break;
+			ip += step;
+			continue;
+		}
+		while (ip > anchor && m > in && ip[-1] == m[-1]) --ip, --m;
+		unsigned long len = MIN_MATCH + match_length(ip + MIN_MATCH, m + MIN_MATCH, end);
+		if (!(op = put_record(op, oend, anchor, ip - anchor, ip - m, len, 0))) return 0;
+		ip += len;
+		anchor = ip;
+		misses = 0;
+		/* the middle of a match often starts the next one */
+		if (end - ip >= 2) table[hash(read32(ip - 2))] = ip - 2 - in;
+	}
+	if (!(op = put_record(op, oend, anchor, end - anchor, 0, 0, 1))) return 0;
+	return op - (uint8_t *) dst;
+}
+
+/* Read the rest of a length whose 4 bits were 15 into *len. */
+static _Bool get_length(const uint8_t **ip, const uint8_t *iend, unsigned long *len)
+{
+	uint8_t b;
+	do
+	{
+		if (*ip == iend) return 0;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 1;
+}
+
+/* Copy 'len' bytes, 8 at a time, perhaps writing up to 7 past the end. The
+ * source may overlap the destination only if it is 8 or more bytes behind. */
+static inline void wild_copy(uint8_t *op, const uint8_t *m, unsigned long len)
+{
+	for (uint8_t *end = op + len; op < end; op += 8, m += 8) memcpy(op, m, 8);
+}
+
+long lz_decompress(const void *src, unsigned long n, void *dst, unsigned long cap)
+{
+	const uint8_t *ip = src, *iend = ip + n;
+	uint8_t *out = dst, *op = out, *oend = out + cap;
+	while (ip < iend)
+	{
+		unsigned token = *ip++;
+		unsigned long nlit = token >> 4;
+		/* Most records are short, and far enough from both ends to copy
+		 * a little too much: 16 bytes of literals and 24 of match. */
+		if (nlit < 15 && iend - ip >= 16 + 2 && oend - op >= 16 + 24)
+		{
+			memcpy(op, ip, 16);
+			op += nlit;
+			ip += nlit;
+			unsigned long dist = ip[0] | (ip[1] << 8), len = (token & 15) + MIN_MATCH;
+			if ((token & 15) < 15 && dist >= 8 && dist <= (unsigned long) (op - out))
+			{
+				ip += 2;
+				const uint8_t *m = op - dist;
+				memcpy(op, m, 8);
+				memcpy(op + 8, m + 8, 8);
+				memcpy(op + 16, m + 16, 8);
+				op += len;
+				continue;
+			}
+			/* the match is long, overlapping or bad */
+			op -= nlit;
+			ip -= nlit;
+		}
+		if (nlit == 15 && !get_length(&ip, iend, &nlit)) return -1;
+		if (nlit > (unsigned long) (iend - ip) || nlit > (unsigned long) (oend - op)) return -1;
+		if (iend - ip >= nlit + 8 && oend - op >= nlit + 8) wild_copy(op, ip, nlit);
+		else memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		if (ip == iend) break;
+		if (iend - ip < 2) return -1;
+		unsigned long dist = ip[0] | (ip[1] << 8);
+		ip += 2;
+		unsigned long len = token & 15;
+		if (len == 15 && !get_length(&ip, iend, &len)) return -1;
+		len += MIN_MATCH;
+		if (dist == 0 || dist > (unsigned long) (op - out) || len > (unsigned long) (oend - op)) return -1;
+		const uint8_t *m = op - dist;
+		/* an overlapping match repeats the last 'dist' bytes */
+		if (dist >= 8 && oend - op >= len + 8) wild_copy(op, m, len);
+		else if (dist >= len) memcpy(op, m, len);
+		else if (dist == 1) memset(op, *m, len);
+		else for (unsigned long k = 0; k < len; ++k) op[k] = m[k];
+		op += len;
+	}
+	return op - out;
+}
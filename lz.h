@@ -0,0 +1,21 @@
+#ifndef LZ_H_
+#define LZ_H_
+
+/* A small, fast LZ77 codec, used for compressed files (see vsfs.h). The
+ * format is that of LZ4's blocks: a sequence of records, each a token byte
+ * holding the lengths of a run of literals and of the match after it (4
+ * bits each, with 15 meaning that more length bytes follow, each 255 but
+ * the last), then the literals, then the match's distance back (2 bytes,
+ * little-endian); the last record has literals only. Matches are 4 bytes
+ * or longer, within the last 64 kB. There is no header: the caller keeps
+ * the lengths. Both functions are thread-safe. */
+
+/* Compress the 'n' bytes at 'src' into at most 'cap' bytes at 'dst'.
+ * Returns the compressed length, or 0 if it would not fit. */
+unsigned long lz_compress(const void *src, unsigned long n, void *dst, unsigned long cap);
+/* Decompress the 'n' bytes at 'src' into at most 'cap' bytes at 'dst'.
+ * Returns the decompressed length, or -1 if the input is damaged or would
+ * not fit. Never reads or writes out of bounds, whatever the input. */
+long lz_decompress(const void *src, unsigned long n, void *dst, unsigned long cap);
+
+#endif
@@ -0,0 +1,648 @@
+/* vsfs-mkimage: build a fresh vsfs image holding a copy of a directory tree,
+ * or of a tar archive read from stdin.
+ *
+ * Usage: vsfs-mkimage [-c] [-s size] [-i inodes] [-f features] image {directory | -}
+ *
+ * We read the whole tree first, noting each file's size and where its
+ * contents are, and from that work out how many inodes and blocks the image
+ * needs, and so (unless -s gives it) how big to make it. Then we create
+ * every file, each with all its blocks in one run, in the order we met them,
+ * and fill every directory in one go, through the bulk calls in vsfs.h, so
+ * that the image is written from start to end, and the time taken follows
+ * the amount of content, not the size of the directories.
+ *
+ * A tar archive on a pipe can't be read twice, so its files are created as
+ * they are read, and -s must say how big to make the image. Tar entries other
+ * than regular files, hard links and directories, and host files other than
+ * regular files and directories, are skipped with a warning, as vsfs has
+ * nothing to hold them; so are names too long for it. -f sets the feature
+ * bits (see vsfs.h), and -i the number of inodes (by default, what the tree
+ * needs, or for an archive on a pipe, one per 16 kB of image). -c compresses
+ * every regular file (see vsfs_set_compression); the image is still sized
+ * as if nothing compressed, so it ends up with room to spare. Any existing
+ * contents of 'image' are lost.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "vsfs.h"
+#include "journal.h"
+
+/* The tree as read, before anything goes in the image. */
+struct node
+{
+	char *name;
+	struct node *parent;
+	struct node *children, *last_child, *next_sibling; /* directories only */
+	unsigned long nchildren;
+	_Bool is_dir;
+	struct node *same; /* a hard link: names the same file as this node */
+	unsigned long size;
+	/* where the contents are: a host file, or an offset in the archive */
+	char *path;
+	off_t offset;
+	dev_t dev;
+	ino_t ino;
+	uint64_t hash; /* its key in whichever table it is in */
+	struct inode *inode;
+};
+static struct node root = { .name = "", .is_dir = 1 };
+static unsigned long nskipped;
+
+static void *xmalloc(size_t sz)
+{
+	void *p = malloc(sz);
+	if (!p) err(EXIT_FAILURE, "allocating memory");
+	return p;
+}
+static char *xstrdup(const char *s)
+{
+	return strcpy(xmalloc(strlen(s) + 1), s);
+}
+static struct node *add_child(struct node *dir, const char *name, _Bool is_dir)
+{
+	struct node *n = xmalloc(sizeof *n);
+	*n = (struct node) { .name = xstrdup(name), .parent = dir, .is_dir = is_dir };
+	if (dir->last_child) dir->last_child->next_sibling = n;
+	else dir->children = n;
+	dir->last_child = n;
+	++dir->nchildren;
+	return n;
+}
+/* Whether vsfs can hold the entry; if not, say so. */
+static _Bool entry_ok(const char *where, const char *name, unsigned long long size)
+{
+	const char *problem = (strlen(name) >= MAX_NAME_LEN) ? "name too long" : (size > UINT32_MAX) ? "too big" : NULL;
+	if (!problem) return 1;
+	warnx("%s: %s; skipped", where, problem);
+	++nskipped;
+	return 0;
+}
+
+/* An open-addressed hash table of nodes, keyed by whatever the caller
+ * hashes and matches on: hard-linked host files by device and inode
+ * number, and archive entries by parent and name. */
+struct table
+{
+	struct node **slots;
+	unsigned long nslots, n;
+};
+static void table_put(struct table *t, struct node *n)
+{
+	unsigned long k = n->hash & (t->nslots - 1);
+	while (t->slots[k]) k = (k + 1) & (t->nslots - 1);
+	t->slots[k] = n;
+}
+static void table_grow(struct table *t)
+{
+	struct node **old = t->slots;
+	unsigned long old_nslots = t->nslots;
+	t->nslots = old_nslots ? 2 * old_nslots : 1024;
+	t->slots = calloc(t->nslots, sizeof *t->slots);
+	if (!t->slots) err(EXIT_FAILURE, "allocating hash table");
+	for (unsigned long k = 0; k < old_nslots; ++k) if (old[k]) table_put(t, old[k]);
+	free(old);
+}
+/* The slot holding the node that matches 'key', or else the empty one
+ * where it would go. */
+static struct node **table_slot(struct table *t, uint64_t hash, _Bool (*match)(struct node *, const void *),
+	const void *key)
+{
+	if (!t->nslots) table_grow(t);
+	for (unsigned long k = hash & (t->nslots - 1); ; k = (k + 1) & (t->nslots - 1))
+	{
+		if (!t->slots[k] || (t->slots[k]->hash == hash && match(t->slots[k], key))) return &t->slots[k];
+	}
+}
+static void table_add(struct table *t, struct node *n)
+{
+	if (2 * (t->n + 1) > t->nslots) table_grow(t);
+	table_put(t, n);
+	++t->n;
+}
+static uint64_t mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	return h ^ (h >> 33);
+}
+
+/* Reading a host directory tree. */
+static struct table host_files;
+static _Bool host_match(struct node *n, const void *key)
+{
+	const struct node *m = key;
+	return n->dev == m->dev && n->ino == m->ino;
+}
+/* <dirent.h> would clash with our struct dirent, so we read directories
+ * with getdents64, which takes these. */
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+static void read_host_dir(struct node *dir, const char *path)
+{
+	int fd = open(path, O_RDONLY|O_DIRECTORY);
+	if (fd == -1) err(EXIT_FAILURE, "opening directory `%s'", path);
+	size_t pathlen = strlen(path);
+	static char buf[1 << 16];
+	long got;
+	/* we descend only once done with this one, to keep few open */
+	while ((got = syscall(SYS_getdents64, fd, buf, sizeof buf)) > 0)
+	{
+		for (long pos = 0; pos < got; pos += ((struct linux_dirent64 *) (buf + pos))->d_reclen)
+		{
+			struct linux_dirent64 *e = (struct linux_dirent64 *) (buf + pos);
+			if (0 == strcmp(e->d_name, ".") || 0 == strcmp(e->d_name, "..")) continue;
+			char *child = xmalloc(pathlen + strlen(e->d_name) + 2);
+			sprintf(child, "%s/%s", path, e->d_name);
+			struct stat st;
+			if (0 != fstatat(fd, e->d_name, &st, AT_SYMLINK_NOFOLLOW)) err(EXIT_FAILURE, "getting status of `%s'", child);
+			if (!(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+			{
+				warnx("%s: not a regular file or a directory; skipped", child);
+				++nskipped;
+			}
+			else if (entry_ok(child, e->d_name, S_ISREG(st.st_mode) ? st.st_size : 0))
+			{
+				struct node *n = add_child(dir, e->d_name, S_ISDIR(st.st_mode));
+				n->path = child;
+				n->size = st.st_size;
+				if (!n->is_dir && st.st_nlink > 1)
+				{
+					/* the first name we meet for a file is the one we copy */
+					n->dev = st.st_dev;
+					n->ino = st.st_ino;
+					n->hash = mix(st.st_dev * 0x9e3779b97f4a7c15ull + st.st_ino);
+					struct node **slot = table_slot(&host_files, n->hash, host_match, n);
+					if (*slot) n->same = *slot;
+					else table_add(&host_files, n);
+				}
+				continue;
+			}
+			free(child);
+		}
+	}
+	if (got == -1) err(EXIT_FAILURE, "reading directory `%s'", path);
+	close(fd);
+	for (struct node *n = dir->children; n; n = n->next_sibling) if (n->is_dir) read_host_dir(n, n->path);
+}
+
+/* Reading a tar archive: ustar, with the GNU long-name and pax extensions
+ * for names longer than its header holds. */
+struct tar_header
+{
+	char name[100], mode[8], uid[8], gid[8], size[12], mtime[12], chksum[8], typeflag;
+	char linkname[100], magic[6], version[2], uname[32], gname[32], devmajor[8], devminor[8];
+	char prefix[155], pad[12];
+};
+_Static_assert(sizeof (struct tar_header) == 512, "tar headers are 512 bytes");
+static int tar_fd;
+static off_t tar_pos;
+static _Bool tar_seekable;
+static struct table tar_names;
+struct tar_key { struct node *parent; const char *name; };
+static _Bool tar_match(struct node *n, const void *key)
+{
+	const struct tar_key *k = key;
+	return n->parent == k->parent && 0 == strcmp(n->name, k->name);
+}
+static uint64_t tar_hash(struct node *parent, const char *name)
+{
+	uint64_t h = mix((uintptr_t) parent);
+	for (; *name; ++name) h = (h ^ (unsigned char) *name) * 0x100000001b3ull;
+	return mix(h);
+}
+static struct node *tar_child(struct node *dir, const char *name, _Bool create, _Bool is_dir)
+{
+	struct tar_key key = { dir, name };
+	uint64_t hash = tar_hash(dir, name);
+	struct node **slot = table_slot(&tar_names, hash, tar_match, &key);
+	if (*slot || !create) return *slot;
+	struct node *n = add_child(dir, name, is_dir);
+	n->hash = hash;
+	table_add(&tar_names, n);
+	return n;
+}
+/* The directory named by 'path', made if need be, having cut 'path' at its
+ * last component, which *last points to then; or null if a component is a
+ * file, or "..". */
+static struct node *tar_dir_of(char *path, char **last)
+{
+	struct node *dir = &root;
+	char *p = path;
+	for (char *slash; (slash = strchr(p, '/')); p = slash + 1)
+	{
+		*slash = '\0';
+		if (0 == strcmp(p, "..")) return NULL;
+		if (*p && 0 != strcmp(p, "."))
+		{
+			if (!(dir = tar_child(dir, p, 1, 1))->is_dir) return NULL;
+		}
+	}
+	*last = p;
+	return (0 == strcmp(p, "..")) ? NULL : dir;
+}
+static void tar_read(void *buf, size_t len)
+{
+	for (size_t done = 0; done < len; )
+	{
+		ssize_t n = read(tar_fd, (char *) buf + done, len - done);
+		if (n <= 0) errx(EXIT_FAILURE, "archive cut short");
+		done += n;
+	}
+	tar_pos += len;
+}
+static void tar_skip(off_t len)
+{
+	if (tar_seekable)
+	{
+		if (lseek(tar_fd, len, SEEK_CUR) == -1) err(EXIT_FAILURE, "seeking in archive");
+		tar_pos += len;
+		return;
+	}
+	char buf[1 << 16];
+	for (off_t n; len > 0; len -= n)
+	{
+		n = (len < sizeof buf) ? len : sizeof buf;
+		tar_read(buf, n);
+	}
+}
+static unsigned long long tar_number(const char *field, size_t len)
+{
+	unsigned long long n = 0;
+	/* big numbers are in base 256, flagged by the top bit */
+	if (*field & 0x80)
+	{
+		n = *field & 0x7f;
+		for (size_t k = 1; k < len; ++k) n = (n << 8) | (unsigned char) field[k];
+		return n;
+	}
+	for (size_t k = 0; k < len && field[k]; ++k) if (field[k] >= '0' && field[k] <= '7') n = 8 * n + field[k] - '0';
+	return n;
+}
+static char *tar_string(unsigned long long len)
+{
+	char *s = xmalloc(len + 1);
+	tar_read(s, len);
+	tar_skip(ROUND_UP_TO(512, len) - len);
+	s[len] = '\0';
+	return s;
+}
+/* pax records are "length key=value\n" */
+static void tar_pax(char *records, unsigned long long len, char **path, char **linkpath)
+{
+	for (char *r = records, *end = records + len; r < end; )
+	{
+		char *key;
+		unsigned long n = strtoul(r, &key, 10);
+		if (n == 0 || r + n > end || *key != ' ') break;
+		r[n - 1] = '\0';
+		char *value = strchr(++key, '=');
+		if (value)
+		{
+			*value++ = '\0';
+			if (0 == strcmp(key, "path")) { free(*path); *path = xstrdup(value); }
+			else if (0 == strcmp(key, "linkpath")) { free(*linkpath); *linkpath = xstrdup(value); }
+		}
+		r += n;
+	}
+}
+static void copy_contents(struct inode *f, struct node *n);
+/* A file for 'n''s contents: one with all its blocks, to be written in
+ * place, or with -c, an empty compressed one. */
+static _Bool compress;
+static struct inode *make_file(struct node *n)
+{
+	if (!compress) return vsfs_bulk_file(n->size);
+	struct inode *f = vsfs_bulk_file(0);
+	if (f && vsfs_set_compression(f, 1) != 0) errx(EXIT_FAILURE, "the image has no compression feature");
+	return f;
+}
+/* Read the archive's entries into the tree. If 'build', the image is open
+ * already, and files are created as they are read. */
+static void read_tar(_Bool build)
+{
+	char *long_name = NULL, *long_link = NULL;
+	struct tar_header h;
+	for (;;)
+	{
+		tar_read(&h, sizeof h);
+		static const char zeroes[sizeof h];
+		if (0 == memcmp(&h, zeroes, sizeof h)) break;
+		unsigned sum = 0;
+		for (unsigned k = 0; k < sizeof h; ++k) sum += (k >= 148 && k < 156) ? ' ' : ((unsigned char *) &h)[k];
+		if (sum != tar_number(h.chksum, sizeof h.chksum)) errx(EXIT_FAILURE, "bad tar header at offset %lld", (long long) tar_pos - 512);
+		unsigned long long size = tar_number(h.size, sizeof h.size);
+		if (h.typeflag == 'L' || h.typeflag == 'K')
+		{
+			char **which = (h.typeflag == 'L') ? &long_name : &long_link;
+			free(*which);
+			*which = tar_string(size);
+			continue;
+		}
+		if (h.typeflag == 'g')
+		{
+			tar_skip(ROUND_UP_TO(512, size));
+			continue;
+		}
+		if (h.typeflag == 'x')
+		{
+			char *records = tar_string(size);
+			tar_pax(records, size, &long_name, &long_link);
+			free(records);
+			continue;
+		}
+		char *path = long_name, *link = long_link;
+		long_name = long_link = NULL;
+		if (!path)
+		{
+			path = xmalloc(sizeof h.prefix + sizeof h.name + 2);
+			if (h.prefix[0]) sprintf(path, "%.*s/%.*s", (int) sizeof h.prefix, h.prefix, (int) sizeof h.name, h.name);
+			else sprintf(path, "%.*s", (int) sizeof h.name, h.name);
+		}
+		if (!link)
+		{
+			link = xmalloc(sizeof h.linkname + 1);
+			sprintf(link, "%.*s", (int) sizeof h.linkname, h.linkname);
+		}
+		char *shown = xstrdup(path), *last;
+		_Bool is_dir = (h.typeflag == '5'), is_file = (h.typeflag == '0' || h.typeflag == '\0' || h.typeflag == '7');
+		struct node *dir = tar_dir_of(path, &last), *n = NULL;
+		const char *problem = NULL;
+		if (!(is_dir || is_file || h.typeflag == '1')) problem = "not a regular file, a hard link or a directory";
+		else if (!dir) problem = "bad path";
+		else if (!*last || 0 == strcmp(last, "."))
+		{
+			/* names the directory itself, which we made already */
+			if (!is_dir) problem = "not a directory";
+		}
+		else if (strlen(last) >= MAX_NAME_LEN) problem = "name too long";
+		else if (is_file && size > UINT32_MAX) problem = "too big";
+		else if ((n = tar_child(dir, last, 0, 0)))
+		{
+			if (!(is_dir && n->is_dir)) problem = "already in the archive";
+			n = NULL;
+		}
+		else if (h.typeflag == '1')
+		{
+			char *target_last;
+			struct node *target_dir = tar_dir_of(link, &target_last);
+			struct node *target = target_dir ? tar_child(target_dir, target_last, 0, 0) : NULL;
+			if (!target || target->is_dir) problem = "link to a file not yet in the archive";
+			else
+			{
+				n = tar_child(dir, last, 1, 0);
+				n->same = target->same ? target->same : target;
+			}
+		}
+		else n = tar_child(dir, last, 1, is_dir);
+		if (problem)
+		{
+			warnx("%s: %s; skipped", shown, problem);
+			++nskipped;
+		}
+		/* what of the entry's data we haven't read */
+		off_t rest = ROUND_UP_TO(512, size);
+		if (n && is_file)
+		{
+			n->size = size;
+			n->offset = tar_pos;
+			if (build)
+			{
+				if (!(n->inode = make_file(n))) errx(EXIT_FAILURE, "%s: no room in the image", shown);
+				copy_contents(n->inode, n);
+				rest -= size;
+			}
+		}
+		tar_skip(rest);
+		free(shown);
+		free(path);
+		free(link);
+	}
+}
+
+/* Copy the file's contents into the image. A host file that has shrunk
+ * since we saw it is padded with zeroes; one that has grown, cut short. */
+static void copy_contents(struct inode *f, struct node *n)
+{
+	static char *buf;
+	enum { BUF_SIZE = 1 << 20 };
+	if (!buf) buf = xmalloc(BUF_SIZE);
+	/* an archive on a pipe is read in order; anything else, from where
+	 * the file is */
+	int fd = tar_fd;
+	off_t base = n->offset;
+	if (n->path)
+	{
+		fd = open(n->path, O_RDONLY);
+		if (fd == -1) err(EXIT_FAILURE, "opening `%s'", n->path);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		base = 0;
+	}
+	for (unsigned long off = 0, len; off < n->size; off += len)
+	{
+		len = (n->size - off < BUF_SIZE) ? n->size - off : BUF_SIZE;
+		if (!n->path && !tar_seekable) tar_read(buf, len);
+		else
+		{
+			ssize_t got = pread(fd, buf, len, base + off);
+			if (got == -1) err(EXIT_FAILURE, "reading `%s'", n->path);
+			if (got < len)
+			{
+				if (got == 0) warnx("%s: shrank while being copied; padded with zeroes", n->path);
+				bzero(buf + got, len - got);
+			}
+		}
+		if (vsfs_write(f, off, buf, len) != len) errx(EXIT_FAILURE, "%s: writing to the image failed", n->path ? n->path : n->name);
+	}
+	if (n->path) close(fd);
+}
+
+/* What the tree needs: inodes and data blocks, going by how vsfs_bulk_*
+ * lay things out. */
+static unsigned long need_inodes, need_blocks, nfiles, ndirs;
+static unsigned long blocks_for(unsigned long bytes)
+{
+	return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+static void count_needs(struct node *dir, uint32_t features)
+{
+	/* the entries, after '.' and '..' */
+	unsigned long dir_bytes = VDIRENT_SIZE(1) + VDIRENT_SIZE(2);
+	unsigned long nentries = dir->nchildren + 2;
+	++ndirs;
+	++need_inodes;
+	for (struct node *n = dir->children; n; n = n->next_sibling)
+	{
+		size_t reclen = VDIRENT_SIZE(strlen(n->name));
+		if (dir_bytes % BLOCK_SIZE + reclen > BLOCK_SIZE) dir_bytes = ROUND_UP_TO(BLOCK_SIZE, dir_bytes);
+		dir_bytes += reclen;
+		if (n->is_dir) count_needs(n, features);
+		else if (!n->same)
+		{
+			++nfiles;
+			++need_inodes;
+			if (compress)
+			{
+				/* whole clusters, each perhaps an extent of its own */
+				unsigned long nclusters = (blocks_for(n->size) + VSFS_CLUSTER_BLOCKS - 1) / VSFS_CLUSTER_BLOCKS;
+				need_blocks += nclusters * VSFS_CLUSTER_BLOCKS + nclusters / EXTENTS_PER_BLOCK;
+			}
+			else if (!(features & VSFS_FEATURE_INLINE_DATA) || n->size > INLINE_DATA_MAX) need_blocks += blocks_for(n->size);
+		}
+	}
+	if (!(features & VSFS_FEATURE_COMPACT_DIRENTS)) dir_bytes = (nentries + 1) * sizeof (struct dirent);
+	unsigned long nblocks = dir_bytes ? blocks_for(dir_bytes) : 1;
+	need_blocks += nblocks;
+	if (nblocks > 1)
+	{
+		/* the name index, with at least four 8-byte slots per entry */
+		unsigned long nslots = BLOCK_SIZE / 8;
+		while (nslots < 4 * (nentries + 1)) nslots *= 2;
+		++need_inodes;
+		need_blocks += blocks_for(8 * nslots);
+	}
+}
+/* How big an image must be to hold 'ninodes' inodes and 'ndata' data blocks,
+ * with the layout that vsfs_init would choose; sets the journal size to
+ * match. */
+static unsigned long long image_size(uint32_t features, unsigned long ninodes, unsigned long ndata)
+{
+	unsigned long long nblocks;
+	/* vsfs_init gives no image fewer inodes than the fixed layout has */
+	if (ninodes < 5 * INODES_PER_BLOCK) ninodes = 5 * INODES_PER_BLOCK;
+	ninodes = ROUND_UP_TO(INODES_PER_BLOCK, ninodes);
+	if (features & VSFS_FEATURE_LAYOUT)
+	{
+		unsigned long bits = 8 * BLOCK_SIZE;
+		nblocks = 1 + (ninodes + bits - 1) / bits + ninodes / INODES_PER_BLOCK + (ndata + bits - 1) / bits + ndata;
+		/* a spare refcount block, since it counts the data bitmap too */
+		if (features & VSFS_FEATURE_REFCOUNTS) nblocks += (ndata + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
+	}
+	else nblocks = 1 + 2 + 5 + ndata;
+	if (features & VSFS_FEATURE_JOURNAL)
+	{
+		/* as vsfs_init would choose, from the size with the journal */
+		unsigned long journal = (nblocks / 31 < 8) ? 8 : (nblocks / 31 > 1024) ? 1024 : nblocks / 31;
+		vsfs_mkfs_journal_blocks = ROUND_UP_TO(2, journal);
+		nblocks += vsfs_mkfs_journal_blocks;
+	}
+	return nblocks * BLOCK_SIZE;
+}
+
+/* Create the files and directories, and then fill the directories. */
+static void create(struct node *dir)
+{
+	for (struct node *n = dir->children; n; n = n->next_sibling)
+	{
+		if (n->is_dir)
+		{
+			if (!(n->inode = vsfs_bulk_dir())) errx(EXIT_FAILURE, "%s: no inode for it in the image", n->path ? n->path : n->name);
+		}
+		else if (!n->same && !n->inode)
+		{
+			if (!(n->inode = make_file(n))) errx(EXIT_FAILURE, "%s: no room in the image", n->path ? n->path : n->name);
+			copy_contents(n->inode, n);
+		}
+	}
+	for (struct node *n = dir->children; n; n = n->next_sibling) if (n->is_dir) create(n);
+}
+static void fill(struct node *dir)
+{
+	const char **names = xmalloc((dir->nchildren + 1) * sizeof *names);
+	struct inode **targets = xmalloc((dir->nchildren + 1) * sizeof *targets);
+	unsigned long k = 0;
+	for (struct node *n = dir->children; n; n = n->next_sibling, ++k)
+	{
+		names[k] = n->name;
+		targets[k] = n->same ? n->same->inode : n->inode;
+	}
+	if (!vsfs_bulk_fill_dir(dir->inode, (dir == &root) ? NULL : dir->parent->inode, k, names, targets))
+	{
+		errx(EXIT_FAILURE, "%s: no room in the image for its entries", dir->path ? dir->path : dir->name);
+	}
+	free(names);
+	free(targets);
+	for (struct node *n = dir->children; n; n = n->next_sibling) if (n->is_dir) fill(n);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long size = 0;
+	unsigned long ninodes = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "cs:i:f:")) != -1)
+	{
+		if (opt == 'c') compress = 1;
+		else if (opt == 's') size = strtoull(optarg, NULL, 0);
+		else if (opt == 'i') ninodes = strtoul(optarg, NULL, 0);
+		else if (opt == 'f') vsfs_mkfs_features = strtoul(optarg, NULL, 0);
+		else errx(EXIT_FAILURE, "usage: %s [-c] [-s size] [-i inodes] [-f features] image {directory | -}", argv[0]);
+	}
+	if (optind + 2 != argc) errx(EXIT_FAILURE, "usage: %s [-c] [-s size] [-i inodes] [-f features] image {directory | -}", argv[0]);
+	const char *image = argv[optind], *source = argv[optind + 1];
+	_Bool from_tar = (0 == strcmp(source, "-"));
+	tar_fd = STDIN_FILENO;
+	tar_seekable = from_tar && lseek(tar_fd, 0, SEEK_CUR) != -1;
+	if (from_tar && !tar_seekable && !size) errx(EXIT_FAILURE, "an archive on a pipe needs -s");
+	/* we fill the image in one pass, so commit in batches, not per call */
+	vsfs_durable_ops = 0;
+	debug_level = 0;
+	debug_out = stdout;
+	int fd = open(image, O_RDWR|O_CREAT|O_TRUNC, 0666);
+	if (fd == -1) err(EXIT_FAILURE, "creating `%s'", image);
+
+	/* an archive on a pipe must be built as it is read */
+	_Bool streaming = from_tar && !tar_seekable;
+	if (!streaming)
+	{
+		if (from_tar) read_tar(0);
+		else
+		{
+			struct stat st;
+			if (0 != stat(source, &st) || !S_ISDIR(st.st_mode)) errx(EXIT_FAILURE, "`%s' is not a directory", source);
+			read_host_dir(&root, source);
+		}
+		count_needs(&root, vsfs_mkfs_features);
+		/* Room for the odd extent block, should a file not get its blocks
+		 * in one run after all. */
+		need_blocks += 16 + need_blocks / 256;
+		/* by default, just the inodes we need, or vsfs_init's usual
+		 * density, if that's more, in an image of a given size */
+		if (!ninodes) ninodes = (size / 16384 > need_inodes) ? size / 16384 : need_inodes;
+		if (ninodes < need_inodes) errx(EXIT_FAILURE, "the tree needs %lu inodes", need_inodes);
+		if (!size) size = image_size(vsfs_mkfs_features, ninodes, need_blocks);
+	}
+	if (ninodes) vsfs_mkfs_inodes = ninodes;
+	if (ftruncate(fd, size) != 0) err(EXIT_FAILURE, "sizing `%s'", image);
+	close(fd);
+	vsfs_init(image, 0);
+	if (streaming)
+	{
+		read_tar(1);
+		count_needs(&root, vsfs_mkfs_features);
+	}
+
+	root.inode = vsfs_inode(0);
+	create(&root);
+	fill(&root);
+	vsfs_sync();
+	struct vsfs_statfs s;
+	vsfs_statfs(&s);
+	printf("%lu files, %lu directories; %lu of %lu inodes and %lu of %lu data blocks in use; %lu skipped\n",
+		nfiles, ndirs, s.ninodes - s.nfree_inodes, s.ninodes, s.ndata_blocks - s.nfree_data_blocks,
+		s.ndata_blocks, nskipped);
+	return EXIT_SUCCESS;
+}
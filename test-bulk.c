@@ -0,0 +1,79 @@
+/* Bulk building into the smallest journal that vsfs_init would choose.
+ *
+ * A child builds, as vsfs-mkimage would, a directory of 3000 entries, each
+ * naming a file of its own; the journal exits if a batch is too big to log.
+ * Another child reopens the image, runs fsck and looks up every name. We do
+ * that with compact and with fixed-format directory entries.
+ *
+ * Usage: test-bulk
+ */
+#define _GNU_SOURCE /* for bench.h */
+#include <string.h>
+
+#include "vsfs.h"
+#include "journal.h"
+#include "bench.h"
+
+#define NENTRIES 3000
+static char image[4096];
+
+static void build(unsigned long features)
+{
+	vsfs_mkfs_features = features;
+	vsfs_init(image, 0);
+	static char names[NENTRIES][16];
+	static const char *name_ptrs[NENTRIES];
+	static struct inode *targets[NENTRIES];
+	struct inode *root = vsfs_inode(0), *dir = vsfs_bulk_dir();
+	if (!dir) errx(EXIT_FAILURE, "making the directory");
+	for (unsigned k = 0; k < NENTRIES; ++k)
+	{
+		snprintf(names[k], sizeof names[k], "file%u", k);
+		name_ptrs[k] = names[k];
+		if (!(targets[k] = vsfs_bulk_file(0))) errx(EXIT_FAILURE, "making %s", names[k]);
+	}
+	const char *dir_name = "dir";
+	if (!vsfs_bulk_fill_dir(dir, root, NENTRIES, name_ptrs, targets) || !vsfs_bulk_fill_dir(root, NULL, 1, &dir_name, &dir))
+	{
+		errx(EXIT_FAILURE, "filling the directories");
+	}
+	vsfs_sync();
+}
+
+static void check(unsigned long unused)
+{
+	vsfs_init(image, 0);
+	struct vsfs_fsck_report r;
+	vsfs_fsck(1, 0, &r);
+	if (r.nproblems) errx(EXIT_FAILURE, "fsck found %lu problems", r.nproblems);
+	for (unsigned k = 0; k < NENTRIES; ++k)
+	{
+		char path[32];
+		snprintf(path, sizeof path, "dir/file%u", k);
+		if (!vsfs_lookup(vsfs_inode(0), path)) errx(EXIT_FAILURE, "no %s", path);
+	}
+}
+
+int main(void)
+{
+	debug_level = 0;
+	debug_out = fopen("/dev/null", "w");
+	/* as vsfs-mkimage builds */
+	vsfs_durable_ops = 0;
+	vsfs_mkfs_journal_blocks = 8;
+	vsfs_mkfs_inodes = 4096;
+	const uint32_t features[] = { vsfs_mkfs_features, vsfs_mkfs_features & ~VSFS_FEATURE_COMPACT_DIRENTS };
+	for (unsigned n = 0; n < sizeof features / sizeof features[0]; ++n)
+	{
+		snprintf(image, sizeof image, "/tmp/test-bulk.XXXXXX");
+		int fd = mkstemp(image);
+		if (fd == -1) err(EXIT_FAILURE, "creating an image");
+		if (ftruncate(fd, 4ul << 20) != 0) err(EXIT_FAILURE, "sizing the image");
+		close(fd);
+		run_in_child(build, features[n]);
+		run_in_child(check, 0);
+		unlink(image);
+	}
+	printf("test-bulk: ok\n");
+	return 0;
+}
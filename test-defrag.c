@@ -0,0 +1,217 @@
+/* Online defragmentation: what moves, what stays put, and resuming.
+ *
+ * A child builds an image holding, written a block at a time in turn so
+ * that their blocks interleave:
+ *
+ *   b and d, then c, a clone of b, then a snapshot, then a few blocks of d
+ *   rewritten, so that b and c share every block and d's are pinned, but
+ *   for those few;
+ *   a and e, after the snapshot, so neither shared nor pinned, and big
+ *   enough to take a defragmentation pass many steps each.
+ *
+ * It then calls vsfs_defrag with a budget of 1 ms until a sweep is done,
+ * and checks that a and e end up in one run each, that some pass stopped
+ * partway through one of them, that every block of b, c and d is where it
+ * was, and that every file reads back as written. Another child reopens the
+ * image, runs fsck and reads every file again, and checks the free space
+ * histogram against vsfs_statfs. Then the frags, defrag and freefrag
+ * commands run on the image through ./vsfs.
+ *
+ * Usage: test-defrag
+ */
+#define _GNU_SOURCE /* for bench.h */
+#include <string.h>
+
+#include "vsfs.h"
+#include "bench.h"
+
+#define NBIG 4096 /* blocks in a and e */
+#define NSMALL 256 /* in b and d */
+#define NREWRITTEN 8 /* of d's, after the snapshot */
+static char image[4096];
+static const char *const names[] = { "a", "b", "c", "d", "e" };
+enum { A, B, C, D, E, NFILES };
+static const unsigned long nblocks[NFILES] = { NBIG, NSMALL, NSMALL, NSMALL, NBIG };
+
+/* What block 'blk' of each file holds: c's are b's, and d's first blocks
+ * change once rewritten. */
+static _Bool rewritten;
+static void fill_block(uint64_t *w, unsigned file, unsigned long blk)
+{
+	if (file == C) file = B;
+	if (file == D && blk < NREWRITTEN && rewritten) file = NFILES;
+	for (unsigned n = 0; n < BLOCK_SIZE / 8; ++n) w[n] = ((uint64_t) file << 32) ^ (blk * 0x9e3779b97f4a7c15ull + n);
+}
+static struct inode *file(unsigned k)
+{
+	struct inode *f = vsfs_lookup(vsfs_inode(0), names[k]);
+	if (!f) errx(EXIT_FAILURE, "no file %s", names[k]);
+	return f;
+}
+/* Write blocks 'from' to 'to' - 1 of files 'k' and 'l' (which may be the
+ * same), taking turns. */
+static void write_blocks(unsigned k, unsigned l, unsigned long from, unsigned long to)
+{
+	static uint64_t buf[BLOCK_SIZE / 8];
+	for (unsigned long blk = from; blk < to; ++blk)
+	{
+		unsigned files[] = { k, l };
+		for (unsigned n = 0; n < 2 - (k == l); ++n)
+		{
+			fill_block(buf, files[n], blk);
+			if (vsfs_write(file(files[n]), blk * BLOCK_SIZE, (char *) buf, BLOCK_SIZE) != BLOCK_SIZE)
+			{
+				errx(EXIT_FAILURE, "writing block %lu of %s", blk, names[files[n]]);
+			}
+		}
+	}
+}
+static void check_contents(void)
+{
+	static uint64_t buf[BLOCK_SIZE / 8], expected[BLOCK_SIZE / 8];
+	for (unsigned k = 0; k < NFILES; ++k)
+	{
+		struct inode *f = file(k);
+		for (unsigned long blk = 0; blk < nblocks[k]; ++blk)
+		{
+			fill_block(expected, k, blk);
+			if (vsfs_read(f, blk * BLOCK_SIZE, (char *) buf, BLOCK_SIZE) != BLOCK_SIZE || memcmp(buf, expected, BLOCK_SIZE))
+			{
+				errx(EXIT_FAILURE, "block %lu of %s reads back wrong", blk, names[k]);
+			}
+		}
+	}
+}
+
+static void build_and_defrag(unsigned long unused)
+{
+	vsfs_init(image, 0);
+	struct inode *root = vsfs_inode(0);
+	for (unsigned k = 0; k < NFILES; ++k) if (k != C && !vsfs_creat(root, names[k])) errx(EXIT_FAILURE, "creating %s", names[k]);
+	write_blocks(B, D, 0, NSMALL);
+	if (!vsfs_clone(file(B), root, "c")) errx(EXIT_FAILURE, "cloning b");
+	if (vsfs_snapshot() < 0) errx(EXIT_FAILURE, "taking a snapshot");
+	/* copied on write, so no longer pinned */
+	rewritten = 1;
+	write_blocks(D, D, 0, NREWRITTEN);
+	write_blocks(A, E, 0, NBIG);
+	check_contents();
+
+	/* where b's, c's and d's blocks are, and that they can't move */
+	static unsigned long where[NFILES][NSMALL];
+	for (unsigned k = B; k <= D; ++k)
+	{
+		for (unsigned long blk = 0; blk < NSMALL; ++blk) where[k][blk] = vsfs_bench_map_block(file(k), blk);
+	}
+	for (unsigned long blk = 0; blk < NSMALL; ++blk)
+	{
+		if (!vsfs_bench_block_shared(where[B][blk]) || where[B][blk] != where[C][blk]) errx(EXIT_FAILURE, "b and c don't share block %lu", blk);
+	}
+	long runs[NFILES];
+	for (unsigned k = 0; k < NFILES; ++k) runs[k] = vsfs_fragments(file(k));
+	if (runs[A] < NBIG / 2 || runs[E] < NBIG / 2) errx(EXIT_FAILURE, "a and e are in only %ld and %ld runs", runs[A], runs[E]);
+
+	struct vsfs_defrag_report r;
+	unsigned long npasses = 0, npartway = 0;
+	do
+	{
+		vsfs_defrag(1, &r);
+		++npasses;
+		for (unsigned k = A; k <= E; k += E - A)
+		{
+			long n = vsfs_fragments(file(k));
+			if (n > 1 && n < runs[k]) ++npartway;
+		}
+	}
+	while (!r.done);
+	if (npartway == 0) errx(EXIT_FAILURE, "no pass of %lu stopped partway through a file", npasses);
+	for (unsigned k = A; k <= E; k += E - A)
+	{
+		long n = vsfs_fragments(file(k));
+		if (n != 1) errx(EXIT_FAILURE, "%s is still in %ld runs", names[k], n);
+	}
+	for (unsigned k = B; k <= D; ++k)
+	{
+		if (vsfs_fragments(file(k)) != runs[k]) errx(EXIT_FAILURE, "%s was moved", names[k]);
+		for (unsigned long blk = 0; blk < NSMALL; ++blk)
+		{
+			if (vsfs_bench_map_block(file(k), blk) != where[k][blk]) errx(EXIT_FAILURE, "block %lu of %s was moved", blk, names[k]);
+		}
+	}
+	check_contents();
+	vsfs_sync();
+	printf("test-defrag: a and e from %ld and %ld runs to 1, in %lu passes; b, c and d unmoved\n", runs[A], runs[E],
+		npasses);
+}
+
+static void reopen_and_check(unsigned long unused)
+{
+	rewritten = 1;
+	vsfs_init(image, 0);
+	struct vsfs_fsck_report r;
+	vsfs_fsck(1, 0, &r);
+	if (r.nproblems) errx(EXIT_FAILURE, "fsck found %lu problems", r.nproblems);
+	check_contents();
+	struct vsfs_free_histogram h;
+	struct vsfs_statfs s;
+	vsfs_free_histogram(&h);
+	vsfs_statfs(&s);
+	unsigned long nruns = 0, nfree = 0;
+	for (unsigned n = 0; n < VSFS_FREE_HISTOGRAM_BUCKETS; ++n)
+	{
+		if (h.bucket_nruns[n] && (h.bucket_nblocks[n] < h.bucket_nruns[n] << n || h.bucket_nblocks[n] >= h.bucket_nruns[n] << (n + 1)))
+		{
+			errx(EXIT_FAILURE, "free space histogram bucket %u has %lu runs of %lu blocks", n, h.bucket_nruns[n], h.bucket_nblocks[n]);
+		}
+		nruns += h.bucket_nruns[n];
+		nfree += h.bucket_nblocks[n];
+	}
+	if (nruns != h.nruns || nfree != h.nfree || h.nfree != s.nfree_data_blocks || h.largest > h.nfree)
+	{
+		errx(EXIT_FAILURE, "free space histogram of %lu runs and %lu blocks, %lu free", h.nruns, h.nfree,
+			s.nfree_data_blocks);
+	}
+	printf("test-defrag: fsck clean; free space in %lu runs\n", h.nruns);
+}
+
+/* Runs 'commands' through ./vsfs in batch mode, and checks that its output
+ * holds each of 'expected', in order. */
+static void run_commands(const char *commands, const char *const *expected)
+{
+	char cmd[8192], out[8192];
+	snprintf(cmd, sizeof cmd, "printf '%s' | ./vsfs -b %s", commands, image);
+	fflush(stdout);
+	FILE *p = popen(cmd, "r");
+	if (!p) err(EXIT_FAILURE, "running ./vsfs");
+	size_t len = fread(out, 1, sizeof out - 1, p);
+	out[len] = 0;
+	if (pclose(p) != 0) errx(EXIT_FAILURE, "./vsfs failed on '%s':\n%s", commands, out);
+	const char *at = out;
+	for (; *expected; ++expected)
+	{
+		if (!(at = strstr(at, *expected))) errx(EXIT_FAILURE, "no '%s' in the output of '%s':\n%s", *expected, commands, out);
+	}
+}
+
+int main(void)
+{
+	debug_level = 0;
+	debug_out = fopen("/dev/null", "w");
+	/* each block its own allocation */
+	vsfs_write_buffer_max = 0;
+	snprintf(image, sizeof image, "/tmp/test-defrag.XXXXXX");
+	int fd = mkstemp(image);
+	if (fd == -1) err(EXIT_FAILURE, "creating an image");
+	/* room for a and e to move, one after the other */
+	if (ftruncate(fd, (2 * NBIG + 3 * NSMALL) * 2ul * BLOCK_SIZE + (8ul << 20)) != 0) err(EXIT_FAILURE, "sizing the image");
+	close(fd);
+	run_in_child(build_and_defrag, 0);
+	run_in_child(reopen_and_check, 0);
+
+	/* a is inode 1: it was made first */
+	run_commands("frags 1\\nfrags 2\\ndefrag 0\\nfreefrag\\n", (const char *const []) {
+		"1 runs\n", "runs\n", "0 blocks moved; sweep done\n", "free data blocks in ", " runs, the longest ", NULL });
+	unlink(image);
+	printf("test-defrag: ok\n");
+	return 0;
+}
@@ -16,27 +16,55 @@
  * missing some implementation: it can only create empty files,
  * and cannot delete files....
  *
- * FIXME: this is not thread-safe! Use a single-threaded event
- * loop only.
+ * Concurrency: the public vsfs_* operations may be called from many
+ * threads at once (vsfs_init may not). Each inode has a reader/writer lock,
+ * held in memory only. Operations that change a directory hold its lock for
+ * writing; lookups hold it for reading, one path component at a time. A
+ * directory is always locked before the inodes it names. The allocation
+ * bitmaps are updated atomically, so allocation needs no lock. The block-map
+ * cache, the write buffer table and the dentry cache have their own internal
+ * locks, which are never held while taking an inode lock. The dump functions
+ * are debugging aids, and take no locks. Nothing stops one thread from
+ * unlinking a file that another thread is using.
+ *
+ * Journalling: every mutating public operation is bracketed by journal_begin
+ * and journal_end, which are taken outside any inode lock, and reports each
+ * change it makes to the mapping with journal_dirty (or, for a block it has
+ * just allocated, journal_fresh, which data_alloc and data_alloc_run do for
+ * it). Freed data blocks go through data_free_blkno, which holds them back
+ * until the freeing batch commits. See journal.h. With the pread backend,
+ * the contents of regular files bypass the mapping and the journal alike;
+ * see file_block_get.
  *
  * FIXME: error reporting is not good. We do too much "return NULL"
  * and the like. Better to collect errors in a thread-local.
  */
 
+#define _GNU_SOURCE /* for sched_getcpu */
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
 #include <err.h>
 
 #include "vsfs.h"
 #include "bitmap.h"
+#include "dcache.h"
+#include "journal.h"
+#include "bcache.h"
+#include "lz.h"
 
 unsigned debug_level;
 FILE *debug_out;
 
+static FILE *backing_file;
 static void *mapping;
 static size_t mapping_size;
 static long page_size;
@@ -49,6 +77,47 @@ static struct inode *inodes;
 static struct inode *inodes_end;
 static data_block_t *data_blocks;
 static data_block_t *data_blocks_end;
+/* With VSFS_FEATURE_REFCOUNTS, one byte per data block: how many more inodes
+ * than one map it (see vsfs_clone). Null without the feature. */
+static uint8_t *refcounts;
+/* The data blocks that some snapshot holds, so that they must be copied
+ * before being written, and stay allocated when the live filesystem lets go
+ * of them (see vsfs_snapshot). Null while there are no snapshots. */
+static bitmap_word_t *pinned;
+/* With the pread backend, the contents of regular files are in the buffer
+ * cache; see file_block_get. */
+static _Bool cached_data;
+/* One chunk of locks per block of the inode table, made on first use, so
+ * that opening a big filesystem costs nothing per inode. */
+static pthread_rwlock_t **inode_lock_chunks;
+static unsigned long inode_lock_nchunks;
+
+/* Allocation groups. Each bitmap is split into groups of whole words, one
+ * per CPU (or fewer, on small filesystems). A thread allocates from the group
+ * of the CPU it is running on, claiming a bit with a compare-and-swap on its
+ * word, and moves on to the other groups only once its own is exhausted.
+ * Each group keeps a cursor, the word where it last found a free bit, so that
+ * a scan resumes there instead of rescanning the group's full prefix, and a
+ * count of its free bits, so that full groups are skipped without scanning.
+ * The cursor is only a hint, but the count is exact: it is taken from the
+ * bitmap at open, and every claim and free adjusts it, so that the sum over
+ * the groups is the number of free objects (see vsfs_statfs). */
+struct alloc_group
+{
+	unsigned long cursor; /* word index in the bitmap */
+	long nfree;
+} __attribute__((aligned(64))); /* one per cache line */
+struct allocator
+{
+	bitmap_word_t *bitmap;
+	unsigned long nbits;
+	unsigned long nwords;
+	unsigned long words_per_group;
+	unsigned ngroups;
+	struct alloc_group *groups;
+};
+static struct allocator inode_allocator;
+static struct allocator data_allocator;
 
 /* internal operations */
 static struct inode *inode_alloc(void);
@@ -56,7 +125,104 @@ static void *data_alloc(void);
 static void inode_free(struct inode *i);
 static void data_free(void *pos);
 static struct dirent *append_dir_entry(struct inode *dir, struct inode *tgt, const char *name);
-static _Bool ensure_allocated_length(struct inode *i, unsigned len);
+static _Bool ensure_allocated_length(struct inode *i, unsigned long len);
+static void bmap_cache_deinit(void);
+static void allocator_init(struct allocator *a, bitmap_word_t *bitmap, unsigned long nbits, _Bool all_free);
+static _Bool allocator_claim(struct allocator *a, unsigned long idx);
+static unsigned long allocator_nfree(struct allocator *a);
+static void super_counts_update(void);
+static _Bool compact_dirents(void);
+static void dir_index_remove(struct inode *idx, uint32_t hash, unsigned pos);
+static unsigned room_hint(struct inode *dir);
+static void set_room_hint(struct inode *dir, unsigned pos);
+static uint32_t entry_hash(struct inode *dir, unsigned pos);
+static void data_free_now(unsigned long blkno);
+static void inode_dirty(struct inode *i);
+static void write_buffer_flush_all(void);
+static void write_buffers_deinit(void);
+static void snapshot_load_pinned(void);
+static void snapshot_rollback(unsigned id);
+static uint32_t snapshot_root(unsigned id);
+static _Bool snapshot_mark(uint32_t root, bitmap_word_t *marks);
+struct write_buffer;
+static struct write_buffer *write_buffer_get(struct inode *f, _Bool create);
+static unsigned long file_size(struct inode *f, struct write_buffer *wb);
+static _Bool promote_inline(struct inode *f);
+static void cluster_cache_deinit(void);
+static _Bool write_clusters(struct inode *f, unsigned long offset, unsigned long end, const struct iovec *iov,
+	unsigned long skip, _Bool reserved);
+
+uint32_t vsfs_mkfs_features = VSFS_FEATURE_COMPACT_DIRENTS|VSFS_FEATURE_JOURNAL|VSFS_FEATURE_LAYOUT
+	|VSFS_FEATURE_INLINE_DATA|VSFS_FEATURE_FREE_COUNTS|VSFS_FEATURE_REFCOUNTS|VSFS_FEATURE_COMPRESSION;
+unsigned vsfs_mkfs_journal_blocks;
+unsigned vsfs_mkfs_inodes;
+enum vsfs_backend vsfs_backend;
+unsigned long vsfs_readahead_max = 2 << 20;
+
+#define BITS_PER_BLOCK (8 * BLOCK_SIZE)
+/* Work out where everything goes, and fill in the superblock to match. We
+ * check an existing filesystem's superblock by comparing it with the one
+ * that this makes from the same parameters. */
+static struct superblock make_superblock(uint32_t features, size_t size, uint32_t num_inodes,
+	uint32_t journal_nblocks)
+{
+	uint64_t total_blocks = size / BLOCK_SIZE;
+	if (total_blocks > UINT32_MAX) errx(EXIT_FAILURE, "filesystem too big (%llu blocks)", (unsigned long long) total_blocks);
+	struct superblock sb = {
+		.magic = "VSFS",
+		.block_size_in_bytes = BLOCK_SIZE,
+		.num_inodes = num_inodes,
+		.features = features,
+		.journal_nblocks = journal_nblocks
+	};
+	uint64_t inode_bitmap_nblocks, inode_table_nblocks, data_bitmap_nblocks, refcount_nblocks = 0, nblocks_left;
+	if (features & VSFS_FEATURE_LAYOUT)
+	{
+		if (num_inodes == 0 || num_inodes % INODES_PER_BLOCK != 0) errx(EXIT_FAILURE, "bad inode count %u", (unsigned) num_inodes);
+		inode_bitmap_nblocks = (num_inodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+		inode_table_nblocks = num_inodes / INODES_PER_BLOCK;
+		uint64_t nreserved = 1 + inode_bitmap_nblocks + inode_table_nblocks + journal_nblocks;
+		if (total_blocks < nreserved + 2) errx(EXIT_FAILURE, "filesystem too small for %u inodes", (unsigned) num_inodes);
+		/* Each data bitmap block covers itself and BITS_PER_BLOCK data blocks,
+		 * and each refcount block itself and BLOCK_SIZE more. */
+		nblocks_left = total_blocks - nreserved;
+		if (features & VSFS_FEATURE_REFCOUNTS)
+		{
+			refcount_nblocks = (nblocks_left + BLOCK_SIZE) / (BLOCK_SIZE + 1);
+			nblocks_left -= refcount_nblocks;
+		}
+		data_bitmap_nblocks = (nblocks_left + BITS_PER_BLOCK) / (BITS_PER_BLOCK + 1);
+		sb.fs_size_in_blocks = total_blocks;
+	}
+	else
+	{
+		/* the original fixed layout */
+		if (num_inodes != 5 * INODES_PER_BLOCK) errx(EXIT_FAILURE, "bad inode count %u", (unsigned) num_inodes);
+		inode_bitmap_nblocks = data_bitmap_nblocks = 1;
+		inode_table_nblocks = 5;
+		if (total_blocks < 1 + 2 + 5 + journal_nblocks + 1) errx(EXIT_FAILURE, "filesystem too small");
+		nblocks_left = total_blocks - 1 - 2 - 5 - journal_nblocks;
+		if (nblocks_left > BITS_PER_BLOCK) errx(EXIT_FAILURE, "filesystem too big without VSFS_FEATURE_LAYOUT");
+		nblocks_left += data_bitmap_nblocks;
+		if (size > UINT32_MAX) errx(EXIT_FAILURE, "filesystem too big without VSFS_FEATURE_LAYOUT");
+		sb.fs_size_in_bytes = size;
+	}
+	sb.num_data_blocks = nblocks_left - data_bitmap_nblocks;
+	if (features & VSFS_FEATURE_LAYOUT)
+	{
+		sb.inode_bitmap_start = 1;
+		sb.data_bitmap_start = sb.inode_bitmap_start + inode_bitmap_nblocks;
+		sb.inode_table_start = sb.data_bitmap_start + data_bitmap_nblocks;
+		if (features & VSFS_FEATURE_REFCOUNTS)
+		{
+			sb.refcount_start = sb.inode_table_start;
+			sb.inode_table_start += refcount_nblocks;
+		}
+		sb.journal_start = sb.inode_table_start + inode_table_nblocks;
+		sb.data_start = sb.journal_start + journal_nblocks;
+	}
+	return sb;
+}
 
 void vsfs_init(const char *backing_file_name, size_t expected_size)
 {
@@ -70,49 +236,162 @@ void vsfs_init(const char *backing_file_name, size_t expected_size)
 	struct stat statbuf;
 	int ret = fstat(fileno(f), &statbuf);
 	if (ret != 0) err(EXIT_FAILURE, "getting status of backing file `%s'", backing_file_name);
+	if (expected_size == 0) expected_size = statbuf.st_size;
 	if (statbuf.st_size != expected_size)
 	{
 		errx(EXIT_FAILURE, "backing file `%s' does not have size %ld bytes; try using `truncate -s'?",
 			backing_file_name, (long) expected_size);
 	}
 
+	/* Decide on features and layout. A fresh filesystem gets the mkfs
+	 * settings; an existing one keeps what it was created with. */
+	_Bool fresh = (statbuf.st_blocks == 0);
+	struct superblock disk_super;
+	if (!fresh && pread(fileno(f), &disk_super, sizeof disk_super, 0) != sizeof disk_super)
+	{
+		err(EXIT_FAILURE, "reading superblock of backing file `%s'", backing_file_name);
+	}
+	/* The superblock reaches the file only once creating the filesystem has
+	 * committed, so if it is still zero, either the file is all zeroes or
+	 * that was interrupted. Either way, start again from a sparse file. */
+	static const struct superblock zero_super;
+	if (!fresh && 0 == memcmp(&disk_super, &zero_super, sizeof disk_super))
+	{
+		if (ftruncate(fileno(f), 0) != 0 || ftruncate(fileno(f), expected_size) != 0)
+		{
+			err(EXIT_FAILURE, "clearing backing file `%s'", backing_file_name);
+		}
+		fresh = 1;
+	}
+	uint32_t features = fresh ? vsfs_mkfs_features : disk_super.features;
+	if (features & ~VSFS_KNOWN_FEATURES) errx(EXIT_FAILURE, "filesystem has unknown features 0x%x", (unsigned) features);
+	if ((features & VSFS_FEATURE_REFCOUNTS) && !(features & VSFS_FEATURE_LAYOUT))
+	{
+		errx(EXIT_FAILURE, "VSFS_FEATURE_REFCOUNTS needs VSFS_FEATURE_LAYOUT");
+	}
+	uint64_t total_blocks = expected_size / BLOCK_SIZE;
+	uint32_t journal_nblocks = 0;
+	if (features & VSFS_FEATURE_JOURNAL)
+	{
+		/* By default, 1/32 of the image, in [8, 1024] blocks. It must split
+		 * into two equal halves. */
+		journal_nblocks = fresh ? vsfs_mkfs_journal_blocks : disk_super.journal_nblocks;
+		if (fresh && !journal_nblocks)
+		{
+			journal_nblocks = (total_blocks / 32 < 8) ? 8 : (total_blocks / 32 > 1024) ? 1024 : total_blocks / 32;
+		}
+		journal_nblocks = ROUND_DOWN_TO(2, journal_nblocks);
+		if (journal_nblocks < 2 || journal_nblocks >= total_blocks)
+		{
+			errx(EXIT_FAILURE, "bad journal size (%u blocks)", (unsigned) journal_nblocks);
+		}
+	}
+	uint32_t num_inodes = 5 * INODES_PER_BLOCK;
+	if (!fresh) num_inodes = disk_super.num_inodes;
+	else if (features & VSFS_FEATURE_LAYOUT)
+	{
+		/* By default, one inode per 16 kB, but no fewer than the fixed
+		 * layout has, in whole blocks of the inode table. The fixed-size
+		 * dirent format can't name more than 32768. */
+		uint64_t n = vsfs_mkfs_inodes ? vsfs_mkfs_inodes : expected_size / 16384;
+		if (n < 5 * INODES_PER_BLOCK) n = 5 * INODES_PER_BLOCK;
+		if (!(features & VSFS_FEATURE_COMPACT_DIRENTS) && n > 32768) n = 32768;
+		if (n > UINT32_MAX / 2) n = UINT32_MAX / 2;
+		num_inodes = ROUND_UP_TO(INODES_PER_BLOCK, n);
+	}
+	/* the free counts are checked below, against the bitmaps */
+	struct superblock expected_super = make_superblock(features, expected_size, num_inodes, journal_nblocks);
+	if (!fresh && (0 != memcmp(&disk_super, &expected_super, offsetof(struct superblock, nfree_inodes))
+		|| disk_super.refcount_start != expected_super.refcount_start))
+	{
+		errx(EXIT_FAILURE, "superblock check failed");
+	}
+	/* Where everything is. The fixed layout has the same order, just with
+	 * sizes that don't depend on the image. */
+	uint32_t inode_bitmap_start = 1, data_bitmap_start = 2, inode_table_start = 3, journal_start = 8;
+	if (features & VSFS_FEATURE_LAYOUT)
+	{
+		inode_bitmap_start = expected_super.inode_bitmap_start;
+		data_bitmap_start = expected_super.data_bitmap_start;
+		inode_table_start = expected_super.inode_table_start;
+		journal_start = expected_super.journal_start;
+	}
+	uint32_t data_start = journal_start + journal_nblocks;
+
+	/* With a journal, our changes must reach the file only through it, so
+	 * the mapping is private. Replay any batch that might not have reached
+	 * its home locations before we map the file. A private mapping would
+	 * normally reserve swap for every page that we might write; we don't
+	 * want that for a big image, nor do we need it, since the journal
+	 * writes back what we change and then drops our copies of it (see
+	 * drop_private in journal.c). */
+	uint64_t last_seq = 0;
+	if (journal_nblocks && !fresh) last_seq = journal_replay(fileno(f), journal_start, journal_nblocks);
 	mapping_size = ROUND_UP_TO(page_size, expected_size);
-	mapping = mmap(NULL, mapping_size, PROT_READ|PROT_WRITE, MAP_SHARED, fileno(f), 0);
+	mapping = mmap(NULL, mapping_size, PROT_READ|PROT_WRITE, journal_nblocks ? MAP_PRIVATE|MAP_NORESERVE : MAP_SHARED,
+		fileno(f), 0);
 	if (mapping == MAP_FAILED) err(EXIT_FAILURE, "mapping backing file `%s'", backing_file_name);
+	backing_file = f;
+	if (journal_nblocks)
+	{
+		journal_open(fileno(f), mapping, journal_start, journal_nblocks, last_seq, data_free_now,
+			super_counts_update);
+	}
 
-	struct superblock expected_super = {
-		.magic = "VSFS",
-		.fs_size_in_bytes = expected_size,
-		.block_size_in_bytes = BLOCK_SIZE,
-		/* We have five blocks' worth of inodes */
-		.num_inodes = (5 * BLOCK_SIZE) / sizeof (struct inode),
-		/* We have exactly two bitmap blocks and one superblock, so the total
-		 * non-data blocks is 8 a.k.a. START_BLOCKS_RESERVED. */
-		.num_data_blocks = (expected_size / BLOCK_SIZE) - START_BLOCKS_RESERVED
-	};
+	/* Besides counting the bits in the bitmaps, nothing here touches more
+	 * than a page or so of the image, so a big filesystem opens quickly.
+	 * Its bitmaps and inode table read as zero (i.e. all free) until first
+	 * written, so a sparse file never allocates storage for the parts we
+	 * haven't used. */
 	super = mapping;
-	inode_bitmap = (void*)((char*)mapping + BLOCK_SIZE);
-	inode_bitmap_end = (void*)((char*)mapping + 2*BLOCK_SIZE);
-	data_bitmap = inode_bitmap_end;
-	data_bitmap_end = (void*)((char*)mapping + 3*BLOCK_SIZE);
-	inodes = (void*)data_bitmap_end;
-	inodes_end = (void*)((char*)mapping + START_BLOCKS_RESERVED*BLOCK_SIZE);
-	data_blocks = (void*) inodes_end;
-	data_blocks_end = data_blocks + super->num_data_blocks;
-	if (statbuf.st_blocks == 0)
+	inode_bitmap = (void*)((char*)mapping + (size_t) inode_bitmap_start * BLOCK_SIZE);
+	inode_bitmap_end = inode_bitmap + (num_inodes + BITMAP_WORD_NBITS - 1) / BITMAP_WORD_NBITS;
+	data_bitmap = (void*)((char*)mapping + (size_t) data_bitmap_start * BLOCK_SIZE);
+	data_bitmap_end = data_bitmap + (expected_super.num_data_blocks + BITMAP_WORD_NBITS - 1) / BITMAP_WORD_NBITS;
+	inodes = (void*)((char*)mapping + (size_t) inode_table_start * BLOCK_SIZE);
+	inodes_end = inodes + num_inodes;
+	data_blocks = (void*)((char*)mapping + (size_t) data_start * BLOCK_SIZE);
+	data_blocks_end = data_blocks + expected_super.num_data_blocks;
+	if (features & VSFS_FEATURE_REFCOUNTS)
+	{
+		refcounts = (uint8_t *) mapping + (size_t) expected_super.refcount_start * BLOCK_SIZE;
+	}
+	if (vsfs_backend == VSFS_BACKEND_PREAD)
+	{
+		bcache_open(backing_file_name, (uint64_t) data_start * BLOCK_SIZE);
+		cached_data = 1;
+	}
+	/* we read ahead of sequential readers ourselves; see readahead */
+	if (vsfs_readahead_max)
+	{
+		uintptr_t from = ROUND_DOWN_TO(page_size, (uintptr_t) data_blocks);
+		madvise((void *) from, (uintptr_t) data_blocks_end - from, MADV_RANDOM);
+	}
+	inode_lock_nchunks = (num_inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+	inode_lock_chunks = calloc(inode_lock_nchunks, sizeof *inode_lock_chunks);
+	if (!inode_lock_chunks) err(EXIT_FAILURE, "allocating inode locks");
+	allocator_init(&inode_allocator, inode_bitmap, num_inodes, fresh);
+	allocator_init(&data_allocator, data_bitmap, expected_super.num_data_blocks, fresh);
+	if (fresh)
 	{
 		debug_printf(0, "detected a zeroed sparse backing file; initializing a fresh vsfs\n");
 		*super = expected_super;
-		/* Manually create the root directory also, using inode 0 and data block 0 */
-		struct inode *root = inode_alloc();
-		root->ftype = VSF_DIR;
-		data_block_t *d = data_alloc();
+		journal_dirty(super, sizeof *super);
+		/* Manually create the root directory also, using inode 0 and data block 0.
+		 * A fixed-format directory starts with a single null entry; a compact
+		 * one starts empty. */
+		_Bool claimed_root = allocator_claim(&inode_allocator, 0) && allocator_claim(&data_allocator, 0);
+		assert(claimed_root);
+		data_block_t *d = &data_blocks[0];
+		journal_fresh(d);
 		inodes[0] = (struct inode) {
 			.ftype = VSF_DIR,
-			.size = sizeof (struct dirent), /* a single null entry */
-			.direct[0] = d - data_blocks, /* NB blocks are numbered from start of data blocks */
+			.size = compact_dirents() ? 0 : sizeof (struct dirent),
+			.extents[0] = { .file_block = 0, .start = d - data_blocks, .len = 1 },
+			.nextents = 1,
 			.nblocks = 1
 		};
+		inode_dirty(&inodes[0]);
 		assert(inodes[0].refcount == 0);
 		struct dirent *d1 = append_dir_entry(&inodes[0], &inodes[0], ".");
 		assert(d1);
@@ -122,296 +401,4503 @@ void vsfs_init(const char *backing_file_name, size_t expected_size)
 		assert(d2);
 		assert(inodes[0].refcount == 2);
 		debug_printf(0, "created '..' directory entry\n");
+		super_counts_update();
+		journal_sync();
+	}
+	else debug_printf(1, "superblock matched OK\n");
+	if (!fresh && refcounts && super->restoring)
+	{
+		/* a restore was cut short; finish it */
+		debug_printf(0, "finishing the restore of snapshot %u\n", (unsigned) super->restoring - 1);
+		snapshot_rollback(super->restoring - 1);
+		super->restoring = 0;
+		journal_dirty(super, sizeof *super);
+		journal_sync();
 	}
-	else if (0 == memcmp(super, &expected_super, sizeof *super))
+	if (!fresh && refcounts) snapshot_load_pinned();
+	if (!fresh && (features & VSFS_FEATURE_FREE_COUNTS)
+		&& (super->nfree_inodes != allocator_nfree(&inode_allocator)
+			|| super->nfree_data_blocks != allocator_nfree(&data_allocator)))
 	{
-		debug_printf(1, "superblock matched OK\n");
+		/* e.g. after a crash without a journal; the next commit fixes them */
+		debug_printf(0, "superblock free counts (%u inodes, %u data blocks) disagree with the bitmaps; correcting\n",
+			(unsigned) super->nfree_inodes, (unsigned) super->nfree_data_blocks);
+		super_counts_update();
 	}
-	else errx(EXIT_FAILURE, "superblock check failed");
 
 	debug_printf(1, "opened the vsfs successfully \n");
-	fclose(f);
 }
 
 __attribute__((destructor))
 static void vsfs_deinit(void)
 {
+	write_buffer_flush_all();
+	write_buffers_deinit();
+	/* file data first, then the metadata that points at it */
+	bcache_close();
+	if (super) super_counts_update();
+	journal_close();
+	bmap_cache_deinit();
+	cluster_cache_deinit();
+	dcache_deinit();
+	for (unsigned long n = 0; n < inode_lock_nchunks; ++n) free(inode_lock_chunks[n]);
+	free(inode_lock_chunks);
+	free(inode_allocator.groups);
+	free(data_allocator.groups);
+	free(pinned);
 	if (mapping) munmap(mapping, mapping_size);
+	if (backing_file) fclose(backing_file);
 }
 
-static struct inode *inode_alloc(void)
+uint32_t vsfs_features(void)
+{
+	return super->features;
+}
+struct inode *vsfs_inode(unsigned idx)
 {
-	unsigned idx = bitmap_find_first_clear(inode_bitmap, inode_bitmap_end, NULL);
-	if (idx == -1 || idx >= super->num_inodes) return NULL;
-	bitmap_set(inode_bitmap, idx);
+	if (idx >= super->num_inodes) return NULL;
 	return &inodes[idx];
 }
-static void *data_alloc(void)
+
+static pthread_rwlock_t *inode_lock(struct inode *i)
 {
-	unsigned idx = bitmap_find_first_clear(data_bitmap, data_bitmap_end, NULL);
-	if (idx == -1 && idx >= super->num_data_blocks) return NULL;
-	bitmap_set(data_bitmap, idx);
-	return &data_blocks[idx];
+	unsigned long n = i - inodes;
+	pthread_rwlock_t **slot = &inode_lock_chunks[n / INODES_PER_BLOCK];
+	pthread_rwlock_t *chunk = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (!chunk)
+	{
+		/* If another thread beats us to it, use its chunk instead. */
+		pthread_rwlock_t *made = malloc(INODES_PER_BLOCK * sizeof *made);
+		if (!made) err(EXIT_FAILURE, "allocating inode locks");
+		for (unsigned k = 0; k < INODES_PER_BLOCK; ++k) pthread_rwlock_init(&made[k], NULL);
+		if (__atomic_compare_exchange_n(slot, &chunk, made, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) chunk = made;
+		else free(made);
+	}
+	return &chunk[n % INODES_PER_BLOCK];
 }
-static void inode_free(struct inode *i)
+static void inode_rdlock(struct inode *i) { pthread_rwlock_rdlock(inode_lock(i)); }
+static void inode_wrlock(struct inode *i) { pthread_rwlock_wrlock(inode_lock(i)); }
+static void inode_unlock(struct inode *i) { pthread_rwlock_unlock(inode_lock(i)); }
+
+static unsigned long group_nbits(struct allocator *a, unsigned g)
 {
-	bitmap_clear(inode_bitmap, i - inodes);
+	unsigned long first_bit = g * a->words_per_group * BITMAP_WORD_NBITS;
+	unsigned long end_bit = first_bit + a->words_per_group * BITMAP_WORD_NBITS;
+	return ((end_bit > a->nbits) ? a->nbits : end_bit) - first_bit;
 }
-static void data_free(void *pos)
+/* If 'all_free', the bitmap is known to be all clear, and needn't be read;
+ * otherwise we count each group's free bits. */
+static void allocator_init(struct allocator *a, bitmap_word_t *bitmap, unsigned long nbits, _Bool all_free)
 {
-	bitmap_clear(data_bitmap, (data_block_t *) pos - data_blocks);
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	a->bitmap = bitmap;
+	a->nbits = nbits;
+	a->nwords = (nbits + BITMAP_WORD_NBITS - 1) / BITMAP_WORD_NBITS;
+	a->ngroups = (ncpus < 1) ? 1 : (ncpus > a->nwords) ? a->nwords : ncpus;
+	a->words_per_group = (a->nwords + a->ngroups - 1) / a->ngroups;
+	a->ngroups = (a->nwords + a->words_per_group - 1) / a->words_per_group;
+	free(a->groups);
+	a->groups = aligned_alloc(sizeof *a->groups, a->ngroups * sizeof *a->groups);
+	if (!a->groups) err(EXIT_FAILURE, "allocating allocation groups");
+	for (unsigned g = 0; g < a->ngroups; ++g)
+	{
+		unsigned long first_bit = g * a->words_per_group * BITMAP_WORD_NBITS;
+		long n = group_nbits(a, g);
+		if (!all_free) n -= bitmap_count_set(a->bitmap, a->bitmap + a->nwords, first_bit, first_bit + n);
+		a->groups[g] = (struct alloc_group) { .cursor = g * a->words_per_group, .nfree = n };
+	}
 }
-static data_block_t *get_data_block(struct inode *i, unsigned byte_offset)
+static long group_nfree(struct allocator *a, unsigned g)
 {
-	if (byte_offset >= i->size) return NULL;
-	if (byte_offset >= NDIRECT * BLOCK_SIZE) return NULL;
-	return &data_blocks[i->direct[byte_offset / BLOCK_SIZE]];
-	/* TODO: support indirect blocks etc */
+	return __atomic_load_n(&a->groups[g].nfree, __ATOMIC_RELAXED);
 }
-/* Grow the file's block allocation s.t. it can hold at least 'len' bytes.
- * NOTE: does not update the file's 'size' field! Do this after writing the
- * data to any newly allocated space. */
-static _Bool ensure_allocated_length(struct inode *i, unsigned len)
+/* Free objects, as the groups count them; O(ngroups). Concurrent claims
+ * and frees may make it a moment out of date, but never wrong for long. */
+static unsigned long allocator_nfree(struct allocator *a)
 {
-	if (BLOCK_SIZE * i->nblocks >= len) return 1;
-	/* TODO: support growing */
-	/* XXX: must zero any fresh length allocated */
-	return 0;
+	long n = 0;
+	for (unsigned g = 0; g < a->ngroups; ++g) n += group_nfree(a, g);
+	return (n < 0) ? 0 : n;
 }
-
-static struct dirent *find_dirent_by_name(struct inode *inode, const char *name);
-
-/* Directories are arrays of dirents, terminated by
- * an all-zero dirent. It follows that directories
- * always have one or more blocks allocated to them and
- * are always `sizeof (struct dirent)` bytes or larger. */
-static struct dirent *append_dir_entry(struct inode *dir, struct inode *tgt, const char *string)
+/* Bits of word 'w' that stand for real objects, i.e. not beyond the end. */
+static bitmap_word_t usable_bits(struct allocator *a, unsigned long w)
 {
-	/* fail if there is already an entry with this name */
-	if (find_dirent_by_name(dir, string)) return NULL;
-	/* the empty name is not allowed */
-	if (!string[0]) return NULL;
-	unsigned initial_nentries_incl_terminator = dir->size / sizeof (struct dirent);
-	assert(initial_nentries_incl_terminator >= 1);
-	_Bool success = ensure_allocated_length(dir,
-		1 + initial_nentries_incl_terminator * sizeof (struct dirent));
-	if (!success) return NULL;
-	/* The last entry should be a null entry. */
-	data_block_t *data_block = get_data_block(dir, ROUND_DOWN_TO(BLOCK_SIZE,
-		(initial_nentries_incl_terminator - 1) * sizeof (struct dirent)));
-	char *data = (char*) data_block;
-	unsigned byte_offset = ((initial_nentries_incl_terminator  - 1)
-		* sizeof (struct dirent)) % BLOCK_SIZE;
-	assert(byte_offset + sizeof (struct dirent) <= BLOCK_SIZE);
-	struct dirent null_dirent;
-	bzero(&null_dirent, sizeof null_dirent);
-	assert(0 == memcmp(data + byte_offset, &null_dirent, sizeof null_dirent));
-	/* Write our directory entry into the null entry; we know that the
-	 * remaining allocated length of the file was zeroed when we grew it, so
-	 * we have a terminator following us already. */
-	struct dirent *d = (struct dirent *)(data + byte_offset);
-	*d = (struct dirent) {
-		.present = 1,
-		.inode_num = tgt - inodes
-	};
-	++tgt->refcount;
-	dir->size += sizeof (struct dirent);
-	strncpy(d->name, string, MAX_NAME_LEN);
-	d->name[MAX_NAME_LEN-1] = '\0'; // ensure the buffer is null-terminated
-	return d;
+	if (w < a->nbits / BITMAP_WORD_NBITS) return (bitmap_word_t) -1;
+	return BOTTOM_N_BITS_SET(a->nbits % BITMAP_WORD_NBITS);
 }
-/* public functions */
-
-struct inode *vsfs_creat(struct inode *dir, const char *name)
+static struct alloc_group *group_of(struct allocator *a, unsigned long idx)
 {
-#warning "creat is unimplemented"
-	/* Create an empty regular file, and make a new directory entry
-	 * pointing at it. */
-	return NULL;
+	return &a->groups[idx / BITMAP_WORD_NBITS / a->words_per_group];
 }
-struct inode *vsfs_mkdir(struct inode *dir, const char *name)
+static unsigned home_group(struct allocator *a)
 {
-#warning "mkdir is unimplemented"
-	/* Create an empty directory, and make a new directory entry
-	 * pointing at it. Also create its '.' and '..' entries. */
-	return NULL;
+	int cpu = sched_getcpu();
+	return (cpu < 0) ? 0 : cpu % a->ngroups;
 }
-struct inode *vsfs_rmdir(struct inode *dir)
+static unsigned long group_alloc(struct allocator *a, unsigned g)
 {
-#warning "rmdir is unimplemented"
-	return NULL; /* return the parent directory inode on success */
+	struct alloc_group *grp = &a->groups[g];
+	unsigned long first = g * a->words_per_group;
+	unsigned long end = first + a->words_per_group;
+	if (end > a->nwords) end = a->nwords;
+	unsigned long start = __atomic_load_n(&grp->cursor, __ATOMIC_RELAXED);
+	if (start < first || start >= end) start = first;
+	unsigned long w = start;
+	do
+	{
+		int bit = bitmap_word_claim_first_clear(&a->bitmap[w], usable_bits(a, w));
+		if (bit != -1)
+		{
+			journal_dirty(&a->bitmap[w], sizeof a->bitmap[w]);
+			__atomic_store_n(&grp->cursor, w, __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&grp->nfree, 1, __ATOMIC_RELAXED);
+			return w * BITMAP_WORD_NBITS + bit;
+		}
+		if (++w == end) w = first;
+	} while (w != start);
+	/* other threads took the last ones while we scanned */
+	return -1;
 }
-unsigned long vsfs_truncate(struct inode *i, unsigned long sz)
+/* Allocate from the home group, else steal from the others in turn. */
+static unsigned long allocator_alloc(struct allocator *a)
 {
-#warning "truncate is mostly unimplemented"
-	/* Give regular file 'i' the size 'sz'. */
-	if (i->ftype != VSF_FILE) return (unsigned long) -1; // error!
-	if (sz > i->size)
+	unsigned home = home_group(a);
+	for (unsigned n = 0; n < a->ngroups; ++n)
 	{
-		// TODO: grow the file
+		unsigned g = (home + n) % a->ngroups;
+		if (group_nfree(a, g) <= 0) continue;
+		unsigned long idx = group_alloc(a, g);
+		if (idx != -1) return idx;
 	}
-	else if (sz < i->size)
+	/* A count may have been read just before a free, so look everywhere
+	 * before giving up. */
+	for (unsigned g = 0; g < a->ngroups; ++g)
 	{
-		// TODO: shrink the file
+		unsigned long idx = group_alloc(a, g);
+		if (idx != -1) return idx;
 	}
-	return i->size;
+	return -1;
 }
-long vsfs_read(struct inode *f, unsigned long offset, char *buf, unsigned long sz)
+/* Allocate exactly 'idx', if it is free. */
+static _Bool allocator_claim(struct allocator *a, unsigned long idx)
 {
-#warning "read is unimplemented"
-	return 0;
+	if (idx >= a->nbits || bitmap_test_and_set(a->bitmap, idx)) return 0;
+	journal_dirty(&a->bitmap[idx / BITMAP_WORD_NBITS], sizeof (bitmap_word_t));
+	__atomic_sub_fetch(&group_of(a, idx)->nfree, 1, __ATOMIC_RELAXED);
+	return 1;
 }
-long vsfs_write(struct inode *f, unsigned long offset, const char *buf, unsigned long sz)
+/* Claim the free bits from 'idx' on, up to 'max' of them, stopping at the
+ * first that is taken. Returns how many we got. This costs one
+ * compare-and-swap per word, rather than one per bit. */
+static unsigned long allocator_claim_run(struct allocator *a, unsigned long idx, unsigned long max)
 {
-#warning "write is unimplemented"
-	return 0;
+	unsigned long n = 0;
+	if (idx >= a->nbits) return 0;
+	if (max > a->nbits - idx) max = a->nbits - idx;
+	while (n < max)
+	{
+		unsigned long w = (idx + n) / BITMAP_WORD_NBITS;
+		unsigned bit = (idx + n) % BITMAP_WORD_NBITS;
+		bitmap_word_t old = __atomic_load_n(&a->bitmap[w], __ATOMIC_RELAXED);
+		bitmap_word_t mask;
+		unsigned long k;
+		do
+		{
+			bitmap_word_t taken = old >> bit;
+			k = taken ? word_ctz(taken) : BITMAP_WORD_NBITS - bit;
+			if (k > max - n) k = max - n;
+			if (k == 0) return n;
+			mask = BOTTOM_N_BITS_SET(k) << bit;
+		} while (!__atomic_compare_exchange_n(&a->bitmap[w], &old, old | mask, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+		journal_dirty(&a->bitmap[w], sizeof a->bitmap[w]);
+		__atomic_sub_fetch(&group_of(a, idx + n)->nfree, k, __ATOMIC_RELAXED);
+		n += k;
+		if (bit + k < BITMAP_WORD_NBITS) break;
+	}
+	return n;
 }
-struct dirent *vsfs_link(struct inode *dir, struct inode *tgt, const char *name)
+static void allocator_free(struct allocator *a, unsigned long idx)
 {
-	return append_dir_entry(dir, tgt, name);
+	bitmap_clear(a->bitmap, idx);
+	journal_dirty(&a->bitmap[idx / BITMAP_WORD_NBITS], sizeof (bitmap_word_t));
+	__atomic_add_fetch(&group_of(a, idx)->nfree, 1, __ATOMIC_RELAXED);
 }
-struct dirent *vsfs_unlink(struct dirent *ent)
+
+static struct inode *inode_alloc(void)
 {
-#warning "unlink is unimplemented"
-	return NULL;
+	unsigned long idx = allocator_alloc(&inode_allocator);
+	if (idx == -1) return NULL;
+	return &inodes[idx];
 }
-struct inode *vsfs_lookup(struct inode *dir, const char *pathname)
+/* Allocate data block 'goal' if it is free, or failing that, any free data
+ * block. Block 0 always belongs to the root directory, so goal 0 means "no
+ * preference". Returns its number, or -1. */
+static unsigned long data_alloc_near(unsigned long goal)
 {
-#warning "lookup is unimplemented"
-	/* This is an iterated verson of `find_dirent_by_name`. Use strchr()
-	 * to iterate through the pathname. */
-	return NULL;
+	unsigned long idx = goal;
+	if (goal == 0 || !allocator_claim(&data_allocator, goal)) idx = allocator_alloc(&data_allocator);
+	return idx;
 }
-
-void dumpfs(void)
+/* Allocate up to 'want' physically contiguous data blocks, starting at
+ * 'goal' if we can, as data_alloc_near does. Sets *got to the number we got,
+ * which is at least one. Returns the first block's number, or -1. If
+ * 'journalled', we tell the journal that they are fresh; blocks that will
+ * hold cached file data (see file_block_get) are not journalled. */
+static unsigned long data_alloc_run(unsigned long goal, unsigned long want, unsigned long *got, _Bool journalled)
 {
-	struct superblock *super = mapping;
-	debug_printf(0, "--- begin vsfs dump\n");
-	debug_printf(0, "superblock:\n");
-	debug_printf(0, "   magic:   %c%c%c%c\n", super->magic[0], super->magic[1], super->magic[2], super->magic[3]);
-	debug_printf(0, "   fs size: %u\n", (unsigned) super->fs_size_in_bytes);
-	debug_printf(0, "   block size: %u\n", (unsigned) super->block_size_in_bytes);
-	debug_printf(0, "   num inodes: %u\n", (unsigned) super->num_inodes);
-	debug_printf(0, "   num data blocks: %u\n", (unsigned) super->num_data_blocks);
-	debug_printf(0, "   root dir inode: (always 0)\n");
-	debug_printf(0, "\ninode numbers in use: [");
-	_Bool printed = 0;
-#define print_it(idx) do { debug_printf(0, "%s%d", printed ? ", " : "", (int) idx); printed = 1; } while(0)
-	BITMAP_FOR_EACH_BIT_SET(inode_bitmap, inode_bitmap_end, print_it);
-	debug_printf(0, "]\n");
-
-	debug_printf(0, "\ndata blocks ('X' denotes a block in use):\n");
-	debug_printf(0, "                        ");
-	for (unsigned i = 0; i < 32-START_BLOCKS_RESERVED; ++i)
+	unsigned long first = data_alloc_near(goal);
+	if (first == -1) return -1;
+	*got = 1 + allocator_claim_run(&data_allocator, first + 1, want - 1);
+	for (unsigned long n = 0; journalled && n < *got; ++n) journal_fresh(&data_blocks[first + n]);
+	return first;
+}
+static unsigned long data_nfree(void)
+{
+	return allocator_nfree(&data_allocator);
+}
+/* Copy the groups' free counts into the superblock, if it keeps them. With a
+ * journal, this runs as each batch commits, so the copy on disk is that of
+ * the last commit; without one, at each sync. */
+static void super_counts_update(void)
+{
+	if (!(super->features & VSFS_FEATURE_FREE_COUNTS)) return;
+	uint32_t ninodes = allocator_nfree(&inode_allocator), nblocks = allocator_nfree(&data_allocator);
+	if (super->nfree_inodes == ninodes && super->nfree_data_blocks == nblocks) return;
+	super->nfree_inodes = ninodes;
+	super->nfree_data_blocks = nblocks;
+	journal_dirty(super, sizeof *super);
+}
+/* Blocks promised to buffered writes (see below), which other allocations
+ * must leave alone, lest a flush find no room for data we said we had
+ * written. */
+static unsigned long write_buffer_reserved;
+static void *data_alloc(void)
+{
+	unsigned long idx = data_alloc_near(0);
+	if (idx == -1) return NULL;
+	journal_fresh(&data_blocks[idx]);
+	return &data_blocks[idx];
+}
+static void inode_free(struct inode *i)
+{
+	allocator_free(&inode_allocator, i - inodes);
+}
+static void data_free_now(unsigned long blkno)
+{
+	allocator_free(&data_allocator, blkno);
+}
+/* With a journal, a freed block stays allocated until its batch commits;
+ * dirtying its bit now counts that change against the operation. */
+static void data_free_blkno(unsigned long blkno)
+{
+	if (cached_data) bcache_forget(blkno);
+	journal_dirty(&data_allocator.bitmap[blkno / BITMAP_WORD_NBITS], sizeof (bitmap_word_t));
+	if (!journal_free_later(&data_blocks[blkno], blkno)) data_free_now(blkno);
+}
+/* Record that we changed the inode, for the journal. */
+static void inode_dirty(struct inode *i)
+{
+	journal_dirty(i, sizeof *i);
+}
+static void data_free(void *pos)
+{
+	data_free_blkno((data_block_t *) pos - data_blocks);
+}
+/* Shared blocks. With VSFS_FEATURE_REFCOUNTS, a data block may be mapped by
+ * several files (see vsfs_clone), and held by snapshots (see vsfs_snapshot).
+ * Such a block must not be written in place: whoever would write it first
+ * gets a copy of their own (see make_private). Block 0 belongs to the root
+ * directory at first, and stays allocated for good, so that 0 can mean
+ * "none" even once the root directory has moved. */
+static _Bool block_shared(unsigned long blkno)
+{
+	return refcounts && (__atomic_load_n(&refcounts[blkno], __ATOMIC_RELAXED)
+		|| (pinned && bitmap_get(pinned, blkno)));
+}
+/* Count one more reference to each of the 'n' data blocks from 'blkno' on.
+ * Fails, having changed nothing, if any of them has as many as it can count. */
+static _Bool blocks_get(unsigned long blkno, unsigned long n)
+{
+	for (unsigned long b = blkno; b < blkno + n; ++b)
 	{
-		debug_printf(0, "[%c]", bitmap_get(data_bitmap, i) ? 'x' : ' ');
+		uint8_t old = __atomic_load_n(&refcounts[b], __ATOMIC_RELAXED);
+		do
+		{
+			if (old == UINT8_MAX)
+			{
+				while (b-- > blkno) __atomic_sub_fetch(&refcounts[b], 1, __ATOMIC_RELAXED);
+				return 0;
+			}
+		} while (!__atomic_compare_exchange_n(&refcounts[b], &old, old + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 	}
-	debug_printf(0, "\n");
-	for (unsigned i = 32-START_BLOCKS_RESERVED; i < TOTAL_BLOCKS - START_BLOCKS_RESERVED; ++i)
+	journal_dirty(&refcounts[blkno], n);
+	return 1;
+}
+/* Let go of 'n' data blocks from 'blkno' on. Each is freed only if nothing
+ * else has it: another file's reference is dropped instead, and a block that
+ * a snapshot holds stays allocated. */
+static void blocks_put(unsigned long blkno, unsigned long n)
+{
+	_Bool counted = 0;
+	for (unsigned long b = blkno; b < blkno + n; ++b)
 	{
-		debug_printf(0, "[%c]", bitmap_get(data_bitmap, i) ? 'x' : ' ');
+		if (refcounts)
+		{
+			uint8_t old = __atomic_load_n(&refcounts[b], __ATOMIC_RELAXED);
+			while (old && !__atomic_compare_exchange_n(&refcounts[b], &old, old - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+			if (old) { counted = 1; continue; }
+			if (pinned && bitmap_get(pinned, b)) continue;
+		}
+		data_free_blkno(b);
 	}
-	debug_printf(0, "\n\n");
-
-	debug_printf(0, "--- end vsfs dump\n");
+	if (counted) journal_dirty(&refcounts[blkno], n);
 }
-
-void dumpi(unsigned idx)
+/* The contents of regular files are read and written through these, so that
+ * they can live either in the mapping, like everything else, or with the
+ * pread backend, in the buffer cache. Get returns data block 'blkno', all of
+ * which the caller will overwrite if 'whole'; put says that the caller is done
+ * with it, having changed 'len' bytes at 'changed'. In between, a cached block
+ * is pinned. Cached blocks are never journalled (nor journal_fresh, lest the
+ * journal write the mapping's copy over them): they reach the image when
+ * evicted, and at vsfs_sync. */
+static char *file_block_get(unsigned long blkno, _Bool whole)
 {
-	struct inode *inode = &inodes[idx];
-
-	debug_printf(0, "inode %u:\n", idx);
-	debug_printf(0, "   type: %s\n", (inode->ftype == VSF_FREE) ? "free" :
-	                                 (inode->ftype == VSF_FILE) ? "regular file" :
-	                                 (inode->ftype == VSF_DIR) ? "directory" : "(invalid)");
-	debug_printf(0, "   links: %d\n", (int) inode->refcount);
-	debug_printf(0, "   size in bytes: %u\n", (unsigned) inode->size);
-	debug_printf(0, "   # blocks allocated: %u\n", (unsigned) inode->nblocks);
-	for (unsigned i = 0; i < NDIRECT; ++i)
+	if (cached_data) return bcache_get(blkno, whole);
+	return data_blocks[blkno];
+}
+static void file_block_put(unsigned long blkno, char *changed, unsigned long len)
+{
+	if (cached_data) bcache_put(blkno, len != 0);
+	else if (len) journal_dirty(changed, len);
+}
+/* Zero 'n' file blocks from 'start', which we have just allocated. */
+static void zero_file_blocks(unsigned long start, unsigned long n)
+{
+	if (!cached_data) bzero(&data_blocks[start], n * sizeof (data_block_t));
+	for (unsigned long k = 0; cached_data && k < n; ++k)
 	{
-		debug_printf(0, "   direct block %d: %u\n", (int) i, (unsigned) inode->direct[i]);
+		bzero(bcache_get(start + k, 1), BLOCK_SIZE);
+		bcache_put(start + k, 1);
 	}
 }
-
-enum cb_res_t for_each_data_block(struct inode *inode, block_cb_t *cb, uintptr_t arg)
+static _Bool is_zero_block(const char *p)
 {
-	enum cb_res_t res = 0;
-	for (unsigned i = 0; i < inode->nblocks; ++i)
+	return p[0] == 0 && 0 == memcmp(p, p + 1, BLOCK_SIZE - 1);
+}
+/* Whether the file's contents are compressed; see VSFS_INODE_COMPRESSED. */
+static _Bool is_compressed(struct inode *i)
+{
+	return i->ftype == VSF_FILE && (i->flags & VSFS_INODE_COMPRESSED);
+}
+/* Whether the file's contents live in its inode; see struct inode. A file
+ * whose contents were all zeroes still looks inline when promoted, until its
+ * write buffer is flushed; so while it has one, it is not inline. Nor is a
+ * compressed file, whose clusters of zeroes are holes. */
+static _Bool is_inline(struct inode *i)
+{
+	return (super->features & VSFS_FEATURE_INLINE_DATA) && i->ftype == VSF_FILE
+		&& i->nextents == 0 && i->size <= INLINE_DATA_MAX && !is_compressed(i);
+}
+/* Extents 0..NEXTENTS-1 live in the inode; the next EXTENTS_PER_BLOCK live
+ * in the indirect extent block; the rest live in the extent blocks named by
+ * the double-indirect block. We treat all of these as one array. */
+static struct extent *extent_at(struct inode *i, unsigned n)
+{
+	if (n < NEXTENTS) return &i->extents[n];
+	n -= NEXTENTS;
+	if (n < EXTENTS_PER_BLOCK)
 	{
-		uint16_t blocknum;
-		if (i < NDIRECT) blocknum = inode->direct[i];
-		else
-		{
-			// FIXME: support indirect blocks
-			err(EXIT_FAILURE, "ran past the end of direct blocks");
-		}
-		res = cb(&data_blocks[blocknum], i, arg);
-		if (res == VSF_STOP) return res;
+		assert(i->extent_indirect != 0);
+		return (struct extent *) &data_blocks[i->extent_indirect] + n;
 	}
-	return res;
+	n -= EXTENTS_PER_BLOCK;
+	assert(i->extent_dindirect != 0);
+	assert(n < BLOCKNUMS_PER_BLOCK * EXTENTS_PER_BLOCK);
+	uint32_t leaf = ((uint32_t *) &data_blocks[i->extent_dindirect])[n / EXTENTS_PER_BLOCK];
+	assert(leaf != 0);
+	return (struct extent *) &data_blocks[leaf] + (n % EXTENTS_PER_BLOCK);
+}
+static _Bool alloc_zeroed_blocknum(uint32_t *out)
+{
+	data_block_t *b = data_alloc();
+	if (!b) return 0;
+	bzero(b, sizeof *b);
+	*out = b - data_blocks;
+	journal_dirty(out, sizeof *out);
+	return 1;
+}
+/* Make sure the (in)direct blocks backing extent slot 'n' exist. */
+static _Bool ensure_extent_slot(struct inode *i, unsigned n)
+{
+	if (n < NEXTENTS) return 1;
+	n -= NEXTENTS;
+	if (n < EXTENTS_PER_BLOCK)
+	{
+		return i->extent_indirect || alloc_zeroed_blocknum(&i->extent_indirect);
+	}
+	n -= EXTENTS_PER_BLOCK;
+	if (n >= BLOCKNUMS_PER_BLOCK * EXTENTS_PER_BLOCK) return 0;
+	if (!i->extent_dindirect && !alloc_zeroed_blocknum(&i->extent_dindirect)) return 0;
+	uint32_t *leaf = &((uint32_t *) &data_blocks[i->extent_dindirect])[n / EXTENTS_PER_BLOCK];
+	return *leaf || alloc_zeroed_blocknum(leaf);
 }
 
-struct dirent_search_args
+/* The block-map cache. Walking a large file's extents on disk means chasing
+ * (double-)indirect blocks at every step of the binary search, so for files
+ * that have spilled out of the inode, we keep a decoded copy of the extent
+ * array in memory. Each entry also remembers the extent that served the last
+ * lookup, so that sequential access costs O(1) per block. The cache is
+ * direct-mapped by inode number; colliding inodes simply evict each other.
+ * Since colliding inodes may be locked by different threads, each entry has
+ * its own mutex, held by whoever is using or changing the entry. */
+struct bmap_cache_entry
 {
-	uintptr_t total_bytes_in_file;
-	const char *name;
-	struct dirent *out_result;
+	pthread_mutex_t lock;
+	struct inode *inode; /* null if the entry is unused */
+	unsigned nextents;
+	unsigned capacity;
+	unsigned last_hit;
+	struct extent *extents;
 };
-static enum cb_res_t find_dirent_by_name_in_one_block(data_block_t *block, unsigned block_idx_in_file,
-	uintptr_t arg)
+#define BMAP_CACHE_SIZE 64
+static struct bmap_cache_entry bmap_cache[BMAP_CACHE_SIZE] = {
+	[0 ... BMAP_CACHE_SIZE-1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static struct bmap_cache_entry *bmap_cache_slot(struct inode *i)
 {
-	struct dirent_search_args *args = (struct dirent_search_args *) arg;
-	unsigned bytes_remaining_in_file = args->total_bytes_in_file - BLOCK_SIZE * block_idx_in_file;
-	unsigned bytes_to_search_in_this_block = (bytes_remaining_in_file < BLOCK_SIZE) ? bytes_remaining_in_file : BLOCK_SIZE;
-	unsigned dirents_to_search = bytes_to_search_in_this_block / sizeof (struct dirent);
-	struct dirent *block_dirents = (struct dirent *) block;
-	for (unsigned i = 0; i < dirents_to_search; ++i)
+	return &bmap_cache[(i - inodes) % BMAP_CACHE_SIZE];
+}
+/* Copy extents [from, i->nextents) of the inode into its cache entry. */
+static _Bool bmap_cache_fill(struct bmap_cache_entry *c, unsigned from)
+{
+	struct inode *i = c->inode;
+	if (i->nextents > c->capacity)
 	{
-		if (0 == strncmp(block_dirents[i].name, args->name, MAX_NAME_LEN))
-		{
-			args->out_result = &block_dirents[i];
-			return VSF_STOP;
-		}
+		unsigned new_capacity = c->capacity ? c->capacity : 16;
+		while (new_capacity < i->nextents) new_capacity *= 2;
+		struct extent *new_extents = realloc(c->extents, new_capacity * sizeof *new_extents);
+		if (!new_extents) return 0;
+		c->extents = new_extents;
+		c->capacity = new_capacity;
 	}
-	return VSF_CONTINUE;
+	for (unsigned n = from; n < i->nextents; ++n) c->extents[n] = *extent_at(i, n);
+	c->nextents = i->nextents;
+	return 1;
 }
-
-static struct dirent *find_dirent_by_name(struct inode *inode, const char *name)
+/* Returns the inode's entry, locked, or null (and nothing locked). */
+static struct bmap_cache_entry *bmap_cache_get(struct inode *i)
 {
-	if (inode->ftype != VSF_DIR) return NULL;
-	struct dirent_search_args args = { .total_bytes_in_file = inode->size,
-		.name = name
-	};
-	enum cb_res_t res = for_each_data_block(inode, find_dirent_by_name_in_one_block,
-		(uintptr_t) &args);
-	if (res == VSF_STOP) return args.out_result;
-	return NULL;
+	struct bmap_cache_entry *c = bmap_cache_slot(i);
+	pthread_mutex_lock(&c->lock);
+	if (c->inode == i) return c;
+	c->inode = i;
+	c->last_hit = 0;
+	if (!bmap_cache_fill(c, 0))
+	{
+		c->inode = NULL;
+		pthread_mutex_unlock(&c->lock);
+		return NULL;
+	}
+	return c;
 }
-
-/* The following serve the command line, but need to access the inode table
- * or other structures private to this file. XXX: make it possible to link
- * against this. */
-
-void dumpd(unsigned idx)
+/* Call after changing extent 'n' onwards of a file. */
+static void bmap_cache_update(struct inode *i, unsigned n)
 {
-	debug_printf(0, "contents of file with inode %u, as a directory:\n", idx);
-	struct inode *inode = &inodes[idx];
-	if (inode->ftype != VSF_DIR) debug_printf(0, "(not a directory)");
-
-	for_each_data_block(inode, dump_one_block_as_dirents, inode->size);
+	struct bmap_cache_entry *c = bmap_cache_slot(i);
+	pthread_mutex_lock(&c->lock);
+	if (c->inode == i && (n > c->nextents || !bmap_cache_fill(c, n))) c->inode = NULL;
+	pthread_mutex_unlock(&c->lock);
 }
-
-void dumpf(unsigned idx)
+static void bmap_cache_invalidate(struct inode *i)
 {
-	debug_printf(0, "contents of file with inode %u, as raw bytes:\n", idx);
-	struct inode *inode = &inodes[idx];
-	if (inode->ftype == VSF_FREE) debug_printf(0, "inode is unallocated");
-
-	for_each_data_block(inode, dump_one_block_as_raw_data, inode->size);
+	struct bmap_cache_entry *c = bmap_cache_slot(i);
+	pthread_mutex_lock(&c->lock);
+	if (c->inode == i) c->inode = NULL;
+	pthread_mutex_unlock(&c->lock);
+}
+static void bmap_cache_deinit(void)
+{
+	for (unsigned n = 0; n < BMAP_CACHE_SIZE; ++n)
+	{
+		free(bmap_cache[n].extents);
+		bmap_cache[n].extents = NULL;
+		bmap_cache[n].inode = NULL;
+		bmap_cache[n].nextents = bmap_cache[n].capacity = 0;
+	}
 }
 
-struct dirent *lookupd(unsigned idx, const char *filename)
-{ return find_dirent_by_name(&inodes[idx], filename); }
-
-struct inode *creat(unsigned idx, const char *filename)
-{ return vsfs_creat(&inodes[idx], filename); }
+static inline _Bool extent_contains(struct extent *e, unsigned file_block)
+{
+	return file_block - e->file_block < e->len;
+}
+/* The length of the hole from 'file_block' up to extent 'next', or up to the
+ * largest file if there is no next extent. */
+static inline unsigned hole_run(unsigned file_block, struct extent *next)
+{
+	return next ? next->file_block - file_block : UINT32_MAX - file_block;
+}
+/* Binary search for the extent that maps block 'file_block' of the file.
+ * 'extents' is non-null if we have a decoded copy of the extent array. */
+static unsigned search_extents(struct inode *i, struct extent *extents, unsigned nextents,
+	unsigned file_block)
+{
+	/* Find the number of extents starting at or below file_block. */
+	unsigned lo = 0;
+	unsigned hi = nextents;
+	while (lo < hi)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		struct extent *e = extents ? &extents[mid] : extent_at(i, mid);
+		if (e->file_block <= file_block) lo = mid + 1;
+		else hi = mid;
+	}
+	/* The last of those is the only one that can contain it. */
+	return lo;
+}
+/* Translate block 'file_block' of the file to a data block number, or -1,
+ * using the block-map cache entry 'c', which the caller has locked. */
+static unsigned long map_file_block_cached(struct bmap_cache_entry *c, unsigned file_block,
+	unsigned *out_run)
+{
+	struct extent *e;
+	/* Try the last extent we hit, then its successor. */
+	if (c->last_hit < c->nextents && extent_contains(&c->extents[c->last_hit], file_block))
+	{
+		e = &c->extents[c->last_hit];
+	}
+	else if (c->last_hit + 1 < c->nextents && extent_contains(&c->extents[c->last_hit + 1], file_block))
+	{
+		e = &c->extents[++c->last_hit];
+	}
+	else
+	{
+		unsigned n = search_extents(c->inode, c->extents, c->nextents, file_block);
+		if (n == 0 || !extent_contains(&c->extents[n - 1], file_block))
+		{
+			if (out_run) *out_run = hole_run(file_block, (n < c->nextents) ? &c->extents[n] : NULL);
+			return -1;
+		}
+		c->last_hit = n - 1;
+		e = &c->extents[n - 1];
+	}
+	if (out_run) *out_run = e->len - (file_block - e->file_block);
+	return e->start + (file_block - e->file_block);
+}
+/* Translate block 'file_block' of the file to a data block number, or -1 if
+ * it lies in a hole. If 'out_run' is non-null, also say how many blocks from
+ * there on are physically contiguous, i.e. the rest of its extent; or, in a
+ * hole, how many blocks from there on are unmapped. */
+static unsigned long map_file_run(struct inode *i, unsigned file_block, unsigned *out_run)
+{
+	struct bmap_cache_entry *c = (i->nextents > NEXTENTS) ? bmap_cache_get(i) : NULL;
+	if (c)
+	{
+		unsigned long blkno = map_file_block_cached(c, file_block, out_run);
+		pthread_mutex_unlock(&c->lock);
+		return blkno;
+	}
+	unsigned n = search_extents(i, NULL, i->nextents, file_block);
+	struct extent *e = (n > 0) ? extent_at(i, n - 1) : NULL;
+	if (!e || !extent_contains(e, file_block))
+	{
+		if (out_run) *out_run = hole_run(file_block, (n < i->nextents) ? extent_at(i, n) : NULL);
+		return -1;
+	}
+	if (out_run) *out_run = e->len - (file_block - e->file_block);
+	return e->start + (file_block - e->file_block);
+}
+static unsigned long map_file_block(struct inode *i, unsigned file_block)
+{
+	return map_file_run(i, file_block, NULL);
+}
+static data_block_t *get_data_block(struct inode *i, unsigned byte_offset)
+{
+	if (byte_offset >= i->size) return NULL;
+	unsigned long blkno = map_file_block(i, byte_offset / BLOCK_SIZE);
+	if (blkno == -1) return NULL;
+	return &data_blocks[blkno];
+}
+/* A fresh copy of data block 'blkno', or 0. */
+static uint32_t block_copy(uint32_t blkno)
+{
+	data_block_t *copy = data_alloc();
+	if (!copy) return 0;
+	memcpy(copy, &data_blocks[blkno], sizeof *copy);
+	return copy - data_blocks;
+}
+/* Replace the block numbered *blkno, if a snapshot holds it, with a copy of
+ * our own. */
+static _Bool block_private(uint32_t *blkno)
+{
+	if (!*blkno || !block_shared(*blkno)) return 1;
+	uint32_t copy = block_copy(*blkno);
+	if (!copy) return 0;
+	blocks_put(*blkno, 1);
+	*blkno = copy;
+	journal_dirty(blkno, sizeof *blkno);
+	return 1;
+}
+/* Make sure that the blocks holding the file's extents are its own, before
+ * changing any of them. Clones get copies of them at once, so only a
+ * snapshot can share them. */
+static _Bool extents_private(struct inode *i)
+{
+	if (!pinned) return 1;
+	if (!block_private(&i->extent_indirect) || !block_private(&i->extent_dindirect)) return 0;
+	uint32_t *leaves = i->extent_dindirect ? (uint32_t *) &data_blocks[i->extent_dindirect] : NULL;
+	for (unsigned n = 0; leaves && n < BLOCKNUMS_PER_BLOCK && leaves[n]; ++n)
+	{
+		if (!block_private(&leaves[n])) return 0;
+	}
+	return 1;
+}
+/* Insert extent 'x' at 'pos' in the file's extent array, moving up those
+ * after it. */
+static _Bool insert_extent(struct inode *i, unsigned pos, struct extent x)
+{
+	if (!ensure_extent_slot(i, i->nextents)) return 0;
+	for (unsigned k = i->nextents; k > pos; --k)
+	{
+		struct extent *e = extent_at(i, k);
+		*e = *extent_at(i, k - 1);
+		journal_dirty(e, sizeof *e);
+	}
+	struct extent *e = extent_at(i, pos);
+	*e = x;
+	journal_dirty(e, sizeof *e);
+	++i->nextents;
+	return 1;
+}
+/* Map the 'n' data blocks from 'blkno' on as file blocks 'file_block'
+ * onwards, which must be a hole. We extend the preceding extent if the two
+ * are contiguous, both in the file and physically, and otherwise insert a
+ * new extent. */
+static _Bool insert_file_run(struct inode *i, unsigned file_block, unsigned blkno, unsigned n)
+{
+	if (!extents_private(i)) return 0;
+	unsigned pos = search_extents(i, NULL, i->nextents, file_block);
+	struct extent *prev = (pos > 0) ? extent_at(i, pos - 1) : NULL;
+	if (prev && prev->file_block + prev->len == file_block && prev->start + prev->len == blkno)
+	{
+		prev->len += n;
+		journal_dirty(prev, sizeof *prev);
+	}
+	else if (!insert_extent(i, pos, (struct extent) { .file_block = file_block, .start = blkno, .len = n }))
+	{
+		return 0;
+	}
+	if (file_block + n > i->nblocks) i->nblocks = file_block + n;
+	inode_dirty(i);
+	bmap_cache_update(i, prev ? pos - 1 : pos);
+	return 1;
+}
+/* Let go of every data block of the file, and the blocks holding its
+ * extents. */
+static void release_all_blocks(struct inode *i)
+{
+	/* inline data overlaps the extents */
+	if (is_inline(i)) bzero(i->inline_data, sizeof i->inline_data);
+	for (unsigned n = 0; n < i->nextents; ++n)
+	{
+		struct extent *e = extent_at(i, n);
+		blocks_put(e->start, e->len);
+	}
+	if (i->extent_dindirect)
+	{
+		uint32_t *leaves = (uint32_t *) &data_blocks[i->extent_dindirect];
+		for (unsigned n = 0; n < BLOCKNUMS_PER_BLOCK && leaves[n]; ++n) blocks_put(leaves[n], 1);
+		blocks_put(i->extent_dindirect, 1);
+	}
+	if (i->extent_indirect) blocks_put(i->extent_indirect, 1);
+	i->extent_indirect = i->extent_dindirect = 0;
+	i->nextents = 0;
+	i->nblocks = 0;
+	inode_dirty(i);
+	bmap_cache_invalidate(i);
+}
+/* Allocate up to 'want' blocks for the hole at file block 'file_block'
+ * onwards, in one run if we can. Returns the first block's number, having
+ * set *got to how many there are, or -1. The new blocks hold whatever they
+ * last held. */
+static unsigned long alloc_file_run(struct inode *i, unsigned file_block, unsigned long want, unsigned long *got)
+{
+	/* Try to allocate physically after the file's preceding block, so that
+	 * sequentially grown files stay in one extent. */
+	unsigned long goal = 0;
+	unsigned pos = search_extents(i, NULL, i->nextents, file_block);
+	if (pos > 0)
+	{
+		struct extent *prev = extent_at(i, pos - 1);
+		goal = prev->start + prev->len;
+	}
+	unsigned long start = data_alloc_run(goal, want, got, !(cached_data && i->ftype == VSF_FILE));
+	if (start == -1) return -1;
+	if (!insert_file_run(i, file_block, start, *got))
+	{
+		for (unsigned long n = 0; n < *got; ++n) data_free(&data_blocks[start + n]);
+		return -1;
+	}
+	return start;
+}
+/* Whether 'n' more blocks may be allocated, leaving alone those promised to
+ * buffered writes. */
+static _Bool may_allocate(unsigned long n)
+{
+	unsigned long reserved = __atomic_load_n(&write_buffer_reserved, __ATOMIC_RELAXED);
+	return !reserved || n + reserved <= data_nfree();
+}
+/* Grow the file's block allocation s.t. it can hold at least 'len' bytes.
+ * NOTE: does not update the file's 'size' field! Do this after writing the
+ * data to any newly allocated space. */
+static _Bool ensure_allocated_length(struct inode *i, unsigned long len)
+{
+	if ((uint64_t) BLOCK_SIZE * i->nblocks < len
+		&& !may_allocate((len + BLOCK_SIZE - 1) / BLOCK_SIZE - i->nblocks)) return 0;
+	while ((uint64_t) BLOCK_SIZE * i->nblocks < len)
+	{
+		unsigned long got;
+		unsigned long start = alloc_file_run(i, i->nblocks, (len + BLOCK_SIZE - 1) / BLOCK_SIZE - i->nblocks, &got);
+		if (start == -1) return 0;
+		/* fresh length must read as zeroes */
+		bzero(&data_blocks[start], got * sizeof (data_block_t));
+	}
+	return 1;
+}
+/* Give blocks to the holes among the blocks holding bytes [offset, end) of
+ * the file. The new blocks read as zeroes. */
+static _Bool ensure_mapped(struct inode *i, unsigned long offset, unsigned long end)
+{
+	unsigned long last = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (unsigned long b = offset / BLOCK_SIZE; b < last; )
+	{
+		unsigned run;
+		if (map_file_run(i, b, &run) != -1)
+		{
+			b += run;
+			continue;
+		}
+		unsigned long got, want = (run < last - b) ? run : last - b;
+		if (!may_allocate(want)) return 0;
+		unsigned long start = alloc_file_run(i, b, want, &got);
+		if (start == -1) return 0;
+		zero_file_blocks(start, got);
+		b += got;
+	}
+	return 1;
+}
+/* Map the 'n' data blocks from 'blkno' on as file blocks 'file_block'
+ * onwards, in place of the blocks there, which must all lie in one extent,
+ * splitting it as necessary. */
+static _Bool remap_file_run(struct inode *i, unsigned file_block, unsigned blkno, unsigned n)
+{
+	/* room for up to two more extents */
+	if (!extents_private(i) || !ensure_extent_slot(i, i->nextents) || !ensure_extent_slot(i, i->nextents + 1)) return 0;
+	unsigned pos = search_extents(i, NULL, i->nextents, file_block) - 1;
+	struct extent *e = extent_at(i, pos);
+	struct extent old = *e;
+	unsigned head = file_block - old.file_block, tail = old.len - head - n;
+	struct extent x = { .file_block = file_block, .start = blkno, .len = n };
+	if (head)
+	{
+		e->len = head;
+		insert_extent(i, ++pos, x);
+	}
+	else *e = x;
+	journal_dirty(e, sizeof *e);
+	if (tail)
+	{
+		insert_extent(i, pos + 1, (struct extent) {
+			.file_block = file_block + n,
+			.start = old.start + head + n,
+			.len = tail
+		});
+	}
+	inode_dirty(i);
+	bmap_cache_update(i, head ? pos - 1 : pos);
+	return 1;
+}
+/* Give file blocks 'file_block' onwards, which are the 'n' shared data
+ * blocks from 'blkno' on, copies of their own, except that blocks wholly
+ * within bytes [offset, end) are left for the caller to fill. */
+static _Bool copy_file_run(struct inode *i, unsigned file_block, unsigned long blkno, unsigned n,
+	unsigned long offset, unsigned long end)
+{
+	_Bool cached = cached_data && i->ftype == VSF_FILE;
+	while (n > 0)
+	{
+		if (!may_allocate(n)) return 0;
+		/* next to the preceding file block, if there is one */
+		unsigned long got, goal = file_block ? map_file_block(i, file_block - 1) + 1 : 0;
+		unsigned long start = data_alloc_run(goal, n, &got, !cached);
+		if (start == -1) return 0;
+		if (!remap_file_run(i, file_block, start, got))
+		{
+			for (unsigned long k = 0; k < got; ++k) data_free_blkno(start + k);
+			return 0;
+		}
+		for (unsigned long k = 0; k < got; ++k)
+		{
+			uint64_t first = (uint64_t) (file_block + k) * BLOCK_SIZE;
+			if (offset <= first && first + BLOCK_SIZE <= end) continue;
+			if (!cached)
+			{
+				memcpy(&data_blocks[start + k], &data_blocks[blkno + k], sizeof (data_block_t));
+				continue;
+			}
+			char *from = bcache_get(blkno + k, 0), *to = bcache_get(start + k, 1);
+			memcpy(to, from, BLOCK_SIZE);
+			bcache_put(start + k, 1);
+			bcache_put(blkno + k, 0);
+		}
+		blocks_put(blkno, got);
+		file_block += got;
+		blkno += got;
+		n -= got;
+	}
+	return 1;
+}
+/* Copy on write: before the caller writes bytes [offset, end) of the file,
+ * which must have blocks, give it its own copies of any there that it
+ * shares, with another file or a snapshot. */
+static _Bool make_private(struct inode *i, unsigned long offset, unsigned long end)
+{
+	if (!refcounts) return 1;
+	unsigned long last = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (unsigned long b = offset / BLOCK_SIZE; b < last; )
+	{
+		unsigned run;
+		unsigned long blkno = map_file_run(i, b, &run);
+		assert(blkno != -1);
+		if (run > last - b) run = last - b;
+		unsigned nprivate = 0, nshared = 0;
+		while (nprivate < run && !block_shared(blkno + nprivate)) ++nprivate;
+		while (nprivate + nshared < run && block_shared(blkno + nprivate + nshared)) ++nshared;
+		if (nshared && !copy_file_run(i, b + nprivate, blkno + nprivate, nshared, offset, end)) return 0;
+		b += nprivate + nshared;
+	}
+	return 1;
+}
+
+/* Take file blocks 'file_block' onwards, 'n' of them, all mapped, out of the
+ * file's extents, letting go of their data blocks. This may split an
+ * extent, so the caller makes sure that there is a slot for one more. */
+static void unmap_file_run(struct inode *i, unsigned file_block, unsigned n)
+{
+	while (n > 0)
+	{
+		unsigned pos = search_extents(i, NULL, i->nextents, file_block) - 1;
+		struct extent *e = extent_at(i, pos);
+		unsigned head = file_block - e->file_block, cut = e->len - head;
+		if (cut > n) cut = n;
+		unsigned tail = e->len - head - cut;
+		blocks_put(e->start + head, cut);
+		struct extent rest = { .file_block = file_block + cut, .start = e->start + head + cut, .len = tail };
+		if (head)
+		{
+			e->len = head;
+			journal_dirty(e, sizeof *e);
+			if (tail) insert_extent(i, pos + 1, rest);
+		}
+		else if (tail)
+		{
+			*e = rest;
+			journal_dirty(e, sizeof *e);
+		}
+		else
+		{
+			for (unsigned k = pos; k + 1 < i->nextents; ++k)
+			{
+				struct extent *x = extent_at(i, k);
+				*x = *extent_at(i, k + 1);
+				journal_dirty(x, sizeof *x);
+			}
+			--i->nextents;
+		}
+		bmap_cache_update(i, pos);
+		file_block += cut;
+		n -= cut;
+	}
+	struct extent *last = i->nextents ? extent_at(i, i->nextents - 1) : NULL;
+	i->nblocks = last ? last->file_block + last->len : 0;
+	inode_dirty(i);
+}
+
+/* Put the 'n' extents 'x' in place of the file's extents 'from' to 'to' - 1,
+ * moving those after them up or down to suit, in one pass. The caller makes
+ * sure that there are slots enough, and that the file blocks mapped stay the
+ * same. */
+static void splice_extents(struct inode *i, unsigned from, unsigned to, const struct extent *x, unsigned n)
+{
+	unsigned nextents = i->nextents - (to - from) + n;
+	if (from + n < to)
+	{
+		for (unsigned k = to; k < i->nextents; ++k)
+		{
+			struct extent *e = extent_at(i, k - (to - from - n));
+			*e = *extent_at(i, k);
+			journal_dirty(e, sizeof *e);
+		}
+	}
+	else if (from + n > to)
+	{
+		for (unsigned k = i->nextents; k-- > to; )
+		{
+			struct extent *e = extent_at(i, k + (from + n - to));
+			*e = *extent_at(i, k);
+			journal_dirty(e, sizeof *e);
+		}
+	}
+	for (unsigned k = 0; k < n; ++k)
+	{
+		struct extent *e = extent_at(i, from + k);
+		*e = x[k];
+		journal_dirty(e, sizeof *e);
+	}
+	i->nextents = nextents;
+	inode_dirty(i);
+	bmap_cache_update(i, from);
+}
+
+/* Compressed files; see VSFS_INODE_COMPRESSED in vsfs.h. We read and write
+ * them a cluster at a time. A write reads the cluster, unless it replaces
+ * all of it, changes it, and stores it afresh: in place if it needs as many
+ * blocks as before and shares none of them, and otherwise in new blocks, so
+ * that, as with make_private, nothing shared is written. A read decompresses
+ * the cluster, unless it is in the cluster cache.
+ *
+ * The cluster cache holds recently decompressed clusters, keyed by their
+ * first data block, and is direct-mapped by it, with a mutex per entry. Only
+ * cluster_write writes such a block, and it drops the key first; so does it
+ * for the first block of any cluster it stores, in case that block held
+ * some other cluster before being freed. Dropping a key bumps the cache's
+ * generation, so that the copies that threads keep for their spans (see
+ * file_spans) know to look again. */
+#define CLUSTER_SIZE (VSFS_CLUSTER_BLOCKS * BLOCK_SIZE)
+struct cluster_cache_entry
+{
+	pthread_mutex_t lock;
+	unsigned long blkno; /* 0 if the entry is unused */
+	char data[CLUSTER_SIZE];
+};
+#define CLUSTER_CACHE_SIZE 32
+static struct cluster_cache_entry cluster_cache[CLUSTER_CACHE_SIZE] = {
+	[0 ... CLUSTER_CACHE_SIZE-1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static unsigned long cluster_cache_generation;
+static struct cluster_cache_entry *cluster_cache_slot(unsigned long blkno)
+{
+	return &cluster_cache[blkno % CLUSTER_CACHE_SIZE];
+}
+static void cluster_cache_forget(unsigned long blkno)
+{
+	struct cluster_cache_entry *c = cluster_cache_slot(blkno);
+	pthread_mutex_lock(&c->lock);
+	if (c->blkno == blkno) c->blkno = 0;
+	pthread_mutex_unlock(&c->lock);
+	__atomic_add_fetch(&cluster_cache_generation, 1, __ATOMIC_RELEASE);
+}
+static void cluster_cache_deinit(void)
+{
+	for (unsigned n = 0; n < CLUSTER_CACHE_SIZE; ++n) cluster_cache[n].blkno = 0;
+	__atomic_add_fetch(&cluster_cache_generation, 1, __ATOMIC_RELEASE);
+}
+/* The data blocks of cluster 'c' of a compressed file, into 'blknos'.
+ * Returns how many there are. */
+static unsigned cluster_blocks(struct inode *f, unsigned long c, unsigned long *blknos)
+{
+	unsigned n = 0;
+	while (n < VSFS_CLUSTER_BLOCKS)
+	{
+		unsigned run;
+		unsigned long blkno = map_file_run(f, c * VSFS_CLUSTER_BLOCKS + n, &run);
+		if (blkno == -1) break;
+		for (; run > 0 && n < VSFS_CLUSTER_BLOCKS; --run) blknos[n++] = blkno++;
+	}
+	return n;
+}
+/* Decompress the cluster held in the 'n' data blocks 'blknos' into 'out'.
+ * Returns 0 if it is damaged. */
+static _Bool cluster_unpack(const unsigned long *blknos, unsigned n, char *out)
+{
+	struct cluster_cache_entry *c = cluster_cache_slot(blknos[0]);
+	pthread_mutex_lock(&c->lock);
+	_Bool hit = (c->blkno == blknos[0]);
+	if (hit) memcpy(out, c->data, CLUSTER_SIZE);
+	pthread_mutex_unlock(&c->lock);
+	if (hit) return 1;
+	/* straight from the mapping, if the blocks are contiguous there */
+	char gathered[(VSFS_CLUSTER_BLOCKS - 1) * BLOCK_SIZE];
+	const char *packed = data_blocks[blknos[0]];
+	if (cached_data || blknos[n - 1] != blknos[0] + n - 1)
+	{
+		for (unsigned k = 0; k < n; ++k)
+		{
+			char *p = file_block_get(blknos[k], 0);
+			memcpy(gathered + k * BLOCK_SIZE, p, BLOCK_SIZE);
+			file_block_put(blknos[k], NULL, 0);
+		}
+		packed = gathered;
+	}
+	uint32_t len;
+	memcpy(&len, packed, sizeof len);
+	if (len > n * BLOCK_SIZE - sizeof len
+		|| lz_decompress(packed + sizeof len, len, out, CLUSTER_SIZE) != CLUSTER_SIZE) return 0;
+	pthread_mutex_lock(&c->lock);
+	memcpy(c->data, out, CLUSTER_SIZE);
+	c->blkno = blknos[0];
+	pthread_mutex_unlock(&c->lock);
+	return 1;
+}
+/* Read all of cluster 'c' of compressed file 'f' into 'out'. Returns 0 if
+ * it is damaged. */
+static _Bool cluster_read(struct inode *f, unsigned long c, char *out)
+{
+	unsigned long blknos[VSFS_CLUSTER_BLOCKS];
+	unsigned n = cluster_blocks(f, c, blknos);
+	if (n == 0) bzero(out, CLUSTER_SIZE);
+	else if (n < VSFS_CLUSTER_BLOCKS) return cluster_unpack(blknos, n, out);
+	for (unsigned k = 0; k < n; ++k)
+	{
+		char *p = file_block_get(blknos[k], 0);
+		memcpy(out + k * BLOCK_SIZE, p, BLOCK_SIZE);
+		file_block_put(blknos[k], NULL, 0);
+	}
+	return 1;
+}
+/* Allocate 'n' data blocks for cluster 'c' of compressed file 'f', in one
+ * run after the file's preceding block if we can, into 'blknos', and make
+ * room in its extent array for them and for the split that unmapping the
+ * cluster's old blocks may cause. The blocks hold whatever they last held.
+ * Unless 'reserved', we leave alone blocks promised to buffered writes. */
+static _Bool cluster_alloc(struct inode *f, unsigned long c, unsigned n, unsigned long *blknos, _Bool reserved)
+{
+	unsigned long first = c * VSFS_CLUSTER_BLOCKS, goal = 0;
+	if (!extents_private(f)) return 0;
+	for (unsigned k = 0; k <= n; ++k) if (!ensure_extent_slot(f, f->nextents + k)) return 0;
+	if (n == 0) return 1;
+	if (!reserved && !may_allocate(n)) return 0;
+	unsigned pos = first ? search_extents(f, NULL, f->nextents, first - 1) : 0;
+	if (pos > 0)
+	{
+		struct extent *prev = extent_at(f, pos - 1);
+		goal = prev->start + ((first - prev->file_block < prev->len) ? first - prev->file_block : prev->len);
+	}
+	for (unsigned done = 0; done < n; )
+	{
+		unsigned long got, start = data_alloc_run(goal, n - done, &got, !cached_data);
+		if (start == -1)
+		{
+			while (done > 0) data_free_blkno(blknos[--done]);
+			return 0;
+		}
+		for (unsigned long k = 0; k < got; ++k) blknos[done++] = start + k;
+		goal = start + got;
+	}
+	return 1;
+}
+/* Store 'data', the whole of cluster 'c' of compressed file 'f', in place
+ * of what the cluster holds: compressed if that saves a block, as it is if
+ * not, and not at all if it is all zeroes. Fails, having changed nothing, if
+ * there is no room; 'reserved' is as for cluster_alloc. */
+static _Bool cluster_write(struct inode *f, unsigned long c, const char *data, _Bool reserved)
+{
+	char packed[(VSFS_CLUSTER_BLOCKS - 1) * BLOCK_SIZE];
+	const char *from = data;
+	unsigned nnew = 0;
+	for (unsigned k = 0; k < VSFS_CLUSTER_BLOCKS && !nnew; ++k) if (!is_zero_block(data + k * BLOCK_SIZE)) nnew = VSFS_CLUSTER_BLOCKS;
+	uint32_t len = nnew ? lz_compress(data, CLUSTER_SIZE, packed + sizeof len, sizeof packed - sizeof len) : 0;
+	if (len)
+	{
+		memcpy(packed, &len, sizeof len);
+		len += sizeof len;
+		nnew = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		bzero(packed + len, nnew * BLOCK_SIZE - len);
+		from = packed;
+	}
+	unsigned long old[VSFS_CLUSTER_BLOCKS], new[VSFS_CLUSTER_BLOCKS];
+	unsigned nold = cluster_blocks(f, c, old);
+	_Bool in_place = (nnew == nold);
+	for (unsigned k = 0; in_place && k < nold; ++k) in_place = !block_shared(old[k]);
+	/* In place, the blocks are journalled whole; if this step hasn't room
+	 * for that, fresh blocks, which the journal needn't log, will do, if
+	 * there are any beyond those promised to buffers. */
+	_Bool moved = in_place && journal_room() < nnew * journal_cost(BLOCK_SIZE) && cluster_alloc(f, c, nnew, new, 0);
+	if (moved) in_place = 0;
+	else if (in_place) memcpy(new, old, sizeof new);
+	else if (!cluster_alloc(f, c, nnew, new, reserved)) return 0;
+	if (nold) cluster_cache_forget(old[0]);
+	if (nnew && !in_place) cluster_cache_forget(new[0]);
+	for (unsigned k = 0; k < nnew; ++k)
+	{
+		char *p = file_block_get(new[k], 1);
+		memcpy(p, from + k * BLOCK_SIZE, BLOCK_SIZE);
+		file_block_put(new[k], p, BLOCK_SIZE);
+	}
+	if (in_place) return 1;
+	if (nold) unmap_file_run(f, c * VSFS_CLUSTER_BLOCKS, nold);
+	for (unsigned k = 0, run; k < nnew; k += run)
+	{
+		for (run = 1; k + run < nnew && new[k + run] == new[k] + run; ++run);
+		insert_file_run(f, c * VSFS_CLUSTER_BLOCKS + k, new[k], run);
+	}
+	return 1;
+}
+
+/* Directories come in one of two formats, chosen per filesystem.
+ *
+ * Without VSFS_FEATURE_COMPACT_DIRENTS, a directory is an array of fixed-size
+ * struct dirents, terminated by an all-zero dirent. It follows that such
+ * directories always have one or more blocks allocated to them and are always
+ * `sizeof (struct dirent)` bytes or larger.
+ *
+ * With it, a directory is a sequence of variable-length struct vdirent
+ * records, as described in vsfs.h. Its size is the offset just past its last
+ * record, so an empty directory has size zero (but still one block).
+ *
+ * Either way, we identify an entry by its byte offset in the directory. */
+static _Bool compact_dirents(void)
+{
+	return super->features & VSFS_FEATURE_COMPACT_DIRENTS;
+}
+static void *dir_bytes_at(struct inode *dir, unsigned pos)
+{
+	return (char *) get_data_block(dir, pos) + (pos % BLOCK_SIZE);
+}
+static uint32_t name_hash(const char *name, size_t len)
+{
+	/* 32-bit FNV-1a */
+	uint32_t h = 2166136261u;
+	for (size_t n = 0; n < len; ++n)
+	{
+		h ^= (unsigned char) name[n];
+		h *= 16777619u;
+	}
+	return h;
+}
+static _Bool entry_has_name(struct inode *dir, unsigned pos, const char *name, size_t len, uint32_t hash)
+{
+	if (compact_dirents())
+	{
+		struct vdirent *v = dir_bytes_at(dir, pos);
+		return v->hash == hash && v->name_len == len && 0 == memcmp(v->name, name, len);
+	}
+	struct dirent *d = dir_bytes_at(dir, pos);
+	return 0 == strncmp(d->name, name, MAX_NAME_LEN);
+}
+static unsigned entry_inode_num(struct inode *dir, unsigned pos)
+{
+	if (compact_dirents()) return ((struct vdirent *) dir_bytes_at(dir, pos))->inode_num;
+	return ((struct dirent *) dir_bytes_at(dir, pos))->inode_num;
+}
+/* Advance '*pos' to the next live entry at or after it, returning 0 if there
+ * is none. Live entries have a name; deleted ones and terminators do not. */
+static _Bool next_live_entry(struct inode *dir, unsigned *pos)
+{
+	while (*pos < dir->size)
+	{
+		if (compact_dirents())
+		{
+			struct vdirent *v = dir_bytes_at(dir, *pos);
+			if (v->rec_len == 0) { *pos = ROUND_UP_TO(BLOCK_SIZE, *pos + 1); continue; }
+			if (v->name_len != 0) return 1;
+			*pos += v->rec_len;
+		}
+		else
+		{
+			struct dirent *d = dir_bytes_at(dir, *pos);
+			if (d->present) return 1;
+			*pos += sizeof (struct dirent);
+		}
+	}
+	return 0;
+}
+static unsigned next_entry_pos(struct inode *dir, unsigned pos)
+{
+	if (compact_dirents()) return pos + ((struct vdirent *) dir_bytes_at(dir, pos))->rec_len;
+	return pos + sizeof (struct dirent);
+}
+/* Turn the entry into a hole, for a new entry to reuse, and free its index
+ * slot. A compact record joins the slack of the one before it in its block,
+ * if any. Call with the index, if any, writable (see dir_index_reserve). */
+static void delete_entry(struct inode *dir, unsigned pos)
+{
+	if (dir->dir_index) dir_index_remove(&inodes[dir->dir_index], entry_hash(dir, pos), pos);
+	unsigned hole = pos;
+	if (compact_dirents())
+	{
+		struct vdirent *v = dir_bytes_at(dir, pos);
+		unsigned prev = ROUND_DOWN_TO(BLOCK_SIZE, pos), next = prev;
+		while (next < pos)
+		{
+			struct vdirent *p = dir_bytes_at(dir, prev);
+			if (p->rec_len == 0 || (next = prev + p->rec_len) >= pos) break;
+			prev = next;
+		}
+		journal_dirty(v, VDIRENT_SIZE(v->name_len));
+		if (next == pos && prev < pos)
+		{
+			struct vdirent *p = dir_bytes_at(dir, prev);
+			p->rec_len += v->rec_len;
+			journal_dirty(p, sizeof *p);
+			bzero(v, VDIRENT_SIZE(v->name_len));
+			hole = prev;
+		}
+		else
+		{
+			bzero(v->name, v->name_len);
+			v->name_len = 0;
+			v->hash = 0;
+		}
+	}
+	else
+	{
+		bzero(dir_bytes_at(dir, pos), sizeof (struct dirent));
+		journal_dirty(dir_bytes_at(dir, pos), sizeof (struct dirent));
+	}
+	if (dir->dir_index && hole < room_hint(dir)) set_room_hint(dir, hole);
+}
+/* The public interface hands out struct dirents. For compact directories,
+ * that is a decoded copy, good until the calling thread's next call. */
+static struct dirent *dirent_view(struct inode *dir, unsigned pos)
+{
+	if (!compact_dirents()) return dir_bytes_at(dir, pos);
+	static _Thread_local struct dirent decoded;
+	struct vdirent *v = dir_bytes_at(dir, pos);
+	decoded = (struct dirent) { .present = (v->name_len != 0), .inode_num = v->inode_num };
+	memcpy(decoded.name, v->name, v->name_len);
+	decoded.name[v->name_len] = '\0';
+	return &decoded;
+}
+
+/* Room for a new entry: from offset 'pos' to 'end', taken from the slack
+ * after the record at 'split', unless that is UINT_MAX. 'pos' is UINT_MAX if
+ * there is none. */
+struct entry_room
+{
+	unsigned pos, end, split;
+};
+/* Whether the compact record 'v', at offset 'pos', has room for a new record
+ * of 'reclen' bytes after its name, if any; if so, says where in *room. A
+ * zero rec_len has the rest of its block. */
+static _Bool vdirent_room(struct vdirent *v, unsigned pos, unsigned reclen, struct entry_room *room)
+{
+	if (v->rec_len == 0)
+	{
+		unsigned end = ROUND_UP_TO(BLOCK_SIZE, pos + 1);
+		if (end - pos < reclen) return 0;
+		*room = (struct entry_room) { .pos = pos, .end = end, .split = UINT_MAX };
+		return 1;
+	}
+	unsigned used = v->name_len ? VDIRENT_SIZE(v->name_len) : 0;
+	if (v->rec_len - used < reclen) return 0;
+	*room = (struct entry_room) { .pos = pos + used, .end = pos + v->rec_len, .split = used ? pos : UINT_MAX };
+	return 1;
+}
+
+/* Linear search. We hand each contiguous run of the directory's blocks to
+ * a per-format scanning loop, which, if 'room_reclen' is nonzero, also finds
+ * the first room for a record that long on the way. */
+struct dirent_search_args
+{
+	uintptr_t total_bytes_in_file;
+	const char *name;
+	size_t len;
+	uint32_t hash;
+	unsigned out_pos;
+	unsigned room_reclen;
+	struct entry_room room;
+};
+static unsigned bytes_to_search_in_run(struct dirent_search_args *args, unsigned nblocks,
+	unsigned first_block_idx_in_file)
+{
+	if (BLOCK_SIZE * first_block_idx_in_file >= args->total_bytes_in_file) return 0;
+	unsigned bytes_remaining_in_file = args->total_bytes_in_file - BLOCK_SIZE * first_block_idx_in_file;
+	return (bytes_remaining_in_file < nblocks * BLOCK_SIZE) ? bytes_remaining_in_file : nblocks * BLOCK_SIZE;
+}
+static enum cb_res_t find_dirent_by_name_in_one_run(data_block_t *first_block, unsigned nblocks,
+	unsigned first_block_idx_in_file, uintptr_t arg)
+{
+	struct dirent_search_args *args = (struct dirent_search_args *) arg;
+	unsigned dirents_to_search = bytes_to_search_in_run(args, nblocks, first_block_idx_in_file)
+		/ sizeof (struct dirent);
+	struct dirent *block_dirents = (struct dirent *) first_block;
+	_Bool want_room = args->room_reclen && args->room.pos == UINT_MAX;
+	for (unsigned i = 0; i < dirents_to_search; ++i)
+	{
+		unsigned pos = BLOCK_SIZE * first_block_idx_in_file + i * sizeof (struct dirent);
+		/* any deleted entry but the terminator */
+		if (want_room && !block_dirents[i].present && pos + sizeof (struct dirent) < args->total_bytes_in_file)
+		{
+			args->room = (struct entry_room) { .pos = pos, .end = pos + sizeof (struct dirent), .split = UINT_MAX };
+			want_room = 0;
+		}
+		if (0 == strncmp(block_dirents[i].name, args->name, MAX_NAME_LEN))
+		{
+			args->out_pos = pos;
+			return VSF_STOP;
+		}
+	}
+	return VSF_CONTINUE;
+}
+/* The compact format's loop, specialised on 'find_room' so that a plain
+ * lookup pays nothing for the room search. */
+static inline enum cb_res_t scan_vdirents(struct dirent_search_args *args, char *base, unsigned bytes_to_search,
+	unsigned first_block_idx_in_file, _Bool find_room)
+{
+	unsigned off = 0;
+	while (off < bytes_to_search)
+	{
+		struct vdirent *v = (struct vdirent *)(base + off);
+		/* Most records have no room: a live one needs slack of at least a
+		 * new record besides its own, and the unused rest of a block, like a
+		 * deleted record, has no name. */
+		if (find_room && (v->name_len == 0 || v->rec_len >= args->room_reclen + VDIRENT_SIZE(1))
+			&& vdirent_room(v, BLOCK_SIZE * first_block_idx_in_file + off, args->room_reclen, &args->room))
+		{
+			find_room = 0;
+		}
+		/* a zero rec_len means the rest of this block is unused */
+		if (v->rec_len == 0) { off = ROUND_UP_TO(BLOCK_SIZE, off + 1); continue; }
+		if (v->hash == args->hash && v->name_len == args->len
+				&& 0 == memcmp(v->name, args->name, args->len))
+		{
+			args->out_pos = BLOCK_SIZE * first_block_idx_in_file + off;
+			return VSF_STOP;
+		}
+		off += v->rec_len;
+	}
+	return VSF_CONTINUE;
+}
+static enum cb_res_t find_vdirent_by_name_in_one_run(data_block_t *first_block, unsigned nblocks,
+	unsigned first_block_idx_in_file, uintptr_t arg)
+{
+	struct dirent_search_args *args = (struct dirent_search_args *) arg;
+	unsigned bytes_to_search = bytes_to_search_in_run(args, nblocks, first_block_idx_in_file);
+	if (args->room_reclen && args->room.pos == UINT_MAX)
+	{
+		return scan_vdirents(args, (char *) first_block, bytes_to_search, first_block_idx_in_file, 1);
+	}
+	return scan_vdirents(args, (char *) first_block, bytes_to_search, first_block_idx_in_file, 0);
+}
+
+/* Hashed directory index. The entries themselves remain the directory's
+ * contents, so code that knows nothing of the index still sees a flat list.
+ * Alongside them, a directory larger than one block gets an unnamed
+ * VSF_DIR_INDEX inode holding an open-addressed hash table from name hashes
+ * to entry offsets. We keep the table at most half full, doubling it and
+ * rehashing from the entries when it fills, so lookup and insert are O(1)
+ * expected. */
+_Bool vsfs_dir_index_enabled = 1;
+struct dir_index_slot
+{
+	uint32_t hash;
+	uint32_t pos_plus_one; /* 0 means the slot is empty */
+};
+/* Slot 0 is a header: its pos_plus_one field counts the table's entries, and
+ * its hash field is where to start looking for room for a new entry (see
+ * make_room_for_entry). Probes skip it. */
+#define DIR_INDEX_HEADER_SLOT 0
+#define DIR_INDEX_SLOTS_PER_BLOCK (BLOCK_SIZE / sizeof (struct dir_index_slot))
+
+static unsigned dir_index_nslots(struct inode *idx)
+{
+	return idx->size / sizeof (struct dir_index_slot);
+}
+static struct dir_index_slot *dir_index_slot(struct inode *idx, unsigned n)
+{
+	return (struct dir_index_slot *) get_data_block(idx, n * sizeof (struct dir_index_slot))
+		+ (n % DIR_INDEX_SLOTS_PER_BLOCK);
+}
+static void dir_index_insert(struct inode *idx, uint32_t hash, unsigned pos)
+{
+	unsigned mask = dir_index_nslots(idx) - 1;
+	for (unsigned n = hash & mask; ; n = (n + 1) & mask)
+	{
+		if (n == DIR_INDEX_HEADER_SLOT) continue;
+		struct dir_index_slot *s = dir_index_slot(idx, n);
+		if (!s->pos_plus_one)
+		{
+			*s = (struct dir_index_slot) { .hash = hash, .pos_plus_one = pos + 1 };
+			journal_dirty(s, sizeof *s);
+			struct dir_index_slot *header = dir_index_slot(idx, DIR_INDEX_HEADER_SLOT);
+			++header->pos_plus_one;
+			journal_dirty(header, sizeof *header);
+			return;
+		}
+	}
+}
+/* The offset of an entry, or of a block, from which to look for room for a
+ * new entry among an indexed directory's old ones: before it, what holes and
+ * slack there are were too small when last looked at. */
+static unsigned room_hint(struct inode *dir)
+{
+	return dir_index_slot(&inodes[dir->dir_index], DIR_INDEX_HEADER_SLOT)->hash;
+}
+static void set_room_hint(struct inode *dir, unsigned pos)
+{
+	struct dir_index_slot *header = dir_index_slot(&inodes[dir->dir_index], DIR_INDEX_HEADER_SLOT);
+	if (header->hash == pos) return;
+	header->hash = pos;
+	journal_dirty(header, sizeof *header);
+}
+/* Empty the slot for the entry at 'pos', if there is one. Each slot after it
+ * in the same cluster that a probe for its hash would pass the emptied slot
+ * to reach moves back into it, and so on, so that no probe stops short. */
+static void dir_index_remove(struct inode *idx, uint32_t hash, unsigned pos)
+{
+	unsigned mask = dir_index_nslots(idx) - 1, hole = hash & mask;
+	struct dir_index_slot *s = NULL;
+	for (unsigned k = 0; ; hole = (hole + 1) & mask, ++k)
+	{
+		if (k > mask) return;
+		if (hole == DIR_INDEX_HEADER_SLOT) continue;
+		s = dir_index_slot(idx, hole);
+		if (!s->pos_plus_one) return;
+		if (s->pos_plus_one == pos + 1) break;
+	}
+	for (unsigned n = (hole + 1) & mask; ; n = (n + 1) & mask)
+	{
+		if (n == DIR_INDEX_HEADER_SLOT) continue;
+		struct dir_index_slot *t = dir_index_slot(idx, n);
+		if (!t->pos_plus_one) break;
+		/* it stays if its probe starts after the hole, cyclically */
+		unsigned home = t->hash & mask;
+		if ((hole < n) ? (hole < home && home <= n) : (hole < home || home <= n)) continue;
+		*s = *t;
+		journal_dirty(s, sizeof *s);
+		s = t;
+		hole = n;
+	}
+	*s = (struct dir_index_slot) { 0 };
+	journal_dirty(s, sizeof *s);
+	struct dir_index_slot *header = dir_index_slot(idx, DIR_INDEX_HEADER_SLOT);
+	--header->pos_plus_one;
+	journal_dirty(header, sizeof *header);
+}
+static _Bool dir_index_lookup(struct inode *dir, const char *name, size_t len, uint32_t hash,
+	unsigned *out_pos)
+{
+	struct inode *idx = &inodes[dir->dir_index];
+	unsigned mask = dir_index_nslots(idx) - 1;
+	for (unsigned n = hash & mask; ; n = (n + 1) & mask)
+	{
+		if (n == DIR_INDEX_HEADER_SLOT) continue;
+		struct dir_index_slot *s = dir_index_slot(idx, n);
+		if (!s->pos_plus_one) return 0;
+		if (s->hash == hash && entry_has_name(dir, s->pos_plus_one - 1, name, len, hash))
+		{
+			*out_pos = s->pos_plus_one - 1;
+			return 1;
+		}
+	}
+}
+static uint32_t entry_hash(struct inode *dir, unsigned pos)
+{
+	if (compact_dirents()) return ((struct vdirent *) dir_bytes_at(dir, pos))->hash;
+	struct dirent *d = dir_bytes_at(dir, pos);
+	return name_hash(d->name, strnlen(d->name, MAX_NAME_LEN));
+}
+/* Whether a snapshot holds any of the file's data blocks. */
+static _Bool has_pinned_blocks(struct inode *i)
+{
+	for (unsigned n = 0; pinned && n < i->nextents; ++n)
+	{
+		struct extent *e = extent_at(i, n);
+		unsigned long b = bitmap_find_first_set1_geq(pinned, pinned + data_allocator.nwords, e->start, NULL);
+		if (b < e->start + e->len) return 1;
+	}
+	return 0;
+}
+/* Make sure the directory's index has room for 'more' more entries, creating
+ * it or growing it as necessary. We always build a bigger index in a new inode,
+ * on freshly allocated blocks, and then swap it in: that way the journal
+ * needs to log only the swap, not every slot. An index that a snapshot holds
+ * is rebuilt in the same way, rather than copied on write slot by slot. On
+ * failure, any existing index is left intact. */
+static _Bool dir_index_reserve(struct inode *dir, unsigned long more)
+{
+	struct inode *old = NULL;
+	unsigned nentries = 0;
+	if (dir->dir_index)
+	{
+		old = &inodes[dir->dir_index];
+		nentries = dir_index_slot(old, DIR_INDEX_HEADER_SLOT)->pos_plus_one;
+		if (dir_index_nslots(old) >= 2 * (nentries + more + 1) && !has_pinned_blocks(old)) return 1;
+	}
+	else
+	{
+		for (unsigned pos = 0; next_live_entry(dir, &pos); pos = next_entry_pos(dir, pos)) ++nentries;
+	}
+	struct inode *idx = inode_alloc();
+	if (!idx) return 0;
+	*idx = (struct inode) { .ftype = VSF_DIR_INDEX };
+	unsigned nslots = DIR_INDEX_SLOTS_PER_BLOCK;
+	while (nslots < 4 * (nentries + more + 1)) nslots *= 2;
+	/* the new blocks come zeroed, i.e. with every slot empty */
+	if (!ensure_allocated_length(idx, nslots * sizeof (struct dir_index_slot)))
+	{
+		idx->ftype = VSF_FREE;
+		release_all_blocks(idx);
+		inode_free(idx);
+		return 0;
+	}
+	idx->size = nslots * sizeof (struct dir_index_slot);
+	for (unsigned pos = 0; next_live_entry(dir, &pos); pos = next_entry_pos(dir, pos))
+	{
+		dir_index_insert(idx, entry_hash(dir, pos), pos);
+	}
+	if (old)
+	{
+		struct dir_index_slot *header = dir_index_slot(idx, DIR_INDEX_HEADER_SLOT);
+		header->hash = room_hint(dir);
+		journal_dirty(header, sizeof *header);
+	}
+	inode_dirty(idx);
+	dir->dir_index = idx - inodes;
+	inode_dirty(dir);
+	if (old)
+	{
+		old->ftype = VSF_FREE;
+		release_all_blocks(old);
+		inode_free(old);
+	}
+	return 1;
+}
+
+/* Find the entry called 'name', storing its offset in *out_pos. Failing
+ * that, if 'room' is not null, and the directory has no index, so that we
+ * search every entry, *room says where the first room for a record of
+ * 'reclen' bytes among them is. */
+static _Bool find_entry_or_room(struct inode *dir, const char *name, unsigned *out_pos, unsigned reclen,
+	struct entry_room *room)
+{
+	if (room) room->pos = UINT_MAX;
+	if (dir->ftype != VSF_DIR) return 0;
+	size_t len = strnlen(name, MAX_NAME_LEN);
+	uint32_t hash = name_hash(name, len);
+	if (dir->dir_index) return dir_index_lookup(dir, name, len, hash, out_pos);
+	struct dirent_search_args args = { .total_bytes_in_file = dir->size,
+		.name = name,
+		.len = len,
+		.hash = hash,
+		.room_reclen = room ? reclen : 0,
+		.room = { .pos = UINT_MAX }
+	};
+	enum cb_res_t res = for_each_data_run(dir, compact_dirents() ? find_vdirent_by_name_in_one_run
+		: find_dirent_by_name_in_one_run, (uintptr_t) &args);
+	if (res != VSF_STOP)
+	{
+		if (room) *room = args.room;
+		return 0;
+	}
+	*out_pos = args.out_pos;
+	return 1;
+}
+static _Bool find_entry(struct inode *dir, const char *name, unsigned *out_pos)
+{
+	return find_entry_or_room(dir, name, out_pos, 0, NULL);
+}
+static struct dirent *find_dirent_by_name(struct inode *inode, const char *name)
+{
+	unsigned pos;
+	if (!find_entry(inode, name, &pos)) return NULL;
+	return dirent_view(inode, pos);
+}
+
+/* Decide where a new entry of 'reclen' bytes goes, and make sure the
+ * directory has blocks there: in the first room among the old entries, which
+ * find_entry_or_room looked for in a directory without an index, and which
+ * we look for from room_hint on in one with; or else at the end. */
+static _Bool make_room_for_entry(struct inode *dir, unsigned reclen, struct entry_room *room)
+{
+	unsigned pos;
+	if (compact_dirents())
+	{
+		for (pos = dir->dir_index ? room_hint(dir) : dir->size; pos < dir->size && room->pos == UINT_MAX; )
+		{
+			struct vdirent *v = dir_bytes_at(dir, pos);
+			if (vdirent_room(v, pos, reclen, room)) break;
+			pos = v->rec_len ? pos + v->rec_len : ROUND_UP_TO(BLOCK_SIZE, pos + 1);
+		}
+		if (room->pos != UINT_MAX) return 1;
+		/* Records don't straddle blocks. If this one won't fit in the last
+		 * block, the rest of that block stays zero, i.e. unused. */
+		pos = dir->size;
+		if (pos % BLOCK_SIZE + reclen > BLOCK_SIZE) pos = ROUND_UP_TO(BLOCK_SIZE, pos);
+		if (!ensure_allocated_length(dir, pos + reclen)) return 0;
+	}
+	else
+	{
+		assert(dir->size >= sizeof (struct dirent));
+		/* any deleted entry but the terminator */
+		for (pos = dir->dir_index ? room_hint(dir) : dir->size; pos + sizeof (struct dirent) < dir->size
+			&& room->pos == UINT_MAX; pos += sizeof (struct dirent))
+		{
+			if (((struct dirent *) dir_bytes_at(dir, pos))->present) continue;
+			*room = (struct entry_room) { .pos = pos, .end = pos + sizeof (struct dirent), .split = UINT_MAX };
+		}
+		if (room->pos != UINT_MAX) return 1;
+		/* We overwrite the terminator, and need room for a new one after us. */
+		pos = dir->size - sizeof (struct dirent);
+		if (!ensure_allocated_length(dir, dir->size + 1)) return 0;
+		struct dirent null_dirent;
+		bzero(&null_dirent, sizeof null_dirent);
+		assert(0 == memcmp(dir_bytes_at(dir, pos), &null_dirent, sizeof null_dirent));
+	}
+	*room = (struct entry_room) { .pos = pos, .end = pos + reclen, .split = UINT_MAX };
+	return 1;
+}
+static struct dirent *append_dir_entry(struct inode *dir, struct inode *tgt, const char *string)
+{
+	/* names are truncated to fit a struct dirent */
+	char name[MAX_NAME_LEN];
+	strncpy(name, string, MAX_NAME_LEN);
+	name[MAX_NAME_LEN-1] = '\0'; // ensure the buffer is null-terminated
+	/* the empty name is not allowed */
+	if (!name[0]) return NULL;
+	/* fail if there is already an entry with this name */
+	size_t len = strlen(name);
+	unsigned pos, reclen = compact_dirents() ? VDIRENT_SIZE(len) : sizeof (struct dirent);
+	struct entry_room room;
+	if (find_entry_or_room(dir, name, &pos, reclen, &room)) return NULL;
+	if (!make_room_for_entry(dir, reclen, &room) || !make_private(dir, room.pos, room.pos + reclen)) return NULL;
+	pos = room.pos;
+	/* Once a directory outgrows a block, index it. If we can't grow an
+	 * existing index, we must fail, or it would go stale. */
+	if (dir->dir_index || (vsfs_dir_index_enabled && dir->nblocks > 1))
+	{
+		if (!dir_index_reserve(dir, 1) && dir->dir_index) return NULL;
+	}
+	/* Write our directory entry; we know that the remaining allocated length
+	 * of the file was zeroed when we grew it, so in the fixed-size format we
+	 * have a terminator following us already if we took the last one. */
+	uint32_t hash = name_hash(name, len);
+	if (compact_dirents())
+	{
+		if (room.split != UINT_MAX)
+		{
+			struct vdirent *p = dir_bytes_at(dir, room.split);
+			p->rec_len = pos - room.split;
+			journal_dirty(p, sizeof *p);
+		}
+		if (room.end > dir->size) dir->size = room.end;
+		struct vdirent *v = dir_bytes_at(dir, pos);
+		*v = (struct vdirent) {
+			.rec_len = room.end - pos,
+			.name_len = len,
+			.inode_num = tgt - inodes,
+			.hash = hash
+		};
+		memcpy(v->name, name, len);
+		journal_dirty(v, reclen);
+	}
+	else
+	{
+		if (room.end == dir->size) dir->size += sizeof (struct dirent);
+		struct dirent *d = dir_bytes_at(dir, pos);
+		*d = (struct dirent) {
+			.present = 1,
+			.inode_num = tgt - inodes
+		};
+		strcpy(d->name, name);
+		journal_dirty(d, sizeof *d);
+	}
+	/* The target may be another directory's entry too, so we don't hold its
+	 * lock; hence the atomic increment. */
+	__atomic_add_fetch(&tgt->refcount, 1, __ATOMIC_RELAXED);
+	inode_dirty(tgt);
+	inode_dirty(dir);
+	if (dir->dir_index)
+	{
+		dir_index_insert(&inodes[dir->dir_index], hash, pos);
+		/* what room there is before us was too small, and we may have left some */
+		set_room_hint(dir, (room.end > pos + reclen) ? pos : room.end);
+	}
+	dcache_insert(dir - inodes, name, tgt - inodes);
+	return dirent_view(dir, pos);
+}
+
+/* public functions */
+
+struct inode *vsfs_creat(struct inode *dir, const char *name)
+{
+	/* Create an empty regular file, and make a new directory entry
+	 * pointing at it. */
+	if (dir->ftype != VSF_DIR) return NULL;
+	journal_begin();
+	struct inode *i = inode_alloc();
+	if (!i)
+	{
+		journal_end();
+		return NULL;
+	}
+	*i = (struct inode) { .ftype = VSF_FILE };
+	inode_dirty(i);
+	inode_wrlock(dir);
+	struct dirent *d = append_dir_entry(dir, i, name);
+	inode_unlock(dir);
+	if (!d)
+	{
+		i->ftype = VSF_FREE;
+		inode_free(i);
+	}
+	journal_end();
+	return d ? i : NULL;
+}
+struct inode *vsfs_mkdir(struct inode *dir, const char *name)
+{
+#warning "mkdir is unimplemented"
+	/* Create an empty directory, and make a new directory entry
+	 * pointing at it. Also create its '.' and '..' entries. */
+	return NULL;
+}
+struct inode *vsfs_rmdir(struct inode *dir)
+{
+#warning "rmdir is unimplemented"
+	return NULL; /* return the parent directory inode on success */
+}
+unsigned long vsfs_truncate(struct inode *i, unsigned long sz)
+{
+#warning "truncate is mostly unimplemented"
+	/* Give regular file 'i' the size 'sz'. */
+	if (i->ftype != VSF_FILE) return (unsigned long) -1; // error!
+	/* file sizes are 32-bit */
+	if (sz > UINT32_MAX) return (unsigned long) -1;
+	journal_begin();
+	inode_wrlock(i);
+	struct write_buffer *wb = write_buffer_get(i, 0);
+	unsigned long size = file_size(i, wb);
+	if (sz > INLINE_DATA_MAX && !wb && is_inline(i) && !promote_inline(i))
+	{
+		/* no room for the block its contents need */
+		size = (unsigned long) -1;
+	}
+	else if (sz > size)
+	{
+		/* The new length is a hole: it has no blocks, and reads as zeroes.
+		 * Nothing past the end of a file is ever written, so the rest of
+		 * its last block reads as zeroes too. */
+		i->size = sz;
+		inode_dirty(i);
+		size = sz;
+	}
+	else if (sz < size)
+	{
+		// TODO: shrink the file
+	}
+	inode_unlock(i);
+	journal_end();
+	return size;
+}
+/* Move an inline file's contents out of its inode, into a block of its own,
+ * before it grows too big for the inode. Contents that are all zeroes need no
+ * block: they become a hole. Call with the file write-locked, inside
+ * journal_begin/end. */
+static _Bool promote_inline(struct inode *f)
+{
+	char data[INLINE_DATA_MAX];
+	unsigned long len = f->size;
+	memcpy(data, f->inline_data, sizeof data);
+	while (len > 0 && !data[len - 1]) --len;
+	/* the extents must start out empty */
+	bzero(f->inline_data, sizeof f->inline_data);
+	inode_dirty(f);
+	if (len == 0) return 1;
+	if (!ensure_mapped(f, 0, len))
+	{
+		memcpy(f->inline_data, data, sizeof data);
+		return 0;
+	}
+	unsigned long blkno = map_file_block(f, 0);
+	char *p = file_block_get(blkno, 0);
+	memcpy(p, data, len);
+	file_block_put(blkno, p, len);
+	return 1;
+}
+/* Write buffers, for delayed allocation. Data written past the blocks a
+ * file already has is not given blocks at once, but gathered in memory, in
+ * the file's write buffer; when the buffer is flushed, the blocks for all of
+ * it are allocated together, as one run if the free space allows. So many
+ * small appends cost one allocation, not one each, and files appended to
+ * side by side don't interleave their blocks.
+ *
+ * A buffer holds the file's bytes from 'start', a block boundary at or past
+ * the end of the file's last mapped block, so that there may be a hole
+ * before it. While a file has one, its size is the greater of its inode's
+ * 'size' and the end of the buffer. Buffers live in
+ * a hash table keyed by the inode, under its own lock, which is never held
+ * while taking an inode lock; a buffer's contents belong to the inode lock.
+ * Buffered data reaches the image only when it is flushed: once it would
+ * outgrow vsfs_write_buffer_max, or once all buffers together hold more than
+ * vsfs_write_buffer_total, on vsfs_sync, and at exit. */
+unsigned long vsfs_write_buffer_max = 1ul << 20;
+unsigned long vsfs_write_buffer_total = 64ul << 20;
+
+/* A write too big for one batch of the journal goes in steps (see
+ * journal_end_step). Each step overwrites at most a quarter of what it may
+ * log, or a block at the least, and the buffer that it may flush holds at
+ * most another quarter's worth of fresh blocks, whatever
+ * vsfs_write_buffer_max says; the rest is for the extents, bitmaps and
+ * inode that it changes. Call these at the start of a step. */
+static unsigned long write_step_max(void)
+{
+	size_t room = journal_room();
+	if (room == SIZE_MAX) return ULONG_MAX;
+	unsigned long nblocks = room / 4 / journal_cost(BLOCK_SIZE);
+	return (nblocks ? nblocks : 1) * BLOCK_SIZE;
+}
+static unsigned long write_buffer_max(void)
+{
+	size_t room = journal_room();
+	if (room == SIZE_MAX) return vsfs_write_buffer_max;
+	unsigned long max = room / 4 / journal_fresh_cost() * BLOCK_SIZE;
+	return (max < vsfs_write_buffer_max) ? max : vsfs_write_buffer_max;
+}
+
+struct write_buffer
+{
+	struct inode *inode;
+	struct write_buffer *next;
+	unsigned long start; /* file offset of data[0] */
+	char *data;
+	unsigned long len;
+	unsigned long capacity;
+	unsigned long nreserved; /* blocks promised to it */
+};
+#define WRITE_BUFFER_BUCKETS 256
+static struct write_buffer *write_buffers[WRITE_BUFFER_BUCKETS];
+static pthread_mutex_t write_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+/* so that files are read without taking the lock while nothing is buffered */
+static unsigned long nwrite_buffers;
+static unsigned long write_buffered_bytes;
+/* Dropped buffers, kept with their memory for reuse, since a big malloc
+ * costs a fresh mapping and a page fault per page. */
+#define WRITE_BUFFER_SPARES 16
+static struct write_buffer *spare_write_buffers;
+static unsigned nspare_write_buffers;
+
+static struct write_buffer **write_buffer_bucket(struct inode *f)
+{
+	return &write_buffers[(unsigned long) (f - inodes) % WRITE_BUFFER_BUCKETS];
+}
+/* The file's write buffer, made empty if 'create' and it has none (in which
+ * case the caller sets its start). */
+static struct write_buffer *write_buffer_get(struct inode *f, _Bool create)
+{
+	if (!create && !__atomic_load_n(&nwrite_buffers, __ATOMIC_ACQUIRE)) return NULL;
+	pthread_mutex_lock(&write_buffers_lock);
+	struct write_buffer **bucket = write_buffer_bucket(f);
+	struct write_buffer *wb = *bucket;
+	while (wb && wb->inode != f) wb = wb->next;
+	if (!wb && create)
+	{
+		if ((wb = spare_write_buffers))
+		{
+			spare_write_buffers = wb->next;
+			--nspare_write_buffers;
+		}
+		else wb = calloc(1, sizeof *wb);
+		if (wb)
+		{
+			wb->inode = f;
+			wb->next = *bucket;
+			*bucket = wb;
+			__atomic_add_fetch(&nwrite_buffers, 1, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&write_buffers_lock);
+	return wb;
+}
+/* Throw away the file's write buffer, if it has one. */
+static void write_buffer_drop(struct inode *f)
+{
+	pthread_mutex_lock(&write_buffers_lock);
+	struct write_buffer **pwb = write_buffer_bucket(f);
+	while (*pwb && (*pwb)->inode != f) pwb = &(*pwb)->next;
+	struct write_buffer *wb = *pwb;
+	if (wb)
+	{
+		*pwb = wb->next;
+		__atomic_sub_fetch(&nwrite_buffers, 1, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&write_buffered_bytes, wb->len, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&write_buffer_reserved, wb->nreserved, __ATOMIC_RELAXED);
+		*wb = (struct write_buffer) { .data = wb->data, .capacity = wb->capacity };
+		if (nspare_write_buffers < WRITE_BUFFER_SPARES)
+		{
+			wb->next = spare_write_buffers;
+			spare_write_buffers = wb;
+			++nspare_write_buffers;
+			wb = NULL;
+		}
+	}
+	pthread_mutex_unlock(&write_buffers_lock);
+	if (wb) free(wb->data);
+	free(wb);
+}
+/* Make the buffer 'len' long, and reserve the blocks it will need. Fails
+ * if memory or free blocks are short. The new length is not zeroed. */
+static _Bool write_buffer_resize(struct write_buffer *wb, unsigned long len)
+{
+	unsigned long nblocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (nblocks > wb->nreserved)
+	{
+		unsigned long more = nblocks - wb->nreserved;
+		if (__atomic_add_fetch(&write_buffer_reserved, more, __ATOMIC_RELAXED) > data_nfree())
+		{
+			__atomic_sub_fetch(&write_buffer_reserved, more, __ATOMIC_RELAXED);
+			return 0;
+		}
+		wb->nreserved = nblocks;
+	}
+	if (len > wb->capacity)
+	{
+		unsigned long capacity = wb->capacity ? wb->capacity : BLOCK_SIZE;
+		while (capacity < len) capacity *= 2;
+		char *data = realloc(wb->data, capacity);
+		if (!data) return 0;
+		wb->data = data;
+		wb->capacity = capacity;
+	}
+	__atomic_add_fetch(&write_buffered_bytes, len - wb->len, __ATOMIC_RELAXED);
+	wb->len = len;
+	return 1;
+}
+/* Store the buffered data of a compressed file, whose buffer starts at a
+ * cluster, a cluster at a time. Returns how much we stored. */
+static unsigned long write_buffer_flush_clusters(struct inode *f, struct write_buffer *wb)
+{
+	unsigned long done = 0;
+	while (done < wb->len)
+	{
+		unsigned long len = (wb->len - done < CLUSTER_SIZE) ? wb->len - done : CLUSTER_SIZE;
+		struct iovec iov = { .iov_base = wb->data + done, .iov_len = len };
+		if (!write_clusters(f, wb->start + done, wb->start + done + len, &iov, 0, 1)) break;
+		done += len;
+	}
+	return done;
+}
+/* Give the buffered data blocks, copy it into them and drop the buffer.
+ * If we run out of space, we keep what we couldn't place and return 0.
+ * Call with the file write-locked, inside journal_begin/end. */
+static _Bool write_buffer_flush(struct inode *f, struct write_buffer *wb)
+{
+	unsigned long done = is_compressed(f) ? write_buffer_flush_clusters(f, wb) : 0;
+	while (done < wb->len && !is_compressed(f))
+	{
+		unsigned long got;
+		unsigned long start = alloc_file_run(f, (wb->start + done) / BLOCK_SIZE,
+			(wb->len - done + BLOCK_SIZE - 1) / BLOCK_SIZE, &got);
+		if (start == -1) break;
+		unsigned long len = got * BLOCK_SIZE;
+		if (len > wb->len - done) len = wb->len - done;
+		for (unsigned long k = 0; k < got; ++k)
+		{
+			unsigned long n = (len - k * BLOCK_SIZE < BLOCK_SIZE) ? len - k * BLOCK_SIZE : BLOCK_SIZE;
+			char *p = file_block_get(start + k, 1);
+			memcpy(p, wb->data + done + k * BLOCK_SIZE, n);
+			/* the rest of the last block must read as zeroes */
+			bzero(p + n, BLOCK_SIZE - n);
+			file_block_put(start + k, p, BLOCK_SIZE);
+		}
+		done += len;
+		if (wb->start + done > f->size) f->size = wb->start + done;
+	}
+	if (done) inode_dirty(f);
+	if (done == wb->len)
+	{
+		write_buffer_drop(f);
+		return 1;
+	}
+	memmove(wb->data, wb->data + done, wb->len - done);
+	__atomic_sub_fetch(&write_buffered_bytes, done, __ATOMIC_RELAXED);
+	wb->start += done;
+	wb->len -= done;
+	__atomic_sub_fetch(&write_buffer_reserved, done / BLOCK_SIZE, __ATOMIC_RELAXED);
+	wb->nreserved -= done / BLOCK_SIZE;
+	return 0;
+}
+static void write_buffers_deinit(void)
+{
+	while (spare_write_buffers)
+	{
+		struct write_buffer *wb = spare_write_buffers;
+		spare_write_buffers = wb->next;
+		free(wb->data);
+		free(wb);
+	}
+	nspare_write_buffers = 0;
+}
+/* Flush every write buffer. */
+static void write_buffer_flush_all(void)
+{
+	if (!__atomic_load_n(&nwrite_buffers, __ATOMIC_ACQUIRE)) return;
+	pthread_mutex_lock(&write_buffers_lock);
+	unsigned long n = 0, nfiles = nwrite_buffers;
+	struct inode **files = nfiles ? malloc(nfiles * sizeof *files) : NULL;
+	for (unsigned b = 0; files && b < WRITE_BUFFER_BUCKETS; ++b)
+	{
+		for (struct write_buffer *wb = write_buffers[b]; wb && n < nfiles; wb = wb->next) files[n++] = wb->inode;
+	}
+	pthread_mutex_unlock(&write_buffers_lock);
+	if (nfiles && !files) err(EXIT_FAILURE, "flushing write buffers");
+	for (unsigned long k = 0; k < n; ++k)
+	{
+		journal_begin();
+		inode_wrlock(files[k]);
+		struct write_buffer *wb = write_buffer_get(files[k], 0);
+		if (wb && !write_buffer_flush(files[k], wb)) debug_printf(0, "out of space flushing inode %lu\n", (unsigned long) (files[k] - inodes));
+		inode_unlock(files[k]);
+		journal_end();
+	}
+	free(files);
+}
+/* The size of the file, counting anything buffered. */
+static unsigned long file_size(struct inode *f, struct write_buffer *wb)
+{
+	return (wb && wb->start + wb->len > f->size) ? wb->start + wb->len : f->size;
+}
+
+/* With the pread backend, the blocks under a thread's spans stay pinned
+ * until it has copied them or released them. */
+static _Thread_local unsigned long *span_pins;
+static _Thread_local unsigned span_npins, span_pins_capacity;
+static void pin_span_block(unsigned long blkno)
+{
+	if (span_npins == span_pins_capacity)
+	{
+		unsigned capacity = span_pins_capacity ? 2 * span_pins_capacity : 16;
+		unsigned long *pins = realloc(span_pins, capacity * sizeof *pins);
+		if (!pins) err(EXIT_FAILURE, "allocating span pins");
+		span_pins = pins;
+		span_pins_capacity = capacity;
+	}
+	span_pins[span_npins++] = blkno;
+}
+static void unpin_spans(void)
+{
+	for (unsigned k = 0; k < span_npins; ++k) bcache_put(span_pins[k], 0);
+	span_npins = 0;
+}
+/* A thread's spans over a compressed cluster point at its own copy of the
+ * cluster, which it keeps until it next needs another; the cache's
+ * generation tells it whether the copy is still good. */
+static _Thread_local char *span_cluster;
+static _Thread_local unsigned long span_cluster_blkno, span_cluster_generation;
+/* Cluster 'c' of compressed file 'f', if it is held compressed, decompressed
+ * into the thread's copy; or null if it isn't, or is damaged (in which case
+ * we set *damaged). */
+static const char *packed_cluster(struct inode *f, unsigned long c, _Bool *damaged)
+{
+	unsigned long blknos[VSFS_CLUSTER_BLOCKS];
+	unsigned n = cluster_blocks(f, c, blknos);
+	*damaged = 0;
+	if (n == 0 || n == VSFS_CLUSTER_BLOCKS) return NULL;
+	unsigned long generation = __atomic_load_n(&cluster_cache_generation, __ATOMIC_ACQUIRE);
+	if (span_cluster && span_cluster_blkno == blknos[0] && span_cluster_generation == generation) return span_cluster;
+	if (!span_cluster && !(span_cluster = malloc(CLUSTER_SIZE))) err(EXIT_FAILURE, "allocating a cluster buffer");
+	span_cluster_blkno = 0;
+	if (!cluster_unpack(blknos, n, span_cluster))
+	{
+		*damaged = 1;
+		return NULL;
+	}
+	span_cluster_blkno = blknos[0];
+	span_cluster_generation = generation;
+	return span_cluster;
+}
+/* Fill in up to 'max' spans covering bytes 'offset' onwards of the file, up
+ * to 'sz' bytes or the end of the file, merging physically contiguous blocks
+ * into one span. Returns the number of bytes covered. Call with the file
+ * locked, and unpin_spans when done with them. */
+static unsigned long file_spans(struct inode *f, unsigned long offset, unsigned long sz,
+	struct iovec *spans, unsigned max, unsigned *out_nspans)
+{
+	/* what holes read as */
+	static const char zeroes[16 * BLOCK_SIZE];
+	struct write_buffer *wb = write_buffer_get(f, 0);
+	unsigned long size = file_size(f, wb);
+	unsigned n = 0;
+	unsigned long done = 0;
+	_Bool damaged = 0;
+	if (offset >= size) sz = 0;
+	else if (sz > size - offset) sz = size - offset;
+	while (done < sz && n < max)
+	{
+		unsigned long pos = offset + done;
+		const char *p;
+		unsigned long len;
+		if (wb && pos >= wb->start && pos < wb->start + wb->len)
+		{
+			p = wb->data + (pos - wb->start);
+			len = wb->len - (pos - wb->start);
+		}
+		else if (!wb && is_inline(f))
+		{
+			p = f->inline_data + pos;
+			len = size - pos;
+		}
+		else if (is_compressed(f) && (p = packed_cluster(f, pos / CLUSTER_SIZE, &damaged)))
+		{
+			/* the thread's copy holds one cluster, so we stop after it */
+			p += pos % CLUSTER_SIZE;
+			len = CLUSTER_SIZE - pos % CLUSTER_SIZE;
+			max = n + 1;
+		}
+		else if (damaged) break;
+		else
+		{
+			unsigned run;
+			unsigned long blkno = map_file_run(f, pos / BLOCK_SIZE, &run);
+			/* cached blocks are not contiguous in memory */
+			if (blkno != -1 && cached_data) run = 1;
+			len = (unsigned long) run * BLOCK_SIZE - pos % BLOCK_SIZE;
+			/* the next cluster may be held compressed */
+			if (is_compressed(f) && len > CLUSTER_SIZE - pos % CLUSTER_SIZE) len = CLUSTER_SIZE - pos % CLUSTER_SIZE;
+			if (blkno != -1)
+			{
+				p = file_block_get(blkno, 0) + pos % BLOCK_SIZE;
+				if (cached_data) pin_span_block(blkno);
+			}
+			else
+			{
+				/* in a hole; nothing is mapped at or past a buffer */
+				p = zeroes;
+				if (len > sizeof zeroes) len = sizeof zeroes;
+				if (wb && pos < wb->start && len > wb->start - pos) len = wb->start - pos;
+			}
+		}
+		if (len > sz - done) len = sz - done;
+		if (n > 0 && (char *) spans[n - 1].iov_base + spans[n - 1].iov_len == p) spans[n - 1].iov_len += len;
+		else spans[n++] = (struct iovec) { .iov_base = (void *) p, .iov_len = len };
+		done += len;
+	}
+	*out_nspans = n;
+	return done;
+}
+/* Readahead. Unless vsfs_readahead_max is 0, the data blocks are mapped
+ * MADV_RANDOM, so that a fault reads in its own page and no more, and we read
+ * ahead of sequential readers ourselves, much as Linux does for a file
+ * descriptor. For each of the last few files read, we note where a
+ * sequential read would carry on, and a window. The first read of a
+ * sequential run hints the blocks it reads and a window after them, of four
+ * times as many; once the reader is into the second half of what we have
+ * hinted, we hint the next window, twice as big, up to vsfs_readahead_max. A
+ * read anywhere else ends the run, and hints only its own blocks, if there
+ * are several, so that they come in with one I/O rather than a fault each.
+ * A hint goes to the physical runs that the blocks map to: MADV_WILLNEED on
+ * the mapping, or with the pread backend, POSIX_FADV_WILLNEED on the image
+ * (see bcache_readahead). The kernel reads ahead of the buffer cache's
+ * preads by itself once they come in order, and better than our windows
+ * do, so with the pread backend we hint only reads out of order. */
+#define READAHEAD_SLOTS 64
+#define READAHEAD_MIN_BLOCKS 8
+struct readahead
+{
+	pthread_mutex_t lock;
+	struct inode *file; /* null if the slot is unused */
+	unsigned long next; /* the byte a sequential read would start at */
+	unsigned long window; /* in blocks; 0 if not in a sequential run */
+	unsigned long ahead; /* the file block after those hinted */
+};
+static struct readahead readaheads[READAHEAD_SLOTS] = {
+	[0 ... READAHEAD_SLOTS-1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+/* Start reading in 'n' data blocks from 'first'; 'cached' if they hold file
+ * data in the buffer cache. If the last of them is in already, so are the
+ * rest, near enough: a warm reader shouldn't pay for madvise walking pages
+ * that are all there. */
+static void will_need(unsigned long first, unsigned long n, _Bool cached)
+{
+	if (cached)
+	{
+		bcache_readahead(first, n);
+		return;
+	}
+	uintptr_t from = ROUND_DOWN_TO(page_size, (uintptr_t) &data_blocks[first]);
+	uintptr_t last = ROUND_DOWN_TO(page_size, (uintptr_t) &data_blocks[first + n] - 1);
+	unsigned char in;
+	if (mincore((void *) last, page_size, &in) == 0 && (in & 1)) return;
+	madvise((void *) from, (uintptr_t) &data_blocks[first + n] - from, MADV_WILLNEED);
+}
+/* Hint the blocks that file blocks 'from' to 'to' - 1 map to, run by run. */
+static void will_need_file(struct inode *f, unsigned long from, unsigned long to)
+{
+	unsigned long first = 0, n = 0; /* the physical run so far */
+	if (to > f->nblocks) to = f->nblocks;
+	for (unsigned long b = from; b < to; )
+	{
+		unsigned run;
+		unsigned long blkno = map_file_run(f, b, &run);
+		if (run > to - b) run = to - b;
+		if (blkno != -1 && n && blkno == first + n) n += run;
+		else if (blkno != -1)
+		{
+			if (n) will_need(first, n, cached_data);
+			first = blkno;
+			n = run;
+		}
+		b += run;
+	}
+	if (n) will_need(first, n, cached_data);
+}
+/* Note a read of 'sz' bytes at 'offset', and hint what it and the reads
+ * after it will need. Call with the file locked. */
+static void readahead(struct inode *f, unsigned long offset, unsigned long sz)
+{
+	if (!vsfs_readahead_max || is_inline(f) || sz == 0) return;
+	unsigned long max = vsfs_readahead_max / BLOCK_SIZE ? vsfs_readahead_max / BLOCK_SIZE : 1;
+	unsigned long first = offset / BLOCK_SIZE, end = (offset + sz + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	unsigned long hint_from = first, hint_to = first;
+	struct readahead *r = &readaheads[(f - inodes) % READAHEAD_SLOTS];
+	pthread_mutex_lock(&r->lock);
+	_Bool sequential = (r->file == f) ? (offset == r->next || (r->next && first == (r->next - 1) / BLOCK_SIZE))
+		: (offset == 0);
+	if (r->file != f)
+	{
+		r->file = f;
+		r->window = r->ahead = 0;
+	}
+	if (!sequential)
+	{
+		r->window = r->ahead = 0;
+		if (end - first > 1) hint_to = end;
+	}
+	else if (cached_data);
+	else if (r->window == 0)
+	{
+		r->window = (4 * (end - first) > READAHEAD_MIN_BLOCKS) ? 4 * (end - first) : READAHEAD_MIN_BLOCKS;
+		if (r->window > max) r->window = max;
+		hint_to = r->ahead = end + r->window;
+	}
+	else if (end + r->window / 2 >= r->ahead)
+	{
+		if (r->ahead > hint_from) hint_from = r->ahead;
+		r->window = (2 * r->window < max) ? 2 * r->window : max;
+		hint_to = r->ahead = ((end > r->ahead) ? end : r->ahead) + r->window;
+	}
+	r->next = offset + sz;
+	pthread_mutex_unlock(&r->lock);
+	if (hint_to > hint_from) will_need_file(f, hint_from, hint_to);
+}
+/* Data blocks 'first' to 'first + n - 1' won't be read again soon, and are
+ * committed, so let the kernel have back the pages holding them, as far as
+ * they hold nothing else. With a journal, the mapping is private, and the
+ * pages that we wrote to are our own copies until dropped. */
+static void cold(unsigned long first, unsigned long n)
+{
+	uintptr_t from = ROUND_UP_TO(page_size, (uintptr_t) &data_blocks[first]);
+	uintptr_t to = ROUND_DOWN_TO(page_size, (uintptr_t) &data_blocks[first + n]);
+	if (from < to) madvise((void *) from, to - from, MADV_DONTNEED);
+}
+long vsfs_read_spans(struct inode *f, unsigned long offset, unsigned long sz,
+	struct iovec *spans, unsigned *nspans)
+{
+	if (f->ftype != VSF_FILE) return -1;
+	inode_rdlock(f);
+	readahead(f, offset, sz);
+	return file_spans(f, offset, sz, spans, *nspans, nspans);
+}
+void vsfs_release_spans(struct inode *f)
+{
+	unpin_spans();
+	inode_unlock(f);
+}
+long vsfs_read(struct inode *f, unsigned long offset, char *buf, unsigned long sz)
+{
+	if (f->ftype != VSF_FILE) return -1;
+	struct iovec spans[16];
+	unsigned long done = 0;
+	inode_rdlock(f);
+	readahead(f, offset, sz);
+	for (unsigned long len; done < sz; done += len)
+	{
+		unsigned nspans;
+		len = file_spans(f, offset + done, sz - done, spans, sizeof spans / sizeof spans[0], &nspans);
+		if (len == 0) break;
+		char *out = buf + done;
+		for (unsigned n = 0; n < nspans; out += spans[n].iov_len, ++n) memcpy(out, spans[n].iov_base, spans[n].iov_len);
+		unpin_spans();
+	}
+	inode_unlock(f);
+	return done;
+}
+/* Whether byte 'pos' of the file holds data, rather than lying in a hole;
+ * sets *len to how many bytes from there on are the same. Blocks count as
+ * data if mapped, even if zeroed, as does anything buffered; in a compressed
+ * file, whole clusters do, if they have any blocks. */
+static _Bool is_data(struct inode *f, struct write_buffer *wb, unsigned long pos, unsigned long *len)
+{
+	if (wb && pos >= wb->start && pos < wb->start + wb->len)
+	{
+		*len = wb->start + wb->len - pos;
+		return 1;
+	}
+	if (!wb && is_inline(f))
+	{
+		*len = f->size - pos;
+		return 1;
+	}
+	unsigned run;
+	_Bool mapped;
+	if (is_compressed(f))
+	{
+		unsigned long blknos[VSFS_CLUSTER_BLOCKS];
+		mapped = cluster_blocks(f, pos / CLUSTER_SIZE, blknos) != 0;
+		*len = CLUSTER_SIZE - pos % CLUSTER_SIZE;
+	}
+	else
+	{
+		mapped = map_file_run(f, pos / BLOCK_SIZE, &run) != -1;
+		*len = (unsigned long) run * BLOCK_SIZE - pos % BLOCK_SIZE;
+	}
+	if (!mapped && wb && pos < wb->start && *len > wb->start - pos) *len = wb->start - pos;
+	return mapped;
+}
+static long seek_data_or_hole(struct inode *f, unsigned long offset, _Bool data)
+{
+	if (f->ftype != VSF_FILE) return -1;
+	inode_rdlock(f);
+	struct write_buffer *wb = write_buffer_get(f, 0);
+	unsigned long size = file_size(f, wb);
+	unsigned long pos = offset;
+	for (unsigned long len; pos < size && is_data(f, wb, pos, &len) != data; pos += len);
+	inode_unlock(f);
+	if (offset >= size) return -1;
+	if (pos < size) return pos;
+	/* there is a hole at the end of every file */
+	return data ? -1 : (long) size;
+}
+long vsfs_seek_data(struct inode *f, unsigned long offset)
+{
+	return seek_data_or_hole(f, offset, 1);
+}
+long vsfs_seek_hole(struct inode *f, unsigned long offset)
+{
+	return seek_data_or_hole(f, offset, 0);
+}
+/* Copy 'len' bytes to 'dst', from byte 'skip' onwards of the data that 'iov'
+ * describes. */
+static void copy_from_iov(char *dst, const struct iovec *iov, unsigned long skip, unsigned long len)
+{
+	for (; skip >= iov->iov_len; ++iov) skip -= iov->iov_len;
+	while (len > 0)
+	{
+		unsigned long n = iov->iov_len - skip;
+		if (n > len) n = len;
+		memcpy(dst, (const char *) iov->iov_base + skip, n);
+		dst += n;
+		len -= n;
+		skip = 0;
+		++iov;
+	}
+}
+/* Write bytes [offset, end) of the file, which must lie within its blocks,
+ * from byte 'skip' onwards of 'iov'. */
+static void write_in_place(struct inode *f, unsigned long offset, unsigned long end,
+	const struct iovec *iov, unsigned long skip)
+{
+	for (unsigned long len, pos = offset; pos < end; pos += len)
+	{
+		unsigned run;
+		unsigned long blkno = map_file_run(f, pos / BLOCK_SIZE, &run);
+		assert(blkno != -1);
+		if (cached_data) run = 1;
+		len = (unsigned long) run * BLOCK_SIZE - pos % BLOCK_SIZE;
+		if (len > end - pos) len = end - pos;
+		char *p = file_block_get(blkno, pos % BLOCK_SIZE == 0 && len == BLOCK_SIZE) + pos % BLOCK_SIZE;
+		copy_from_iov(p, iov, skip + (pos - offset), len);
+		file_block_put(blkno, p, len);
+	}
+}
+/* Write bytes [offset, end) of compressed file 'f' from byte 'skip' onwards
+ * of 'iov', a cluster at a time; 'reserved' is as for cluster_alloc. A
+ * cluster that we overwrite up to the end of the file needn't be read
+ * first: nothing past the end of a file is ever written, so the rest of it
+ * is zeroes. If we run out of room, the clusters before stay written. */
+static _Bool write_clusters(struct inode *f, unsigned long offset, unsigned long end, const struct iovec *iov,
+	unsigned long skip, _Bool reserved)
+{
+	char cluster[CLUSTER_SIZE];
+	for (unsigned long len, pos = offset; pos < end; pos += len)
+	{
+		unsigned long c = pos / CLUSTER_SIZE, first = c * CLUSTER_SIZE;
+		len = (end - first < CLUSTER_SIZE) ? end - pos : first + CLUSTER_SIZE - pos;
+		if (pos == first && (pos + len == first + CLUSTER_SIZE || pos + len >= f->size)) bzero(cluster, sizeof cluster);
+		else if (!cluster_read(f, c, cluster)) return 0;
+		copy_from_iov(cluster + (pos - first), iov, skip + (pos - offset), len);
+		if (!cluster_write(f, c, cluster, reserved)) return 0;
+		if (pos + len > f->size)
+		{
+			f->size = pos + len;
+			inode_dirty(f);
+		}
+	}
+	return 1;
+}
+/* Write bytes [offset, end) of the file where its blocks are, giving blocks
+ * to any holes there, from byte 'skip' onwards of 'iov'. */
+static _Bool write_direct(struct inode *f, unsigned long offset, unsigned long end, const struct iovec *iov,
+	unsigned long skip)
+{
+	if (is_compressed(f)) return write_clusters(f, offset, end, iov, skip, 0);
+	/* New blocks come zeroed, and nothing past the end of a file is ever
+	 * written, so any gap before 'offset' reads as zeroes. */
+	if (!ensure_mapped(f, offset, end) || !make_private(f, offset, end)) return 0;
+	write_in_place(f, offset, end, iov, skip);
+	if (end > f->size)
+	{
+		f->size = end;
+		inode_dirty(f);
+	}
+	return 1;
+}
+/* Write bytes [offset, end) of the file, which must end past the buffer's
+ * start, into its buffer, and any before the buffer directly, from byte
+ * 'skip' onwards of 'iov'. Returns 0 if we can't, having changed at most the
+ * bytes we were asked to. */
+static _Bool write_buffered(struct inode *f, struct write_buffer *wb, unsigned long offset, unsigned long end,
+	const struct iovec *iov, unsigned long skip)
+{
+	if (offset < wb->start && !write_direct(f, offset, wb->start, iov, skip)) return 0;
+	unsigned long old_end = wb->start + wb->len;
+	if (end > old_end && !write_buffer_resize(wb, end - wb->start)) return 0;
+	/* Any gap before 'offset' reads as zeroes: we zero it in the buffer. */
+	if (offset > old_end) bzero(wb->data + (old_end - wb->start), offset - old_end);
+	unsigned long first = (offset > wb->start) ? offset : wb->start;
+	copy_from_iov(wb->data + (first - wb->start), iov, skip + (first - offset), end - first);
+	if (__atomic_load_n(&write_buffered_bytes, __ATOMIC_RELAXED) > vsfs_write_buffer_total)
+	{
+		/* Over budget: flushing ours keeps the total bounded. It's buffered
+		 * already, so if we can't, it waits for the next try. */
+		write_buffer_flush(f, wb);
+	}
+	return 1;
+}
+/* Where a write buffer for the file may start: past its last block, or,
+ * for a compressed file, at the cluster holding that, since a cluster is
+ * stored whole. */
+static unsigned long buffer_floor(struct inode *f)
+{
+	if (!is_compressed(f) || !f->nblocks) return (unsigned long) f->nblocks * BLOCK_SIZE;
+	return (unsigned long) ROUND_DOWN_TO(VSFS_CLUSTER_BLOCKS, f->nblocks - 1) * BLOCK_SIZE;
+}
+/* Fill a compressed file's new buffer, which starts at the file's last
+ * cluster with blocks, with what that cluster holds. */
+static _Bool write_buffer_prefill(struct inode *f, struct write_buffer *wb)
+{
+	char cluster[CLUSTER_SIZE];
+	unsigned long len = (f->size - wb->start < CLUSTER_SIZE) ? f->size - wb->start : CLUSTER_SIZE;
+	if (!cluster_read(f, wb->start / CLUSTER_SIZE, cluster) || !write_buffer_resize(wb, len)) return 0;
+	memcpy(wb->data, cluster, len);
+	return 1;
+}
+/* Write 'sz' bytes at 'offset' from byte 'skip' onwards of 'iov'. Call with
+ * the file write-locked, at the start of a step. */
+static _Bool write_locked(struct inode *f, unsigned long offset, const struct iovec *iov, unsigned long skip,
+	unsigned long sz)
+{
+	unsigned long end = offset + sz, buffer_max = write_buffer_max();
+	struct write_buffer *wb = write_buffer_get(f, 0);
+	/* A buffer only ever follows promotion, so an inline file has none. */
+	if (!wb && is_inline(f))
+	{
+		if (end <= INLINE_DATA_MAX)
+		{
+			copy_from_iov(f->inline_data + offset, iov, skip, sz);
+			if (end > f->size) f->size = end;
+			inode_dirty(f);
+			return 1;
+		}
+		if (!promote_inline(f)) return 0;
+	}
+	unsigned long alloc_end = buffer_floor(f);
+	/* If the buffer can't take this write, flush it first, so that if we
+	 * can't, this write fails with nothing done, and what was buffered
+	 * before stays buffered. A write a block or more past the end of the
+	 * buffer starts a new one, leaving a hole between. */
+	if (wb && end > wb->start)
+	{
+		unsigned long buf_end = (end > wb->start + wb->len) ? end : wb->start + wb->len;
+		if (buf_end - wb->start > buffer_max
+			|| offset >= ROUND_UP_TO(BLOCK_SIZE, wb->start + wb->len) + BLOCK_SIZE)
+		{
+			if (!write_buffer_flush(f, wb)) return 0;
+			wb = NULL;
+			alloc_end = buffer_floor(f);
+		}
+	}
+	if (!wb && end > alloc_end && buffer_max)
+	{
+		unsigned long start = ROUND_DOWN_TO(is_compressed(f) ? CLUSTER_SIZE : BLOCK_SIZE, offset);
+		if (start < alloc_end) start = alloc_end;
+		if (end - start <= buffer_max && (wb = write_buffer_get(f, 1))) wb->start = start;
+		if (wb && is_compressed(f) && start < f->size && !write_buffer_prefill(f, wb))
+		{
+			write_buffer_drop(f);
+			wb = NULL;
+		}
+	}
+	if (wb && end > wb->start)
+	{
+		if (write_buffered(f, wb, offset, end, iov, skip)) return 1;
+		/* For want of memory, or of free blocks to promise it, we can't
+		 * buffer it; so write it straight. */
+		if (!write_buffer_flush(f, wb)) return 0;
+	}
+	/* Too big to buffer (or buffering is off), or before the buffer. */
+	return write_direct(f, offset, end, iov, skip);
+}
+long vsfs_writev(struct inode *f, unsigned long offset, const struct iovec *iov, unsigned iovcnt)
+{
+	if (f->ftype != VSF_FILE) return -1;
+	unsigned long sz = 0;
+	for (unsigned n = 0; n < iovcnt; ++n)
+	{
+		if (sz + iov[n].iov_len < sz) return -1;
+		sz += iov[n].iov_len;
+	}
+	/* file sizes are 32-bit */
+	if (offset + sz < offset || offset + sz > UINT32_MAX) return -1;
+	if (sz == 0) return 0;
+	unsigned long done = 0;
+	for (_Bool ok = 1; ok && done < sz; )
+	{
+		journal_begin();
+		unsigned long pos = offset + done, len = sz - done, step = write_step_max();
+		/* each step but the last ends on a block boundary */
+		if (len > step) len = ROUND_DOWN_TO(BLOCK_SIZE, pos + step) - pos;
+		inode_wrlock(f);
+		ok = write_locked(f, pos, iov, done, len);
+		inode_unlock(f);
+		if (ok) done += len;
+		if (ok && done < sz) journal_end_step();
+		else journal_end();
+	}
+	return done ? (long) done : -1;
+}
+long vsfs_write(struct inode *f, unsigned long offset, const char *buf, unsigned long sz)
+{
+	struct iovec iov = { .iov_base = (void *) buf, .iov_len = sz };
+	return vsfs_writev(f, offset, &iov, 1);
+}
+long vsfs_set_compression(struct inode *f, unsigned long on)
+{
+	if (!(super->features & VSFS_FEATURE_COMPRESSION) || f->ftype != VSF_FILE) return -1;
+	journal_begin();
+	inode_wrlock(f);
+	/* an empty file has no blocks, nor anything inline */
+	long ret = (file_size(f, write_buffer_get(f, 0)) == 0) ? 0 : -1;
+	if (ret == 0)
+	{
+		f->flags = on ? (f->flags | VSFS_INODE_COMPRESSED) : (f->flags & ~VSFS_INODE_COMPRESSED);
+		inode_dirty(f);
+	}
+	inode_unlock(f);
+	journal_end();
+	return ret;
+}
+struct dirent *vsfs_link(struct inode *dir, struct inode *tgt, const char *name)
+{
+	journal_begin();
+	inode_wrlock(dir);
+	struct dirent *d = append_dir_entry(dir, tgt, name);
+	inode_unlock(dir);
+	journal_end();
+	return d;
+}
+struct inode *vsfs_unlink(struct inode *dir, const char *name)
+{
+	/* Remove the entry 'name' from 'dir', freeing its target if that was the
+	 * last link. Directories must be removed with rmdir instead. */
+	unsigned pos;
+	if (!name[0]) return NULL;
+	journal_begin();
+	inode_wrlock(dir);
+	struct inode *tgt = find_entry(dir, name, &pos) ? &inodes[entry_inode_num(dir, pos)] : NULL;
+	if (!tgt || tgt->ftype == VSF_DIR)
+	{
+		inode_unlock(dir);
+		journal_end();
+		return NULL;
+	}
+	/* a snapshot's index is rebuilt rather than changed */
+	if (!make_private(dir, pos, next_entry_pos(dir, pos)) || (dir->dir_index && !dir_index_reserve(dir, 0)))
+	{
+		inode_unlock(dir);
+		journal_end();
+		return NULL;
+	}
+	dcache_insert(dir - inodes, name, DCACHE_NEGATIVE);
+	delete_entry(dir, pos);
+	inode_dirty(tgt);
+	if (__atomic_sub_fetch(&tgt->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		inode_wrlock(tgt);
+		write_buffer_drop(tgt);
+		release_all_blocks(tgt);
+		tgt->ftype = VSF_FREE;
+		tgt->size = 0;
+		inode_unlock(tgt);
+		inode_free(tgt);
+	}
+	inode_unlock(dir);
+	journal_end();
+	return dir; /* return the parent directory inode on success */
+}
+/* Make 'c' a copy of regular file 'src', sharing its data blocks but with
+ * copies of the blocks holding its extents. On failure, 'c' holds what it
+ * has of its own, for release_all_blocks. */
+static _Bool clone_blocks(struct inode *c, struct inode *src)
+{
+	*c = *src;
+	c->refcount = 0;
+	inode_dirty(c);
+	bmap_cache_invalidate(c);
+	if (is_inline(src)) return 1;
+	/* until it is whole, lest it look inline with no extents */
+	c->ftype = VSF_FREE;
+	c->extent_indirect = c->extent_dindirect = 0;
+	c->nextents = c->nblocks = 0;
+	if (src->extent_indirect && !(c->extent_indirect = block_copy(src->extent_indirect))) return 0;
+	if (src->extent_dindirect && !(c->extent_dindirect = block_copy(src->extent_dindirect))) return 0;
+	uint32_t *leaves = c->extent_dindirect ? (uint32_t *) &data_blocks[c->extent_dindirect] : NULL;
+	for (unsigned n = 0; leaves && n < BLOCKNUMS_PER_BLOCK && leaves[n]; ++n)
+	{
+		if (!(leaves[n] = block_copy(leaves[n])))
+		{
+			/* the rest are still the source's */
+			bzero(&leaves[n], (BLOCKNUMS_PER_BLOCK - n) * sizeof *leaves);
+			return 0;
+		}
+	}
+	for (unsigned n = 0; n < src->nextents; ++n)
+	{
+		struct extent *e = extent_at(src, n);
+		if (!blocks_get(e->start, e->len)) return 0;
+		c->nextents = n + 1;
+	}
+	c->nblocks = src->nblocks;
+	c->ftype = VSF_FILE;
+	return 1;
+}
+struct inode *vsfs_clone(struct inode *src, struct inode *dir, const char *name)
+{
+	if (!refcounts || src->ftype != VSF_FILE || dir->ftype != VSF_DIR) return NULL;
+	journal_begin();
+	inode_wrlock(dir);
+	inode_wrlock(src);
+	/* buffered data has no blocks to share yet */
+	struct write_buffer *wb = write_buffer_get(src, 0);
+	struct inode *c = (!wb || write_buffer_flush(src, wb)) ? inode_alloc() : NULL;
+	_Bool ok = c && clone_blocks(c, src);
+	inode_unlock(src);
+	if (c && !(ok && append_dir_entry(dir, c, name)))
+	{
+		release_all_blocks(c);
+		c->ftype = VSF_FREE;
+		c->size = 0;
+		inode_dirty(c);
+		inode_free(c);
+		c = NULL;
+	}
+	inode_unlock(dir);
+	journal_end();
+	return c;
+}
+struct inode *vsfs_lookup(struct inode *dir, const char *pathname)
+{
+	/* This is an iterated version of `find_dirent_by_name`, which asks the
+	 * dentry cache first, and tells it what it found. */
+	if (pathname[0] == '/') dir = &inodes[0];
+	char component[MAX_NAME_LEN];
+	const char *pos = pathname;
+	while (*pos)
+	{
+		const char *end = strchr(pos, '/');
+		if (!end) end = pos + strlen(pos);
+		size_t len = end - pos;
+		if (len >= MAX_NAME_LEN) return NULL;
+		if (len > 0)
+		{
+			if (dir->ftype != VSF_DIR) return NULL;
+			memcpy(component, pos, len);
+			component[len] = '\0';
+			uint32_t dir_ino = dir - inodes;
+			uint32_t ino;
+			if (!dcache_lookup(dir_ino, component, &ino))
+			{
+				/* Fill the dcache before unlocking, so that we can't
+				 * overwrite what a concurrent writer put there. */
+				unsigned pos;
+				inode_rdlock(dir);
+				ino = find_entry(dir, component, &pos) ? entry_inode_num(dir, pos) : DCACHE_NEGATIVE;
+				dcache_insert(dir_ino, component, ino);
+				inode_unlock(dir);
+			}
+			if (ino == DCACHE_NEGATIVE) return NULL;
+			dir = &inodes[ino];
+		}
+		pos = *end ? end + 1 : end;
+	}
+	return dir;
+}
+
+void dumpfs(void)
+{
+	struct superblock *super = mapping;
+	debug_printf(0, "--- begin vsfs dump\n");
+	debug_printf(0, "superblock:\n");
+	debug_printf(0, "   magic:   %c%c%c%c\n", super->magic[0], super->magic[1], super->magic[2], super->magic[3]);
+	debug_printf(0, "   fs size: %llu\n", (super->features & VSFS_FEATURE_LAYOUT) ?
+		(unsigned long long) super->fs_size_in_blocks * BLOCK_SIZE : (unsigned long long) super->fs_size_in_bytes);
+	debug_printf(0, "   block size: %u\n", (unsigned) super->block_size_in_bytes);
+	debug_printf(0, "   num inodes: %u\n", (unsigned) super->num_inodes);
+	debug_printf(0, "   num data blocks: %u\n", (unsigned) super->num_data_blocks);
+	debug_printf(0, "   features: 0x%x%s%s%s%s%s%s%s\n", (unsigned) super->features,
+		(super->features & VSFS_FEATURE_COMPACT_DIRENTS) ? " (compact dirents)" : "",
+		(super->features & VSFS_FEATURE_JOURNAL) ? " (journal)" : "",
+		(super->features & VSFS_FEATURE_LAYOUT) ? " (layout)" : "",
+		(super->features & VSFS_FEATURE_INLINE_DATA) ? " (inline data)" : "",
+		(super->features & VSFS_FEATURE_FREE_COUNTS) ? " (free counts)" : "",
+		(super->features & VSFS_FEATURE_REFCOUNTS) ? " (refcounts)" : "",
+		(super->features & VSFS_FEATURE_COMPRESSION) ? " (compression)" : "");
+	debug_printf(0, "   journal blocks: %u\n", (unsigned) super->journal_nblocks);
+	if (super->features & VSFS_FEATURE_FREE_COUNTS)
+	{
+		debug_printf(0, "   free: %u inodes, %u data blocks\n",
+			(unsigned) super->nfree_inodes, (unsigned) super->nfree_data_blocks);
+	}
+	debug_printf(0, "   layout: inode bitmap at block %lu, data bitmap at %lu, inode table at %lu,\n",
+		(unsigned long) ((char *) inode_bitmap - (char *) mapping) / BLOCK_SIZE,
+		(unsigned long) ((char *) data_bitmap - (char *) mapping) / BLOCK_SIZE,
+		(unsigned long) ((char *) inodes - (char *) mapping) / BLOCK_SIZE);
+	debug_printf(0, "           data blocks from block %lu\n",
+		(unsigned long) ((char *) data_blocks - (char *) mapping) / BLOCK_SIZE);
+	if (refcounts)
+	{
+		debug_printf(0, "   refcount table at block %u, snapshots: [", (unsigned) super->refcount_start);
+		_Bool any = 0;
+		for (unsigned k = 0; k < VSFS_MAX_SNAPSHOTS; ++k) if (super->snapshots[k])
+		{
+			debug_printf(0, "%s%u", any ? ", " : "", k);
+			any = 1;
+		}
+		debug_printf(0, "]%s\n", super->restoring ? " (restore unfinished)" : "");
+	}
+	debug_printf(0, "   root dir inode: (always 0)\n");
+	debug_printf(0, "\ninode numbers in use: [");
+	_Bool printed = 0;
+#define print_it(idx) do { debug_printf(0, "%s%d", printed ? ", " : "", (int) idx); printed = 1; } while(0)
+	BITMAP_FOR_EACH_BIT_SET(inode_bitmap, inode_bitmap_end, print_it);
+	debug_printf(0, "]\n");
+
+	/* One row per 32 blocks, but a run of rows with nothing in use is
+	 * shown as one line, since a big filesystem is mostly free. */
+	debug_printf(0, "\ndata blocks ('X' denotes a block in use):\n");
+	unsigned long nblocks = super->num_data_blocks;
+	for (unsigned long row = 0; row < nblocks; )
+	{
+		unsigned long free_end = bitmap_find_first_set1_geq(data_bitmap, data_bitmap_end, row, NULL);
+		if (free_end > nblocks) free_end = nblocks;
+		if (free_end < nblocks) free_end = ROUND_DOWN_TO(32, free_end);
+		if (free_end - row > 32)
+		{
+			debug_printf(0, "%10lu: (blocks %lu-%lu not in use)\n", row, row, free_end - 1);
+			row = free_end;
+			continue;
+		}
+		debug_printf(0, "%10lu: ", row);
+		for (unsigned long end = (row + 32 < nblocks) ? row + 32 : nblocks; row < end; ++row)
+		{
+			debug_printf(0, "[%c]", bitmap_get(data_bitmap, row) ? 'x' : ' ');
+		}
+		debug_printf(0, "\n");
+	}
+	debug_printf(0, "\n");
+
+	debug_printf(0, "--- end vsfs dump\n");
+}
+
+void dumpi(unsigned idx)
+{
+	struct inode *inode = &inodes[idx];
+
+	debug_printf(0, "inode %u:\n", idx);
+	debug_printf(0, "   type: %s\n", (inode->ftype == VSF_FREE) ? "free" :
+	                                 (inode->ftype == VSF_FILE) ? "regular file" :
+	                                 (inode->ftype == VSF_DIR) ? "directory" :
+	                                 (inode->ftype == VSF_DIR_INDEX) ? "directory index" : "(invalid)");
+	debug_printf(0, "   links: %d\n", (int) inode->refcount);
+	debug_printf(0, "   size in bytes: %u\n", (unsigned) inode->size);
+	unsigned long nallocated = 0;
+	for (unsigned i = 0; i < inode->nextents; ++i) nallocated += extent_at(inode, i)->len;
+	debug_printf(0, "   # blocks allocated: %lu\n", nallocated);
+	debug_printf(0, "   # extents: %u\n", (unsigned) inode->nextents);
+	if (is_inline(inode))
+	{
+		debug_printf(0, "   inline data: %u bytes, held in the inode\n", (unsigned) inode->size);
+		return;
+	}
+	if (inode->extent_indirect) debug_printf(0, "   indirect extent block: %u\n", (unsigned) inode->extent_indirect);
+	if (inode->extent_dindirect) debug_printf(0, "   double-indirect extent block: %u\n", (unsigned) inode->extent_dindirect);
+	if (inode->ftype == VSF_DIR && inode->dir_index) debug_printf(0, "   index inode: %u\n", (unsigned) inode->dir_index);
+	if (is_compressed(inode)) debug_printf(0, "   compressed, in clusters of %u blocks\n", (unsigned) VSFS_CLUSTER_BLOCKS);
+	unsigned long next = 0; /* the file block after the last extent */
+	for (unsigned i = 0; i < inode->nextents; ++i)
+	{
+		struct extent *e = extent_at(inode, i);
+		if (e->file_block > next) debug_printf(0, "   hole: file blocks %lu-%u\n", next, (unsigned) e->file_block - 1);
+		debug_printf(0, "   extent %u: file blocks %u-%u -> data blocks %u-%u\n", i,
+			(unsigned) e->file_block, (unsigned) (e->file_block + e->len - 1),
+			(unsigned) e->start, (unsigned) (e->start + e->len - 1));
+		next = e->file_block + e->len;
+	}
+	unsigned long size_blocks = ((unsigned long) inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (size_blocks > next) debug_printf(0, "   hole: file blocks %lu-%lu\n", next, size_blocks - 1);
+}
+
+/* A walk through extent 'e' of the inode has got to its block 'at': hint
+ * a readahead window's worth of blocks at a time. */
+static void walk_ahead(struct inode *inode, struct extent *e, unsigned at)
+{
+	unsigned long max = vsfs_readahead_max / BLOCK_SIZE;
+	if (max && at % max == 0) will_need(e->start + at, (e->len - at < max) ? e->len - at : max, cached_data && inode->ftype == VSF_FILE);
+}
+enum cb_res_t for_each_data_block(struct inode *inode, block_cb_t *cb, uintptr_t arg)
+{
+	enum cb_res_t res = 0;
+	for (unsigned n = 0; n < inode->nextents; ++n)
+	{
+		struct extent *e = extent_at(inode, n);
+		for (unsigned i = 0; i < e->len; ++i)
+		{
+			unsigned long blkno = e->start + i;
+			walk_ahead(inode, e, i);
+			_Bool file = (inode->ftype == VSF_FILE);
+			res = cb(file ? (data_block_t *) file_block_get(blkno, 0) : &data_blocks[blkno], e->file_block + i, arg);
+			if (file) file_block_put(blkno, NULL, 0);
+			if (res == VSF_STOP) return res;
+		}
+	}
+	return res;
+}
+/* Like for_each_data_block, but hand over each extent whole, so that callers
+ * can treat it as one contiguous span of nblocks * BLOCK_SIZE bytes. */
+enum cb_res_t for_each_data_run(struct inode *inode, run_cb_t *cb, uintptr_t arg)
+{
+	enum cb_res_t res = 0;
+	for (unsigned n = 0; n < inode->nextents; ++n)
+	{
+		struct extent *e = extent_at(inode, n);
+		if (!(cached_data && inode->ftype == VSF_FILE))
+		{
+			walk_ahead(inode, e, 0);
+			res = cb(&data_blocks[e->start], e->len, e->file_block, arg);
+			if (res == VSF_STOP) return res;
+			continue;
+		}
+		/* cached blocks are not contiguous in memory, so go one by one */
+		for (unsigned i = 0; i < e->len; ++i)
+		{
+			walk_ahead(inode, e, i);
+			res = cb((data_block_t *) bcache_get(e->start + i, 0), 1, e->file_block + i, arg);
+			bcache_put(e->start + i, 0);
+			if (res == VSF_STOP) return res;
+		}
+	}
+	return res;
+}
+
+struct dirent *vsfs_lookup_one(struct inode *dir, const char *filename)
+{
+	inode_rdlock(dir);
+	struct dirent *d = find_dirent_by_name(dir, filename);
+	inode_unlock(dir);
+	return d;
+}
+void vsfs_sync(void)
+{
+	write_buffer_flush_all();
+	if (cached_data) bcache_sync();
+	if (super->features & VSFS_FEATURE_JOURNAL) journal_sync();
+	else
+	{
+		super_counts_update();
+		if (msync(mapping, mapping_size, MS_SYNC) != 0) warn("syncing backing file");
+	}
+}
+void vsfs_statfs(struct vsfs_statfs *out)
+{
+	unsigned long nfree = data_nfree(), reserved = __atomic_load_n(&write_buffer_reserved, __ATOMIC_RELAXED);
+	*out = (struct vsfs_statfs) {
+		.block_size = BLOCK_SIZE,
+		.ninodes = super->num_inodes,
+		.nfree_inodes = allocator_nfree(&inode_allocator),
+		.ndata_blocks = super->num_data_blocks,
+		.nfree_data_blocks = nfree,
+		.navail_data_blocks = (reserved < nfree) ? nfree - reserved : 0
+	};
+}
+long vsfs_fsync(struct inode *f)
+{
+	long ret = 0;
+	/* Only this file's buffered data is given blocks... */
+	if (f->ftype == VSF_FILE && write_buffer_get(f, 0))
+	{
+		journal_begin();
+		inode_wrlock(f);
+		struct write_buffer *wb = write_buffer_get(f, 0);
+		if (wb && !write_buffer_flush(f, wb)) ret = -1;
+		inode_unlock(f);
+		journal_end();
+	}
+	/* ...and only its cached blocks are written back, ahead of the
+	 * metadata that points at them. */
+	if (cached_data && f->ftype == VSF_FILE)
+	{
+		inode_rdlock(f);
+		unsigned long written = 0;
+		for (unsigned n = 0; n < f->nextents; ++n)
+		{
+			struct extent *e = extent_at(f, n);
+			written += bcache_write_range(e->start, e->len);
+		}
+		if (written) bcache_flush();
+		inode_unlock(f);
+	}
+	/* The metadata goes in the running batch, whoever dirtied it, as the
+	 * journal commits nothing less. Without a journal, the kernel's
+	 * writeback of the image is all or nothing anyway. */
+	if (super->features & VSFS_FEATURE_JOURNAL) journal_sync();
+	else
+	{
+		super_counts_update();
+		if (msync(mapping, mapping_size, MS_SYNC) != 0) warn("syncing backing file");
+	}
+	return ret;
+}
+
+/* Bulk building; see vsfs.h. The next bulk allocation starts where the last
+ * one ended; it is only a hint, so threads may race on it. */
+static unsigned long bulk_goal;
+/* Give the file blocks up to 'len' bytes, as ensure_allocated_length does,
+ * but starting from bulk_goal, and zeroing them only if 'zero' (which only a
+ * directory or index may ask for, its blocks being in the mapping). */
+static _Bool bulk_allocate(struct inode *i, unsigned long len, _Bool zero)
+{
+	unsigned long want = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (want > i->nblocks && !may_allocate(want - i->nblocks)) return 0;
+	while (i->nblocks < want)
+	{
+		unsigned long got;
+		unsigned long start = data_alloc_run(__atomic_load_n(&bulk_goal, __ATOMIC_RELAXED), want - i->nblocks,
+			&got, !(cached_data && i->ftype == VSF_FILE));
+		if (start == -1) return 0;
+		if (!insert_file_run(i, i->nblocks, start, got))
+		{
+			for (unsigned long n = 0; n < got; ++n) data_free(&data_blocks[start + n]);
+			return 0;
+		}
+		if (zero) bzero(&data_blocks[start], got * sizeof (data_block_t));
+		__atomic_store_n(&bulk_goal, start + got, __ATOMIC_RELAXED);
+	}
+	return 1;
+}
+struct inode *vsfs_bulk_file(unsigned long size)
+{
+	/* file sizes are 32-bit */
+	if (size > UINT32_MAX) return NULL;
+	journal_begin();
+	struct inode *i = inode_alloc();
+	if (i)
+	{
+		/* a small enough file is inline, and zeroed already */
+		*i = (struct inode) { .ftype = VSF_FILE, .size = size };
+		inode_dirty(i);
+		if (!is_inline(i) && !bulk_allocate(i, size, 0))
+		{
+			i->ftype = VSF_FREE;
+			release_all_blocks(i);
+			inode_free(i);
+			i = NULL;
+		}
+		/* Nothing past the end of a file is ever written, so the rest of
+		 * its last block must read as zeroes. */
+		else if (size % BLOCK_SIZE && !is_inline(i)) zero_file_blocks(map_file_block(i, size / BLOCK_SIZE), 1);
+	}
+	journal_end();
+	return i;
+}
+struct inode *vsfs_bulk_dir(void)
+{
+	journal_begin();
+	struct inode *i = inode_alloc();
+	if (i)
+	{
+		*i = (struct inode) { .ftype = VSF_DIR };
+		inode_dirty(i);
+	}
+	journal_end();
+	return i;
+}
+/* Where the next entry, of 'len' bytes of name, goes, if the last one ended
+ * at *pos; updates *pos to just past it. */
+static unsigned long bulk_entry_pos(unsigned long *pos, size_t len)
+{
+	unsigned reclen = compact_dirents() ? VDIRENT_SIZE(len) : sizeof (struct dirent);
+	/* compact records don't straddle blocks */
+	if (compact_dirents() && *pos % BLOCK_SIZE + reclen > BLOCK_SIZE) *pos = ROUND_UP_TO(BLOCK_SIZE, *pos);
+	unsigned long here = *pos;
+	*pos += reclen;
+	return here;
+}
+static void bulk_put_entry(struct inode *dir, unsigned long *pos, const char *name, struct inode *tgt)
+{
+	size_t len = strlen(name);
+	uint32_t hash = name_hash(name, len);
+	unsigned long here = bulk_entry_pos(pos, len);
+	/* past the directory's size, but within its blocks */
+	char *p = (char *) &data_blocks[map_file_block(dir, here / BLOCK_SIZE)] + here % BLOCK_SIZE;
+	if (compact_dirents())
+	{
+		struct vdirent *v = (struct vdirent *) p;
+		*v = (struct vdirent) {
+			.rec_len = VDIRENT_SIZE(len),
+			.name_len = len,
+			.inode_num = tgt - inodes,
+			.hash = hash
+		};
+		memcpy(v->name, name, len);
+		journal_dirty(v, v->rec_len);
+	}
+	else
+	{
+		struct dirent *d = (struct dirent *) p;
+		*d = (struct dirent) {
+			.present = 1,
+			.inode_num = tgt - inodes
+		};
+		strcpy(d->name, name);
+		journal_dirty(d, sizeof *d);
+	}
+	__atomic_add_fetch(&tgt->refcount, 1, __ATOMIC_RELAXED);
+	inode_dirty(tgt);
+	if (dir->dir_index) dir_index_insert(&inodes[dir->dir_index], hash, here);
+	dcache_invalidate(dir - inodes, name);
+}
+/* Give the directory the blocks, and the index slots, for its new entries,
+ * which start at 'start'. Call with the directory write-locked, inside
+ * journal_begin/end. */
+static _Bool bulk_reserve_entries(struct inode *dir, unsigned long start, struct inode *parent, unsigned long n,
+	const char *const *names)
+{
+	unsigned long end = start;
+	if (parent)
+	{
+		bulk_entry_pos(&end, 1);
+		bulk_entry_pos(&end, 2);
+	}
+	for (unsigned long k = 0; k < n; ++k) bulk_entry_pos(&end, strlen(names[k]));
+	unsigned long size = compact_dirents() ? end : end + sizeof (struct dirent);
+	/* directory sizes are 32-bit */
+	if (size > UINT32_MAX) return 0;
+	/* Every directory has a block, even an empty one. Unused space, and the
+	 * fixed format's terminator, read as zeroes. */
+	if (!bulk_allocate(dir, size ? size : 1, 1)) return 0;
+	/* of the blocks we write, only the first can be one the directory had */
+	if (!make_private(dir, start, start + 1)) return 0;
+	if (dir->dir_index || (vsfs_dir_index_enabled && dir->nblocks > 1))
+	{
+		if (!dir_index_reserve(dir, n + (parent ? 2 : 0)) && dir->dir_index) return 0;
+	}
+	return 1;
+}
+/* The most that writing entry 'name' logs: its record, its target's link
+ * count and its index slot. */
+static size_t bulk_entry_cost(struct inode *dir, const char *name)
+{
+	size_t len = strlen(name);
+	size_t cost = journal_cost(compact_dirents() ? VDIRENT_SIZE(len) : sizeof (struct dirent))
+		+ journal_cost(sizeof (struct inode));
+	return dir->dir_index ? cost + journal_cost(sizeof (struct dir_index_slot)) : cost;
+}
+_Bool vsfs_bulk_fill_dir(struct inode *dir, struct inode *parent, unsigned long n, const char *const *names,
+	struct inode *const *targets)
+{
+	if (dir->ftype != VSF_DIR) return 0;
+	/* The entries go in steps, each writing them while the journal has room
+	 * for one more besides the directory's inode, the index's header and
+	 * the superblock's free counts, so that each commits atomically, however
+	 * small the journal. */
+	size_t step_cost = journal_cost(sizeof (struct inode)) + journal_cost(sizeof (struct dir_index_slot))
+		+ journal_cost(sizeof *super);
+	journal_begin();
+	inode_wrlock(dir);
+	/* A fixed-format directory's new entries start over its terminator,
+	 * and need room for a new one after them. */
+	unsigned long pos = dir->size;
+	if (!compact_dirents() && pos) pos -= sizeof (struct dirent);
+	_Bool ok = bulk_reserve_entries(dir, pos, parent, n, names);
+	if (ok && parent)
+	{
+		bulk_put_entry(dir, &pos, ".", dir);
+		bulk_put_entry(dir, &pos, "..", parent);
+	}
+	for (unsigned long k = 0; ok; )
+	{
+		while (k < n && journal_room() >= step_cost + bulk_entry_cost(dir, names[k]))
+		{
+			bulk_put_entry(dir, &pos, names[k], targets[k]);
+			++k;
+		}
+		dir->size = compact_dirents() ? pos : pos + sizeof (struct dirent);
+		inode_dirty(dir);
+		if (k == n) break;
+		inode_unlock(dir);
+		journal_end_step();
+		journal_begin();
+		inode_wrlock(dir);
+	}
+	inode_unlock(dir);
+	journal_end();
+	return ok;
+}
+
+/* The offline consistency checker; see vsfs_fsck in vsfs.h.
+ *
+ * Phase 1 walks the inode table, each thread taking a chunk at a time from a
+ * shared cursor, and rebuilds the two bitmaps from what the inodes claim,
+ * checking each inode's extents (and the blocks holding them) before
+ * trusting them. Chunks that are holes in the image hold only free inodes,
+ * so we skip them without reading them. Phase 2 does the same over the
+ * directories that phase 1 found, counting the entries that name each inode
+ * and checking each directory's index against its entries. Phase 3, on one
+ * thread, compares link counts and bitmaps with those rebuilt.
+ *
+ * Repair is conservative. We fix: inodes of no known type (cleared); files
+ * whose extents stop making sense (cut back to the extents before that
+ * point, leaving a hole); entries naming inodes not in use (deleted);
+ * directory indexes that are damaged or miss entries (dropped, so that the
+ * directory is searched linearly until it next grows one); link counts;
+ * files and indexes that nothing refers to (freed); and both bitmaps. We
+ * only report blocks claimed twice and directories whose blocks we cannot
+ * read; while there are any of the latter, we can neither count links nor
+ * trust the data bitmap we built, so we leave both alone.
+ *
+ * With VSFS_FEATURE_REFCOUNTS, a data block may be claimed by several
+ * inodes, and we check its reference count against their number instead,
+ * and fix it. Snapshots' blocks, and the blocks they hold, count as in use;
+ * a snapshot that names blocks out of range is dropped. Repairs that would
+ * write to a block that a snapshot holds are left undone.
+ *
+ * Compressed files' clusters are decompressed, and those that fail, or that
+ * map blocks after a hole, are only reported. */
+#define FSCK_CHUNK_INODES (64 * INODES_PER_BLOCK)
+enum fsck_bad { FSCK_OK, FSCK_BAD_TYPE, FSCK_BAD_MAP };
+static struct
+{
+	_Bool repair;
+	unsigned long cursor; /* the next chunk of the inode table */
+	unsigned long nchunks;
+	bitmap_word_t *inodes_used; /* the bitmaps as they should be */
+	bitmap_word_t *blocks_used;
+	bitmap_word_t *blocks_shared; /* claimed more than once */
+	uint16_t *claims; /* with refcounts, how many inodes claim each data block */
+	bitmap_word_t *dirs; /* for phase 2 */
+	uint8_t *bad; /* enum fsck_bad, per inode */
+	uint32_t *links; /* entries naming each inode; for an index, directories using it */
+	_Bool dirs_ok; /* every directory could be read */
+	struct vsfs_fsck_report report;
+} fsck;
+#define FSCK_PROBLEM(...) do { __atomic_add_fetch(&fsck.report.nproblems, 1, __ATOMIC_RELAXED); \
+	debug_printf(0, "fsck: " __VA_ARGS__); } while (0)
+#define FSCK_REPAIRED() __atomic_add_fetch(&fsck.report.nrepaired, 1, __ATOMIC_RELAXED)
+
+static _Bool fsck_blkno_ok(uint32_t blkno)
+{
+	return blkno != 0 && blkno < super->num_data_blocks;
+}
+static void fsck_claim(unsigned n, unsigned long blkno)
+{
+	if (fsck.claims)
+	{
+		if (__atomic_add_fetch(&fsck.claims[blkno], 1, __ATOMIC_RELAXED) == 1) bitmap_set(fsck.blocks_used, blkno);
+		return;
+	}
+	if (!bitmap_test_and_set(fsck.blocks_used, blkno)) return;
+	bitmap_set(fsck.blocks_shared, blkno);
+	FSCK_PROBLEM("data block %lu is claimed twice, once by inode %u\n", blkno, n);
+}
+static void fsck_unclaim(unsigned n, unsigned long blkno)
+{
+	if (fsck.claims ? --fsck.claims[blkno] == 0 : !bitmap_get(fsck.blocks_shared, blkno)) bitmap_clear(fsck.blocks_used, blkno);
+}
+static void fsck_ignore(unsigned n, unsigned long blkno) {}
+/* Call 'fn' on each data block that inode 'n' holds, both its extents' and
+ * those holding its extents, as far as they make sense: we check each block
+ * number before following it, and stop at the first extent that is out of
+ * range or out of order. Returns how many extents we got through, and sets
+ * *damaged if that is not all of them, or if there was anything else wrong
+ * with the map. Mind that extent_at asserts what we check here. */
+static unsigned fsck_walk_blocks(unsigned n, void (*fn)(unsigned, unsigned long), _Bool *damaged, _Bool quiet)
+{
+	struct inode *i = &inodes[n];
+	*damaged = 0;
+	if (is_inline(i)) return 0;
+	_Bool indirect_ok = fsck_blkno_ok(i->extent_indirect);
+	if (i->extent_indirect && !indirect_ok) *damaged = 1;
+	if (indirect_ok) fn(n, i->extent_indirect);
+	unsigned nleaves = 0;
+	if (i->extent_dindirect && !fsck_blkno_ok(i->extent_dindirect)) *damaged = 1;
+	else if (i->extent_dindirect)
+	{
+		fn(n, i->extent_dindirect);
+		uint32_t *leaves = (uint32_t *) &data_blocks[i->extent_dindirect];
+		for (; nleaves < BLOCKNUMS_PER_BLOCK && leaves[nleaves]; ++nleaves)
+		{
+			if (!fsck_blkno_ok(leaves[nleaves])) { *damaged = 1; break; }
+			fn(n, leaves[nleaves]);
+		}
+	}
+	unsigned limit = !indirect_ok ? NEXTENTS : NEXTENTS + EXTENTS_PER_BLOCK + nleaves * EXTENTS_PER_BLOCK;
+	unsigned k;
+	uint64_t next = 0;
+	for (k = 0; k < i->nextents && k < limit; ++k)
+	{
+		struct extent *e = extent_at(i, k);
+		if (e->len == 0 || e->file_block < next || (uint64_t) e->file_block + e->len > UINT32_MAX
+			|| (e->start == 0 && n != 0) || e->start >= super->num_data_blocks
+			|| e->len > super->num_data_blocks - e->start) break;
+		for (unsigned b = 0; b < e->len; ++b) fn(n, e->start + b);
+		next = e->file_block + e->len;
+	}
+	if (k < i->nextents)
+	{
+		*damaged = 1;
+		if (!quiet) FSCK_PROBLEM("inode %u: extent %u of %u is bad or out of reach\n", n, k, (unsigned) i->nextents);
+	}
+	else if (i->nblocks != next)
+	{
+		*damaged = 1;
+		if (!quiet) FSCK_PROBLEM("inode %u: %u blocks mapped, but its extents end at %lu\n", n, (unsigned) i->nblocks, (unsigned long) next);
+	}
+	else if (*damaged && !quiet) FSCK_PROBLEM("inode %u: bad extent block number\n", n);
+	return k;
+}
+/* Directories and their indexes are read by offset, so must have no holes
+ * up to their size. */
+static _Bool fsck_dense(struct inode *i)
+{
+	for (unsigned k = 0; k < i->nextents; ++k)
+	{
+		struct extent *e = extent_at(i, k);
+		if (e->file_block != (k ? extent_at(i, k - 1)->file_block + extent_at(i, k - 1)->len : 0)) return 0;
+	}
+	return (uint64_t) i->nblocks * BLOCK_SIZE >= i->size;
+}
+/* Each cluster of a compressed file must map a prefix of its blocks, and
+ * decompress if it maps fewer than all. */
+static void fsck_file(unsigned n)
+{
+	struct inode *i = &inodes[n];
+	if (i->flags & ~VSFS_INODE_COMPRESSED) FSCK_PROBLEM("inode %u has unknown flags 0x%x\n", n, (unsigned) i->flags);
+	if (!is_compressed(i)) return;
+	if (!(super->features & VSFS_FEATURE_COMPRESSION))
+	{
+		FSCK_PROBLEM("inode %u is compressed, without the feature\n", n);
+		return;
+	}
+	char out[CLUSTER_SIZE];
+	unsigned long next = 0; /* the first cluster not yet checked */
+	for (unsigned k = 0; k < i->nextents; ++k)
+	{
+		struct extent *e = extent_at(i, k);
+		unsigned long c = e->file_block / VSFS_CLUSTER_BLOCKS;
+		for (c = (c > next) ? c : next; c <= (e->file_block + e->len - 1) / VSFS_CLUSTER_BLOCKS; ++c)
+		{
+			unsigned long blknos[VSFS_CLUSTER_BLOCKS];
+			unsigned nmapped = 0, run;
+			for (unsigned b = 0; b < VSFS_CLUSTER_BLOCKS; ++b) nmapped += map_file_run(i, c * VSFS_CLUSTER_BLOCKS + b, &run) != -1;
+			unsigned nprefix = cluster_blocks(i, c, blknos);
+			if (nprefix != nmapped) FSCK_PROBLEM("inode %u: cluster %lu maps blocks after a hole\n", n, c);
+			else if (nprefix < VSFS_CLUSTER_BLOCKS && !cluster_read(i, c, out)) FSCK_PROBLEM("inode %u: cluster %lu does not decompress\n", n, c);
+		}
+		next = c;
+	}
+}
+static void fsck_inode(unsigned n)
+{
+	struct inode *i = &inodes[n];
+	if (i->ftype == VSF_FREE)
+	{
+		if (n == 0) FSCK_PROBLEM("the root directory, inode 0, is free\n");
+		return;
+	}
+	bitmap_set(fsck.inodes_used, n);
+	if (i->ftype > VSF_DIR_INDEX || (n == 0 && i->ftype != VSF_DIR))
+	{
+		FSCK_PROBLEM("inode %u has bad type %u\n", n, (unsigned) i->ftype);
+		fsck.bad[n] = FSCK_BAD_TYPE;
+		return;
+	}
+	_Bool damaged;
+	fsck_walk_blocks(n, fsck_claim, &damaged, 0);
+	if (damaged) fsck.bad[n] = FSCK_BAD_MAP;
+	if (i->ftype == VSF_FILE && !damaged) fsck_file(n);
+	if (i->ftype == VSF_FILE) return;
+	if (!damaged && !fsck_dense(i))
+	{
+		FSCK_PROBLEM("inode %u: %s has holes\n", n, (i->ftype == VSF_DIR) ? "directory" : "directory index");
+		fsck.bad[n] = FSCK_BAD_MAP;
+	}
+	unsigned nslots = i->size / sizeof (struct dir_index_slot);
+	if (i->ftype == VSF_DIR_INDEX && (i->size % sizeof (struct dir_index_slot) || nslots < 2 || (nslots & (nslots - 1))))
+	{
+		FSCK_PROBLEM("inode %u: directory index has bad size %u\n", n, (unsigned) i->size);
+		fsck.bad[n] = FSCK_BAD_MAP;
+	}
+	if (i->ftype == VSF_DIR && fsck.bad[n])
+	{
+		debug_printf(0, "fsck: directory %u cannot be read\n", n);
+		fsck.dirs_ok = 0;
+	}
+	else if (i->ftype == VSF_DIR) bitmap_set(fsck.dirs, n);
+}
+static void *fsck_inodes_worker(void *arg)
+{
+	/* inodes are 64 bytes, so a chunk is 64 blocks */
+	int fd = fileno(backing_file);
+	off_t table_off = (char *) inodes - (char *) mapping;
+	off_t chunk_bytes = FSCK_CHUNK_INODES * sizeof (struct inode);
+	unsigned long c;
+	while ((c = __atomic_fetch_add(&fsck.cursor, 1, __ATOMIC_RELAXED)) < fsck.nchunks)
+	{
+		off_t data = lseek(fd, table_off + c * chunk_bytes, SEEK_DATA);
+		if ((data == -1 && errno == ENXIO) || data >= table_off + (off_t) (c + 1) * chunk_bytes) continue;
+		unsigned long end = (c + 1) * FSCK_CHUNK_INODES;
+		if (end > super->num_inodes) end = super->num_inodes;
+		/* in with one I/O, not a fault per page */
+		madvise(&inodes[c * FSCK_CHUNK_INODES], (end - c * FSCK_CHUNK_INODES) * sizeof (struct inode), MADV_WILLNEED);
+		for (unsigned long n = c * FSCK_CHUNK_INODES; n < end; ++n) fsck_inode(n);
+	}
+	return NULL;
+}
+
+/* Phase 2. An entry naming an inode not in use is a problem; one naming an
+ * inode in use counts towards its links. */
+static void fsck_entry(struct inode *dir, unsigned pos, unsigned target, unsigned long *nlive)
+{
+	unsigned n = dir - inodes;
+	if (target < super->num_inodes && (inodes[target].ftype == VSF_FILE || inodes[target].ftype == VSF_DIR))
+	{
+		__atomic_add_fetch(&fsck.links[target], 1, __ATOMIC_RELAXED);
+		++*nlive;
+		return;
+	}
+	FSCK_PROBLEM("directory %u: entry at %u names inode %u, which is not a file or directory\n", n, pos, target);
+	if (!fsck.repair || block_shared(map_file_block(dir, pos / BLOCK_SIZE))) return;
+	journal_begin();
+	if (!dir->dir_index || dir_index_reserve(dir, 0))
+	{
+		delete_entry(dir, pos);
+		FSCK_REPAIRED();
+	}
+	journal_end();
+}
+/* Check the 'len' bytes of a compact directory's block from 'pos' on.
+ * Records never straddle blocks, so each block stands alone. */
+static _Bool fsck_vdirents(struct inode *dir, char *block, unsigned pos, unsigned len, unsigned long *nlive)
+{
+	unsigned n = dir - inodes;
+	for (unsigned off = 0; off < len; )
+	{
+		struct vdirent *v = (struct vdirent *) (block + off);
+		if (v->rec_len == 0)
+		{
+			/* the rest of the block is unused, so it must not be the end */
+			if (len == BLOCK_SIZE) break;
+			FSCK_PROBLEM("directory %u: its size ends in unused space at %u\n", n, pos + off);
+			return 0;
+		}
+		if (len - off < sizeof *v)
+		{
+			FSCK_PROBLEM("directory %u: record at %u is cut off by the end\n", n, pos + off);
+			return 0;
+		}
+		if (v->rec_len % 4 || v->rec_len < VDIRENT_SIZE(v->name_len) || v->rec_len > len - off)
+		{
+			FSCK_PROBLEM("directory %u: record at %u has bad length %u\n", n, pos + off, (unsigned) v->rec_len);
+			return 0;
+		}
+		if (v->name_len && v->hash != name_hash(v->name, v->name_len))
+		{
+			FSCK_PROBLEM("directory %u: entry at %u has the wrong hash\n", n, pos + off);
+			if (fsck.repair && !block_shared(map_file_block(dir, (pos + off) / BLOCK_SIZE)))
+			{
+				journal_begin();
+				v->hash = name_hash(v->name, v->name_len);
+				journal_dirty(&v->hash, sizeof v->hash);
+				journal_end();
+				FSCK_REPAIRED();
+			}
+		}
+		if (v->name_len) fsck_entry(dir, pos + off, v->inode_num, nlive);
+		off += v->rec_len;
+	}
+	return 1;
+}
+static _Bool fsck_dirents(struct inode *dir, char *block, unsigned pos, unsigned len, unsigned long *nlive)
+{
+	unsigned n = dir - inodes;
+	static const struct dirent null_dirent;
+	for (unsigned off = 0; off < len; off += sizeof (struct dirent))
+	{
+		struct dirent *d = (struct dirent *) (block + off);
+		if (pos + off + sizeof *d == dir->size && memcmp(d, &null_dirent, sizeof *d))
+		{
+			FSCK_PROBLEM("directory %u: the last entry is not a terminator\n", n);
+			return 0;
+		}
+		if (!d->present) continue;
+		if (!d->name[0] || !memchr(d->name, '\0', MAX_NAME_LEN))
+		{
+			FSCK_PROBLEM("directory %u: entry at %u has a bad name\n", n, pos + off);
+			return 0;
+		}
+		fsck_entry(dir, pos + off, d->inode_num, nlive);
+	}
+	return 1;
+}
+/* Whether the index has a slot for the entry at 'pos', where a lookup
+ * would find it. */
+static _Bool fsck_index_has(struct inode *idx, uint32_t hash, unsigned pos)
+{
+	unsigned mask = dir_index_nslots(idx) - 1;
+	for (unsigned n = hash & mask, k = 0; k <= mask; n = (n + 1) & mask, ++k)
+	{
+		if (n == DIR_INDEX_HEADER_SLOT) continue;
+		struct dir_index_slot *s = dir_index_slot(idx, n);
+		if (!s->pos_plus_one) return 0;
+		if (s->hash == hash && s->pos_plus_one == pos + 1) return 1;
+	}
+	return 0;
+}
+static _Bool fsck_index(struct inode *dir, unsigned long nlive)
+{
+	unsigned n = dir - inodes, x = dir->dir_index;
+	if (x >= super->num_inodes || inodes[x].ftype != VSF_DIR_INDEX || fsck.bad[x])
+	{
+		FSCK_PROBLEM("directory %u: index inode %u is not a sound directory index\n", n, x);
+		return 0;
+	}
+	struct inode *idx = &inodes[x];
+	unsigned long nslots = dir_index_nslots(idx), nused = 0;
+	for (unsigned long k = 1; k < nslots; ++k)
+	{
+		struct dir_index_slot *s = dir_index_slot(idx, k);
+		if (s->pos_plus_one > dir->size)
+		{
+			FSCK_PROBLEM("directory %u: index slot %lu points past the end\n", n, k);
+			if (!fsck.repair) __atomic_add_fetch(&fsck.links[x], 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+		nused += (s->pos_plus_one != 0);
+	}
+	/* Unlinking used to leave stale slots, so an older image may have more
+	 * slots than entries. */
+	unsigned long count = dir_index_slot(idx, DIR_INDEX_HEADER_SLOT)->pos_plus_one;
+	_Bool ok = 1;
+	if (count != nused || nused < nlive || nused == nslots - 1)
+	{
+		FSCK_PROBLEM("directory %u: index counts %lu entries, has %lu in %lu slots, for %lu live entries\n",
+			n, count, nused, nslots - 1, nlive);
+		ok = 0;
+	}
+	for (unsigned pos = 0; ok && next_live_entry(dir, &pos); pos = next_entry_pos(dir, pos))
+	{
+		if (!fsck_index_has(idx, entry_hash(dir, pos), pos))
+		{
+			FSCK_PROBLEM("directory %u: entry at %u is missing from its index\n", n, pos);
+			ok = 0;
+		}
+	}
+	/* a bad index is dropped in repair, and then belongs to nobody */
+	if (ok || !fsck.repair) __atomic_add_fetch(&fsck.links[x], 1, __ATOMIC_RELAXED);
+	return ok;
+}
+static void fsck_dir(unsigned n)
+{
+	struct inode *dir = &inodes[n];
+	_Bool ok = 1;
+	unsigned long nlive = 0;
+	if (!compact_dirents() && (dir->size < sizeof (struct dirent) || dir->size % sizeof (struct dirent)))
+	{
+		FSCK_PROBLEM("directory %u has bad size %u\n", n, (unsigned) dir->size);
+		ok = 0;
+	}
+	for (unsigned k = 0; ok && k < dir->nextents; ++k)
+	{
+		struct extent *e = extent_at(dir, k);
+		for (unsigned b = 0; ok && b < e->len && (e->file_block + b) * BLOCK_SIZE < dir->size; ++b)
+		{
+			unsigned pos = (e->file_block + b) * BLOCK_SIZE;
+			unsigned len = (dir->size - pos < BLOCK_SIZE) ? dir->size - pos : BLOCK_SIZE;
+			char *block = data_blocks[e->start + b];
+			ok = compact_dirents() ? fsck_vdirents(dir, block, pos, len, &nlive) : fsck_dirents(dir, block, pos, len, &nlive);
+		}
+	}
+	if (!ok)
+	{
+		debug_printf(0, "fsck: directory %u cannot be read\n", n);
+		__atomic_store_n(&fsck.dirs_ok, 0, __ATOMIC_RELAXED);
+		return;
+	}
+	if (dir->dir_index && !fsck_index(dir, nlive) && fsck.repair)
+	{
+		journal_begin();
+		dir->dir_index = 0;
+		inode_dirty(dir);
+		journal_end();
+		FSCK_REPAIRED();
+	}
+}
+static void *fsck_dirs_worker(void *arg)
+{
+	unsigned long c;
+	while ((c = __atomic_fetch_add(&fsck.cursor, 1, __ATOMIC_RELAXED)) < fsck.nchunks)
+	{
+		unsigned long end = (c + 1) * FSCK_CHUNK_INODES;
+		if (end > super->num_inodes) end = super->num_inodes;
+		for (unsigned long n = c * FSCK_CHUNK_INODES; n < end; ++n)
+		{
+			n = bitmap_find_first_set1_geq(fsck.dirs, fsck.dirs + (end + BITMAP_WORD_NBITS - 1) / BITMAP_WORD_NBITS, n, NULL);
+			if (n >= end) break;
+			fsck_dir(n);
+		}
+	}
+	return NULL;
+}
+/* Run 'fn' on 'nthreads' threads, including this one, over the chunks. */
+static void fsck_run(void *(*fn)(void *), unsigned nthreads)
+{
+	pthread_t threads[nthreads];
+	unsigned nstarted = 0;
+	fsck.cursor = 0;
+	while (nstarted + 1 < nthreads && 0 == pthread_create(&threads[nstarted], NULL, fn, NULL)) ++nstarted;
+	fn(NULL);
+	for (unsigned t = 0; t < nstarted; ++t) pthread_join(threads[t], NULL);
+}
+
+/* Phase 1 repairs, before we read any directories. */
+static void fsck_fix_inode(unsigned n)
+{
+	struct inode *i = &inodes[n];
+	journal_begin();
+	if (fsck.bad[n] == FSCK_BAD_TYPE)
+	{
+		bzero(i, sizeof *i);
+		bitmap_clear(fsck.inodes_used, n);
+	}
+	else
+	{
+		/* Keep the extents before the first bad one. What follows becomes a
+		 * hole, and blocks that only the rest pointed to become free. */
+		_Bool damaged;
+		unsigned nvalid = fsck_walk_blocks(n, fsck_ignore, &damaged, 1);
+		if (nvalid == 0 && (super->features & VSFS_FEATURE_INLINE_DATA) && i->size <= INLINE_DATA_MAX)
+		{
+			/* with no extents left, it will look inline, so clear them */
+			fsck_walk_blocks(n, fsck_unclaim, &damaged, 1);
+			bzero(i->inline_data, sizeof i->inline_data);
+		}
+		if (i->extent_indirect && !fsck_blkno_ok(i->extent_indirect)) i->extent_indirect = 0;
+		if (i->extent_dindirect && !fsck_blkno_ok(i->extent_dindirect)) i->extent_dindirect = 0;
+		uint32_t *leaves = i->extent_dindirect ? (uint32_t *) &data_blocks[i->extent_dindirect] : NULL;
+		for (unsigned k = 0; leaves && k < BLOCKNUMS_PER_BLOCK && leaves[k]; ++k)
+		{
+			if (fsck_blkno_ok(leaves[k])) continue;
+			if (!block_shared(i->extent_dindirect))
+			{
+				leaves[k] = 0;
+				journal_dirty(&leaves[k], sizeof leaves[k]);
+			}
+			break;
+		}
+		i->nextents = nvalid;
+		i->nblocks = nvalid ? extent_at(i, nvalid - 1)->file_block + extent_at(i, nvalid - 1)->len : 0;
+		bmap_cache_invalidate(i);
+	}
+	inode_dirty(i);
+	journal_end();
+	FSCK_REPAIRED();
+}
+static void fsck_free_inode(unsigned n)
+{
+	struct inode *i = &inodes[n];
+	_Bool damaged;
+	fsck_walk_blocks(n, fsck_unclaim, &damaged, 1);
+	journal_begin();
+	bzero(i, sizeof *i);
+	inode_dirty(i);
+	journal_end();
+	bmap_cache_invalidate(i);
+	bitmap_clear(fsck.inodes_used, n);
+	FSCK_REPAIRED();
+}
+/* Phase 3: link counts, and inodes that nothing refers to. */
+static void fsck_links(unsigned n)
+{
+	struct inode *i = &inodes[n];
+	uint32_t links = fsck.links[n];
+	if (fsck.bad[n] == FSCK_BAD_TYPE) return;
+	if (i->ftype == VSF_DIR_INDEX)
+	{
+		if (links == 1) return;
+		if (links > 1) FSCK_PROBLEM("directory index %u is shared by %u directories\n", n, (unsigned) links);
+		else FSCK_PROBLEM("directory index %u belongs to no directory\n", n);
+		if (links == 0 && fsck.repair) fsck_free_inode(n);
+		return;
+	}
+	if (links == i->refcount) return;
+	if (links == 0 && n != 0)
+	{
+		/* a directory's entries count towards others' links, so we keep it */
+		FSCK_PROBLEM("%s %u is in no directory\n", (i->ftype == VSF_DIR) ? "directory" : "file", n);
+		if (fsck.repair && i->ftype == VSF_FILE) fsck_free_inode(n);
+		return;
+	}
+	FSCK_PROBLEM("inode %u has %u links, but %u entries name it\n", n, (unsigned) i->refcount, (unsigned) links);
+	if (!fsck.repair || links > UINT16_MAX) return;
+	journal_begin();
+	i->refcount = links;
+	inode_dirty(i);
+	journal_end();
+	FSCK_REPAIRED();
+}
+/* Make the allocator's bitmap 'expected', in one operation per block of the
+ * bitmap, to keep each batch small, and recount its free bits. */
+static void allocator_set_bitmap(struct allocator *a, bitmap_word_t *expected)
+{
+	const unsigned long words_per_block = BLOCK_SIZE / sizeof (bitmap_word_t);
+	for (unsigned long w0 = 0; w0 < a->nwords; w0 += words_per_block)
+	{
+		journal_begin();
+		for (unsigned long w = w0; w < a->nwords && w < w0 + words_per_block; ++w)
+		{
+			if ((a->bitmap[w] & usable_bits(a, w)) == expected[w]) continue;
+			a->bitmap[w] = expected[w];
+			journal_dirty(&a->bitmap[w], sizeof a->bitmap[w]);
+		}
+		journal_end();
+	}
+	allocator_init(a, a->bitmap, a->nbits, 0);
+}
+/* Each data block should count one reference fewer than the inodes that
+ * claim it. */
+static void fsck_refcounts(_Bool repair)
+{
+	unsigned long nwrong = 0, nfixed = 0;
+	for (unsigned long b = 0; b < super->num_data_blocks; ++b)
+	{
+		unsigned expected = fsck.claims[b] ? fsck.claims[b] - 1 : 0;
+		if (refcounts[b] == expected) continue;
+		if (nwrong++ < 10) debug_printf(0, "fsck: data block %lu counts %u more references, but %u more inodes claim it\n",
+			b, (unsigned) refcounts[b], expected);
+	}
+	if (!nwrong) return;
+	__atomic_add_fetch(&fsck.report.nproblems, nwrong, __ATOMIC_RELAXED);
+	debug_printf(0, "fsck: %lu data blocks have the wrong reference count\n", nwrong);
+	/* one operation per block of the table */
+	for (unsigned long b0 = 0; repair && b0 < super->num_data_blocks; b0 += BLOCK_SIZE)
+	{
+		journal_begin();
+		for (unsigned long b = b0; b < super->num_data_blocks && b < b0 + BLOCK_SIZE; ++b)
+		{
+			unsigned expected = fsck.claims[b] ? fsck.claims[b] - 1 : 0;
+			if (refcounts[b] == expected || expected > UINT8_MAX) continue;
+			refcounts[b] = expected;
+			journal_dirty(&refcounts[b], 1);
+			++nfixed;
+		}
+		journal_end();
+	}
+	fsck.report.nrepaired += nfixed;
+}
+/* The blocks that snapshots take, and those they hold, are in use too. */
+static void fsck_snapshots(_Bool repair)
+{
+	for (unsigned id = 0; id < VSFS_MAX_SNAPSHOTS; ++id)
+	{
+		if (!super->snapshots[id] || (snapshot_root(id) && snapshot_mark(snapshot_root(id), fsck.blocks_used))) continue;
+		FSCK_PROBLEM("snapshot %u names blocks out of range\n", id);
+		if (!repair) continue;
+		journal_begin();
+		super->snapshots[id] = 0;
+		journal_dirty(super, sizeof *super);
+		journal_end();
+		FSCK_REPAIRED();
+	}
+	snapshot_load_pinned();
+	for (unsigned long w = 0; pinned && w < data_allocator.nwords; ++w) fsck.blocks_used[w] |= pinned[w];
+	bitmap_set(fsck.blocks_used, 0);
+}
+/* Compare a bitmap with the one we built, and with 'repair', make it so. */
+static void fsck_bitmap(const char *what, struct allocator *a, bitmap_word_t *expected, _Bool repair)
+{
+	unsigned long nleaked = 0, nlost = 0, nshown = 0;
+	for (unsigned long w = 0; w < a->nwords; ++w)
+	{
+		bitmap_word_t disk = a->bitmap[w] & usable_bits(a, w), diff = disk ^ expected[w];
+		if (!diff) continue;
+		nleaked += popcount_word(diff & disk);
+		nlost += popcount_word(diff & expected[w]);
+		for (; diff && nshown < 10; diff &= diff - 1, ++nshown)
+		{
+			unsigned long idx = w * BITMAP_WORD_NBITS + word_ctz(diff);
+			debug_printf(0, "fsck: %s %lu is %s\n", what, idx, bitmap_get(expected, idx) ? "in use, but marked free" : "marked in use, but unused");
+		}
+	}
+	if (!nleaked && !nlost) return;
+	__atomic_add_fetch(&fsck.report.nproblems, nleaked + nlost, __ATOMIC_RELAXED);
+	debug_printf(0, "fsck: %lu %ss marked in use but unused, %lu in use but marked free\n", nleaked, what, nlost);
+	if (!repair) return;
+	allocator_set_bitmap(a, expected);
+	fsck.report.nrepaired += nleaked + nlost;
+}
+
+void vsfs_fsck(unsigned nthreads, _Bool repair, struct vsfs_fsck_report *out)
+{
+	if (nthreads == 0)
+	{
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (ncpus < 1) ? 1 : ncpus;
+	}
+	unsigned long ninode_words = inode_allocator.nwords, nblock_words = data_allocator.nwords;
+	fsck = (typeof (fsck)) {
+		.repair = repair,
+		.nchunks = (super->num_inodes + FSCK_CHUNK_INODES - 1) / FSCK_CHUNK_INODES,
+		.inodes_used = calloc(ninode_words, sizeof (bitmap_word_t)),
+		.dirs = calloc(ninode_words, sizeof (bitmap_word_t)),
+		.blocks_used = calloc(nblock_words, sizeof (bitmap_word_t)),
+		.blocks_shared = calloc(nblock_words, sizeof (bitmap_word_t)),
+		.bad = calloc(super->num_inodes, sizeof *fsck.bad),
+		.links = calloc(super->num_inodes, sizeof *fsck.links),
+		.claims = refcounts ? calloc(super->num_data_blocks, sizeof *fsck.claims) : NULL,
+		.dirs_ok = 1
+	};
+	if (!fsck.inodes_used || !fsck.dirs || !fsck.blocks_used || !fsck.blocks_shared || !fsck.bad || !fsck.links
+		|| (refcounts && !fsck.claims))
+	{
+		err(EXIT_FAILURE, "allocating fsck tables");
+	}
+
+	fsck_run(fsck_inodes_worker, nthreads);
+	/* Repaired or not, a bad file's blocks are claimed as far as its
+	 * extents make sense; a bad directory's may not all be. */
+	_Bool blocks_known = fsck.dirs_ok;
+	for (unsigned long n = 0; repair; ++n)
+	{
+		n = bitmap_find_first_set1_geq(fsck.inodes_used, fsck.inodes_used + ninode_words, n, NULL);
+		if (n >= super->num_inodes) break;
+		if (fsck.bad[n] == FSCK_BAD_TYPE || (fsck.bad[n] && inodes[n].ftype == VSF_FILE)) fsck_fix_inode(n);
+	}
+	fsck_run(fsck_dirs_worker, nthreads);
+	if (!fsck.dirs_ok) debug_printf(0, "fsck: not checking link counts while directories are unreadable\n");
+	for (unsigned long n = 0; fsck.dirs_ok; ++n)
+	{
+		n = bitmap_find_first_set1_geq(fsck.inodes_used, fsck.inodes_used + ninode_words, n, NULL);
+		if (n >= super->num_inodes) break;
+		fsck_links(n);
+	}
+	if (refcounts)
+	{
+		fsck_refcounts(repair && blocks_known);
+		fsck_snapshots(repair);
+	}
+	fsck_bitmap("inode", &inode_allocator, fsck.inodes_used, repair);
+	if (repair && !blocks_known) debug_printf(0, "fsck: not repairing the data bitmap while directories are unreadable\n");
+	fsck_bitmap("data block", &data_allocator, fsck.blocks_used, repair && blocks_known);
+	if (repair && fsck.report.nrepaired) vsfs_sync();
+
+	fsck.report.ninodes = bitmap_count_words(fsck.inodes_used, fsck.inodes_used + ninode_words);
+	fsck.report.ndirs = bitmap_count_words(fsck.dirs, fsck.dirs + ninode_words);
+	fsck.report.nblocks = bitmap_count_words(fsck.blocks_used, fsck.blocks_used + nblock_words);
+	*out = fsck.report;
+	free(fsck.inodes_used);
+	free(fsck.dirs);
+	free(fsck.blocks_used);
+	free(fsck.blocks_shared);
+	free(fsck.bad);
+	free(fsck.links);
+	free(fsck.claims);
+}
+
+/* Snapshots; see vsfs.h. A snapshot is a copy of image blocks 1 up to the
+ * journal: the inode bitmap, the data bitmap, the refcount table and the
+ * inode table. Its slot in the superblock names a root block, which lists up
+ * to BLOCKNUMS_PER_BLOCK map blocks, each of which lists the copies of the
+ * next BLOCKNUMS_PER_BLOCK image blocks in turn. An image block that was all
+ * zeroes has no copy, and a map block with no copies is 0.
+ *
+ * The copy of the data bitmap is not the bitmap as it was, but the blocks
+ * that the inodes held, as live_blocks finds them: blocks that were in use
+ * only by other snapshots, or by the snapshot's own copies, are not part of
+ * it. The union of these copies over the snapshots is 'pinned', which the
+ * live filesystem must leave as it is. */
+#define SNAPSHOT_BLOCKS_PER_OP 256
+static bitmap_word_t *marking;
+static void mark_block(unsigned n, unsigned long blkno)
+{
+	bitmap_set(marking, blkno);
+}
+/* The data blocks that the inodes in use hold, and block 0, in a new bitmap
+ * of 'nbytes' bytes. */
+static bitmap_word_t *live_blocks(size_t nbytes)
+{
+	marking = calloc(1, nbytes);
+	if (!marking) err(EXIT_FAILURE, "allocating a bitmap of blocks in use");
+	for (unsigned long n = 0; ; ++n)
+	{
+		n = bitmap_find_first_set1_geq(inode_bitmap, inode_bitmap_end, n, NULL);
+		if (n >= super->num_inodes) break;
+		_Bool damaged;
+		if (inodes[n].ftype != VSF_FREE && inodes[n].ftype <= VSF_DIR_INDEX) fsck_walk_blocks(n, mark_block, &damaged, 1);
+	}
+	bitmap_set(marking, 0);
+	return marking;
+}
+/* Image blocks 1 up to here are what a snapshot copies. */
+static unsigned long snapshot_end(void)
+{
+	return super->journal_start;
+}
+static _Bool in_data_bitmap(unsigned long image_blkno)
+{
+	return image_blkno >= super->data_bitmap_start && image_blkno < super->refcount_start;
+}
+static uint32_t snapshot_root(unsigned id)
+{
+	return fsck_blkno_ok(super->snapshots[id]) ? super->snapshots[id] : 0;
+}
+/* Where snapshot 'root' keeps the number of its copy of image block
+ * 'image_blkno'; null if it has no map block for it and we may not, or
+ * cannot, make one. */
+static uint32_t *snapshot_slot(uint32_t root, unsigned long image_blkno, _Bool create)
+{
+	uint32_t *map = (uint32_t *) &data_blocks[root] + (image_blkno - 1) / BLOCKNUMS_PER_BLOCK;
+	if (!*map && !(create && alloc_zeroed_blocknum(map))) return NULL;
+	if (!fsck_blkno_ok(*map)) return NULL;
+	return (uint32_t *) &data_blocks[*map] + (image_blkno - 1) % BLOCKNUMS_PER_BLOCK;
+}
+/* The number of snapshot 'root''s copy of image block 'image_blkno', or 0. */
+static uint32_t snapshot_copy_of(uint32_t root, unsigned long image_blkno)
+{
+	uint32_t *slot = snapshot_slot(root, image_blkno, 0);
+	return (slot && fsck_blkno_ok(*slot)) ? *slot : 0;
+}
+/* Mark in 'marks' the blocks that snapshot 'root' takes: its root, its map
+ * blocks and its copies. Returns 0 if it names any block out of range,
+ * which we skip. */
+static _Bool snapshot_mark(uint32_t root, bitmap_word_t *marks)
+{
+	_Bool ok = 1;
+	bitmap_set(marks, root);
+	uint32_t *maps = (uint32_t *) &data_blocks[root];
+	for (unsigned m = 0; m < BLOCKNUMS_PER_BLOCK; ++m)
+	{
+		if (!maps[m]) continue;
+		if (!fsck_blkno_ok(maps[m])) { ok = 0; continue; }
+		bitmap_set(marks, maps[m]);
+		uint32_t *copies = (uint32_t *) &data_blocks[maps[m]];
+		for (unsigned c = 0; c < BLOCKNUMS_PER_BLOCK; ++c)
+		{
+			if (!copies[c]) continue;
+			if (fsck_blkno_ok(copies[c])) bitmap_set(marks, copies[c]);
+			else ok = 0;
+		}
+	}
+	return ok;
+}
+static void snapshot_free(uint32_t root)
+{
+	uint32_t *maps = (uint32_t *) &data_blocks[root];
+	for (unsigned m = 0; m < BLOCKNUMS_PER_BLOCK; ++m)
+	{
+		if (!maps[m]) continue;
+		uint32_t *copies = (uint32_t *) &data_blocks[maps[m]];
+		for (unsigned c = 0; c < BLOCKNUMS_PER_BLOCK; ++c) if (copies[c]) data_free_blkno(copies[c]);
+		data_free_blkno(maps[m]);
+		journal_end();
+		journal_begin();
+	}
+	data_free_blkno(root);
+}
+/* A snapshot's blocks are read only to restore it, so once committed, they
+ * needn't stay in memory. */
+static void snapshot_cold(uint32_t root)
+{
+	unsigned long first = root, n = 1; /* the run so far */
+	uint32_t *maps = (uint32_t *) &data_blocks[root];
+	for (unsigned m = 0; m < BLOCKNUMS_PER_BLOCK; ++m)
+	{
+		if (!maps[m]) continue;
+		uint32_t *copies = (uint32_t *) &data_blocks[maps[m]];
+		for (unsigned c = 0; c <= BLOCKNUMS_PER_BLOCK; ++c)
+		{
+			/* the map, then its copies */
+			uint32_t blkno = c ? copies[c - 1] : maps[m];
+			if (!blkno) continue;
+			if (blkno == first + n)
+			{
+				++n;
+				continue;
+			}
+			cold(first, n);
+			first = blkno;
+			n = 1;
+		}
+	}
+	cold(first, n);
+}
+/* Work out 'pinned' from the snapshots' copies of the data bitmap. */
+static void snapshot_load_pinned(void)
+{
+	free(pinned);
+	pinned = NULL;
+	const unsigned long words_per_block = BLOCK_SIZE / sizeof (bitmap_word_t);
+	for (unsigned id = 0; id < VSFS_MAX_SNAPSHOTS; ++id)
+	{
+		uint32_t root = snapshot_root(id);
+		if (!root) continue;
+		if (!pinned && !(pinned = calloc(data_allocator.nwords, sizeof *pinned))) err(EXIT_FAILURE, "allocating pinned blocks");
+		for (unsigned long b = super->data_bitmap_start; b < super->refcount_start; ++b)
+		{
+			uint32_t copy = snapshot_copy_of(root, b);
+			if (!copy) continue;
+			bitmap_word_t *frozen = (bitmap_word_t *) &data_blocks[copy];
+			unsigned long w0 = (b - super->data_bitmap_start) * words_per_block;
+			for (unsigned long w = w0; w < data_allocator.nwords && w < w0 + words_per_block; ++w)
+			{
+				pinned[w] |= frozen[w - w0] & usable_bits(&data_allocator, w);
+			}
+		}
+	}
+}
+/* The first image block from 'blkno' on, and before 'end', that is not in a
+ * hole of the backing file, or 'end' if there is none; sets *run to the
+ * number of blocks from there to the next hole, or to 'end'. */
+static unsigned long image_data_run(unsigned long blkno, unsigned long end, unsigned long *run)
+{
+	int fd = fileno(backing_file);
+	off_t data = lseek(fd, (off_t) blkno * BLOCK_SIZE, SEEK_DATA);
+	*run = 0;
+	if (data == -1 && errno != ENXIO)
+	{
+		/* no way to tell, so it's all data */
+		*run = end - blkno;
+		return blkno;
+	}
+	if (data == -1 || data >= (off_t) end * BLOCK_SIZE) return end;
+	off_t hole = lseek(fd, data, SEEK_HOLE);
+	unsigned long first = data / BLOCK_SIZE, last = (hole == -1) ? end : (hole + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	*run = ((last < end) ? last : end) - first;
+	return first;
+}
+long vsfs_snapshot(void)
+{
+	if (!refcounts) return -1;
+	unsigned id = 0;
+	while (id < VSFS_MAX_SNAPSHOTS && super->snapshots[id]) ++id;
+	if (id == VSFS_MAX_SNAPSHOTS || snapshot_end() - 1 > BLOCKNUMS_PER_BLOCK * BLOCKNUMS_PER_BLOCK) return -1;
+	vsfs_sync();
+	bitmap_word_t *live = live_blocks((size_t) (super->refcount_start - super->data_bitmap_start) * BLOCK_SIZE);
+	/* The copying takes many operations, but it is all or nothing anyway,
+	 * so they needn't commit one by one. */
+	_Bool durable = vsfs_durable_ops;
+	vsfs_durable_ops = 0;
+	journal_begin();
+	data_block_t *root = data_alloc();
+	_Bool ok = (root != NULL);
+	if (root) bzero(root, sizeof *root);
+	unsigned long ncopied = 0;
+	/* holes in the image are all zeroes, so have no copies */
+	for (unsigned long b = 1, run; ok && b < snapshot_end(); )
+	{
+		b = image_data_run(b, snapshot_end(), &run);
+		for (unsigned long end = b + run; ok && b < end; ++b)
+		{
+			const char *from = in_data_bitmap(b) ? (char *) live + (size_t) (b - super->data_bitmap_start) * BLOCK_SIZE
+				: (char *) mapping + (size_t) b * BLOCK_SIZE;
+			if (is_zero_block(from)) continue;
+			uint32_t *slot = snapshot_slot(root - data_blocks, b, 1);
+			data_block_t *copy = slot ? data_alloc() : NULL;
+			if (!copy) { ok = 0; break; }
+			memcpy(copy, from, sizeof *copy);
+			*slot = copy - data_blocks;
+			journal_dirty(slot, sizeof *slot);
+			if (++ncopied % SNAPSHOT_BLOCKS_PER_OP == 0)
+			{
+				journal_end();
+				journal_begin();
+			}
+		}
+	}
+	if (ok)
+	{
+		super->snapshots[id] = root - data_blocks;
+		journal_dirty(super, sizeof *super);
+	}
+	else if (root) snapshot_free(root - data_blocks);
+	journal_end();
+	vsfs_durable_ops = durable;
+	vsfs_sync();
+	if (ok) snapshot_cold(root - data_blocks);
+	if (ok && !pinned && !(pinned = calloc(data_allocator.nwords, sizeof *pinned))) err(EXIT_FAILURE, "allocating pinned blocks");
+	for (unsigned long w = 0; ok && w < data_allocator.nwords; ++w) pinned[w] |= live[w];
+	free(live);
+	return ok ? (long) id : -1;
+}
+/* Put back the blocks that snapshot 'id' copied, writing them straight to
+ * the image, since there may be far too many to journal; and so too the
+ * data bitmap: what the snapshot's inodes held, what the other snapshots
+ * hold, and every snapshot's own blocks. This is all worked out from the
+ * snapshots alone, so that if it is cut short, doing it again at the next
+ * open (see super->restoring) finishes it. */
+static void snapshot_rollback(unsigned id)
+{
+	uint32_t root = snapshot_root(id);
+	if (!root) return;
+	int fd = fileno(backing_file);
+	size_t bitmap_bytes = (size_t) (super->refcount_start - super->data_bitmap_start) * BLOCK_SIZE;
+	bitmap_word_t *bitmap = calloc(1, bitmap_bytes);
+	if (!bitmap) err(EXIT_FAILURE, "allocating the data bitmap");
+	snapshot_load_pinned();
+	memcpy(bitmap, pinned, data_allocator.nwords * sizeof *pinned);
+	for (unsigned t = 0; t < VSFS_MAX_SNAPSHOTS; ++t) if (snapshot_root(t)) snapshot_mark(snapshot_root(t), bitmap);
+	bitmap_set(bitmap, 0);
+	static const data_block_t zeroes;
+	unsigned long data = 0, data_end = 0;
+	for (unsigned long b = 1; b < snapshot_end(); ++b)
+	{
+		uint32_t copy = snapshot_copy_of(root, b);
+		const void *from = in_data_bitmap(b) ? (char *) bitmap + (size_t) (b - super->data_bitmap_start) * BLOCK_SIZE
+			: copy ? (const void *) &data_blocks[copy] : NULL;
+		if (!from)
+		{
+			/* what is a hole already needn't be zeroed */
+			if (b >= data_end)
+			{
+				unsigned long run;
+				data = image_data_run(b, snapshot_end(), &run);
+				data_end = data + run;
+			}
+			if (b < data) continue;
+			from = zeroes;
+		}
+		for (ssize_t n = 0, done = 0; done < BLOCK_SIZE; done += n)
+		{
+			n = pwrite(fd, (const char *) from + done, BLOCK_SIZE - done, (off_t) b * BLOCK_SIZE + done);
+			if (n <= 0) err(EXIT_FAILURE, "restoring snapshot %u", id);
+		}
+	}
+	free(bitmap);
+	if (fdatasync(fd) != 0) err(EXIT_FAILURE, "restoring snapshot %u", id);
+	/* With a journal, the mapping is private, and may hold its own copies
+	 * of what we just wrote, which this drops. */
+	size_t from = ROUND_DOWN_TO(page_size, BLOCK_SIZE), to = ROUND_UP_TO(page_size, (size_t) snapshot_end() * BLOCK_SIZE);
+	if (madvise((char *) mapping + from, to - from, MADV_DONTNEED) != 0) err(EXIT_FAILURE, "restoring snapshot %u", id);
+	allocator_init(&inode_allocator, inode_bitmap, super->num_inodes, 0);
+	allocator_init(&data_allocator, data_bitmap, super->num_data_blocks, 0);
+	bmap_cache_deinit();
+	cluster_cache_deinit();
+	dcache_deinit();
+}
+long vsfs_snapshot_restore(unsigned long id)
+{
+	if (!refcounts || id >= VSFS_MAX_SNAPSHOTS || !snapshot_root(id)) return -1;
+	vsfs_sync();
+	journal_begin();
+	super->restoring = id + 1;
+	journal_dirty(super, sizeof *super);
+	journal_end();
+	vsfs_sync();
+	snapshot_rollback(id);
+	journal_begin();
+	super->restoring = 0;
+	journal_dirty(super, sizeof *super);
+	journal_end();
+	vsfs_sync();
+	return 0;
+}
+long vsfs_snapshot_delete(unsigned long id)
+{
+	if (!refcounts || id >= VSFS_MAX_SNAPSHOTS || !super->snapshots[id]) return -1;
+	vsfs_sync();
+	journal_begin();
+	super->snapshots[id] = 0;
+	journal_dirty(super, sizeof *super);
+	journal_end();
+	vsfs_sync();
+	/* Free what nothing else holds: not the inodes, nor another snapshot. */
+	snapshot_load_pinned();
+	bitmap_word_t *expected = live_blocks(data_allocator.nwords * sizeof (bitmap_word_t));
+	for (unsigned long w = 0; pinned && w < data_allocator.nwords; ++w) expected[w] |= pinned[w];
+	for (unsigned t = 0; t < VSFS_MAX_SNAPSHOTS; ++t) if (snapshot_root(t)) snapshot_mark(snapshot_root(t), expected);
+	allocator_set_bitmap(&data_allocator, expected);
+	free(expected);
+	vsfs_sync();
+	return 0;
+}
+
+/* Defragmentation. A file's blocks lie in runs of physically contiguous data
+ * blocks, and reading it in order costs a seek between runs. vsfs_defrag
+ * moves each file that has several into one free run long enough for all of
+ * them, found first-fit, a few hundred blocks per operation: each claims the
+ * next blocks of the run, copies the file's next blocks into them, and maps
+ * them in place of the old ones, which it frees, so that a crash leaves every
+ * file whole, if not yet in one run. Holes stay holes; the blocks either side
+ * of one just end up adjacent. Shared blocks (see block_shared) stay put, as
+ * moving one would unshare it, and so does block 0, which must stay
+ * allocated; so do the files that hold them. The run is not reserved between
+ * operations, so if another allocation takes part of it meanwhile, the file
+ * stays as far as it got, to be taken up again by the next sweep. A sweep
+ * goes through the inodes in turn, and may take many calls, each carrying on
+ * where the last stopped, in the middle of a file if need be. */
+#define DEFRAG_BLOCKS_PER_OP 256
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Where the sweep has got to: the inode, and once we have started moving
+ * it, its next file block and where that goes. */
+static struct
+{
+	unsigned long inode;
+	_Bool moving;
+	unsigned long file_block;
+	unsigned long dest;
+} defrag_at;
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/* The number of physically contiguous runs that the file's blocks lie in. */
+static unsigned long file_runs(struct inode *i)
+{
+	if (is_inline(i)) return 0;
+	unsigned long n = 0, next = -1;
+	for (unsigned k = 0; k < i->nextents; ++k)
+	{
+		struct extent *e = extent_at(i, k);
+		if (e->start != next) ++n;
+		next = e->start + e->len;
+	}
+	return n;
+}
+static _Bool block_movable(unsigned long blkno)
+{
+	return blkno != 0 && !block_shared(blkno);
+}
+/* How many blocks the file has, or 0 if any of them must stay put. */
+static unsigned long movable_blocks(struct inode *i)
+{
+	unsigned long n = 0;
+	for (unsigned k = 0; k < i->nextents; ++k)
+	{
+		struct extent *e = extent_at(i, k);
+		for (unsigned b = 0; b < e->len; ++b) if (!block_movable(e->start + b)) return 0;
+		n += e->len;
+	}
+	return n;
+}
+/* The first run of free data blocks at or after 'from': returns its first
+ * block, having set *len to its length, or -1 if there is none. */
+static unsigned long free_run(unsigned long from, unsigned long *len)
+{
+	unsigned long nbits = data_allocator.nbits;
+	unsigned long start = bitmap_find_first_clear_geq(data_bitmap, data_bitmap_end, from, NULL);
+	if (start >= nbits) return -1;
+	unsigned long end = bitmap_find_first_set1_geq(data_bitmap, data_bitmap_end, start, NULL);
+	*len = ((end < nbits) ? end : nbits) - start;
+	return start;
+}
+/* The first free run of at least 'n' blocks, or 0 if there is none. */
+static unsigned long defrag_dest(unsigned long n)
+{
+	unsigned long len;
+	for (unsigned long b = free_run(0, &len); b != -1; b = free_run(b + len, &len))
+	{
+		if (len >= n) return b;
+	}
+	return 0;
+}
+/* Move the file's blocks from file block *file_block on into the free blocks
+ * from *dest on, up to DEFRAG_BLOCKS_PER_OP of them, advancing both; if
+ * *dest is 0, first find room for all of them. Returns how many we moved, or
+ * -1 if we could move none. Call with the file write-locked, inside
+ * journal_begin/end. */
+static long defrag_step(struct inode *f, unsigned long *file_block, unsigned long *dest)
+{
+	_Bool cached = cached_data && f->ftype == VSF_FILE;
+	if (is_inline(f) || !extents_private(f)) return -1;
+	/* The moved blocks replace the extents they were in, but for a part of
+	 * the first before them and of the last after them. Make room for
+	 * those first, as a block that that takes would be the first free one,
+	 * where ours are going. */
+	if (!ensure_extent_slot(f, f->nextents) || !ensure_extent_slot(f, f->nextents + 1)) return -1;
+	if (*dest == 0)
+	{
+		unsigned long n = movable_blocks(f);
+		if (n == 0 || !(*dest = defrag_dest(n))) return -1;
+	}
+	/* the extents holding the blocks, and how many of those we can move */
+	unsigned from = search_extents(f, NULL, f->nextents, *file_block), to;
+	if (from > 0 && extent_contains(extent_at(f, from - 1), *file_block)) --from;
+	unsigned long want = 0;
+	for (to = from; to < f->nextents && want < DEFRAG_BLOCKS_PER_OP; ++to)
+	{
+		struct extent *e = extent_at(f, to);
+		unsigned skip = (*file_block > e->file_block) ? *file_block - e->file_block : 0, b;
+		for (b = skip; b < e->len && want < DEFRAG_BLOCKS_PER_OP && block_movable(e->start + b); ++b) ++want;
+		if (b < e->len && want < DEFRAG_BLOCKS_PER_OP) break;
+	}
+	unsigned long got = (want && may_allocate(want)) ? allocator_claim_run(&data_allocator, *dest, want) : 0;
+	if (got == 0) return -1;
+	/* Copy them over, and work out the extents that replace theirs: one
+	 * per stretch between holes, joined to the one before if it ends where
+	 * they start. */
+	struct extent x[DEFRAG_BLOCKS_PER_OP + 2];
+	unsigned n = 0;
+	unsigned long done = 0, fb = *file_block;
+	for (to = from; done < got; ++to)
+	{
+		struct extent e = *extent_at(f, to);
+		unsigned skip = (fb > e.file_block) ? fb - e.file_block : 0;
+		unsigned len = (e.len - skip < got - done) ? e.len - skip : got - done;
+		if (skip) x[n++] = (struct extent) { .file_block = e.file_block, .start = e.start, .len = skip };
+		for (unsigned k = 0; k < len; ++k)
+		{
+			unsigned long old = e.start + skip + k, new = *dest + done + k;
+			if (!cached)
+			{
+				journal_fresh(&data_blocks[new]);
+				memcpy(&data_blocks[new], &data_blocks[old], sizeof (data_block_t));
+			}
+			else
+			{
+				char *p = bcache_get(old, 0), *q = bcache_get(new, 1);
+				memcpy(q, p, BLOCK_SIZE);
+				bcache_put(new, 1);
+				bcache_put(old, 0);
+			}
+			/* as in cluster_write, for a block that may start a cluster */
+			if (is_compressed(f)) cluster_cache_forget(new);
+		}
+		blocks_put(e.start + skip, len);
+		struct extent moved = { .file_block = e.file_block + skip, .start = *dest + done, .len = len };
+		if (n && x[n - 1].file_block + x[n - 1].len == moved.file_block && x[n - 1].start + x[n - 1].len == moved.start)
+		{
+			x[n - 1].len += len;
+		}
+		else x[n++] = moved;
+		if (skip + len < e.len)
+		{
+			x[n++] = (struct extent) { .file_block = moved.file_block + len, .start = e.start + skip + len, .len = e.len - skip - len };
+		}
+		done += len;
+		fb = moved.file_block + len;
+	}
+	struct extent *prev = from ? extent_at(f, from - 1) : NULL;
+	if (prev && prev->file_block + prev->len == x[0].file_block && prev->start + prev->len == x[0].start)
+	{
+		x[0] = (struct extent) { .file_block = prev->file_block, .start = prev->start, .len = prev->len + x[0].len };
+		--from;
+	}
+	splice_extents(f, from, to, x, n);
+	*file_block = fb;
+	*dest += got;
+	return got;
+}
+long vsfs_fragments(struct inode *f)
+{
+	if (f->ftype == VSF_FREE) return -1;
+	inode_rdlock(f);
+	long n = file_runs(f);
+	inode_unlock(f);
+	return n;
+}
+void vsfs_defrag(unsigned long budget_ms, struct vsfs_defrag_report *out)
+{
+	double deadline = now_ns() + budget_ms * 1e6;
+	struct vsfs_defrag_report r = { 0 };
+	pthread_mutex_lock(&defrag_lock);
+	while (defrag_at.inode < super->num_inodes && !(budget_ms && now_ns() >= deadline))
+	{
+		struct inode *f = &inodes[defrag_at.inode];
+		if (!defrag_at.moving)
+		{
+			/* a new file: is it worth moving? */
+			unsigned long runs = 0;
+			inode_rdlock(f);
+			if (bitmap_get(inode_bitmap, defrag_at.inode) && f->ftype != VSF_FREE) runs = file_runs(f);
+			_Bool movable = (runs > 1 && movable_blocks(f));
+			inode_unlock(f);
+			r.nfiles += (runs > 0);
+			r.nfragmented += (runs > 1);
+			if (!movable)
+			{
+				++defrag_at.inode;
+				continue;
+			}
+			defrag_at.moving = 1;
+			defrag_at.file_block = defrag_at.dest = 0;
+		}
+		journal_begin();
+		inode_wrlock(f);
+		long moved = (f->ftype != VSF_FREE) ? defrag_step(f, &defrag_at.file_block, &defrag_at.dest) : -1;
+		_Bool finished = (moved < 0 || defrag_at.file_block >= f->nblocks);
+		if (finished && moved >= 0 && file_runs(f) == 1) ++r.ndefragged;
+		inode_unlock(f);
+		journal_end();
+		if (moved > 0) r.nblocks_moved += moved;
+		if (finished)
+		{
+			defrag_at.moving = 0;
+			++defrag_at.inode;
+		}
+	}
+	if (defrag_at.inode >= super->num_inodes)
+	{
+		r.done = 1;
+		defrag_at.inode = 0;
+	}
+	pthread_mutex_unlock(&defrag_lock);
+	*out = r;
+}
+void vsfs_free_histogram(struct vsfs_free_histogram *out)
+{
+	*out = (struct vsfs_free_histogram) { 0 };
+	unsigned long len;
+	for (unsigned long b = free_run(0, &len); b != -1; b = free_run(b + len, &len))
+	{
+		unsigned k = word_msb(len);
+		++out->nruns;
+		out->nfree += len;
+		if (len > out->largest) out->largest = len;
+		++out->bucket_nruns[k];
+		out->bucket_nblocks[k] += len;
+	}
+}
+
+#ifdef VSFS_BENCH
+/* Entry points for bench-core, which times these internals on their own,
+ * and for the tests. Only the objects built for those have them. */
+struct inode *vsfs_bench_inode_alloc(void)
+{
+	return inode_alloc();
+}
+void vsfs_bench_inode_free(struct inode *i)
+{
+	inode_free(i);
+}
+unsigned long vsfs_bench_data_alloc(void)
+{
+	data_block_t *d = data_alloc();
+	return d ? (unsigned long) (d - data_blocks) : -1;
+}
+void vsfs_bench_data_free(unsigned long blkno)
+{
+	data_free_blkno(blkno);
+}
+unsigned long vsfs_bench_map_block(struct inode *f, unsigned long file_block)
+{
+	inode_rdlock(f);
+	unsigned long blkno = is_inline(f) ? -1 : map_file_block(f, file_block);
+	inode_unlock(f);
+	return blkno;
+}
+_Bool vsfs_bench_block_shared(unsigned long blkno)
+{
+	return block_shared(blkno);
+}
+#endif
+
+/* The following serve the command line, but need to access the inode table
+ * or other structures private to this file. The command line does the rest
+ * through the vsfs_* operations, so that nothing here clashes with libc
+ * (there used to be a 'creat') and other programs can link against it. */
+
+void dumpd(unsigned idx)
+{
+	debug_printf(0, "contents of file with inode %u, as a directory:\n", idx);
+	struct inode *inode = &inodes[idx];
+	if (inode->ftype != VSF_DIR) debug_printf(0, "(not a directory)");
+
+	for_each_data_block(inode, dump_one_block_as_dirents, inode->size);
+}
+
+static void dump_hole(unsigned long from_block, unsigned long to_block, unsigned long size)
+{
+	unsigned long end = to_block * BLOCK_SIZE;
+	debug_printf(0, "(hole: bytes %lu-%lu read as zeroes)\n", from_block * BLOCK_SIZE, ((end < size) ? end : size) - 1);
+}
+/* A compressed file's contents, decompressed, and what holds each cluster. */
+static void dump_clusters(struct inode *inode, unsigned long size_blocks)
+{
+	char *cluster = malloc(CLUSTER_SIZE);
+	if (!cluster) err(EXIT_FAILURE, "allocating a cluster buffer");
+	for (unsigned long c = 0; c * VSFS_CLUSTER_BLOCKS < size_blocks; ++c)
+	{
+		unsigned long blknos[VSFS_CLUSTER_BLOCKS], first = c * VSFS_CLUSTER_BLOCKS;
+		unsigned n = cluster_blocks(inode, c, blknos);
+		unsigned long end = (first + VSFS_CLUSTER_BLOCKS < size_blocks) ? first + VSFS_CLUSTER_BLOCKS : size_blocks;
+		if (n == 0)
+		{
+			dump_hole(first, end, inode->size);
+			continue;
+		}
+		if (n < VSFS_CLUSTER_BLOCKS) debug_printf(0, "(cluster %lu: compressed into %u blocks)\n", c, n);
+		if (!cluster_read(inode, c, cluster))
+		{
+			debug_printf(0, "(cluster %lu: damaged)\n", c);
+			continue;
+		}
+		for (unsigned long b = first; b < end; ++b)
+		{
+			dump_one_block_as_raw_data((data_block_t *) (cluster + (b - first) * BLOCK_SIZE), b, inode->size);
+		}
+	}
+	free(cluster);
+}
+void dumpf(unsigned idx)
+{
+	debug_printf(0, "contents of file with inode %u, as raw bytes:\n", idx);
+	struct inode *inode = &inodes[idx];
+	if (inode->ftype == VSF_FREE) debug_printf(0, "inode is unallocated");
+	if (is_inline(inode))
+	{
+		debug_printf(0, "(inline, held in the inode)\n");
+		if (inode->size) dump_one_block_as_raw_data((data_block_t *) inode->inline_data, 0, inode->size);
+		return;
+	}
+
+	unsigned long size_blocks = ((unsigned long) inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (is_compressed(inode))
+	{
+		dump_clusters(inode, size_blocks);
+		return;
+	}
+	unsigned long next = 0; /* the file block after the last extent */
+	for (unsigned n = 0; n < inode->nextents && next < size_blocks; ++n)
+	{
+		struct extent *e = extent_at(inode, n);
+		if (e->file_block > next) dump_hole(next, e->file_block, inode->size);
+		for (unsigned i = 0; i < e->len && e->file_block + i < size_blocks; ++i)
+		{
+			data_block_t *b = (data_block_t *) file_block_get(e->start + i, 0);
+			dump_one_block_as_raw_data(b, e->file_block + i, inode->size);
+			file_block_put(e->start + i, NULL, 0);
+		}
+		next = e->file_block + e->len;
+	}
+	if (size_blocks > next) dump_hole(next, size_blocks, inode->size);
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 extern unsigned debug_level;
 extern FILE *debug_out;
@@ -12,35 +13,129 @@ extern FILE *debug_out;
 #define BLOCK_SIZE 4096
 typedef char data_block_t[BLOCK_SIZE];
 
-/* XXX: we do memcmp on this struct, so it should not contain any padding. */
+#define VSFS_MAX_SNAPSHOTS 8
+/* XXX: we do memcmp on this struct, up to the free counts, so it should not
+ * contain any padding. */
 struct superblock
 {
 	char magic[4];
-	uint32_t fs_size_in_bytes;
+	uint32_t fs_size_in_bytes; /* 0 with VSFS_FEATURE_LAYOUT */
 	uint32_t block_size_in_bytes;
 	uint32_t num_inodes;
 	uint32_t num_data_blocks;
+	uint32_t features; /* VSFS_FEATURE_* bits */
+	uint32_t journal_nblocks; /* 0 unless VSFS_FEATURE_JOURNAL */
+	/* The rest is 0 unless VSFS_FEATURE_LAYOUT. Regions are given by their
+	 * first block, counting from the start of the image; each one ends where
+	 * the next begins. */
+	uint32_t fs_size_in_blocks;
+	uint32_t inode_bitmap_start;
+	uint32_t data_bitmap_start;
+	uint32_t inode_table_start;
+	uint32_t journal_start;
+	uint32_t data_start;
+	/* With VSFS_FEATURE_FREE_COUNTS, how many inodes and data blocks are
+	 * free, as of the last commit (or sync, without a journal). */
+	uint32_t nfree_inodes;
+	uint32_t nfree_data_blocks;
+	/* With VSFS_FEATURE_REFCOUNTS, the first block of the refcount table,
+	 * which lies between the data bitmap and the inode table; the first
+	 * block of each snapshot's map, or 0 for an unused slot; and, while a
+	 * snapshot is being restored, one more than its slot number (see
+	 * vsfs_snapshot_restore). */
+	uint32_t refcount_start;
+	uint32_t snapshots[VSFS_MAX_SNAPSHOTS];
+	uint32_t restoring;
 };
-/* We reserve 8 initial blocks: one for superblock, two for bitmaps, 5 for inode table */
-#define START_BLOCKS_RESERVED 8
-#define TOTAL_BLOCKS 64
+/* Directories hold variable-length struct vdirents, not struct dirents. */
+#define VSFS_FEATURE_COMPACT_DIRENTS 0x1
+/* Metadata changes go through a journal, in the blocks just after the inode
+ * table. Data blocks follow the journal. */
+#define VSFS_FEATURE_JOURNAL 0x2
+/* The geometry was chosen at mkfs time, and the superblock records it: the
+ * image may be any size up to 2^32 blocks, and the bitmaps and the inode
+ * table as big as it needs. Without this, the image has one block for each
+ * bitmap and five for the inode table, so at most 320 inodes and 32768 data
+ * blocks. Either way the order is: superblock, inode bitmap, data bitmap,
+ * (refcount table,) inode table, journal, data blocks. */
+#define VSFS_FEATURE_LAYOUT 0x4
+/* Tiny regular files keep their contents in the inode; see struct inode. */
+#define VSFS_FEATURE_INLINE_DATA 0x8
+/* The superblock keeps count of free inodes and data blocks. */
+#define VSFS_FEATURE_FREE_COUNTS 0x10
+/* Data blocks may be shared, by files that vsfs_clone made and by snapshots;
+ * a table after the data bitmap counts the extra owners of each. Needs
+ * VSFS_FEATURE_LAYOUT. */
+#define VSFS_FEATURE_REFCOUNTS 0x20
+/* Regular files may be compressed; see vsfs_set_compression. */
+#define VSFS_FEATURE_COMPRESSION 0x40
+#define VSFS_KNOWN_FEATURES (VSFS_FEATURE_COMPACT_DIRENTS|VSFS_FEATURE_JOURNAL|VSFS_FEATURE_LAYOUT\
+	|VSFS_FEATURE_INLINE_DATA|VSFS_FEATURE_FREE_COUNTS|VSFS_FEATURE_REFCOUNTS|VSFS_FEATURE_COMPRESSION)
 
 #define ROUND_UP_TO(mult, quant) \
 	( ((quant) % (mult) == 0) ? (quant) : (mult)*(1+((quant)/(mult))) )
 #define ROUND_DOWN_TO(mult, quant) \
 	( (mult)*((quant)/(mult)) )
 
-#define NDIRECT 10  /* 10 directly addressed blocks */
-enum ftype_t { VSF_FREE, VSF_FILE, VSF_DIR };
+/* A run of 'len' physically contiguous data blocks, holding the file's blocks
+ * from 'file_block' onwards. A file's extents are kept sorted by file_block. */
+struct extent
+{
+	uint32_t file_block;
+	uint32_t start; /* NB blocks are numbered from start of data blocks */
+	uint32_t len;
+};
+#define NEXTENTS 3  /* 3 extents held in the inode itself */
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof (struct extent))
+#define BLOCKNUMS_PER_BLOCK (BLOCK_SIZE / sizeof (uint32_t))
+#define MAX_EXTENTS (NEXTENTS + EXTENTS_PER_BLOCK + BLOCKNUMS_PER_BLOCK * EXTENTS_PER_BLOCK)
+#define INLINE_DATA_MAX (NEXTENTS * sizeof (struct extent) + 2 * sizeof (uint32_t))
+enum ftype_t { VSF_FREE, VSF_FILE, VSF_DIR, VSF_DIR_INDEX };
 struct inode
 {
 	/*ftype_t*/ uint16_t ftype;
 	uint16_t refcount;
-	uint16_t nblocks; /* number of blocks allocated to this file */
-	uint16_t direct[NDIRECT];
-	/* XXX: indirect block here? */
+	uint32_t nblocks; /* one past the last file block mapped by an extent */
 	uint32_t size; /* size in bytes of file/dir */
+	uint32_t nextents;
+	union
+	{
+		struct
+		{
+			struct extent extents[NEXTENTS];
+			/* Extents beyond the first NEXTENTS overflow into the indirect
+			 * extent block, and beyond that, into the extent blocks listed
+			 * by the double-indirect block. Data block 0 always belongs to
+			 * the root directory, so 0 means "none". */
+			uint32_t extent_indirect;
+			uint32_t extent_dindirect;
+		};
+		/* With VSFS_FEATURE_INLINE_DATA, a regular file with no extents
+		 * and no more than INLINE_DATA_MAX bytes holds them here instead,
+		 * and has no blocks at all. Bytes past its size are zero. */
+		char inline_data[INLINE_DATA_MAX];
+	};
+	union
+	{
+		/* Directories only: the (unnamed) inode holding this directory's
+		 * hashed name index, or 0 if it has none. */
+		uint32_t dir_index;
+		/* Regular files only: VSFS_INODE_* bits. */
+		uint32_t flags;
+	};
 };
+/* The file's contents are compressed, in clusters of VSFS_CLUSTER_BLOCKS
+ * blocks (file blocks 0-3, 4-7 and so on). A cluster with no blocks mapped
+ * is a hole, and one with all of them holds its bytes as they are. One with
+ * fewer, which are always its first, holds them compressed by lz_compress
+ * (see lz.h), preceded by their compressed length, a uint32_t; the rest of
+ * its last block is zeroes. A cluster is always stored whole, so the last
+ * one, unless compressed, has blocks past the end of the file. Needs
+ * VSFS_FEATURE_COMPRESSION. */
+#define VSFS_INODE_COMPRESSED 0x1
+#define VSFS_CLUSTER_BLOCKS 4
+_Static_assert(BLOCK_SIZE % sizeof (struct inode) == 0, "inode size must divide the block size");
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof (struct inode))
 
 #define MAX_NAME_LEN 254
 struct dirent
@@ -51,35 +146,298 @@ struct dirent
 };
 _Static_assert(BLOCK_SIZE % sizeof (struct dirent) == 0, "directory entry size must divide the block size");
 
-/* utility code: open or create a vsfs */
+/* Compact directory entry, used when the superblock has
+ * VSFS_FEATURE_COMPACT_DIRENTS. Records are 4-byte aligned and never straddle
+ * a block; a rec_len of 0 means the rest of the block is unused. A record may
+ * be longer than its name needs, and new entries reuse that slack. A deleted
+ * entry becomes slack of the record before it in its block, or, if it is the
+ * first, keeps its rec_len but has name_len 0. The name is not null-terminated.
+ * We store the name's hash so that scans can mostly skip the memcmp. */
+struct vdirent
+{
+	uint16_t rec_len; /* bytes from this record to the next */
+	uint8_t name_len;
+	uint8_t unused;
+	uint32_t inode_num;
+	uint32_t hash;
+	char name[];
+};
+#define VDIRENT_SIZE(name_len) ROUND_UP_TO(4, sizeof (struct vdirent) + (name_len))
+
+/* utility code: open or create a vsfs. The backing file must be
+ * 'expected_size' bytes long, unless that is 0, in which case the
+ * filesystem is as big as the file. */
 void vsfs_init(const char *backing_file_name, size_t expected_size);
+/* feature bits given to freshly created filesystems, and those of the open one */
+extern uint32_t vsfs_mkfs_features;
+uint32_t vsfs_features(void);
+/* journal size and inode count for freshly created filesystems; 0 picks one
+ * from the image size */
+extern unsigned vsfs_mkfs_journal_blocks;
+extern unsigned vsfs_mkfs_inodes;
+/* How the contents of regular files are reached; set before vsfs_init. By
+ * default, like everything else, through the mapping of the image, so that
+ * every change goes through the journal. With VSFS_BACKEND_PREAD, they go
+ * through a buffer cache of vsfs_bcache_budget bytes, read with pread and
+ * written back with pwrite (see bcache.h), which bounds the memory they take
+ * and, with vsfs_bcache_direct, keeps them out of the page cache. File data
+ * is then not journalled: it reaches the image when evicted and at vsfs_sync,
+ * not as each operation commits, so a crash may leave a file with stale
+ * contents in blocks written since the last vsfs_sync. Directories and other
+ * metadata always go through the mapping. */
+enum vsfs_backend { VSFS_BACKEND_MMAP, VSFS_BACKEND_PREAD };
+extern enum vsfs_backend vsfs_backend;
+/* The most that vsfs_read and vsfs_read_spans read ahead of a file being
+ * read sequentially, in bytes (2 MB by default); set before vsfs_init. With
+ * 0, the kernel's own read-around on the mapping does instead, which reads
+ * pages around each one faulted in, whether the reads are sequential or
+ * not. See readahead in vsfs.c. */
+extern unsigned long vsfs_readahead_max;
+
+/* the inode numbered 'idx', or null if there is no such inode */
+struct inode *vsfs_inode(unsigned idx);
 
-/* walk data blocks */
+/* Whether to build hashed name indexes for directories that outgrow one
+ * block. Directories without an index are searched linearly. */
+extern _Bool vsfs_dir_index_enabled;
+
+/* walk data blocks, one at a time or as physically contiguous runs
+ * (these take no locks) */
 enum cb_res_t { VSF_NO_RESULT, VSF_STOP, VSF_CONTINUE };
 typedef enum cb_res_t block_cb_t(data_block_t *block, unsigned block_idx_in_file, uintptr_t arg);
 enum cb_res_t for_each_data_block(struct inode *inode, block_cb_t *cb, uintptr_t arg);
+typedef enum cb_res_t run_cb_t(data_block_t *first_block, unsigned nblocks,
+	unsigned first_block_idx_in_file, uintptr_t arg);
+enum cb_res_t for_each_data_run(struct inode *inode, run_cb_t *cb, uintptr_t arg);
 
 /* External operations. Each of these may be lightly glued into
- * the command-line front-end and the fuse front-end. */
+ * the command-line front-end and the fuse front-end. They are safe to call
+ * from several threads at once. A returned struct dirent is only good until
+ * the calling thread's next call. */
 #ifndef CMDLINE_FMT
 #define CMDLINE_FMT(ident, argstr) \
 	extern const char ident ## _cmdline[];
 #endif
 
-struct inode *vsfs_creat(struct inode *dir, const char *name); CMDLINE_FMT(creat, "%u %d %s");
+struct inode *vsfs_creat(struct inode *dir, const char *name); CMDLINE_FMT(creat, "%u %s");
 struct dirent *vsfs_link(struct inode *dir, struct inode *tgt, const char *name); CMDLINE_FMT(link, "%u %u %s");
-struct dirent *vsfs_unlink(struct dirent *ent); CMDLINE_FMT(unlink, "%u");
-struct inode *vsfs_lookup(struct inode *dir, const char *pathname); CMDLINE_FMT(lookup, "%u");
+struct inode *vsfs_unlink(struct inode *dir, const char *name); CMDLINE_FMT(unlink, "%u %s");
+struct inode *vsfs_lookup(struct inode *dir, const char *pathname); CMDLINE_FMT(lookup, "%u %s");
 
 struct dirent *vsfs_lookup_one(struct inode *dir, const char *filename); CMDLINE_FMT(lookupd, "%u %s");
 
+/* Read or write up to 'sz' bytes of regular file 'f' at 'offset'. Reads stop
+ * at the end of the file; writes extend it, and a gap reads as zeroes.
+ * Both return the number of bytes done, or -1 on error. vsfs_writev writes
+ * the concatenation of 'iov', all or nothing, as one journalled operation,
+ * unless it is longer than one step of the journal allows: about a
+ * seventieth of the journal's size, or a block, whichever is more. Then it
+ * goes in steps that end on block boundaries, each all or nothing, so an
+ * error partway leaves the steps before it done, and the return value says
+ * how many bytes they hold; a crash may leave any number of them done.
+ *
+ * Data written past a file's last block is buffered in memory, and given
+ * blocks only when the buffer is flushed: once it would grow beyond
+ * vsfs_write_buffer_max bytes, once all buffers hold more than
+ * vsfs_write_buffer_total, on vsfs_sync and at exit. Until then it is
+ * not in the image, journalled or not. A vsfs_write_buffer_max of 0 gives
+ * every write its blocks at once. */
+long vsfs_read(struct inode *f, unsigned long offset, char *buf, unsigned long sz); CMDLINE_FMT(read, "%u %lu %lu");
+long vsfs_write(struct inode *f, unsigned long offset, const char *buf, unsigned long sz); CMDLINE_FMT(write, "%u %lu %s");
+long vsfs_writev(struct inode *f, unsigned long offset, const struct iovec *iov, unsigned iovcnt);
+extern unsigned long vsfs_write_buffer_max;
+extern unsigned long vsfs_write_buffer_total;
+/* Give regular file 'f' the size 'sz', returning its new size, or -1 on
+ * error. Growing a file leaves a hole at its end. Files cannot shrink yet. */
+unsigned long vsfs_truncate(struct inode *f, unsigned long sz); CMDLINE_FMT(truncate, "%u %lu");
+/* Files may have holes: ranges with no blocks, which read as zeroes and take
+ * no space in the image. These say where the first byte of data, or of a
+ * hole, lies at or after 'offset', like lseek's SEEK_DATA and SEEK_HOLE, so
+ * that copying and backup tools can skip the holes. Every file ends in a
+ * hole, at its size. Both return -1 if 'offset' is at or past the end of the
+ * file, or on error, and seek_data does if there is no more data. */
+long vsfs_seek_data(struct inode *f, unsigned long offset); CMDLINE_FMT(seekdata, "%u %lu");
+long vsfs_seek_hole(struct inode *f, unsigned long offset); CMDLINE_FMT(seekhole, "%u %lu");
+/* Zero-copy read: rather than copying, fill in up to *nspans spans pointing
+ * straight at the file's bytes in the image, for up to 'sz' bytes at
+ * 'offset', e.g. for writev or vmsplice. Sets *nspans to the number used and
+ * returns the number of bytes covered, which is less than 'sz' at the end of
+ * the file, if the spans ran out, or after a compressed cluster (see
+ * vsfs_set_compression); or returns -1 on error.
+ *
+ * After a successful call, the file is read-locked until the same thread
+ * calls vsfs_release_spans(f), which it must do exactly once. Until then the
+ * spans stay valid and the bytes they cover do not change: anything that
+ * would write, truncate or free the file waits. So hold spans only briefly,
+ * and don't write to the file from the same thread meanwhile. The spans are
+ * read-only. With the pread backend, they point into the buffer cache, whose
+ * blocks they keep pinned, and a thread may hold only one set at a time. */
+long vsfs_read_spans(struct inode *f, unsigned long offset, unsigned long sz,
+	struct iovec *spans, unsigned *nspans);
+void vsfs_release_spans(struct inode *f);
+/* Capacity and usage, in constant time whatever the size of the image. Free
+ * data blocks include those promised to buffered writes (see vsfs_write),
+ * which other writes cannot have; 'navail_data_blocks' leaves them out. */
+struct vsfs_statfs
+{
+	unsigned long block_size;
+	unsigned long ninodes;
+	unsigned long nfree_inodes;
+	unsigned long ndata_blocks;
+	unsigned long nfree_data_blocks;
+	unsigned long navail_data_blocks;
+};
+void vsfs_statfs(struct vsfs_statfs *out); CMDLINE_FMT(statfs, "");
+/* make everything done so far durable */
+void vsfs_sync(void); CMDLINE_FMT(sync, "");
+/* Make everything done so far to file 'f' durable, costing time in
+ * proportion to what changed rather than to the image: this flushes only the
+ * file's write buffer and, with the pread backend, only its dirty cached
+ * blocks, and commits the journal's running batch, which may hold other
+ * operations too; a batch with nothing in it costs nothing. Returns 0, or -1
+ * if there was no room for the file's buffered data. */
+long vsfs_fsync(struct inode *f); CMDLINE_FMT(fsync, "%u");
+
+/* Compress regular file 'f' from now on if 'on', or stop if not, with
+ * VSFS_FEATURE_COMPRESSION. Only an empty file can change; returns 0, or -1
+ * if the file has contents or the filesystem lacks the feature. A compressed
+ * file is read and written like any other, but a write rewrites each cluster
+ * that it touches, compressing it afresh, and a read decompresses each one
+ * it needs, keeping the last few in a cache. Clusters of zeroes take no
+ * blocks, so a compressed file's holes are its clusters of zeroes, whether
+ * written or not. vsfs_read_spans covers at most one compressed cluster per
+ * call, and points into a buffer of the calling thread. */
+long vsfs_set_compression(struct inode *f, unsigned long on); CMDLINE_FMT(compress, "%u %lu");
+
+/* Sharing, on a filesystem with VSFS_FEATURE_REFCOUNTS (these fail without
+ * it). A shared data block is copied when first written, by whichever file
+ * writes it, so sharing takes no space until the data diverges.
+ *
+ * vsfs_clone makes a new regular file called 'name' in 'dir' with the
+ * contents of regular file 'src', whose data blocks it shares, and returns
+ * it, or null. It copies the blocks holding the extents and counts one more
+ * reference to each data block, but copies no data. A block can be shared
+ * by at most 256 files.
+ *
+ * vsfs_snapshot freezes the whole filesystem as it is, returning the
+ * snapshot's number, or -1 if there is no room for it or VSFS_MAX_SNAPSHOTS
+ * are taken. It copies the bitmaps, the refcount table and the inode table,
+ * or rather the parts of them that are not holes, into data blocks, and
+ * thereafter holds every data block that was in use, so that nothing that
+ * the snapshot refers to is overwritten or reused. vsfs_snapshot_restore
+ * puts the filesystem back as it was when the snapshot was taken, keeping
+ * the snapshot, so that it can be restored again; a crash part way through
+ * leaves it to be finished at the next vsfs_init. vsfs_snapshot_delete lets
+ * go of a snapshot, and of the blocks that only it held. These return 0, or
+ * -1 if there is no such snapshot. All three make everything durable first,
+ * and, like vsfs_fsck, must be called with nothing else in flight. */
+struct inode *vsfs_clone(struct inode *src, struct inode *dir, const char *name); CMDLINE_FMT(clone, "%u %u %s");
+long vsfs_snapshot(void); CMDLINE_FMT(snapshot, "");
+long vsfs_snapshot_restore(unsigned long id); CMDLINE_FMT(restore, "%lu");
+long vsfs_snapshot_delete(unsigned long id); CMDLINE_FMT(snapdel, "%lu");
+
+/* Fragmentation. A file's blocks lie in one or more runs of physically
+ * contiguous data blocks, and reading it in order costs a seek between runs.
+ * vsfs_fragments returns how many runs file or directory 'f' has (0 if it
+ * has no blocks, as when its data is inline), or -1 if there is no such file.
+ *
+ * vsfs_defrag moves fragmented files' blocks, each file's into one free run,
+ * for up to 'budget_ms' milliseconds (0 for no limit), and reports what it did
+ * in *out. It goes through the inodes in turn, and each call carries on where
+ * the last stopped, so that a sweep of the whole filesystem can be spread
+ * over many short calls; out->done says that this one finished a sweep. Other
+ * operations may run meanwhile: a file is locked only while a few hundred of
+ * its blocks move. Files with blocks shared with a clone or a snapshot are
+ * left alone, as are those that no free run is long enough for.
+ *
+ * vsfs_free_histogram reports how fragmented the free space is: how many
+ * runs of free data blocks there are of each size, in powers of two, and so
+ * whether files can grow, or be defragmented, in one run. It costs a scan of
+ * the data bitmap, and like vsfs_statfs takes no locks, so may be a moment out
+ * of date. */
+struct vsfs_defrag_report
+{
+	unsigned long nfiles; /* looked at, having blocks */
+	unsigned long nfragmented; /* of those, in more than one run */
+	unsigned long ndefragged; /* moved into one run */
+	unsigned long nblocks_moved;
+	_Bool done; /* got past the last inode; the next call starts again */
+};
+#define VSFS_FREE_HISTOGRAM_BUCKETS 32
+struct vsfs_free_histogram
+{
+	unsigned long nfree; /* free data blocks */
+	unsigned long nruns;
+	unsigned long largest; /* the longest run's length */
+	/* bucket k: the runs of 2^k to 2^(k+1) - 1 blocks, and their blocks */
+	unsigned long bucket_nruns[VSFS_FREE_HISTOGRAM_BUCKETS];
+	unsigned long bucket_nblocks[VSFS_FREE_HISTOGRAM_BUCKETS];
+};
+long vsfs_fragments(struct inode *f); CMDLINE_FMT(frags, "%u");
+void vsfs_defrag(unsigned long budget_ms, struct vsfs_defrag_report *out); CMDLINE_FMT(defrag, "%lu");
+void vsfs_free_histogram(struct vsfs_free_histogram *out); CMDLINE_FMT(freefrag, "");
+
+/* Check the filesystem offline: call this just after vsfs_init, with nothing
+ * else in flight. Using 'nthreads' threads (0 for one per CPU), it rebuilds
+ * the bitmaps and link counts from the inode table and the directories, and
+ * reports through debug_printf each way in which the image differs from
+ * them. With 'repair', it also fixes what it safely can (see vsfs.c) and
+ * makes that durable. */
+struct vsfs_fsck_report
+{
+	unsigned long ninodes; /* in use */
+	unsigned long ndirs;
+	unsigned long nblocks; /* data blocks in use */
+	unsigned long nproblems;
+	unsigned long nrepaired;
+};
+void vsfs_fsck(unsigned nthreads, _Bool repair, struct vsfs_fsck_report *out);
+
+/* Bulk building, for filling a fresh filesystem in one pass (see mkimage.c).
+ * These skip the checks that the usual operations make, and take their
+ * blocks from where the last bulk allocation left off, so that the image is
+ * laid out in the order it is built.
+ *
+ * vsfs_bulk_file makes an unnamed regular file of 'size' bytes, with all its
+ * blocks allocated, in as few runs as the free space allows; the caller must
+ * then write every byte with vsfs_write, which writes in place. Until then,
+ * its blocks hold whatever they last held.
+ *
+ * vsfs_bulk_dir makes an unnamed directory with nothing in it, not even its
+ * '.' and '..'; it is not valid until filled with vsfs_bulk_fill_dir. That
+ * way, a directory's subdirectories can be made before it is filled.
+ *
+ * vsfs_bulk_fill_dir appends entries to 'dir': if 'parent' is not null,
+ * first '.' and '..', and then names[k] for targets[k], for each k < n. It
+ * allocates the directory's blocks in one go and indexes it in one pass,
+ * but adds the entries in steps, each no more than a step of the journal may
+ * log (see journal_end_step), so that even a big directory is built
+ * atomically step by step; nothing else may change the directory meanwhile. The
+ * names must be distinct, within the directory too, and neither "." nor
+ * "..", nor longer than MAX_NAME_LEN - 1 bytes, for none of that is checked.
+ * Returns 0 if there was no room. */
+struct inode *vsfs_bulk_file(unsigned long size);
+struct inode *vsfs_bulk_dir(void);
+_Bool vsfs_bulk_fill_dir(struct inode *dir, struct inode *parent, unsigned long n, const char *const *names,
+	struct inode *const *targets);
+
+#ifdef VSFS_BENCH
+/* Internals timed by bench-core, or looked at by the tests; built only into
+ * the objects that those link against. There is no journal around the
+ * allocator's, so use an image without one. */
+struct inode *vsfs_bench_inode_alloc(void);
+void vsfs_bench_inode_free(struct inode *i);
+unsigned long vsfs_bench_data_alloc(void); /* a block number, or -1 */
+void vsfs_bench_data_free(unsigned long blkno);
+unsigned long vsfs_bench_map_block(struct inode *f, unsigned long file_block); /* a block number, or -1 for a hole */
+_Bool vsfs_bench_block_shared(unsigned long blkno);
+#endif
+
 /* These are purely user-facing debugging helpers. */
-void dumpfs(void);
-void dumpi(unsigned idx);
-void dumpd(unsigned idx);
-void dumpf(unsigned idx);
-struct dirent *lookupd(unsigned idx, const char *name);
-struct inode *creat(unsigned idx, const char *filename);
+void dumpfs(void); CMDLINE_FMT(dumpfs, "");
+void dumpi(unsigned idx); CMDLINE_FMT(dumpi, "%u");
+void dumpd(unsigned idx); CMDLINE_FMT(dumpd, "%u");
+void dumpf(unsigned idx); CMDLINE_FMT(dumpf, "%u");
 
 const char *print_dirent(struct dirent *d);
 const char *print_inode(struct inode *d);